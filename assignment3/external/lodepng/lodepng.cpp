@@ -28,6 +28,11 @@ The manual and changelog are in the header file "lodepng.h"
 Rename this file to lodepng.cpp to use it for C++, or to lodepng.c to use it for C.
 */
 
+/*
+Altered for the model viewer: CRC32 uses slice-by-8 tables, and the Average
+and Paeth scanline filters have SSE2 versions for 8-bit RGB and RGBA.
+*/
+
 #include "lodepng.h"
 
 #include <stdio.h>
@@ -2257,9 +2262,11 @@ const LodePNGDecompressSettings lodepng_default_decompress_settings = {0, 0, 0,
 /* ////////////////////////////////////////////////////////////////////////// */
 
 static unsigned Crc32_crc_table_computed = 0;
-static unsigned Crc32_crc_table[256];
+/*table[0] is the classic byte-wise table; table[k] advances the CRC of a byte
+by k more zero bytes, so that 8 bytes can be processed per step (slice-by-8)*/
+static unsigned Crc32_crc_table[8][256];
 
-/*Make the table for a fast CRC.*/
+/*Make the tables for a fast CRC.*/
 static void Crc32_make_crc_table(void)
 {
   unsigned c, k, n;
@@ -2271,23 +2278,46 @@ static void Crc32_make_crc_table(void)
       if(c & 1) c = 0xedb88320L ^ (c >> 1);
       else c = c >> 1;
     }
-    Crc32_crc_table[n] = c;
+    Crc32_crc_table[0][n] = c;
+  }
+  for(n = 0; n < 256; n++)
+  {
+    c = Crc32_crc_table[0][n];
+    for(k = 1; k < 8; k++)
+    {
+      c = Crc32_crc_table[0][c & 0xff] ^ (c >> 8);
+      Crc32_crc_table[k][n] = c;
+    }
   }
   Crc32_crc_table_computed = 1;
 }
 
+#ifdef __cplusplus
+/*compute the tables before main, so that threads decoding in parallel never race on them*/
+static const unsigned Crc32_crc_table_init = (Crc32_make_crc_table(), 1);
+#endif /*__cplusplus*/
+
 /*Update a running CRC with the bytes buf[0..len-1]--the CRC should be
 initialized to all 1's, and the transmitted value is the 1's complement of the
 final running CRC (see the crc() routine below).*/
 static unsigned Crc32_update_crc(const unsigned char* buf, unsigned crc, size_t len)
 {
   unsigned c = crc;
-  size_t n;
+  size_t n = 0;
 
   if(!Crc32_crc_table_computed) Crc32_make_crc_table();
-  for(n = 0; n < len; n++)
+  for(; n + 8 <= len; n += 8)
+  {
+    unsigned one = c ^ (buf[n] | (buf[n + 1] << 8) | (buf[n + 2] << 16) | ((unsigned)buf[n + 3] << 24));
+    unsigned two = buf[n + 4] | (buf[n + 5] << 8) | (buf[n + 6] << 16) | ((unsigned)buf[n + 7] << 24);
+    c = Crc32_crc_table[7][one & 0xff] ^ Crc32_crc_table[6][(one >> 8) & 0xff]
+      ^ Crc32_crc_table[5][(one >> 16) & 0xff] ^ Crc32_crc_table[4][one >> 24]
+      ^ Crc32_crc_table[3][two & 0xff] ^ Crc32_crc_table[2][(two >> 8) & 0xff]
+      ^ Crc32_crc_table[1][(two >> 16) & 0xff] ^ Crc32_crc_table[0][two >> 24];
+  }
+  for(; n < len; n++)
   {
-    c = Crc32_crc_table[(c ^ buf[n]) & 0xff] ^ (c >> 8);
+    c = Crc32_crc_table[0][(c ^ buf[n]) & 0xff] ^ (c >> 8);
   }
   return c;
 }
@@ -3972,6 +4002,85 @@ unsigned lodepng_inspect(unsigned* w, unsigned* h, LodePNGState* state,
   return state->error;
 }
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#include <string.h>
+#define LODEPNG_UNFILTER_SSE2
+
+/*
+SSE2 versions of the Average and Paeth filters for 3 and 4 bytes per pixel
+(8-bit RGB and RGBA), after libpng's filter_sse2_intrinsics.c. Each pixel
+depends on the one to its left, so the lanes are the channels of one pixel.
+Pixels are loaded and stored with memcpy so that 3-byte pixels never touch
+the byte after the scanline.
+*/
+static __m128i unfilterLoadPixel(const unsigned char* p, size_t bytewidth)
+{
+  int v = 0;
+  memcpy(&v, p, bytewidth);
+  return _mm_cvtsi32_si128(v);
+}
+
+static void unfilterStorePixel(unsigned char* p, __m128i v, size_t bytewidth)
+{
+  int x = _mm_cvtsi128_si32(v);
+  memcpy(p, &x, bytewidth);
+}
+
+static void unfilterAverageSSE2(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                                size_t bytewidth, size_t length)
+{
+  size_t i;
+  __m128i a = _mm_setzero_si128();
+  for(i = 0; i + bytewidth <= length; i += bytewidth)
+  {
+    __m128i b = unfilterLoadPixel(&precon[i], bytewidth);
+    /*(a + b) / 2 rounded down: _mm_avg_epu8 rounds up, so subtract the carry bit*/
+    __m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+    a = _mm_add_epi8(unfilterLoadPixel(&scanline[i], bytewidth), avg);
+    unfilterStorePixel(&recon[i], a, bytewidth);
+  }
+}
+
+static __m128i unfilterAbs16(__m128i x)
+{
+  return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
+
+static __m128i unfilterSelect(__m128i mask, __m128i a, __m128i b)
+{
+  return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+static void unfilterPaethSSE2(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                              size_t bytewidth, size_t length)
+{
+  /*a is the pixel to the left, b the one above and c the one above a, widened to 16 bits*/
+  size_t i;
+  __m128i zero = _mm_setzero_si128();
+  __m128i a = zero, c = zero;
+  for(i = 0; i + bytewidth <= length; i += bytewidth)
+  {
+    __m128i b = _mm_unpacklo_epi8(unfilterLoadPixel(&precon[i], bytewidth), zero);
+    __m128i pa = _mm_sub_epi16(b, c); /*p - a, where p = a + b - c*/
+    __m128i pb = _mm_sub_epi16(a, c); /*p - b*/
+    __m128i pc = unfilterAbs16(_mm_add_epi16(pa, pb)); /*p - c*/
+    __m128i smallest;
+    __m128i nearest;
+    pa = unfilterAbs16(pa);
+    pb = unfilterAbs16(pb);
+    smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+    /*ties go to a, then b, as in paethPredictor*/
+    nearest = unfilterSelect(_mm_cmpeq_epi16(smallest, pb), b, c);
+    nearest = unfilterSelect(_mm_cmpeq_epi16(smallest, pa), a, nearest);
+    a = _mm_add_epi8(unfilterLoadPixel(&scanline[i], bytewidth), _mm_packus_epi16(nearest, nearest));
+    unfilterStorePixel(&recon[i], a, bytewidth);
+    a = _mm_unpacklo_epi8(a, zero);
+    c = b;
+  }
+}
+#endif /*SSE2*/
+
 static unsigned unfilterScanline(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
                                  size_t bytewidth, unsigned char filterType, size_t length)
 {
@@ -4005,6 +4114,13 @@ static unsigned unfilterScanline(unsigned char* recon, const unsigned char* scan
       }
       break;
     case 3:
+#ifdef LODEPNG_UNFILTER_SSE2
+      if(precon && (bytewidth == 3 || bytewidth == 4) && length % bytewidth == 0)
+      {
+        unfilterAverageSSE2(recon, scanline, precon, bytewidth, length);
+        break;
+      }
+#endif /*LODEPNG_UNFILTER_SSE2*/
       if(precon)
       {
         for(i = 0; i < bytewidth; i++) recon[i] = scanline[i] + precon[i] / 2;
@@ -4017,6 +4133,13 @@ static unsigned unfilterScanline(unsigned char* recon, const unsigned char* scan
       }
       break;
     case 4:
+#ifdef LODEPNG_UNFILTER_SSE2
+      if(precon && (bytewidth == 3 || bytewidth == 4) && length % bytewidth == 0)
+      {
+        unfilterPaethSSE2(recon, scanline, precon, bytewidth, length);
+        break;
+      }
+#endif /*LODEPNG_UNFILTER_SSE2*/
       if(precon)
       {
         for(i = 0; i < bytewidth; i++)
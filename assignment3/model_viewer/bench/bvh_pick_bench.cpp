@@ -0,0 +1,196 @@
+// BVH picking benchmark
+//
+// Builds the picking BVH of an OBJ file or of a synthetic wavy grid (10M
+// triangles by default) with one thread and with all of them, checks that
+// both trees are identical, and reports the build times and the shape of
+// the tree. Then casts rays through random pixels of the viewer's default
+// camera, as a click does, and reports the average, 99th percentile and
+// worst pick time.
+// A sample of the rays is checked against testing every triangle; exits
+// with a failure if a hit differs.
+//
+// Usage: bvh_pick_bench [obj_file | num_triangles] [num_rays] [max_threads]
+//
+
+#include "utils2.h"
+#include "obj_loader.h"
+#include "mesh_bvh.h"
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+double secondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Build a wavy n x n quad grid in [-1, 1]^2 (without normals, which
+// picking does not use)
+void makeGrid(OBJMesh &mesh, int n)
+{
+    mesh.vertices.reserve(std::size_t(n + 1) * (n + 1));
+    mesh.indices.reserve(std::size_t(n) * n * 6);
+    for (int j = 0; j <= n; ++j) {
+        for (int i = 0; i <= n; ++i) {
+            float x = float(i) / n * 2.0f - 1.0f;
+            float y = float(j) / n * 2.0f - 1.0f;
+            mesh.vertices.push_back(glm::vec3(x, y, 0.1f * std::sin(10.0f * x) * std::cos(7.0f * y)));
+        }
+    }
+    for (int j = 0; j < n; ++j) {
+        for (int i = 0; i < n; ++i) {
+            std::uint32_t v0 = j * (n + 1) + i;
+            std::uint32_t v2 = v0 + n + 1;
+            std::uint32_t triangles[] = { v0, v0 + 1, v2 + 1, v0, v2 + 1, v2 };
+            mesh.indices.insert(mesh.indices.end(), triangles, triangles + 6);
+        }
+    }
+}
+
+// Nearest hit by testing every triangle
+bool bruteForceIntersect(const MeshView &mesh, const glm::vec3 &origin, const glm::vec3 &direction, BVHHit *hit)
+{
+    bool found = false;
+    float maxDistance = std::numeric_limits<float>::max();
+    for (std::size_t t = 0; t < mesh.numIndices / 3; ++t) {
+        const std::uint32_t *index = &mesh.indices[3 * t];
+        float distance, u, v;
+        if (bvhIntersectTriangle(mesh.vertices[index[0]], mesh.vertices[index[1]], mesh.vertices[index[2]], origin,
+                                 direction, maxDistance, &distance, &u, &v)) {
+            maxDistance = hit->distance = distance;
+            hit->triangle = std::uint32_t(t);
+            found = true;
+        }
+    }
+    return found;
+}
+
+// Depth of the tree and its SAH cost (relative to the root's area)
+void treeStats(const MeshBVH &bvh, int *depth, std::size_t *numLeaves, double *cost)
+{
+    struct Entry {
+        std::uint32_t node;
+        int depth;
+    };
+    std::vector<Entry> stack(1, Entry{ 0, 1 });
+    *depth = 0;
+    *numLeaves = 0;
+    *cost = 0.0;
+    auto area = [](const BVHNode &node) {
+        glm::vec3 d = node.boundsMax - node.boundsMin;
+        return double(d.x) * d.y + double(d.y) * d.z + double(d.z) * d.x;
+    };
+    double rootArea = area(bvh.nodes[0]);
+    while (!stack.empty()) {
+        Entry entry = stack.back();
+        stack.pop_back();
+        const BVHNode &node = bvh.nodes[entry.node];
+        *depth = std::max(*depth, entry.depth);
+        if (node.count > 0) {
+            ++*numLeaves;
+            *cost += node.count * area(node) / rootArea;
+        }
+        else {
+            *cost += area(node) / rootArea;
+            stack.push_back(Entry{ node.first, entry.depth + 1 });
+            stack.push_back(Entry{ node.first + 1, entry.depth + 1 });
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    std::string input = argc > 1 ? argv[1] : "10000000";
+    int numRays = argc > 2 ? std::max(1, std::atoi(argv[2])) : 100000;
+    int maxThreads = argc > 3 ? std::max(1, std::atoi(argv[3])) : defaultThreadCount();
+
+    OBJMesh mesh;
+    if (input.find_first_not_of("0123456789") == std::string::npos) {
+        makeGrid(mesh, std::max(1, int(std::sqrt(std::atof(input.c_str()) / 2.0))));
+    }
+    else if (!objMeshLoadMapped(mesh, input, maxThreads)) {
+        return EXIT_FAILURE;
+    }
+    MeshView view;
+    view.vertices = mesh.vertices.data();
+    view.indices = mesh.indices.data();
+    view.numVertices = mesh.vertices.size();
+    view.numIndices = mesh.indices.size();
+    std::cout << view.numIndices / 3 << " triangles" << std::endl;
+
+    MeshBVH serial, bvh;
+    auto start = std::chrono::steady_clock::now();
+    bvhBuild(&serial, view, 1);
+    double serialTime = secondsSince(start);
+    start = std::chrono::steady_clock::now();
+    bvhBuild(&bvh, view, maxThreads);
+    double parallelTime = secondsSince(start);
+    bool identical = serial.nodes.size() == bvh.nodes.size() && serial.triangles == bvh.triangles &&
+                     std::memcmp(serial.nodes.data(), bvh.nodes.data(), bvh.nodes.size() * sizeof(BVHNode)) == 0;
+    serial = MeshBVH();
+    std::cout << "bvhBuild: " << serialTime << " s with 1 thread, " << parallelTime << " s with " << maxThreads
+              << " threads, trees " << (identical ? "identical" : "DIFFER") << std::endl;
+    int depth;
+    std::size_t numLeaves;
+    double cost;
+    treeStats(bvh, &depth, &numLeaves, &cost);
+    std::cout << bvh.nodes.size() << " nodes, " << numLeaves << " leaves, depth " << depth << ", SAH cost " << cost
+              << std::endl;
+
+    // Rays of the viewer's default camera (see drawMesh) through random
+    // pixels of an 800x600 window, with the model turned to the side
+    glm::mat4 model = glm::rotate(glm::mat4(1.0f), glm::radians(-50.0f), glm::vec3(1.0f, 0.0f, 0.0f));
+    glm::mat4 viewMatrix = glm::lookAt(glm::vec3(0.0f, 0.0f, 2.0f), glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+    glm::mat4 projection = glm::perspective(1.0f, 800.0f / 600.0f, 0.1f, 100.0f);
+    glm::mat4 inverse = glm::inverse(projection * viewMatrix * model);
+    std::mt19937 random(1);
+    std::uniform_real_distribution<float> ndc(-1.0f, 1.0f);
+    std::vector<glm::vec3> origins(numRays), directions(numRays);
+    for (int i = 0; i < numRays; ++i) {
+        glm::vec2 p(ndc(random), ndc(random));
+        glm::vec4 nearPoint = inverse * glm::vec4(p, -1.0f, 1.0f);
+        glm::vec4 farPoint = inverse * glm::vec4(p, 1.0f, 1.0f);
+        origins[i] = glm::vec3(nearPoint) / nearPoint.w;
+        directions[i] = glm::normalize(glm::vec3(farPoint) / farPoint.w - origins[i]);
+    }
+
+    std::vector<BVHHit> hits(numRays);
+    std::vector<char> found(numRays);
+    std::vector<double> times(numRays);
+    for (int i = 0; i < numRays; ++i) {
+        auto rayStart = std::chrono::steady_clock::now();
+        found[i] = bvhIntersect(bvh, view, origins[i], directions[i], &hits[i]);
+        times[i] = 1e6 * secondsSince(rayStart);
+    }
+    double totalTime = 0.0;
+    for (double time : times) {
+        totalTime += time;
+    }
+    std::sort(times.begin(), times.end());
+    int numHits = int(std::count(found.begin(), found.end(), 1));
+    std::cout << numRays << " picks, " << numHits << " hits: " << totalTime / numRays << " us average, "
+              << times[numRays * 99 / 100] << " us 99th percentile, " << times.back() << " us worst" << std::endl;
+
+    // Ties between triangles at the same distance may pick either one
+    int numChecked = std::min(numRays, 32), numWrong = 0;
+    for (int i = 0; i < numChecked; ++i) {
+        BVHHit expected;
+        bool expectedFound = bruteForceIntersect(view, origins[i], directions[i], &expected);
+        if (expectedFound != bool(found[i]) ||
+            (expectedFound && std::abs(expected.distance - hits[i].distance) > 1e-5f * expected.distance)) {
+            ++numWrong;
+        }
+    }
+    bool ok = identical && numWrong == 0;
+    std::cout << numChecked << " picks checked against every triangle, " << numWrong << " wrong" << std::endl;
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
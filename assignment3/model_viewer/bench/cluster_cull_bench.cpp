@@ -0,0 +1,153 @@
+// Cluster culling benchmark
+//
+// Clusters a synthetic grid mesh (or an OBJ file), builds the cluster
+// hierarchy and culls it against the view frustum of several camera
+// states of the viewer (zoom, rotation, lens). Reports how many clusters
+// and triangles are drawn and how long culling takes, and checks that no
+// cluster with a vertex inside the frustum was culled; exits with a
+// failure if one was.
+//
+// Usage: cluster_cull_bench [obj_file | num_triangles]
+//
+
+#include "utils2.h"
+#include "obj_loader.h"
+#include "mesh_clusters.h"
+
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+
+// Build a wavy n x n quad grid in [-1, 1]^2 and shuffle its triangles
+void makeShuffledGrid(OBJMesh &mesh, int n)
+{
+    for (int j = 0; j <= n; ++j) {
+        for (int i = 0; i <= n; ++i) {
+            float x = float(i) / n * 2.0f - 1.0f;
+            float y = float(j) / n * 2.0f - 1.0f;
+            mesh.vertices.push_back(glm::vec3(x, y, 0.1f * std::sin(10.0f * x) * std::cos(7.0f * y)));
+        }
+    }
+    std::vector<glm::uvec3> triangles;
+    for (int j = 0; j < n; ++j) {
+        for (int i = 0; i < n; ++i) {
+            std::uint32_t v0 = j * (n + 1) + i;
+            std::uint32_t v2 = v0 + n + 1;
+            triangles.push_back(glm::uvec3(v0, v0 + 1, v2 + 1));
+            triangles.push_back(glm::uvec3(v0, v2 + 1, v2));
+        }
+    }
+    std::mt19937 random(1);
+    std::shuffle(triangles.begin(), triangles.end(), random);
+    for (const glm::uvec3 &triangle : triangles) {
+        mesh.indices.push_back(triangle.x);
+        mesh.indices.push_back(triangle.y);
+        mesh.indices.push_back(triangle.z);
+    }
+}
+
+// A camera state, as set in the viewer by scrolling, dragging and Q
+struct CameraState {
+    const char *name;
+    float zoom;
+    float yaw, pitch; // degrees
+    bool perspective;
+};
+
+// The model-view-projection matrix of drawMesh for a camera state
+glm::mat4 cameraMatrix(const CameraState &camera, float aspect)
+{
+    glm::mat4 model = glm::rotate(glm::mat4(1.0f), glm::radians(camera.pitch), glm::vec3(1.0f, 0.0f, 0.0f));
+    model = glm::rotate(model, glm::radians(camera.yaw), glm::vec3(0.0f, 1.0f, 0.0f));
+    glm::mat4 view = glm::lookAt(glm::vec3(0, 0, 2), glm::vec3(), glm::vec3(0, 1, 0));
+    float size = 2.0f / std::pow(2.0f, camera.zoom);
+    glm::mat4 projection = camera.perspective ? glm::perspective(size, aspect, 0.1f, 100.0f)
+                                              : glm::ortho(-size * aspect, size * aspect, -size, size, 0.1f, 100.0f);
+    return projection * view * model;
+}
+
+int main(int argc, char *argv[])
+{
+    std::string arg = argc > 1 ? argv[1] : "2000000";
+    OBJMesh mesh;
+    if (!arg.empty() && arg.find_first_not_of("0123456789") == std::string::npos) {
+        int n = std::max(1, int(std::sqrt(std::atof(arg.c_str()) / 2.0)));
+        makeShuffledGrid(mesh, n);
+        std::cout << "Shuffled grid, " << mesh.indices.size() / 3 << " triangles" << std::endl;
+    }
+    else if (!objMeshLoadMapped(mesh, arg, 0)) {
+        return EXIT_FAILURE;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    clusterTriangles(mesh.indices, mesh.vertices);
+    double clusterTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    start = std::chrono::steady_clock::now();
+    MeshClusters clusters;
+    meshClustersBuild(mesh.vertices.data(), mesh.indices.data(), mesh.indices.size(), &clusters);
+    double buildTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "clusterTriangles: " << clusterTime << " s, meshClustersBuild: " << buildTime << " s, "
+              << clusters.levels[0].size() << " clusters, " << clusters.levels.size() << " levels" << std::endl;
+
+    const CameraState cameras[] = {
+        { "default", 0.0f, 0.0f, 0.0f, true },
+        { "zoom 1", 1.0f, 0.0f, 0.0f, true },
+        { "zoom 2, rotated", 2.0f, 30.0f, -20.0f, true },
+        { "zoom 4", 4.0f, 0.0f, 0.0f, true },
+        { "edge on", 0.0f, 90.0f, 0.0f, true },
+        { "ortho zoom 2", 2.0f, 15.0f, 10.0f, false }
+    };
+    const float aspect = 800.0f / 600.0f;
+    std::size_t numTriangles = mesh.indices.size() / 3;
+    bool conservative = true;
+    for (const CameraState &camera : cameras) {
+        glm::mat4 mvp = cameraMatrix(camera, aspect);
+        Frustum frustum = frustumFromMatrix(mvp);
+        std::vector<ClusterRange> ranges;
+        ClusterCullStats stats;
+        const int repetitions = 100;
+        start = std::chrono::steady_clock::now();
+        for (int i = 0; i < repetitions; ++i) {
+            meshClustersCull(clusters, frustum, &ranges, &stats);
+        }
+        double cullTime = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() /
+                          repetitions;
+
+        // Every triangle with a vertex inside the frustum must be drawn
+        std::vector<bool> drawn(numTriangles, false);
+        std::size_t numDrawn = 0;
+        for (const ClusterRange &range : ranges) {
+            std::fill(drawn.begin() + range.first, drawn.begin() + range.first + range.count, true);
+            numDrawn += range.count;
+        }
+        std::size_t numInside = 0, numMissed = 0;
+        for (std::size_t t = 0; t < numTriangles; ++t) {
+            bool inside = false;
+            for (int k = 0; k < 3; ++k) {
+                glm::vec4 p = mvp * glm::vec4(mesh.vertices[mesh.indices[3 * t + k]], 1.0f);
+                inside = inside || (std::abs(p.x) < p.w && std::abs(p.y) < p.w && std::abs(p.z) < p.w);
+            }
+            numInside += inside;
+            numMissed += inside && !drawn[t];
+        }
+        conservative = conservative && numMissed == 0;
+
+        std::cout << camera.name << ": " << stats.numClusters - stats.numVisible << " of " << stats.numClusters
+                  << " clusters culled, " << ranges.size() << " ranges, " << numDrawn << " triangles drawn ("
+                  << numInside << " with a vertex inside), " << stats.numTests << " tests, " << cullTime << " us";
+        if (numMissed > 0) {
+            std::cout << ", " << numMissed << " VISIBLE TRIANGLES CULLED";
+        }
+        std::cout << std::endl;
+    }
+
+    return conservative ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,129 @@
+// Light clustering benchmark
+//
+// Bins 10, 100, 1000, ... up to num_lights point lights around the
+// viewer's default model (the lights of --lights, turned a little every
+// frame) into the clusters of the viewer's default camera, with 1, 2,
+// 4, ... up to max_threads threads, and reports the average binning time,
+// the number of light references and the longest cluster list.
+// Every count checks that all thread counts give the same lists, and
+// that for random points near the lights every light that reaches the
+// point is listed in the point's cluster, found as mesh.frag finds it;
+// exits with a failure if not.
+//
+// Usage: light_cluster_bench [num_lights] [max_threads]
+//
+
+#include "light_clusters.h"
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+
+const float Z_NEAR = 0.1f, Z_FAR = 100.0f; // see getProjectionMatrix
+
+// Check that every light whose sphere contains a point is listed in the
+// point's cluster, for points scattered in the spheres of random lights
+bool checkCoverage(const LightClusters &clusters, const glm::mat4 &projection, int numSamples, int *numChecked)
+{
+    std::mt19937 random(2);
+    std::uniform_real_distribution<float> uniform(-1.0f, 1.0f);
+    std::size_t numLights = clusters.lightData.size() / 2;
+    *numChecked = 0;
+    for (int i = 0; i < numSamples; ++i) {
+        glm::vec4 sphere = clusters.lightData[2 * (random() % numLights)];
+        glm::vec3 offset(uniform(random), uniform(random), uniform(random));
+        glm::vec3 p = glm::vec3(sphere) + offset * sphere.w;
+        glm::vec4 clip = projection * glm::vec4(p, 1.0f);
+        float depth = -p.z;
+        if (depth < Z_NEAR || depth > Z_FAR || std::abs(clip.x) >= clip.w || std::abs(clip.y) >= clip.w) {
+            continue;
+        }
+        // As in mesh.frag, from the window position and view depth
+        int x = int((clip.x / clip.w * 0.5f + 0.5f) * LIGHT_CLUSTERS_X);
+        int y = int((clip.y / clip.w * 0.5f + 0.5f) * LIGHT_CLUSTERS_Y);
+        int cluster = x + y * LIGHT_CLUSTERS_X + lightClusterSlice(clusters, depth) * LIGHT_CLUSTERS_PER_SLICE;
+        glm::uvec2 range = clusters.grid[cluster];
+        const std::uint32_t *first = &clusters.indices[0] + range.x, *last = first + range.y;
+        for (std::size_t light = 0; light < numLights; ++light) {
+            glm::vec4 other = clusters.lightData[2 * light];
+            glm::vec3 d = p - glm::vec3(other);
+            if (glm::dot(d, d) < other.w * other.w && !std::binary_search(first, last, std::uint32_t(light))) {
+                return false;
+            }
+        }
+        ++*numChecked;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    int maxLights = argc > 1 ? std::max(1, std::atoi(argv[1])) : 100000;
+    int maxThreads = argc > 2 ? std::max(1, std::atoi(argv[2])) : defaultThreadCount();
+    const int numFrames = 20;
+
+    // The viewer's default camera (see drawMesh) with the model turned
+    glm::mat4 model = glm::rotate(glm::mat4(1.0f), glm::radians(-50.0f), glm::vec3(1.0f, 0.0f, 0.0f));
+    glm::mat4 view = glm::lookAt(glm::vec3(0.0f, 0.0f, 2.0f), glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+    glm::mat4 projection = glm::perspective(1.0f, 800.0f / 600.0f, Z_NEAR, Z_FAR);
+    glm::mat4 modelView = view * model;
+
+    std::vector<int> counts;
+    for (int count = 10; count < maxLights; count *= 10) {
+        counts.push_back(count);
+    }
+    counts.push_back(maxLights);
+    std::vector<int> threadCounts;
+    for (int threads = 1; threads < maxThreads; threads *= 2) {
+        threadCounts.push_back(threads);
+    }
+    threadCounts.push_back(maxThreads);
+
+    bool ok = true;
+    for (int count : counts) {
+        std::vector<PointLight> lights, moved;
+        pointLightsRandom(count, pointLightRadius(count), 1, &lights);
+        std::cout << count << " lights:";
+        LightClusters reference;
+        for (int threads : threadCounts) {
+            LightClusters clusters;
+            lightClustersBuild(&clusters, lights, modelView, projection, Z_NEAR, Z_FAR, threads); // warm up
+            double seconds = 0.0;
+            for (int frame = 0; frame < numFrames; ++frame) {
+                pointLightsOrbit(lights, 0.01f * frame, &moved);
+                auto start = std::chrono::steady_clock::now();
+                lightClustersBuild(&clusters, moved, modelView, projection, Z_NEAR, Z_FAR, threads);
+                seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            }
+            std::cout << " " << 1e3 * seconds / numFrames << " ms (" << threads << (threads > 1 ? " threads)" : " thread)");
+            if (threads == 1) {
+                reference.grid = clusters.grid;
+                reference.indices = clusters.indices;
+            }
+            else if (clusters.grid != reference.grid || clusters.indices != reference.indices) {
+                std::cout << " DIFFERS";
+                ok = false;
+            }
+            if (threads == threadCounts.back()) {
+                std::cout << std::endl << "  " << clusters.indices.size() << " light references, at most "
+                          << clusters.maxClusterLights << " lights per cluster";
+                int numChecked;
+                if (!checkCoverage(clusters, projection, count <= 10000 ? 20000 : 2000, &numChecked)) {
+                    std::cout << ", a light is MISSING from a cluster";
+                    ok = false;
+                }
+                else {
+                    std::cout << ", " << numChecked << " points checked";
+                }
+            }
+        }
+        std::cout << std::endl;
+    }
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
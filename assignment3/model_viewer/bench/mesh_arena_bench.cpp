@@ -0,0 +1,142 @@
+// Mesh arena allocator benchmark
+//
+// Runs the allocation policy of meshArenaAdd (allocate, else compact if
+// the free space adds up, else grow to twice the size) on the CPU with a
+// random workload of scene parts being added and removed, and reports
+// how often the arena had to be compacted or grown, how fragmented the
+// free space was and how fast allocate/free are. After every step it
+// checks that no two parts overlap and that parts and free ranges cover
+// the arena exactly; exits with a failure if they do not.
+//
+// Usage: mesh_arena_bench [num_operations] [max_live_parts]
+//
+
+#include "arena_allocator.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+
+struct Part {
+    std::size_t offset, size;
+};
+
+// Check that the parts and the free ranges tile [0, capacity)
+bool checkArena(const ArenaAllocator &arena, const std::vector<Part> &parts)
+{
+    std::vector<Part> ranges(parts);
+    std::size_t used = 0;
+    for (const Part &part : parts) {
+        used += part.size;
+    }
+    for (const auto &range : arena.freeRanges) {
+        Part free = { range.first, range.second };
+        ranges.push_back(free);
+    }
+    std::sort(ranges.begin(), ranges.end(), [](const Part &a, const Part &b) { return a.offset < b.offset; });
+    std::size_t end = 0;
+    for (const Part &range : ranges) {
+        if (range.offset != end || range.size == 0) {
+            return false;
+        }
+        end += range.size;
+    }
+    return end == arena.capacity && used == arena.used;
+}
+
+// Move the parts together, as meshArenaRepack does with the buffers
+void repack(ArenaAllocator *arena, std::vector<Part> &parts, std::size_t capacity)
+{
+    std::size_t offset = 0;
+    for (Part &part : parts) {
+        part.offset = offset;
+        offset += part.size;
+    }
+    arenaAllocatorReset(arena, capacity, offset);
+}
+
+int main(int argc, char *argv[])
+{
+    int numOperations = argc > 1 ? std::max(1, std::atoi(argv[1])) : 200000;
+    std::size_t maxParts = argc > 2 ? std::size_t(std::max(1, std::atoi(argv[2]))) : 500;
+
+    // Part sizes are log-uniform between 100 and 100000 vertices, like the
+    // pieces of a CAD model
+    std::mt19937 random(1);
+    std::uniform_real_distribution<double> logSize(std::log(100.0), std::log(100000.0));
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+
+    ArenaAllocator arena;
+    arenaAllocatorReset(&arena, 1 << 16);
+    std::vector<Part> parts;
+    int numCompactions = 0, numGrowths = 0, numChecks = 0;
+    double fragmentationSum = 0.0;
+    int fragmentationSamples = 0;
+    bool ok = true;
+    double allocTime = 0.0, freeTime = 0.0;
+    int numAllocs = 0, numFrees = 0;
+    for (int op = 0; op < numOperations && ok; ++op) {
+        // Grow the scene to maxParts, then add and remove at random
+        bool add = parts.empty() || (parts.size() < maxParts && (op < int(maxParts) || uniform(random) < 0.5));
+        if (add) {
+            Part part;
+            part.size = std::size_t(std::exp(logSize(random)));
+            auto start = std::chrono::steady_clock::now();
+            bool fits = arenaAllocate(&arena, part.size, &part.offset);
+            allocTime += std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+            ++numAllocs;
+            if (!fits) {
+                if (arena.used + part.size <= arena.capacity) {
+                    repack(&arena, parts, arena.capacity);
+                    ++numCompactions;
+                }
+                else {
+                    repack(&arena, parts, std::max(2 * arena.capacity, arena.used + part.size));
+                    ++numGrowths;
+                }
+                ok = arenaAllocate(&arena, part.size, &part.offset);
+            }
+            parts.push_back(part);
+        }
+        else {
+            std::size_t index = std::size_t(uniform(random) * parts.size()) % parts.size();
+            auto start = std::chrono::steady_clock::now();
+            arenaFree(&arena, parts[index].offset, parts[index].size);
+            freeTime += std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+            ++numFrees;
+            parts.erase(parts.begin() + index);
+        }
+
+        std::size_t freeTotal = arena.capacity - arena.used;
+        if (op >= int(maxParts) && freeTotal > 0) {
+            fragmentationSum += 1.0 - double(arenaLargestFree(arena)) / double(freeTotal);
+            ++fragmentationSamples;
+        }
+        if (op % 97 == 0 || op + 1 == numOperations) {
+            ok = ok && checkArena(arena, parts);
+            ++numChecks;
+        }
+    }
+
+    // Freeing everything must leave one free range
+    for (const Part &part : parts) {
+        arenaFree(&arena, part.offset, part.size);
+    }
+    parts.clear();
+    ok = ok && arena.used == 0 && arena.freeRanges.size() == 1 && checkArena(arena, parts);
+
+    std::cout << numOperations << " operations, up to " << maxParts << " live parts, final capacity "
+              << arena.capacity << " vertices" << std::endl;
+    std::cout << numGrowths << " growths, " << numCompactions << " compactions ("
+              << 100.0 * numCompactions / std::max(1, numAllocs) << "% of allocations)" << std::endl;
+    std::cout << "average fragmentation (1 - largest free / total free): "
+              << (fragmentationSamples > 0 ? fragmentationSum / fragmentationSamples : 0.0) << std::endl;
+    std::cout << "arenaAllocate: " << allocTime / std::max(1, numAllocs) << " us, arenaFree: "
+              << freeTime / std::max(1, numFrees) << " us" << std::endl;
+    std::cout << numChecks << " consistency checks " << (ok ? "passed" : "FAILED") << std::endl;
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
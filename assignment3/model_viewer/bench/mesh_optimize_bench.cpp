@@ -0,0 +1,84 @@
+// Vertex cache optimization benchmark
+//
+// Reports the ACMR/ATVR of a simulated FIFO vertex cache before and after
+// optimizeMesh, for an OBJ file or for a synthetic grid mesh whose
+// triangles are shuffled (like scanned data). Exits with a failure if
+// the optimized order is worse than the input order.
+//
+// Usage: mesh_optimize_bench [obj_file | num_triangles]
+//
+
+#include "utils2.h"
+#include "obj_loader.h"
+#include "mesh_optimize.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+
+// Build an n x n quad grid and shuffle its triangles
+void makeShuffledGrid(OBJMesh &mesh, int n)
+{
+    for (int j = 0; j <= n; ++j) {
+        for (int i = 0; i <= n; ++i) {
+            mesh.vertices.push_back(glm::vec3(float(i) / n, float(j) / n, 0.0f));
+        }
+    }
+    std::vector<glm::uvec3> triangles;
+    for (int j = 0; j < n; ++j) {
+        for (int i = 0; i < n; ++i) {
+            std::uint32_t v0 = j * (n + 1) + i;
+            std::uint32_t v2 = v0 + n + 1;
+            triangles.push_back(glm::uvec3(v0, v0 + 1, v2 + 1));
+            triangles.push_back(glm::uvec3(v0, v2 + 1, v2));
+        }
+    }
+    std::mt19937 random(1);
+    std::shuffle(triangles.begin(), triangles.end(), random);
+    for (const glm::uvec3 &triangle : triangles) {
+        mesh.indices.push_back(triangle.x);
+        mesh.indices.push_back(triangle.y);
+        mesh.indices.push_back(triangle.z);
+    }
+    computeNormals(mesh.vertices, mesh.indices, &mesh.normals);
+}
+
+int main(int argc, char *argv[])
+{
+    std::string arg = argc > 1 ? argv[1] : "1000000";
+    OBJMesh mesh;
+    if (!arg.empty() && arg.find_first_not_of("0123456789") == std::string::npos) {
+        int n = std::max(1, int(std::sqrt(std::atof(arg.c_str()) / 2.0)));
+        makeShuffledGrid(mesh, n);
+        std::cout << "Shuffled grid, " << mesh.indices.size() / 3 << " triangles" << std::endl;
+    }
+    else if (!objMeshLoadMapped(mesh, arg, 0)) {
+        return EXIT_FAILURE;
+    }
+
+    const unsigned cacheSizes[] = { 16, 32 };
+    VertexCacheStats before[2];
+    for (int i = 0; i < 2; ++i) {
+        before[i] = simulateVertexCache(mesh.indices.data(), mesh.indices.size(),
+                                        mesh.vertices.size(), cacheSizes[i]);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    VertexCacheStats unused;
+    optimizeMesh(mesh, cacheSizes[0], &unused, &unused);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "optimizeMesh: " << seconds << " s" << std::endl;
+
+    bool improved = true;
+    for (int i = 0; i < 2; ++i) {
+        VertexCacheStats after = simulateVertexCache(mesh.indices.data(), mesh.indices.size(),
+                                                     mesh.vertices.size(), cacheSizes[i]);
+        std::cout << "FIFO " << cacheSizes[i] << ": ACMR " << before[i].acmr << " -> " << after.acmr
+                  << ", ATVR " << before[i].atvr << " -> " << after.atvr << std::endl;
+        improved = improved && after.acmr <= before[i].acmr;
+    }
+    return improved ? EXIT_SUCCESS : EXIT_FAILURE;
+}
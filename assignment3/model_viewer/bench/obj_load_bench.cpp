@@ -0,0 +1,206 @@
+// OBJ loader benchmark
+//
+// Writes a synthetic grid mesh to an OBJ file and compares the load time
+// of the getline/istringstream loader (objMeshLoad) with the
+// memory-mapped loader (objMeshLoadMapped), then scales the parallel
+// ingest of the latter over the number of threads and times a warm load
+// from the binary mesh cache. Finally compares computeNormals with the
+// parallel normal generator.
+//
+// Usage: obj_load_bench [num_triangles] [obj_file] [max_threads]
+//
+// obj_file defaults to obj_load_bench.obj in $TMPDIR (or /tmp); it and
+// its mesh cache are deleted when the benchmark ends.
+//
+
+#include "utils2.h"
+#include "obj_loader.h"
+#include "mesh_cache.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Write a wavy (n+1) x (n+1) vertex grid with 2 n^2 triangles
+bool writeGridOBJ(const std::string &filename, int n)
+{
+    std::FILE *f = std::fopen(filename.c_str(), "w");
+    if (f == nullptr) {
+        std::cerr << "Could not create " << filename << std::endl;
+        return false;
+    }
+    std::fprintf(f, "# Synthetic grid, %d triangles\n", 2 * n * n);
+    for (int j = 0; j <= n; ++j) {
+        for (int i = 0; i <= n; ++i) {
+            float x = float(i) / n * 2.0f - 1.0f;
+            float y = float(j) / n * 2.0f - 1.0f;
+            float z = 0.1f * std::sin(10.0f * x) * std::cos(7.0f * y);
+            std::fprintf(f, "v %f %f %f\n", x, y, z);
+        }
+    }
+    for (int j = 0; j < n; ++j) {
+        for (int i = 0; i < n; ++i) {
+            int v0 = j * (n + 1) + i + 1;
+            int v1 = v0 + 1;
+            int v2 = v0 + n + 1;
+            int v3 = v2 + 1;
+            std::fprintf(f, "f %d %d %d\n", v0, v1, v3);
+            std::fprintf(f, "f %d %d %d\n", v0, v3, v2);
+        }
+    }
+    std::fclose(f);
+    return true;
+}
+
+// Returns true if the meshes are bit-identical
+bool identical(const OBJMesh &a, const OBJMesh &b)
+{
+    return a.vertices.size() == b.vertices.size() &&
+           a.normals.size() == b.normals.size() &&
+           a.indices == b.indices &&
+           std::memcmp(a.vertices.data(), b.vertices.data(), a.vertices.size() * sizeof(glm::vec3)) == 0 &&
+           std::memcmp(a.normals.data(), b.normals.data(), a.normals.size() * sizeof(glm::vec3)) == 0;
+}
+
+// The directory for temporary files, ending with a separator
+std::string tempDir()
+{
+    const char *names[] = { "TMPDIR", "TEMP", "TMP" };
+    for (const char *name : names) {
+        const char *dir = std::getenv(name);
+        if (dir != nullptr && *dir != '\0') {
+            return std::string(dir) + "/";
+        }
+    }
+#ifdef _WIN32
+    return "";
+#else
+    return "/tmp/";
+#endif
+}
+
+// Deletes the files that the benchmark writes, however it returns
+struct TempFiles {
+    std::vector<std::string> filenames;
+
+    ~TempFiles()
+    {
+        for (const std::string &filename : filenames) {
+            std::remove(filename.c_str());
+        }
+    }
+};
+
+double secondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char *argv[])
+{
+    long numTriangles = argc > 1 ? std::atol(argv[1]) : 4000000;
+    std::string filename = argc > 2 ? argv[2] : tempDir() + "obj_load_bench.obj";
+    int maxThreads = argc > 3 ? std::atoi(argv[3]) : defaultThreadCount();
+    int n = std::max(1, int(std::sqrt(numTriangles / 2.0)));
+    TempFiles tempFiles;
+    tempFiles.filenames.push_back(filename);
+    tempFiles.filenames.push_back(meshCachePath(filename));
+
+    std::cout << "Writing " << filename << " (" << 2L * n * n << " triangles)" << std::endl;
+    if (!writeGridOBJ(filename, n)) {
+        return EXIT_FAILURE;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    OBJMesh reference;
+    objMeshLoad(reference, filename);
+    double referenceTime = secondsSince(start);
+
+    start = std::chrono::steady_clock::now();
+    OBJMesh mapped;
+    objMeshLoadMapped(mapped, filename);
+    double mappedTime = secondsSince(start);
+
+    bool same = reference.vertices.size() == mapped.vertices.size() &&
+                reference.indices == mapped.indices;
+    float maxError = 0.0f;
+    for (std::size_t i = 0; same && i < mapped.vertices.size(); ++i) {
+        glm::vec3 d = glm::abs(reference.vertices[i] - mapped.vertices[i]);
+        maxError = std::max(maxError, std::max(d.x, std::max(d.y, d.z)));
+    }
+
+    same = same && std::memcmp(reference.normals.data(), mapped.normals.data(),
+                               mapped.normals.size() * sizeof(glm::vec3)) == 0;
+
+    std::cout << "objMeshLoad:       " << referenceTime << " s" << std::endl;
+    std::cout << "objMeshLoadMapped: " << mappedTime << " s ("
+              << referenceTime / mappedTime << "x)" << std::endl;
+    std::cout << "Meshes match: " << (same ? "yes" : "no")
+              << ", max vertex difference: " << maxError << std::endl;
+
+
+    for (int numThreads = 2; numThreads <= maxThreads; numThreads *= 2) {
+        start = std::chrono::steady_clock::now();
+        OBJMesh parallel;
+        objMeshLoadMapped(parallel, filename, numThreads);
+        double parallelTime = secondsSince(start);
+        bool bitIdentical = identical(parallel, mapped);
+        same = same && bitIdentical;
+        std::cout << "objMeshLoadMapped, " << numThreads << " threads: " << parallelTime << " s ("
+                  << mappedTime / parallelTime << "x), bit-identical: "
+                  << (bitIdentical ? "yes" : "no") << std::endl;
+    }
+
+    MeshView view;
+    view.vertices = mapped.vertices.data();
+    view.normals = mapped.normals.data();
+    view.indices = mapped.indices.data();
+    view.numVertices = mapped.vertices.size();
+    view.numIndices = mapped.indices.size();
+    std::string cacheFilename = meshCachePath(filename);
+    if (meshCacheWrite(cacheFilename, filename, 0, view)) {
+        start = std::chrono::steady_clock::now();
+        MappedFile cacheFile;
+        MeshView cached;
+        bool opened = meshCacheOpen(cacheFile, cacheFilename, filename, 0, &cached);
+        double cacheTime = secondsSince(start);
+        bool bitIdentical = opened && cached.numVertices == view.numVertices &&
+                            cached.numIndices == view.numIndices &&
+                            std::memcmp(cached.vertices, view.vertices, view.numVertices * sizeof(glm::vec3)) == 0 &&
+                            std::memcmp(cached.normals, view.normals, view.numVertices * sizeof(glm::vec3)) == 0 &&
+                            std::memcmp(cached.indices, view.indices, view.numIndices * sizeof(std::uint32_t)) == 0;
+        same = same && bitIdentical;
+        std::cout << "meshCacheOpen: " << cacheTime * 1000.0 << " ms, bit-identical: "
+                  << (bitIdentical ? "yes" : "no") << std::endl;
+        mappedFileClose(cacheFile);
+    }
+
+    start = std::chrono::steady_clock::now();
+    std::vector<glm::vec3> referenceNormals;
+    computeNormals(mapped.vertices, mapped.indices, &referenceNormals);
+    double normalsTime = secondsSince(start);
+    std::cout << "computeNormals: " << normalsTime << " s" << std::endl;
+    for (int numThreads = 1; numThreads <= maxThreads; numThreads *= 2) {
+        std::vector<glm::vec3> normals;
+        start = std::chrono::steady_clock::now();
+        computeNormalsParallel(mapped.vertices, mapped.indices, &normals, NORMAL_WEIGHT_AREA, numThreads);
+        double areaTime = secondsSince(start);
+        bool bitIdentical = std::memcmp(normals.data(), referenceNormals.data(),
+                                        normals.size() * sizeof(glm::vec3)) == 0;
+        same = same && bitIdentical;
+        start = std::chrono::steady_clock::now();
+        computeNormalsParallel(mapped.vertices, mapped.indices, &normals, NORMAL_WEIGHT_ANGLE, numThreads);
+        double angleTime = secondsSince(start);
+        std::cout << "computeNormalsParallel, " << numThreads << " threads: area " << areaTime
+                  << " s (" << normalsTime / areaTime << "x, bit-identical: " << (bitIdentical ? "yes" : "no")
+                  << "), angle " << angleTime << " s" << std::endl;
+    }
+
+    return same ? EXIT_SUCCESS : EXIT_FAILURE;
+}
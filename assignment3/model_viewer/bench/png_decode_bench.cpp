@@ -0,0 +1,307 @@
+// PNG decode benchmark
+//
+// Decodes the cubemap PNGs (the six faces of every cubemap and of its
+// prefiltered levels) with lodepng's own inflate (lodepng::decode) and
+// with the table-driven inflate of png_decode.h (pngDecode), checks that
+// the pixels match, and reports the decode times. The scanline filters
+// of every PNG, and of generated RGB and RGBA images that use all five
+// filters, are also undone with the scalar unfilter below and compared
+// with lodepng's (SSE2 for Average and Paeth). Then compares the
+// throughput of the vectorized Adler-32 and of lodepng_crc32 (slice-by-8)
+// with scalar ones, and checks their results; exits with a failure if any
+// check fails.
+//
+// Usage: png_decode_bench [cubemap_dir] [repetitions]
+//
+// cubemap_dir defaults to $ASSIGNMENT3_ROOT/model_viewer/cubemaps.
+//
+
+#include "png_decode.h"
+#include "cubemap_image.h"
+
+#include <lodepng.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+double secondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// The Adler-32 of zlib's reference implementation
+unsigned scalarAdler32(const unsigned char *data, std::size_t len)
+{
+    unsigned s1 = 1, s2 = 0;
+    for (std::size_t i = 0; i < len; ++i) {
+        s1 = (s1 + data[i]) % 65521;
+        s2 = (s2 + s1) % 65521;
+    }
+    return (s2 << 16) | s1;
+}
+
+// The CRC-32 of the PNG specification, a bit at a time
+unsigned scalarCrc32(const unsigned char *data, std::size_t len)
+{
+    unsigned c = 0xffffffffu;
+    for (std::size_t i = 0; i < len; ++i) {
+        c ^= data[i];
+        for (int k = 0; k < 8; ++k) {
+            c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        }
+    }
+    return c ^ 0xffffffffu;
+}
+
+// Undo the scanline filters of non-interlaced image data as the PNG
+// specification defines them, one byte at a time. filterCounts counts the
+// scanlines of each filter type. Returns false for an unknown filter.
+bool scalarUnfilter(const std::vector<unsigned char> &filtered, unsigned width, unsigned height,
+                    unsigned bytewidth, std::vector<unsigned char> *pixels, std::size_t filterCounts[5])
+{
+    std::size_t stride = std::size_t(width) * bytewidth;
+    if (filtered.size() < (stride + 1) * height) {
+        return false;
+    }
+    pixels->assign(stride * height, 0);
+    for (unsigned y = 0; y < height; ++y) {
+        const unsigned char *in = &filtered[(stride + 1) * y];
+        unsigned char *out = &(*pixels)[stride * y];
+        const unsigned char *up = y > 0 ? out - stride : nullptr;
+        unsigned char type = *in++;
+        if (type > 4) {
+            return false;
+        }
+        ++filterCounts[type];
+        for (std::size_t i = 0; i < stride; ++i) {
+            int a = i >= bytewidth ? out[i - bytewidth] : 0;
+            int b = up ? up[i] : 0;
+            int c = up && i >= bytewidth ? up[i - bytewidth] : 0;
+            int predictor = 0;
+            if (type == 1) {
+                predictor = a;
+            }
+            else if (type == 2) {
+                predictor = b;
+            }
+            else if (type == 3) {
+                predictor = (a + b) / 2;
+            }
+            else if (type == 4) {
+                int p = a + b - c;
+                int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+                predictor = pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+            }
+            out[i] = (unsigned char)(in[i] + predictor);
+        }
+    }
+    return true;
+}
+
+// Check lodepng's unfiltering of an 8-bit, non-interlaced RGB or RGBA PNG
+// against scalarUnfilter; other PNGs are skipped (*checked is false)
+bool checkUnfilter(const std::vector<unsigned char> &file, std::size_t filterCounts[5], bool *checked)
+{
+    *checked = false;
+    lodepng::State state;
+    unsigned width, height;
+    if (lodepng_inspect(&width, &height, &state, file.data(), file.size()) != 0) {
+        return false;
+    }
+    const LodePNGColorMode &color = state.info_png.color;
+    if (color.bitdepth != 8 || state.info_png.interlace_method != 0 ||
+        (color.colortype != LCT_RGB && color.colortype != LCT_RGBA)) {
+        return true;
+    }
+    *checked = true;
+
+    // Inflate the concatenated IDAT chunks to the filtered scanlines
+    std::vector<unsigned char> idat, filtered, reference, pixels;
+    const unsigned char *end = file.data() + file.size();
+    for (const unsigned char *chunk = file.data() + 8; chunk + 12 <= end;
+         chunk = lodepng_chunk_next_const(chunk)) {
+        if (lodepng_chunk_type_equals(chunk, "IDAT")) {
+            const unsigned char *data = lodepng_chunk_data_const(chunk);
+            idat.insert(idat.end(), data, data + lodepng_chunk_length(chunk));
+        }
+        if (lodepng_chunk_type_equals(chunk, "IEND")) {
+            break;
+        }
+    }
+    unsigned bytewidth = color.colortype == LCT_RGBA ? 4 : 3;
+    if (lodepng::decompress(filtered, idat) != 0 ||
+        !scalarUnfilter(filtered, width, height, bytewidth, &reference, filterCounts)) {
+        return false;
+    }
+    return lodepng::decode(pixels, width, height, file, color.colortype, 8) == 0 && pixels == reference;
+}
+
+// Encode a generated width x height image whose scanlines cycle through
+// the five filters
+std::vector<unsigned char> filterTestPNG(unsigned width, unsigned height, LodePNGColorType colortype)
+{
+    unsigned bytewidth = colortype == LCT_RGBA ? 4 : 3;
+    std::vector<unsigned char> pixels(std::size_t(width) * height * bytewidth), filters(height), file;
+    for (std::size_t i = 0; i < pixels.size(); ++i) {
+        pixels[i] = (unsigned char)((i * 2654435761u >> 11) % 97 + i / 3 % 150); // noise on a gradient
+    }
+    for (unsigned y = 0; y < height; ++y) {
+        filters[y] = (unsigned char)(y % 5);
+    }
+    lodepng::State state;
+    state.info_raw.colortype = state.info_png.color.colortype = colortype;
+    state.encoder.auto_convert = LAC_NO;
+    state.encoder.filter_palette_zero = 0;
+    state.encoder.filter_strategy = LFS_PREDEFINED;
+    state.encoder.predefined_filters = filters.data();
+    lodepng::encode(file, pixels, width, height, state);
+    return file;
+}
+
+// The PNG files of the cubemaps in dirname that exist
+std::vector<std::string> cubemapPNGs(const std::string &dirname)
+{
+    static const char *cubemaps[] = { "Forrest", "LarnacaCastle", "LarnacaCastle2", "RomeChurch" };
+    static const char *levels[] = { "", "/prefiltered/2048", "/prefiltered/512", "/prefiltered/128",
+                                     "/prefiltered/32", "/prefiltered/8", "/prefiltered/2",
+                                     "/prefiltered/0.5", "/prefiltered/0.125" };
+    std::vector<std::string> filenames;
+    for (const char *cubemap : cubemaps) {
+        for (const char *level : levels) {
+            for (const char *face : cubemapImageFaceNames) {
+                std::string filename = dirname + "/" + cubemap + level + "/" + face + ".png";
+                if (std::ifstream(filename.c_str())) {
+                    filenames.push_back(filename);
+                }
+            }
+        }
+    }
+    return filenames;
+}
+
+int main(int argc, char *argv[])
+{
+    std::string dirname;
+    if (argc > 1) {
+        dirname = argv[1];
+    }
+    else if (const char *root = std::getenv("ASSIGNMENT3_ROOT")) {
+        dirname = std::string(root) + "/model_viewer/cubemaps";
+    }
+    else {
+        dirname = "cubemaps";
+    }
+    int repetitions = argc > 2 ? std::max(1, std::atoi(argv[2])) : 3;
+
+    std::vector<std::string> filenames = cubemapPNGs(dirname);
+    if (filenames.empty()) {
+        std::cerr << "No cubemap PNGs found in " << dirname << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // Read the files first so that only decoding is timed
+    std::vector<std::vector<unsigned char> > files(filenames.size());
+    std::size_t fileBytes = 0, pixelBytes = 0;
+    for (std::size_t i = 0; i < filenames.size(); ++i) {
+        lodepng::load_file(files[i], filenames[i]);
+        fileBytes += files[i].size();
+    }
+
+    bool same = true;
+    double referenceTime = 0.0, fastTime = 0.0;
+    for (int r = 0; r < repetitions; ++r) {
+        for (std::size_t i = 0; i < files.size(); ++i) {
+            std::vector<unsigned char> reference, pixels;
+            unsigned width, height, fastWidth, fastHeight;
+            auto start = std::chrono::steady_clock::now();
+            unsigned error = lodepng::decode(reference, width, height, files[i]);
+            referenceTime += secondsSince(start);
+
+            lodepng::State state;
+            state.decoder.zlibsettings.custom_zlib = pngZlibDecompress;
+            start = std::chrono::steady_clock::now();
+            unsigned fastError = lodepng::decode(pixels, fastWidth, fastHeight, state, files[i]);
+            fastTime += secondsSince(start);
+
+            if (error != 0 || fastError != 0 || pixels != reference) {
+                std::cerr << filenames[i] << ": decodes differ (" << lodepng_error_text(error) << ", "
+                          << lodepng_error_text(fastError) << ")" << std::endl;
+                same = false;
+            }
+            if (r == 0) {
+                pixelBytes += reference.size();
+            }
+        }
+    }
+    referenceTime /= repetitions;
+    fastTime /= repetitions;
+    std::cout << filenames.size() << " PNGs, " << fileBytes / 1048576.0 << " MB compressed, "
+              << pixelBytes / 1048576.0 << " MB decoded" << std::endl;
+    std::cout << "lodepng::decode: " << referenceTime << " s" << std::endl;
+    std::cout << "pngDecode:       " << fastTime << " s (" << referenceTime / fastTime << "x)" << std::endl;
+    std::cout << "Pixels match: " << (same ? "yes" : "no") << std::endl;
+
+    // Unfiltering, of the cubemaps and of generated images with odd widths
+    std::vector<std::vector<unsigned char> > unfilterFiles = files;
+    for (unsigned width : { 1u, 5u, 67u, 256u }) {
+        unfilterFiles.push_back(filterTestPNG(width, 40, LCT_RGB));
+        unfilterFiles.push_back(filterTestPNG(width, 40, LCT_RGBA));
+    }
+    std::size_t filterCounts[5] = { 0, 0, 0, 0, 0 }, numUnfiltered = 0;
+    bool unfilterSame = true;
+    for (std::size_t i = 0; i < unfilterFiles.size(); ++i) {
+        bool checked;
+        if (!checkUnfilter(unfilterFiles[i], filterCounts, &checked)) {
+            std::cerr << (i < filenames.size() ? filenames[i] : "generated PNG " + std::to_string(i - files.size()))
+                      << ": unfiltered scanlines differ" << std::endl;
+            unfilterSame = false;
+        }
+        numUnfiltered += checked ? 1 : 0;
+    }
+    std::cout << "Unfiltering matches the scalar one: " << (unfilterSame ? "yes" : "no") << " (" << numUnfiltered
+              << " PNGs; scanlines with filters None, Sub, Up, Average, Paeth: " << filterCounts[0] << ", "
+              << filterCounts[1] << ", " << filterCounts[2] << ", " << filterCounts[3] << ", " << filterCounts[4]
+              << ")" << std::endl;
+    same = same && unfilterSame;
+
+    // Checksums over 64 MB of generated data
+    std::vector<unsigned char> data(64 << 20);
+    for (std::size_t i = 0; i < data.size(); ++i) {
+        data[i] = (unsigned char)(i * 2654435761u >> 13);
+    }
+    auto start = std::chrono::steady_clock::now();
+    unsigned reference = scalarAdler32(data.data(), data.size());
+    double scalarAdlerTime = secondsSince(start);
+    start = std::chrono::steady_clock::now();
+    unsigned adler = pngAdler32(1, data.data(), data.size());
+    double adlerTime = secondsSince(start);
+    start = std::chrono::steady_clock::now();
+    unsigned crcReference = scalarCrc32(data.data(), data.size());
+    double scalarCrcTime = secondsSince(start);
+    start = std::chrono::steady_clock::now();
+    unsigned crc = lodepng_crc32(data.data(), data.size());
+    double crcTime = secondsSince(start);
+    // The check value of the CRC-32, and every tail length at every alignment
+    bool crcSame = crc == crcReference && lodepng_crc32((const unsigned char *)"123456789", 9) == 0xcbf43926u;
+    for (std::size_t offset = 0; offset < 8; ++offset) {
+        for (std::size_t len = 0; len <= 64; ++len) {
+            crcSame = crcSame && lodepng_crc32(&data[offset], len) == scalarCrc32(&data[offset], len);
+        }
+    }
+    double megabytes = data.size() / 1048576.0;
+    std::cout << "Adler-32, scalar: " << megabytes / scalarAdlerTime << " MB/s" << std::endl;
+    std::cout << "pngAdler32:       " << megabytes / adlerTime << " MB/s ("
+              << scalarAdlerTime / adlerTime << "x, match: " << (adler == reference ? "yes" : "no") << ")"
+              << std::endl;
+    std::cout << "CRC-32, scalar:   " << megabytes / scalarCrcTime << " MB/s" << std::endl;
+    std::cout << "lodepng_crc32:    " << megabytes / crcTime << " MB/s (" << scalarCrcTime / crcTime
+              << "x, match: " << (crcSame ? "yes" : "no") << ")" << std::endl;
+    same = same && adler == reference && crcSame;
+
+    return same ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,307 @@
+// Software rasterizer benchmark and golden-image test
+//
+// Renders a synthetic scene (a bumpy sphere in front of a procedural
+// cubemap) with softRender in every color mode, with both lenses and with
+// the model cut by the near plane, and compares the images with the PNG
+// files in the golden directory: a case fails if more than 0.5% of its
+// pixels differ by more than 16 in a channel. Checks that the images are
+// identical with one thread and with all of them. Then reports frames per
+// second at 320x240, 800x600 and 1920x1080 with 1, 2, 4, ... threads.
+// Exits with a failure if a check fails.
+//
+// Usage: soft_raster_bench [options]
+//
+// The golden directory defaults to $ASSIGNMENT3_ROOT/model_viewer/bench/golden.
+//
+
+#include "utils2.h"
+#include "obj_loader.h"
+#include "soft_raster.h"
+
+#include <lodepng.h>
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+void printUsage(const char *program)
+{
+    std::cout << "Usage: " << program << " [options]" << std::endl
+              << "  --golden DIR     directory of the golden images" << std::endl
+              << "  --update         write the golden images instead of comparing with them" << std::endl
+              << "  --model FILE     time this OBJ file instead of the synthetic sphere" << std::endl
+              << "  --cubemap DIR    time with the cubemap faces in DIR" << std::endl
+              << "  --triangles N    triangles of the timed sphere (default: 200000)" << std::endl
+              << "  --max-threads N  largest thread count timed (default: all cores)" << std::endl
+              << "  --frames N       frames timed per resolution and thread count (default: 10)" << std::endl;
+}
+
+double secondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// A unit sphere of about numTriangles triangles with ridges, so that the
+// shading varies
+void makeSphere(OBJMesh &mesh, int numTriangles)
+{
+    int n = std::max(4, int(std::sqrt(numTriangles / 4.0)));
+    int rings = n, segments = 2 * n;
+    for (int j = 0; j <= rings; ++j) {
+        float theta = glm::pi<float>() * j / rings;
+        for (int i = 0; i <= segments; ++i) {
+            float phi = 2.0f * glm::pi<float>() * i / segments;
+            glm::vec3 d(std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi));
+            float r = 0.8f + 0.05f * std::sin(8.0f * phi) * std::sin(6.0f * theta);
+            mesh.vertices.push_back(r * d);
+        }
+    }
+    for (int j = 0; j < rings; ++j) {
+        for (int i = 0; i < segments; ++i) {
+            std::uint32_t v0 = j * (segments + 1) + i;
+            std::uint32_t v2 = v0 + segments + 1;
+            std::uint32_t triangles[] = { v0, v2, v0 + 1, v0 + 1, v2, v2 + 1 };
+            mesh.indices.insert(mesh.indices.end(), triangles, triangles + 6);
+        }
+    }
+    computeNormals(mesh.vertices, mesh.indices, &mesh.normals);
+}
+
+// Sky above, ground below, with a bright spot to reflect
+void makeCubemap(CubemapImage *image, int size)
+{
+    cubemapImageAllocate(image, size);
+    for (int f = 0; f < 6; ++f) {
+        for (int y = 0; y < size; ++y) {
+            for (int x = 0; x < size; ++x) {
+                glm::vec3 d = cubemapTexelDirection(f, size, x, y);
+                glm::vec3 color = d.y > 0.0f ? glm::mix(glm::vec3(0.6f, 0.7f, 0.9f), glm::vec3(0.1f, 0.2f, 0.6f), d.y)
+                                             : glm::mix(glm::vec3(0.3f, 0.25f, 0.2f), glm::vec3(0.1f, 0.3f, 0.1f), -d.y);
+                float sun = std::max(0.0f, glm::dot(d, glm::normalize(glm::vec3(1.0f, 1.0f, 0.5f))));
+                color += glm::vec3(std::pow(sun, 64.0f));
+                image->faces[f][y * size + x] = color;
+            }
+        }
+    }
+}
+
+struct Environment {
+    CubemapImage skybox;
+    std::vector<CubemapImage> prefiltered;
+    SH9 irradiance;
+};
+
+void makeEnvironment(Environment &environment, const CubemapImage &skybox)
+{
+    environment.skybox = skybox;
+    cubemapImageMipChain(skybox, &environment.prefiltered);
+    environment.irradiance = shIrradiance(shProjectCubemap(skybox, 0));
+}
+
+// The default state of the viewer (see init), with the model turned a
+// little to show its side and moved by offset
+SoftScene makeScene(const Environment &environment, int colorMode, bool perspective, const glm::vec3 &offset,
+                    float aspect)
+{
+    SoftScene scene;
+    scene.model = glm::translate(glm::mat4(1.0f), offset) * glm::mat4_cast(glm::angleAxis(glm::radians(20.0f), glm::vec3(1.0f, 0.0f, 0.0f)) *
+                                 glm::angleAxis(glm::radians(30.0f), glm::vec3(0.0f, 1.0f, 0.0f)));
+    scene.view = glm::lookAt(glm::vec3(0.0f, 0.0f, 2.0f), glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+    float size = 2.0f / std::pow(2.0f, 1.0f);
+    scene.fovy = perspective ? size : 0.0f;
+    scene.aspect = aspect;
+    scene.projection = perspective ? glm::perspective(size, aspect, 0.1f, 100.0f)
+                                   : glm::ortho(-size * aspect, size * aspect, -size, size, 0.1f, 100.0f);
+    scene.ambient_light = glm::vec3(0.04f);
+    scene.light_position = glm::vec3(1.0f);
+    scene.light_color = glm::vec3(1.0f);
+    scene.diffuse_color = glm::vec3(0.1f, 1.0f, 0.1f);
+    scene.specular_color = glm::vec3(0.04f);
+    scene.specular_power = 60.0f;
+    scene.ambient_weight = scene.diffuse_weight = scene.specular_weight = 1.0f;
+    scene.color_mode = colorMode;
+    scene.gamma_correction = true;
+    scene.color_inversion = false;
+    scene.roughness = 0.3f;
+    scene.skybox = &environment.skybox;
+    scene.prefiltered = &environment.prefiltered;
+    scene.irradiance_sh = environment.irradiance;
+    scene.background_color = glm::vec3(0.2f);
+    return scene;
+}
+
+MeshView meshView(const OBJMesh &mesh)
+{
+    MeshView view;
+    view.vertices = mesh.vertices.data();
+    view.normals = mesh.normals.data();
+    view.indices = mesh.indices.data();
+    view.numVertices = mesh.vertices.size();
+    view.numIndices = mesh.indices.size();
+    return view;
+}
+
+// Fraction of pixels with a channel that differs by more than 16 from
+// the golden image, or 1 if it cannot be read
+double compareGolden(const SoftFramebuffer &framebuffer, const std::string &filename)
+{
+    std::vector<unsigned char> golden;
+    unsigned width, height;
+    if (lodepng::decode(golden, width, height, filename, LCT_RGB) != 0 || int(width) != framebuffer.width ||
+        int(height) != framebuffer.height) {
+        std::cerr << "Error: could not read " << filename << " (run with --update to create it)" << std::endl;
+        return 1.0;
+    }
+    std::size_t numDifferent = 0, numPixels = std::size_t(width) * height;
+    for (std::size_t i = 0; i < numPixels; ++i) {
+        for (int c = 0; c < 3; ++c) {
+            if (std::abs(int(golden[3 * i + c]) - int(framebuffer.color[4 * i + c])) > 16) {
+                ++numDifferent;
+                break;
+            }
+        }
+    }
+    return double(numDifferent) / double(numPixels);
+}
+
+int main(int argc, char *argv[])
+{
+    std::string rootDir = std::getenv("ASSIGNMENT3_ROOT") != nullptr ? std::getenv("ASSIGNMENT3_ROOT") : ".";
+    std::string goldenDir = rootDir + "/model_viewer/bench/golden";
+    std::string modelFile, cubemapDir;
+    bool update = false;
+    int numTriangles = 200000, maxThreads = defaultThreadCount(), numFrames = 10;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--golden" && i + 1 < argc) {
+            goldenDir = argv[++i];
+        }
+        else if (arg == "--update") {
+            update = true;
+        }
+        else if (arg == "--model" && i + 1 < argc) {
+            modelFile = argv[++i];
+        }
+        else if (arg == "--cubemap" && i + 1 < argc) {
+            cubemapDir = argv[++i];
+        }
+        else if (arg == "--triangles" && i + 1 < argc) {
+            numTriangles = std::max(1, std::atoi(argv[++i]));
+        }
+        else if (arg == "--max-threads" && i + 1 < argc) {
+            maxThreads = std::max(1, std::atoi(argv[++i]));
+        }
+        else if (arg == "--frames" && i + 1 < argc) {
+            numFrames = std::max(1, std::atoi(argv[++i]));
+        }
+        else {
+            printUsage(argv[0]);
+            return arg == "--help" ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    // Golden images of the synthetic scene, which does not depend on any
+    // files. The last case moves the sphere through the near plane.
+    struct Case {
+        const char *name;
+        int colorMode;
+        bool perspective;
+        glm::vec3 offset;
+    };
+    const Case cases[] = {
+        { "normal_perspective", SOFT_NORMAL_AS_RGB, true, glm::vec3(0.0f) },
+        { "normal_orthographic", SOFT_NORMAL_AS_RGB, false, glm::vec3(0.0f) },
+        { "blinn_phong_perspective", SOFT_BLINN_PHONG, true, glm::vec3(0.0f) },
+        { "blinn_phong_orthographic", SOFT_BLINN_PHONG, false, glm::vec3(0.0f) },
+        { "reflection_perspective", SOFT_REFLECTION, true, glm::vec3(0.0f) },
+        { "reflection_orthographic", SOFT_REFLECTION, false, glm::vec3(0.0f) },
+        { "diffuse_ibl_perspective", SOFT_DIFFUSE_IBL, true, glm::vec3(0.0f) },
+        { "diffuse_ibl_orthographic", SOFT_DIFFUSE_IBL, false, glm::vec3(0.0f) },
+        { "near_clipped", SOFT_BLINN_PHONG, true, glm::vec3(0.6f, 0.1f, 1.2f) },
+    };
+    const int goldenWidth = 160, goldenHeight = 120;
+    CubemapImage proceduralCubemap;
+    makeCubemap(&proceduralCubemap, 64);
+    Environment environment;
+    makeEnvironment(environment, proceduralCubemap);
+    OBJMesh sphere;
+    makeSphere(sphere, 20000);
+
+    bool ok = true;
+    SoftRasterizer serial(1), parallel(maxThreads);
+    SoftFramebuffer serialImage, parallelImage;
+    for (const Case &c : cases) {
+        SoftScene scene = makeScene(environment, c.colorMode, c.perspective, c.offset,
+                                    float(goldenWidth) / float(goldenHeight));
+        softRender(serial, meshView(sphere), scene, goldenWidth, goldenHeight, &serialImage);
+        softRender(parallel, meshView(sphere), scene, goldenWidth, goldenHeight, &parallelImage);
+        bool identical = serialImage.color == parallelImage.color;
+        std::string filename = goldenDir + "/" + c.name + ".png";
+        if (update) {
+            ok = softFramebufferSave(serialImage, filename) && ok;
+            std::cout << "Wrote " << filename << std::endl;
+        }
+        else {
+            double different = compareGolden(serialImage, filename);
+            bool passed = different <= 0.005;
+            std::cout << c.name << ": " << 100.0 * different << "% of pixels differ, "
+                      << (passed ? "passed" : "FAILED") << std::endl;
+            ok = ok && passed;
+        }
+        if (!identical) {
+            std::cout << c.name << ": image with " << maxThreads << " threads differs from 1 thread, FAILED"
+                      << std::endl;
+            ok = false;
+        }
+    }
+
+    // Timing
+    OBJMesh mesh;
+    if (!modelFile.empty()) {
+        if (!objMeshLoadMapped(mesh, modelFile, 0)) {
+            return EXIT_FAILURE;
+        }
+    }
+    else {
+        makeSphere(mesh, numTriangles);
+    }
+    if (!cubemapDir.empty()) {
+        CubemapImage cubemap;
+        std::string error;
+        if (!cubemapImageLoad(&cubemap, cubemapDir, &error)) {
+            std::cerr << "Error: " << error << std::endl;
+            return EXIT_FAILURE;
+        }
+        makeEnvironment(environment, cubemap);
+    }
+    std::cout << mesh.indices.size() / 3 << " triangles, " << numFrames << " frames per measurement" << std::endl;
+    const int resolutions[][2] = { { 320, 240 }, { 800, 600 }, { 1920, 1080 } };
+    std::vector<int> threadCounts;
+    for (int threads = 1; threads < maxThreads; threads *= 2) {
+        threadCounts.push_back(threads);
+    }
+    threadCounts.push_back(maxThreads);
+    for (const auto &resolution : resolutions) {
+        int width = resolution[0], height = resolution[1];
+        SoftScene scene = makeScene(environment, SOFT_BLINN_PHONG, true, glm::vec3(0.0f), float(width) / float(height));
+        std::cout << width << "x" << height << ":";
+        for (int threads : threadCounts) {
+            SoftRasterizer raster(threads);
+            SoftFramebuffer framebuffer;
+            softRender(raster, meshView(mesh), scene, width, height, &framebuffer); // warm up
+            auto start = std::chrono::steady_clock::now();
+            for (int frame = 0; frame < numFrames; ++frame) {
+                softRender(raster, meshView(mesh), scene, width, height, &framebuffer);
+            }
+            std::cout << " " << numFrames / secondsSince(start) << " fps (" << threads << " threads)";
+        }
+        std::cout << std::endl;
+    }
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
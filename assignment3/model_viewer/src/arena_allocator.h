@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstddef>
+#include <iterator>
+#include <map>
+
+// Offset allocator that hands out ranges of [0, capacity) in abstract
+// units (vertices or indices of a GPU buffer; it never touches memory
+// itself). Free ranges are kept in a map by offset and merged with their
+// neighbours when freed; allocations take the smallest free range that
+// fits, which keeps large ranges intact for large meshes. Growing and
+// compacting are up to the owner, which moves the data and then rebuilds
+// the allocator with arenaAllocatorReset.
+
+struct ArenaAllocator {
+    std::size_t capacity;
+    std::size_t used;
+    std::map<std::size_t, std::size_t> freeRanges; // offset -> size
+
+    ArenaAllocator() : capacity(0), used(0) {}
+};
+
+// Start over with capacity units, of which the first used are taken (by
+// ranges that were packed together) and the rest is free
+void arenaAllocatorReset(ArenaAllocator *arena, std::size_t capacity, std::size_t used = 0)
+{
+    arena->capacity = capacity;
+    arena->used = used;
+    arena->freeRanges.clear();
+    if (used < capacity) {
+        arena->freeRanges[used] = capacity - used;
+    }
+}
+
+// Allocate size units (size > 0). Returns false if no free range is large
+// enough, although there may be that much free space in total.
+bool arenaAllocate(ArenaAllocator *arena, std::size_t size, std::size_t *offset)
+{
+    auto best = arena->freeRanges.end();
+    for (auto it = arena->freeRanges.begin(); it != arena->freeRanges.end(); ++it) {
+        if (it->second >= size && (best == arena->freeRanges.end() || it->second < best->second)) {
+            best = it;
+            if (it->second == size) {
+                break;
+            }
+        }
+    }
+    if (size == 0 || best == arena->freeRanges.end()) {
+        return false;
+    }
+    *offset = best->first;
+    std::size_t remaining = best->second - size;
+    arena->freeRanges.erase(best);
+    if (remaining > 0) {
+        arena->freeRanges[*offset + size] = remaining;
+    }
+    arena->used += size;
+    return true;
+}
+
+// Return a range from arenaAllocate, merging it with free neighbours
+void arenaFree(ArenaAllocator *arena, std::size_t offset, std::size_t size)
+{
+    arena->used -= size;
+    auto next = arena->freeRanges.lower_bound(offset);
+    if (next != arena->freeRanges.begin()) {
+        auto previous = std::prev(next);
+        if (previous->first + previous->second == offset) {
+            offset = previous->first;
+            size += previous->second;
+            arena->freeRanges.erase(previous);
+        }
+    }
+    if (next != arena->freeRanges.end() && offset + size == next->first) {
+        size += next->second;
+        arena->freeRanges.erase(next);
+    }
+    arena->freeRanges[offset] = size;
+}
+
+// Size of the largest range that arenaAllocate can return
+std::size_t arenaLargestFree(const ArenaAllocator &arena)
+{
+    std::size_t largest = 0;
+    for (const auto &range : arena.freeRanges) {
+        largest = range.second > largest ? range.second : largest;
+    }
+    return largest;
+}
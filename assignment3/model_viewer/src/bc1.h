@@ -0,0 +1,276 @@
+#pragma once
+
+#include "parallel.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// BC1 (DXT1) block compression of RGBA8 images: every 4x4 block is stored
+// in 8 bytes as two RGB565 endpoints and a 2-bit index per texel into the
+// four colors between them. Alpha is ignored (the opaque four-color mode
+// is always used). The encoder fits the endpoints to the principal axis of
+// the block colors and then refines them by least squares, like most
+// offline encoders.
+
+namespace {
+int bc1Expand5(int v) { return (v << 3) | (v >> 2); }
+int bc1Expand6(int v) { return (v << 2) | (v >> 4); }
+
+std::uint16_t bc1Pack565(const float c[3])
+{
+    int r = std::min(std::max(int(c[0] * 31.0f / 255.0f + 0.5f), 0), 31);
+    int g = std::min(std::max(int(c[1] * 63.0f / 255.0f + 0.5f), 0), 63);
+    int b = std::min(std::max(int(c[2] * 31.0f / 255.0f + 0.5f), 0), 31);
+    return std::uint16_t((r << 11) | (g << 5) | b);
+}
+
+void bc1Unpack565(std::uint16_t c, int rgb[3])
+{
+    rgb[0] = bc1Expand5(c >> 11);
+    rgb[1] = bc1Expand6((c >> 5) & 63);
+    rgb[2] = bc1Expand5(c & 31);
+}
+
+// The four colors of a block with color0 > color1
+void bc1Palette(std::uint16_t color0, std::uint16_t color1, int palette[4][3])
+{
+    bc1Unpack565(color0, palette[0]);
+    bc1Unpack565(color1, palette[1]);
+    for (int c = 0; c < 3; ++c) {
+        palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+        palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+    }
+}
+
+// Choose the nearest palette color for every texel. Returns the squared
+// error of the block.
+int bc1ChooseIndices(const int texels[16][3], std::uint16_t color0, std::uint16_t color1, int indices[16])
+{
+    int palette[4][3];
+    bc1Palette(color0, color1, palette);
+    int total = 0;
+    for (int i = 0; i < 16; ++i) {
+        int best = 0, bestError = 0x7fffffff;
+        for (int p = 0; p < 4; ++p) {
+            int dr = texels[i][0] - palette[p][0];
+            int dg = texels[i][1] - palette[p][1];
+            int db = texels[i][2] - palette[p][2];
+            int error = dr * dr + dg * dg + db * db;
+            if (error < bestError) {
+                best = p;
+                bestError = error;
+            }
+        }
+        indices[i] = best;
+        total += bestError;
+    }
+    return total;
+}
+
+// Endpoints from the extent of the colors along their principal axis
+void bc1PrincipalEndpoints(const int texels[16][3], float end0[3], float end1[3])
+{
+    float mean[3] = { 0.0f, 0.0f, 0.0f };
+    for (int i = 0; i < 16; ++i) {
+        for (int c = 0; c < 3; ++c) {
+            mean[c] += texels[i][c] / 16.0f;
+        }
+    }
+    float cov[6] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f }; // rr, rg, rb, gg, gb, bb
+    for (int i = 0; i < 16; ++i) {
+        float r = texels[i][0] - mean[0], g = texels[i][1] - mean[1], b = texels[i][2] - mean[2];
+        cov[0] += r * r;
+        cov[1] += r * g;
+        cov[2] += r * b;
+        cov[3] += g * g;
+        cov[4] += g * b;
+        cov[5] += b * b;
+    }
+    // Power iteration, starting from the luminance direction
+    float axis[3] = { 0.299f, 0.587f, 0.114f };
+    for (int iteration = 0; iteration < 8; ++iteration) {
+        float x = cov[0] * axis[0] + cov[1] * axis[1] + cov[2] * axis[2];
+        float y = cov[1] * axis[0] + cov[3] * axis[1] + cov[4] * axis[2];
+        float z = cov[2] * axis[0] + cov[4] * axis[1] + cov[5] * axis[2];
+        float length = std::max(std::max(std::abs(x), std::abs(y)), std::abs(z));
+        if (length < 1e-6f) {
+            break; // a single color
+        }
+        axis[0] = x / length;
+        axis[1] = y / length;
+        axis[2] = z / length;
+    }
+    float lo = 1e30f, hi = -1e30f;
+    float axisLength2 = axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2];
+    for (int i = 0; i < 16; ++i) {
+        float t = (texels[i][0] - mean[0]) * axis[0] + (texels[i][1] - mean[1]) * axis[1] +
+                  (texels[i][2] - mean[2]) * axis[2];
+        lo = std::min(lo, t);
+        hi = std::max(hi, t);
+    }
+    for (int c = 0; c < 3; ++c) {
+        end0[c] = mean[c] + axis[c] * hi / axisLength2;
+        end1[c] = mean[c] + axis[c] * lo / axisLength2;
+    }
+}
+
+// Least-squares endpoints for fixed indices. Returns false if all texels
+// use the same weight.
+bool bc1RefineEndpoints(const int texels[16][3], const int indices[16], float end0[3], float end1[3])
+{
+    const float weights[4] = { 1.0f, 0.0f, 2.0f / 3.0f, 1.0f / 3.0f }; // of endpoint 0
+    float aa = 0.0f, ab = 0.0f, bb = 0.0f;
+    float ax[3] = { 0.0f, 0.0f, 0.0f }, bx[3] = { 0.0f, 0.0f, 0.0f };
+    for (int i = 0; i < 16; ++i) {
+        float a = weights[indices[i]], b = 1.0f - a;
+        aa += a * a;
+        ab += a * b;
+        bb += b * b;
+        for (int c = 0; c < 3; ++c) {
+            ax[c] += a * texels[i][c];
+            bx[c] += b * texels[i][c];
+        }
+    }
+    float det = aa * bb - ab * ab;
+    if (std::abs(det) < 1e-6f) {
+        return false;
+    }
+    for (int c = 0; c < 3; ++c) {
+        end0[c] = (bb * ax[c] - ab * bx[c]) / det;
+        end1[c] = (aa * bx[c] - ab * ax[c]) / det;
+    }
+    return true;
+}
+
+void bc1WriteBlock(std::uint16_t color0, std::uint16_t color1, const int indices[16], unsigned char block[8])
+{
+    // Four-color mode needs color0 > color1; swapping the endpoints swaps
+    // indices 0 <-> 1 and 2 <-> 3
+    std::uint32_t flip = 0;
+    if (color0 < color1) {
+        std::swap(color0, color1);
+        flip = 1;
+    }
+    std::uint32_t bits = 0;
+    if (color0 != color1) {
+        for (int i = 0; i < 16; ++i) {
+            bits |= (std::uint32_t(indices[i]) ^ flip) << (2 * i);
+        }
+    }
+    block[0] = (unsigned char)(color0 & 0xff);
+    block[1] = (unsigned char)(color0 >> 8);
+    block[2] = (unsigned char)(color1 & 0xff);
+    block[3] = (unsigned char)(color1 >> 8);
+    for (int i = 0; i < 4; ++i) {
+        block[4 + i] = (unsigned char)(bits >> (8 * i));
+    }
+}
+} // namespace
+
+// Compress a 4x4 block of RGBA8 texels, row by row
+void bc1CompressBlock(const unsigned char rgba[64], unsigned char block[8])
+{
+    int texels[16][3];
+    for (int i = 0; i < 16; ++i) {
+        for (int c = 0; c < 3; ++c) {
+            texels[i][c] = rgba[4 * i + c];
+        }
+    }
+    float end0[3], end1[3];
+    bc1PrincipalEndpoints(texels, end0, end1);
+    std::uint16_t color0 = bc1Pack565(end0), color1 = bc1Pack565(end1);
+    int indices[16];
+    int error = bc1ChooseIndices(texels, color0, color1, indices);
+
+    for (int iteration = 0; iteration < 2 && error > 0; ++iteration) {
+        if (!bc1RefineEndpoints(texels, indices, end0, end1)) {
+            break;
+        }
+        std::uint16_t refined0 = bc1Pack565(end0), refined1 = bc1Pack565(end1);
+        int refinedIndices[16];
+        int refinedError = bc1ChooseIndices(texels, refined0, refined1, refinedIndices);
+        if (refinedError >= error) {
+            break;
+        }
+        color0 = refined0;
+        color1 = refined1;
+        std::copy(refinedIndices, refinedIndices + 16, indices);
+        error = refinedError;
+    }
+    bc1WriteBlock(color0, color1, indices, block);
+}
+
+void bc1DecompressBlock(const unsigned char block[8], unsigned char rgba[64])
+{
+    std::uint16_t color0 = std::uint16_t(block[0] | (block[1] << 8));
+    std::uint16_t color1 = std::uint16_t(block[2] | (block[3] << 8));
+    int palette[4][3];
+    bc1Palette(color0, color1, palette);
+    if (color0 <= color1) {
+        // Three-color mode, with transparent black
+        for (int c = 0; c < 3; ++c) {
+            palette[2][c] = (palette[0][c] + palette[1][c]) / 2;
+            palette[3][c] = 0;
+        }
+    }
+    std::uint32_t bits = block[4] | (block[5] << 8) | (block[6] << 16) | (std::uint32_t(block[7]) << 24);
+    for (int i = 0; i < 16; ++i) {
+        int index = (bits >> (2 * i)) & 3;
+        for (int c = 0; c < 3; ++c) {
+            rgba[4 * i + c] = (unsigned char)palette[index][c];
+        }
+        rgba[4 * i + 3] = (color0 <= color1 && index == 3) ? 0 : 255;
+    }
+}
+
+// Size in bytes of a compressed image
+std::size_t bc1ImageSize(unsigned width, unsigned height)
+{
+    return std::size_t((width + 3) / 4) * ((height + 3) / 4) * 8;
+}
+
+// Compress an RGBA8 image, in parallel over rows of blocks. Blocks at the
+// right and bottom edges of images whose size is not a multiple of 4 are
+// padded by repeating the last column and row.
+void bc1CompressImage(const unsigned char *rgba, unsigned width, unsigned height,
+                      std::vector<unsigned char> *blocks, int numThreads)
+{
+    unsigned blocksX = (width + 3) / 4, blocksY = (height + 3) / 4;
+    blocks->resize(bc1ImageSize(width, height));
+    parallelFor(int(blocksY), numThreads, [&](int by) {
+        unsigned char texels[64];
+        for (unsigned bx = 0; bx < blocksX; ++bx) {
+            for (unsigned y = 0; y < 4; ++y) {
+                unsigned sy = std::min(4 * unsigned(by) + y, height - 1);
+                for (unsigned x = 0; x < 4; ++x) {
+                    unsigned sx = std::min(4 * bx + x, width - 1);
+                    const unsigned char *p = &rgba[(std::size_t(sy) * width + sx) * 4];
+                    std::copy(p, p + 4, &texels[(4 * y + x) * 4]);
+                }
+            }
+            bc1CompressBlock(texels, &(*blocks)[(std::size_t(by) * blocksX + bx) * 8]);
+        }
+    });
+}
+
+void bc1DecompressImage(const unsigned char *blocks, unsigned width, unsigned height,
+                        std::vector<unsigned char> *rgba)
+{
+    unsigned blocksX = (width + 3) / 4, blocksY = (height + 3) / 4;
+    rgba->resize(std::size_t(width) * height * 4);
+    unsigned char texels[64];
+    for (unsigned by = 0; by < blocksY; ++by) {
+        for (unsigned bx = 0; bx < blocksX; ++bx) {
+            bc1DecompressBlock(&blocks[(std::size_t(by) * blocksX + bx) * 8], texels);
+            for (unsigned y = 0; y < 4 && 4 * by + y < height; ++y) {
+                for (unsigned x = 0; x < 4 && 4 * bx + x < width; ++x) {
+                    std::copy(&texels[(4 * y + x) * 4], &texels[(4 * y + x) * 4] + 4,
+                              &(*rgba)[((std::size_t(4 * by + y)) * width + 4 * bx + x) * 4]);
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,282 @@
+#pragma once
+
+#include "parallel.h"
+#include "png_decode.h"
+
+#include <lodepng.h>
+
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Read the size of a PNG image from its header, without decoding it
+bool pngImageSize(const std::string &filename, unsigned *width, unsigned *height)
+{
+    // 8 byte signature, then the IHDR chunk: length, type, width, height
+    unsigned char header[24];
+    std::ifstream file(filename.c_str(), std::ios::binary);
+    if (!file.read(reinterpret_cast<char *>(header), sizeof(header))) {
+        return false;
+    }
+    if (header[0] != 0x89 || header[1] != 'P' || header[2] != 'N' || header[3] != 'G' ||
+        header[12] != 'I' || header[13] != 'H' || header[14] != 'D' || header[15] != 'R') {
+        return false;
+    }
+    *width = (unsigned(header[16]) << 24) | (unsigned(header[17]) << 16) | (unsigned(header[18]) << 8) | header[19];
+    *height = (unsigned(header[20]) << 24) | (unsigned(header[21]) << 16) | (unsigned(header[22]) << 8) | header[23];
+    return true;
+}
+
+namespace {
+float srgbToLinear(float c)
+{
+    return c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+}
+
+float linearToSrgb(float c)
+{
+    return c <= 0.0031308f ? c * 12.92f : 1.055f * std::pow(c, 1.0f / 2.4f) - 0.055f;
+}
+
+struct SrgbTable {
+    float toLinear[256];
+
+    SrgbTable()
+    {
+        for (int i = 0; i < 256; ++i) {
+            toLinear[i] = srgbToLinear(i / 255.0f);
+        }
+    }
+};
+} // namespace
+
+// Halve an sRGB RGBA8 image (to at least 1x1) with a 2x2 box filter in
+// linear space; alpha is averaged as is
+void downsampleSrgba8(const std::vector<unsigned char> &src, unsigned width, unsigned height,
+                      std::vector<unsigned char> *dst)
+{
+    static const SrgbTable table;
+    unsigned dstWidth = width > 1 ? width / 2 : 1;
+    unsigned dstHeight = height > 1 ? height / 2 : 1;
+    dst->resize(std::size_t(dstWidth) * dstHeight * 4);
+    for (unsigned y = 0; y < dstHeight; ++y) {
+        unsigned y0 = std::min(2 * y, height - 1), y1 = std::min(2 * y + 1, height - 1);
+        for (unsigned x = 0; x < dstWidth; ++x) {
+            unsigned x0 = std::min(2 * x, width - 1), x1 = std::min(2 * x + 1, width - 1);
+            const unsigned char *p[4] = {
+                &src[(std::size_t(y0) * width + x0) * 4], &src[(std::size_t(y0) * width + x1) * 4],
+                &src[(std::size_t(y1) * width + x0) * 4], &src[(std::size_t(y1) * width + x1) * 4]
+            };
+            unsigned char *out = &(*dst)[(std::size_t(y) * dstWidth + x) * 4];
+            for (int c = 0; c < 3; ++c) {
+                float sum = table.toLinear[p[0][c]] + table.toLinear[p[1][c]] +
+                            table.toLinear[p[2][c]] + table.toLinear[p[3][c]];
+                out[c] = (unsigned char)(linearToSrgb(0.25f * sum) * 255.0f + 0.5f);
+            }
+            out[3] = (unsigned char)((p[0][3] + p[1][3] + p[2][3] + p[3][3] + 2) / 4);
+        }
+    }
+}
+
+// Halve an image until it has the given size. Returns false if that size
+// cannot be reached by halving.
+bool downsampleSrgba8To(std::vector<unsigned char> &pixels, unsigned *width, unsigned *height,
+                        unsigned targetWidth, unsigned targetHeight)
+{
+    std::vector<unsigned char> half;
+    while (*width > targetWidth || *height > targetHeight) {
+        downsampleSrgba8(pixels, *width, *height, &half);
+        pixels.swap(half);
+        *width = *width > 1 ? *width / 2 : 1;
+        *height = *height > 1 ? *height / 2 : 1;
+    }
+    return *width == targetWidth && *height == targetHeight;
+}
+
+// Cubemap with square faces of linear RGB texels, in the order posx,
+// negx, posy, negy, posz, negz (the OpenGL face order). Rows are stored
+// top to bottom, as in the PNG files.
+struct CubemapImage {
+    int size;
+    std::vector<glm::vec3> faces[6];
+};
+
+const char *const cubemapImageFaceNames[] = { "posx", "negx", "posy", "negy", "posz", "negz" };
+
+void cubemapImageAllocate(CubemapImage *image, int size)
+{
+    image->size = size;
+    for (int f = 0; f < 6; ++f) {
+        image->faces[f].assign(std::size_t(size) * size, glm::vec3(0.0f));
+    }
+}
+
+// Load the six sRGB PNG faces in dirname in parallel. Returns false (with
+// a message in error) if a face cannot be read or the faces are not
+// squares of the same size.
+bool cubemapImageLoad(CubemapImage *image, const std::string &dirname, std::string *error, int numThreads = 0)
+{
+    static const SrgbTable table;
+    std::vector<unsigned char> pixels[6];
+    unsigned width[6], height[6], errors[6];
+    parallelFor(6, numThreads, [&](int f) {
+        std::string filename = dirname + "/" + cubemapImageFaceNames[f] + ".png";
+        errors[f] = pngDecode(pixels[f], width[f], height[f], filename);
+    });
+    for (int f = 0; f < 6; ++f) {
+        std::string filename = dirname + "/" + cubemapImageFaceNames[f] + ".png";
+        if (errors[f] != 0) {
+            *error = filename + ": " + lodepng_error_text(errors[f]);
+            return false;
+        }
+        if (width[f] != height[f] || width[f] != width[0]) {
+            *error = filename + ": faces must be squares of the same size";
+            return false;
+        }
+    }
+    cubemapImageAllocate(image, int(width[0]));
+    for (int f = 0; f < 6; ++f) {
+        for (std::size_t i = 0; i < image->faces[f].size(); ++i) {
+            const unsigned char *p = &pixels[f][4 * i];
+            image->faces[f][i] = glm::vec3(table.toLinear[p[0]], table.toLinear[p[1]], table.toLinear[p[2]]);
+        }
+    }
+    return true;
+}
+
+// Write the faces to dirname as sRGB PNG files (which must exist)
+bool cubemapImageSave(const CubemapImage &image, const std::string &dirname, std::string *error)
+{
+    for (int f = 0; f < 6; ++f) {
+        std::vector<unsigned char> pixels(image.faces[f].size() * 4);
+        for (std::size_t i = 0; i < image.faces[f].size(); ++i) {
+            for (int c = 0; c < 3; ++c) {
+                float value = linearToSrgb(glm::clamp(image.faces[f][i][c], 0.0f, 1.0f));
+                pixels[4 * i + c] = (unsigned char)(value * 255.0f + 0.5f);
+            }
+            pixels[4 * i + 3] = 255;
+        }
+        std::string filename = dirname + "/" + cubemapImageFaceNames[f] + ".png";
+        unsigned result = lodepng::encode(filename, pixels, image.size, image.size);
+        if (result != 0) {
+            *error = filename + ": " + lodepng_error_text(result);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Returns the (unnormalized) direction through a point of a face, where
+// s and t are in [-1, 1] and t = -1 is the top row
+glm::vec3 cubemapDirection(int face, float s, float t)
+{
+    switch (face) {
+    case 0: return glm::vec3(1.0f, -t, -s);
+    case 1: return glm::vec3(-1.0f, -t, s);
+    case 2: return glm::vec3(s, 1.0f, t);
+    case 3: return glm::vec3(s, -1.0f, -t);
+    case 4: return glm::vec3(s, -t, 1.0f);
+    default: return glm::vec3(-s, -t, -1.0f);
+    }
+}
+
+// Returns the direction through the center of a texel
+glm::vec3 cubemapTexelDirection(int face, int size, int x, int y)
+{
+    return cubemapDirection(face, 2.0f * (x + 0.5f) / size - 1.0f, 2.0f * (y + 0.5f) / size - 1.0f);
+}
+
+// Returns the solid angle that a texel covers
+float cubemapTexelSolidAngle(int size, int x, int y)
+{
+    // Integral of the projected area from the corner (0, 0) to (u, v)
+    struct Area {
+        static float at(float u, float v) { return std::atan2(u * v, std::sqrt(u * u + v * v + 1.0f)); }
+    };
+    float inv = 1.0f / size;
+    float u0 = 2.0f * x * inv - 1.0f, u1 = u0 + 2.0f * inv;
+    float v0 = 2.0f * y * inv - 1.0f, v1 = v0 + 2.0f * inv;
+    return Area::at(u0, v0) - Area::at(u0, v1) - Area::at(u1, v0) + Area::at(u1, v1);
+}
+
+// Find the face that a direction points into and the texel coordinates
+// (in [0, 1], t = 0 at the top) of that point
+void cubemapFaceCoordinates(const glm::vec3 &d, int *face, float *s, float *t)
+{
+    glm::vec3 a = glm::abs(d);
+    float sc, tc, ma;
+    if (a.x >= a.y && a.x >= a.z) {
+        *face = d.x >= 0.0f ? 0 : 1;
+        sc = d.x >= 0.0f ? -d.z : d.z;
+        tc = -d.y;
+        ma = a.x;
+    }
+    else if (a.y >= a.z) {
+        *face = d.y >= 0.0f ? 2 : 3;
+        sc = d.x;
+        tc = d.y >= 0.0f ? d.z : -d.z;
+        ma = a.y;
+    }
+    else {
+        *face = d.z >= 0.0f ? 4 : 5;
+        sc = d.z >= 0.0f ? d.x : -d.x;
+        tc = -d.y;
+        ma = a.z;
+    }
+    *s = 0.5f * (sc / ma + 1.0f);
+    *t = 0.5f * (tc / ma + 1.0f);
+}
+
+// Bilinearly filtered lookup in a direction (filtering stops at the face
+// edges)
+glm::vec3 cubemapSample(const CubemapImage &image, const glm::vec3 &direction)
+{
+    int face;
+    float s, t;
+    cubemapFaceCoordinates(direction, &face, &s, &t);
+    int n = image.size;
+    float x = glm::clamp(s * n - 0.5f, 0.0f, float(n - 1));
+    float y = glm::clamp(t * n - 0.5f, 0.0f, float(n - 1));
+    int x0 = int(x), y0 = int(y);
+    int x1 = std::min(x0 + 1, n - 1), y1 = std::min(y0 + 1, n - 1);
+    float fx = x - x0, fy = y - y0;
+    const std::vector<glm::vec3> &texels = image.faces[face];
+    glm::vec3 top = glm::mix(texels[y0 * n + x0], texels[y0 * n + x1], fx);
+    glm::vec3 bottom = glm::mix(texels[y1 * n + x0], texels[y1 * n + x1], fx);
+    return glm::mix(top, bottom, fy);
+}
+
+// Halve the faces of a cubemap with a 2x2 box filter
+void cubemapImageDownsample(const CubemapImage &source, CubemapImage *half)
+{
+    int n = std::max(source.size / 2, 1);
+    cubemapImageAllocate(half, n);
+    for (int f = 0; f < 6; ++f) {
+        const std::vector<glm::vec3> &src = source.faces[f];
+        for (int y = 0; y < n; ++y) {
+            int y0 = std::min(2 * y, source.size - 1), y1 = std::min(2 * y + 1, source.size - 1);
+            for (int x = 0; x < n; ++x) {
+                int x0 = std::min(2 * x, source.size - 1), x1 = std::min(2 * x + 1, source.size - 1);
+                half->faces[f][y * n + x] = 0.25f * (src[y0 * source.size + x0] + src[y0 * source.size + x1] +
+                                                     src[y1 * source.size + x0] + src[y1 * source.size + x1]);
+            }
+        }
+    }
+}
+
+// Build a mip chain down to 1x1; mips[0] is a copy of the image
+void cubemapImageMipChain(const CubemapImage &image, std::vector<CubemapImage> *mips)
+{
+    mips->assign(1, image);
+    while (mips->back().size > 1) {
+        CubemapImage half;
+        cubemapImageDownsample(mips->back(), &half);
+        mips->push_back(half);
+    }
+}
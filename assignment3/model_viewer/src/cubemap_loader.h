@@ -0,0 +1,331 @@
+#pragma once
+
+#include "parallel.h"
+#include "cubemap_image.h"
+#include "spherical_harmonics.h"
+
+#include <GL/glew.h>
+#include <lodepng.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Loads cubemap textures in the background. The PNG faces are decoded on
+// a worker pool, and the render thread uploads each face through a pixel
+// buffer object as soon as it is decoded (cubemapLoaderUpdate, once per
+// frame), so textures fill in progressively instead of blocking startup.
+// Until all faces of a cubemap are in, missing faces are black (and a
+// cubemap with generated mipmaps has none yet).
+//
+// A cubemap can also be projected onto 9 spherical harmonics coefficients
+// for diffuse lighting: every face is projected on the worker that
+// decoded it, and the coefficients are available once all faces are in
+// (cubemapLoaderIrradiance).
+
+// A decoded face, waiting to be uploaded
+struct CubemapFace {
+    std::size_t cubemap;
+    int level;
+    int face;
+    std::string filename;
+    std::vector<unsigned char> pixels;
+    unsigned width;
+    unsigned height;
+    std::string error; // empty if decoded
+    bool projected; // radiance holds the SH projection of the face
+    SH9 radiance;
+};
+
+struct CubemapLoadState {
+    GLuint texture;
+    bool generateMipmaps;
+    int numLevels; // levels loaded from files
+    unsigned width; // of level 0; 0 until known
+    unsigned height;
+    int numFaces; // uploaded faces of all levels
+    bool projectIrradiance;
+    SH9 faceRadiance[6]; // SH projections of the faces of level 0
+    int numProjected;
+    SH9 irradiance; // valid once all faces are projected
+};
+
+struct CubemapLoader {
+    std::unique_ptr<WorkerPool> pool;
+    std::vector<CubemapLoadState> cubemaps;
+    std::mutex mutex; // guards decoded
+    std::deque<CubemapFace> decoded;
+    int numPending; // faces that have not been uploaded yet
+    GLuint pbos[2];
+    int nextPBO;
+    std::chrono::steady_clock::time_point start;
+};
+
+namespace {
+const char *cubemapFaceFilenames[] = { "posx.png", "negx.png", "posy.png", "negy.png", "posz.png", "negz.png" };
+const GLenum cubemapFaceTargets[] = {
+    GL_TEXTURE_CUBE_MAP_POSITIVE_X, GL_TEXTURE_CUBE_MAP_NEGATIVE_X,
+    GL_TEXTURE_CUBE_MAP_POSITIVE_Y, GL_TEXTURE_CUBE_MAP_NEGATIVE_Y,
+    GL_TEXTURE_CUBE_MAP_POSITIVE_Z, GL_TEXTURE_CUBE_MAP_NEGATIVE_Z
+};
+
+// Allocate all faces of a cubemap level at the given size, filled with
+// black
+void cubemapAllocate(GLuint texture, int level, unsigned width, unsigned height)
+{
+    std::vector<unsigned char> black(std::size_t(width) * height * 4, 0);
+    glBindTexture(GL_TEXTURE_CUBE_MAP, texture);
+    for (int i = 0; i < 6; ++i) {
+        glTexImage2D(cubemapFaceTargets[i], level, GL_SRGB8_ALPHA8, width, height,
+                     0, GL_RGBA, GL_UNSIGNED_BYTE, black.data());
+    }
+}
+
+// Decode a face on a worker thread. Faces of level > 0 of a mip chain are
+// downsampled to the size of their level if they are stored larger.
+// If project is set, the face is also projected onto spherical harmonics.
+void cubemapDecodeFace(CubemapLoader *loader, std::size_t cubemap, int level, int face,
+                       const std::string &filename, unsigned width, unsigned height, bool project)
+{
+    CubemapFace decoded;
+    decoded.cubemap = cubemap;
+    decoded.level = level;
+    decoded.face = face;
+    decoded.filename = filename;
+    decoded.width = decoded.height = 0;
+    decoded.projected = false;
+    unsigned error = pngDecode(decoded.pixels, decoded.width, decoded.height, filename);
+    if (error != 0) {
+        decoded.error = lodepng_error_text(error);
+    }
+    else if (level > 0 && !downsampleSrgba8To(decoded.pixels, &decoded.width, &decoded.height,
+                                              std::max(width >> level, 1u), std::max(height >> level, 1u))) {
+        decoded.error = "too small for mipmap level " + std::to_string(level);
+    }
+    else if (project) {
+        if (decoded.width != decoded.height) {
+            decoded.error = "faces must be square";
+        }
+        else {
+            decoded.radiance = shProjectFaceSrgba8(face, int(decoded.width), decoded.pixels.data());
+            decoded.projected = true;
+        }
+    }
+    std::lock_guard<std::mutex> lock(loader->mutex);
+    loader->decoded.push_back(std::move(decoded));
+}
+
+// Upload a decoded face through the next pixel buffer object. The buffer
+// is orphaned first, so the copy does not wait for the previous upload.
+void cubemapUploadFace(CubemapLoader &loader, const CubemapFace &face)
+{
+    CubemapLoadState &state = loader.cubemaps[face.cubemap];
+    if (!face.error.empty()) {
+        std::cout << "Error: " << face.filename << ": " << face.error << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+    if (state.width == 0) {
+        state.width = face.width;
+        state.height = face.height;
+        cubemapAllocate(state.texture, 0, state.width, state.height);
+    }
+    if (face.width != std::max(state.width >> face.level, 1u) ||
+        face.height != std::max(state.height >> face.level, 1u)) {
+        std::cout << "Error: " << face.filename << " has a different size than the other faces" << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+
+    std::size_t size = face.pixels.size();
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, loader.pbos[loader.nextPBO]);
+    loader.nextPBO = 1 - loader.nextPBO;
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, size, nullptr, GL_STREAM_DRAW);
+    void *mapped = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size,
+                                    GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    const void *source = nullptr; // offset into the buffer
+    if (mapped != nullptr) {
+        std::memcpy(mapped, face.pixels.data(), size);
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+    }
+    else {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        source = face.pixels.data();
+    }
+    glBindTexture(GL_TEXTURE_CUBE_MAP, state.texture);
+    glTexSubImage2D(cubemapFaceTargets[face.face], face.level, 0, 0, face.width, face.height,
+                    GL_RGBA, GL_UNSIGNED_BYTE, source);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    if (face.projected) {
+        state.faceRadiance[face.face] = face.radiance;
+        if (++state.numProjected == 6) {
+            // Add the faces in a fixed order, whatever order they came in
+            SH9 radiance = state.faceRadiance[0];
+            for (int i = 1; i < 6; ++i) {
+                for (int k = 0; k < 9; ++k) {
+                    radiance.c[k] += state.faceRadiance[i].c[k];
+                }
+            }
+            state.irradiance = shIrradiance(radiance);
+        }
+    }
+
+    if (++state.numFaces == 6 * state.numLevels && state.generateMipmaps) {
+        glGenerateMipmap(GL_TEXTURE_CUBE_MAP);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    }
+    glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+}
+} // namespace
+
+void cubemapLoaderInit(CubemapLoader &loader, int numThreads)
+{
+    loader.pool.reset(new WorkerPool(numThreads));
+    loader.cubemaps.clear();
+    loader.numPending = 0;
+    glGenBuffers(2, loader.pbos);
+    loader.nextPBO = 0;
+    loader.start = std::chrono::steady_clock::now();
+}
+
+// Start loading the cubemap in dirname (posx.png, negx.png, ...). Returns
+// the texture right away; it can be bound while it is loading. Cubemaps
+// are decoded in the order they are added. With projectIrradiance, its
+// spherical harmonics irradiance is computed as well.
+GLuint cubemapLoaderAdd(CubemapLoader &loader, const std::string &dirname, bool generateMipmaps,
+                        bool projectIrradiance = false)
+{
+    CubemapLoadState state;
+    glGenTextures(1, &state.texture);
+    glBindTexture(GL_TEXTURE_CUBE_MAP, state.texture);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    cubemapAllocate(state.texture, 0, 1, 1);
+    glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+    state.generateMipmaps = generateMipmaps;
+    state.numLevels = 1;
+    state.width = state.height = 0;
+    state.numFaces = 0;
+    state.projectIrradiance = projectIrradiance;
+    state.numProjected = 0;
+    loader.cubemaps.push_back(state);
+
+    std::size_t cubemap = loader.cubemaps.size() - 1;
+    CubemapLoader *shared = &loader;
+    for (int i = 0; i < 6; ++i) {
+        std::string filename = dirname + "/" + cubemapFaceFilenames[i];
+        loader.pool->submit([=]() {
+            cubemapDecodeFace(shared, cubemap, 0, i, filename, 0, 0, projectIrradiance);
+        });
+        ++loader.numPending;
+    }
+    return state.texture;
+}
+
+// Start loading a cubemap with a precomputed mip chain: level i is read
+// from levelDirs[i]. Levels stored at a larger size than 2^-i times the
+// size of level 0 are downsampled (so a chain of prefiltered images that
+// all have the same size works). The chain must be complete, ending at
+// 1x1.
+GLuint cubemapLoaderAddMipmapped(CubemapLoader &loader, const std::vector<std::string> &levelDirs)
+{
+    CubemapLoadState state;
+    std::string first = levelDirs[0] + "/" + cubemapFaceFilenames[0];
+    if (!pngImageSize(first, &state.width, &state.height)) {
+        std::cout << "Error: could not read " << first << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+    state.generateMipmaps = false;
+    state.numLevels = int(levelDirs.size());
+    state.numFaces = 0;
+    state.projectIrradiance = false;
+    state.numProjected = 0;
+    glGenTextures(1, &state.texture);
+    glBindTexture(GL_TEXTURE_CUBE_MAP, state.texture);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_BASE_LEVEL, 0);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, state.numLevels - 1);
+    for (int level = 0; level < state.numLevels; ++level) {
+        cubemapAllocate(state.texture, level, std::max(state.width >> level, 1u), std::max(state.height >> level, 1u));
+    }
+    glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+    loader.cubemaps.push_back(state);
+
+    std::size_t cubemap = loader.cubemaps.size() - 1;
+    CubemapLoader *shared = &loader;
+    unsigned width = state.width, height = state.height;
+    for (int level = 0; level < state.numLevels; ++level) {
+        for (int i = 0; i < 6; ++i) {
+            std::string filename = levelDirs[level] + "/" + cubemapFaceFilenames[i];
+            loader.pool->submit([=]() {
+                cubemapDecodeFace(shared, cubemap, level, i, filename, width, height, false);
+            });
+            ++loader.numPending;
+        }
+    }
+    return state.texture;
+}
+
+// Upload up to maxUploads decoded faces (all if 0). Call once per frame
+// from the render thread. Returns true while faces are still loading.
+bool cubemapLoaderUpdate(CubemapLoader &loader, int maxUploads)
+{
+    for (int i = 0; loader.numPending > 0 && (maxUploads <= 0 || i < maxUploads); ++i) {
+        CubemapFace face;
+        {
+            std::lock_guard<std::mutex> lock(loader.mutex);
+            if (loader.decoded.empty()) {
+                break;
+            }
+            face = std::move(loader.decoded.front());
+            loader.decoded.pop_front();
+        }
+        cubemapUploadFace(loader, face);
+        if (--loader.numPending == 0) {
+            auto elapsed = std::chrono::steady_clock::now() - loader.start;
+            std::cout << "Loaded " << loader.cubemaps.size() << " cubemaps in "
+                      << std::chrono::duration<double, std::milli>(elapsed).count() << " ms" << std::endl;
+        }
+    }
+    return loader.numPending > 0;
+}
+
+// Get the spherical harmonics irradiance of a cubemap added with
+// projectIrradiance (see shIrradiance). Returns false until all of its
+// faces have been uploaded.
+bool cubemapLoaderIrradiance(const CubemapLoader &loader, GLuint texture, SH9 *irradiance)
+{
+    for (const CubemapLoadState &state : loader.cubemaps) {
+        if (state.texture == texture && state.projectIrradiance && state.numProjected == 6) {
+            *irradiance = state.irradiance;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Wait for and upload all faces
+void cubemapLoaderFinish(CubemapLoader &loader)
+{
+    loader.pool->wait();
+    cubemapLoaderUpdate(loader, 0);
+}
+
+// Stop the workers (waiting for running decodes) and free the buffers.
+// The textures are not deleted.
+void cubemapLoaderShutdown(CubemapLoader &loader)
+{
+    loader.pool.reset();
+    loader.decoded.clear();
+    glDeleteBuffers(2, loader.pbos);
+}
@@ -0,0 +1,213 @@
+#pragma once
+
+#include "cubemap_image.h"
+#include "parallel.h"
+
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CUBEMAP_PREFILTER_SSE2
+#endif
+
+// Prefiltering of environment maps with a normalized Phong lobe: the
+// value in reflection direction r is the average of the radiance L(w)
+// weighted by max(0, dot(r, w))^power.
+
+namespace {
+#ifdef CUBEMAP_PREFILTER_SSE2
+// Approximate log2 and exp2 for x > 0 (relative error about 1e-4), after
+// Paul Mineiro's fastapprox
+inline __m128 prefilterLog2(__m128 x)
+{
+    __m128i bits = _mm_castps_si128(x);
+    __m128 y = _mm_mul_ps(_mm_cvtepi32_ps(bits), _mm_set1_ps(1.1920928955078125e-7f));
+    __m128 mx = _mm_castsi128_ps(_mm_or_si128(_mm_and_si128(bits, _mm_set1_epi32(0x007fffff)),
+                                              _mm_set1_epi32(0x3f000000)));
+    y = _mm_sub_ps(y, _mm_set1_ps(124.22551499f));
+    y = _mm_sub_ps(y, _mm_mul_ps(_mm_set1_ps(1.498030302f), mx));
+    return _mm_sub_ps(y, _mm_div_ps(_mm_set1_ps(1.72587999f), _mm_add_ps(_mm_set1_ps(0.3520887068f), mx)));
+}
+
+inline __m128 prefilterExp2(__m128 p)
+{
+    p = _mm_max_ps(p, _mm_set1_ps(-126.0f));
+    __m128 w = _mm_cvtepi32_ps(_mm_cvttps_epi32(p));
+    __m128 offset = _mm_and_ps(_mm_cmplt_ps(p, _mm_setzero_ps()), _mm_set1_ps(1.0f));
+    __m128 z = _mm_add_ps(_mm_sub_ps(p, w), offset);
+    __m128 v = _mm_add_ps(p, _mm_set1_ps(121.2740575f));
+    v = _mm_add_ps(v, _mm_div_ps(_mm_set1_ps(27.7280233f), _mm_sub_ps(_mm_set1_ps(4.84252568f), z)));
+    v = _mm_sub_ps(v, _mm_mul_ps(_mm_set1_ps(1.49012907f), z));
+    return _mm_castsi128_ps(_mm_cvtps_epi32(_mm_mul_ps(_mm_set1_ps(float(1 << 23)), v)));
+}
+#endif
+
+// Texels of a cubemap as structure-of-arrays, padded to a multiple of four
+// with zero weights
+struct PrefilterTexels {
+    std::vector<float> x, y, z; // unit direction
+    std::vector<float> r, g, b; // radiance times solid angle
+    std::vector<float> solidAngle;
+};
+
+void prefilterGatherTexels(const CubemapImage &image, PrefilterTexels *texels)
+{
+    int n = image.size;
+    std::size_t count = 6 * std::size_t(n) * n;
+    std::size_t padded = (count + 3) & ~std::size_t(3);
+    std::vector<float> *arrays[] = { &texels->x, &texels->y, &texels->z, &texels->r, &texels->g, &texels->b,
+                                     &texels->solidAngle };
+    for (std::vector<float> *array : arrays) {
+        array->assign(padded, 0.0f);
+    }
+    std::size_t i = 0;
+    for (int face = 0; face < 6; ++face) {
+        for (int y = 0; y < n; ++y) {
+            for (int x = 0; x < n; ++x, ++i) {
+                glm::vec3 d = glm::normalize(cubemapTexelDirection(face, n, x, y));
+                float solidAngle = cubemapTexelSolidAngle(n, x, y);
+                glm::vec3 radiance = image.faces[face][y * n + x] * solidAngle;
+                texels->x[i] = d.x;
+                texels->y[i] = d.y;
+                texels->z[i] = d.z;
+                texels->r[i] = radiance.x;
+                texels->g[i] = radiance.y;
+                texels->b[i] = radiance.z;
+                texels->solidAngle[i] = solidAngle;
+            }
+        }
+    }
+}
+
+// Phong-weighted average of all texels around a direction
+glm::vec3 prefilterTexelsPhong(const PrefilterTexels &texels, const glm::vec3 &r, float power)
+{
+    std::size_t count = texels.x.size();
+    std::size_t i = 0;
+    float sum[4] = { 0.0f, 0.0f, 0.0f, 0.0f }; // r, g, b, weight
+#ifdef CUBEMAP_PREFILTER_SSE2
+    __m128 rx = _mm_set1_ps(r.x), ry = _mm_set1_ps(r.y), rz = _mm_set1_ps(r.z);
+    __m128 n = _mm_set1_ps(power);
+    __m128 sumR = _mm_setzero_ps(), sumG = _mm_setzero_ps(), sumB = _mm_setzero_ps(), sumW = _mm_setzero_ps();
+    for (; i + 4 <= count; i += 4) {
+        __m128 c = _mm_add_ps(_mm_add_ps(_mm_mul_ps(rx, _mm_loadu_ps(&texels.x[i])),
+                                         _mm_mul_ps(ry, _mm_loadu_ps(&texels.y[i]))),
+                              _mm_mul_ps(rz, _mm_loadu_ps(&texels.z[i])));
+        __m128 positive = _mm_cmpgt_ps(c, _mm_setzero_ps());
+        c = _mm_max_ps(c, _mm_set1_ps(1e-30f));
+        __m128 w = _mm_and_ps(positive, prefilterExp2(_mm_mul_ps(n, prefilterLog2(c))));
+        sumR = _mm_add_ps(sumR, _mm_mul_ps(w, _mm_loadu_ps(&texels.r[i])));
+        sumG = _mm_add_ps(sumG, _mm_mul_ps(w, _mm_loadu_ps(&texels.g[i])));
+        sumB = _mm_add_ps(sumB, _mm_mul_ps(w, _mm_loadu_ps(&texels.b[i])));
+        sumW = _mm_add_ps(sumW, _mm_mul_ps(w, _mm_loadu_ps(&texels.solidAngle[i])));
+    }
+    __m128 *sums[] = { &sumR, &sumG, &sumB, &sumW };
+    for (int k = 0; k < 4; ++k) {
+        float lanes[4];
+        _mm_storeu_ps(lanes, *sums[k]);
+        sum[k] = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    }
+#endif
+    for (; i < count; ++i) {
+        float c = r.x * texels.x[i] + r.y * texels.y[i] + r.z * texels.z[i];
+        if (c > 0.0f) {
+            float w = std::pow(c, power);
+            sum[0] += w * texels.r[i];
+            sum[1] += w * texels.g[i];
+            sum[2] += w * texels.b[i];
+            sum[3] += w * texels.solidAngle[i];
+        }
+    }
+    return sum[3] > 0.0f ? glm::vec3(sum[0], sum[1], sum[2]) / sum[3] : glm::vec3(0.0f);
+}
+
+// Van der Corput radical inverse, for Hammersley points
+float prefilterRadicalInverse(std::uint32_t bits)
+{
+    bits = (bits << 16) | (bits >> 16);
+    bits = ((bits & 0x55555555u) << 1) | ((bits & 0xaaaaaaaau) >> 1);
+    bits = ((bits & 0x33333333u) << 2) | ((bits & 0xccccccccu) >> 2);
+    bits = ((bits & 0x0f0f0f0fu) << 4) | ((bits & 0xf0f0f0f0u) >> 4);
+    bits = ((bits & 0x00ff00ffu) << 8) | ((bits & 0xff00ff00u) >> 8);
+    return float(bits) * 2.3283064365386963e-10f;
+}
+
+// Trilinear lookup in a mip chain
+glm::vec3 prefilterSampleLod(const std::vector<CubemapImage> &mips, const glm::vec3 &d, float lod)
+{
+    lod = glm::clamp(lod, 0.0f, float(mips.size() - 1));
+    int level = int(lod);
+    int next = std::min(level + 1, int(mips.size()) - 1);
+    glm::vec3 a = cubemapSample(mips[level], d);
+    return level == next ? a : glm::mix(a, cubemapSample(mips[next], d), lod - level);
+}
+} // namespace
+
+// Prefilter by summing over all texels of source (vectorized). The cost is
+// the number of output texels times the number of source texels, so it is
+// meant for low powers, where a small source suffices.
+void prefilterPhongBruteForce(const CubemapImage &source, float power, int size, CubemapImage *output,
+                              int numThreads)
+{
+    PrefilterTexels texels;
+    prefilterGatherTexels(source, &texels);
+    cubemapImageAllocate(output, size);
+    parallelFor(6 * size, numThreads, [&](int row) {
+        int face = row / size, y = row % size;
+        for (int x = 0; x < size; ++x) {
+            glm::vec3 r = glm::normalize(cubemapTexelDirection(face, size, x, y));
+            output->faces[face][y * size + x] = prefilterTexelsPhong(texels, r, power);
+        }
+    });
+}
+
+// Prefilter with importance sampling of the lobe, for high powers: the
+// directions are distributed like the lobe (Hammersley points), so their
+// plain average estimates the weighted one. Every sample reads a mip level
+// of the source that matches the solid angle it represents (Krivanek and
+// Colbert, "Real-time Shading with Filtered Importance Sampling", 2008),
+// which avoids noise with few samples.
+void prefilterPhongImportance(const std::vector<CubemapImage> &sourceMips, float power, int size,
+                              int numSamples, CubemapImage *output, int numThreads)
+{
+    const float pi = 3.14159265358979f;
+    float texelSolidAngle = 4.0f * pi / (6.0f * sourceMips[0].size * sourceMips[0].size);
+
+    // The lobe samples are the same for every texel, in a local frame
+    // around the z axis
+    std::vector<glm::vec3> samples(numSamples);
+    std::vector<float> lods(numSamples);
+    for (int k = 0; k < numSamples; ++k) {
+        float u = (k + 0.5f) / numSamples;
+        float v = prefilterRadicalInverse(std::uint32_t(k));
+        float cosTheta = std::pow(u, 1.0f / (power + 1.0f));
+        float sinTheta = std::sqrt(std::max(0.0f, 1.0f - cosTheta * cosTheta));
+        float phi = 2.0f * pi * v;
+        samples[k] = glm::vec3(sinTheta * std::cos(phi), sinTheta * std::sin(phi), cosTheta);
+        float pdf = (power + 1.0f) / (2.0f * pi) * std::pow(cosTheta, power);
+        float sampleSolidAngle = 1.0f / (numSamples * pdf);
+        lods[k] = 0.5f * std::log2(sampleSolidAngle / texelSolidAngle) + 1.0f;
+    }
+
+    cubemapImageAllocate(output, size);
+    parallelFor(6 * size, numThreads, [&](int row) {
+        int face = row / size, y = row % size;
+        for (int x = 0; x < size; ++x) {
+            glm::vec3 r = glm::normalize(cubemapTexelDirection(face, size, x, y));
+            glm::vec3 up = std::abs(r.z) < 0.999f ? glm::vec3(0.0f, 0.0f, 1.0f) : glm::vec3(1.0f, 0.0f, 0.0f);
+            glm::vec3 tangent = glm::normalize(glm::cross(up, r));
+            glm::vec3 bitangent = glm::cross(r, tangent);
+            glm::vec3 sum(0.0f);
+            for (int k = 0; k < numSamples; ++k) {
+                glm::vec3 d = tangent * samples[k].x + bitangent * samples[k].y + r * samples[k].z;
+                sum += prefilterSampleLod(sourceMips, d, lods[k]);
+            }
+            output->faces[face][y * size + x] = sum / float(numSamples);
+        }
+    });
+}
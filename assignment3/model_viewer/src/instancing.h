@@ -0,0 +1,130 @@
+#pragma once
+
+#include <GL/glew.h>
+
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Per-instance model transforms for drawing many copies of one mesh with
+// a single glDrawElementsInstanced. The matrices live in a buffer texture
+// (GL_RGBA32F, four texels per matrix) that mesh.vert reads with
+// texelFetch at gl_InstanceID, which needs nothing beyond GL 3.1. The
+// transforms are applied before the trackball rotation and should be
+// rigid with an optional uniform scale, as normals are transformed by
+// their upper 3x3 part.
+
+struct InstanceBuffer {
+    GLuint buffer;
+    GLuint texture;
+    int count; // 0 when instancing is off
+    std::vector<glm::mat4> inverses; // of the uploaded transforms, for picking
+
+    InstanceBuffer() : buffer(0), texture(0), count(0) {}
+};
+
+// Place count copies on a cubic grid that fills [-1, 1]^3, each scaled to
+// its cell (the meshes are assumed to fit in the unit sphere)
+void instanceGrid(int count, std::vector<glm::mat4> *transforms)
+{
+    transforms->clear();
+    int side = std::max(1, int(std::ceil(std::cbrt(double(count)) - 1e-9)));
+    float cell = 2.0f / side;
+    for (int i = 0; i < count; ++i) {
+        int x = i % side, y = (i / side) % side, z = i / (side * side);
+        glm::vec3 center = glm::vec3(x + 0.5f, y + 0.5f, z + 0.5f) * cell - 1.0f;
+        glm::mat4 transform = glm::translate(glm::mat4(1.0f), center);
+        transforms->push_back(glm::scale(transform, glm::vec3(0.5f * cell)));
+    }
+}
+
+// Read transforms from a text file with one instance per line: either a
+// translation "x y z", a translation and uniform scale "x y z s", or a
+// column-major 4x4 matrix of 16 numbers. Lines without numbers (empty or
+// starting with #) are skipped. Returns false if the file cannot be read
+// or a line has another number of values.
+bool instanceLoadFile(const std::string &filename, std::vector<glm::mat4> *transforms)
+{
+    std::ifstream file(filename);
+    if (!file) {
+        std::cerr << "Error: could not read " << filename << std::endl;
+        return false;
+    }
+    transforms->clear();
+    std::string line;
+    for (int lineNumber = 1; std::getline(file, line); ++lineNumber) {
+        std::istringstream stream(line);
+        std::vector<float> values;
+        float value;
+        while (stream >> value) {
+            values.push_back(value);
+        }
+        if (values.empty()) {
+            continue;
+        }
+        glm::mat4 transform(1.0f);
+        if (values.size() == 3 || values.size() == 4) {
+            transform = glm::translate(transform, glm::vec3(values[0], values[1], values[2]));
+            if (values.size() == 4) {
+                transform = glm::scale(transform, glm::vec3(values[3]));
+            }
+        }
+        else if (values.size() == 16) {
+            for (int i = 0; i < 16; ++i) {
+                transform[i / 4][i % 4] = values[i];
+            }
+        }
+        else {
+            std::cerr << "Error: " << filename << ":" << lineNumber << ": expected 3, 4 or 16 values" << std::endl;
+            return false;
+        }
+        transforms->push_back(transform);
+    }
+    return true;
+}
+
+// Upload transforms, replacing those already in the buffer. An empty list
+// turns instancing off. Returns false if the list is larger than the
+// driver's buffer textures allow.
+bool instanceBufferUpload(InstanceBuffer *instances, const std::vector<glm::mat4> &transforms)
+{
+    GLint maxTexels = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &maxTexels);
+    if (transforms.size() * 4 > std::size_t(maxTexels)) {
+        std::cerr << "Error: at most " << maxTexels / 4 << " instances are supported" << std::endl;
+        return false;
+    }
+    if (instances->buffer == 0) {
+        glGenBuffers(1, &instances->buffer);
+        glGenTextures(1, &instances->texture);
+    }
+    glBindBuffer(GL_TEXTURE_BUFFER, instances->buffer);
+    glBufferData(GL_TEXTURE_BUFFER, transforms.size() * sizeof(glm::mat4), transforms.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+    glBindTexture(GL_TEXTURE_BUFFER, instances->texture);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, instances->buffer);
+    glBindTexture(GL_TEXTURE_BUFFER, 0);
+    instances->count = int(transforms.size());
+    instances->inverses.resize(transforms.size());
+    for (std::size_t i = 0; i < transforms.size(); ++i) {
+        instances->inverses[i] = glm::inverse(transforms[i]);
+    }
+    return true;
+}
+
+void instanceBufferDestroy(InstanceBuffer *instances)
+{
+    glDeleteTextures(1, &instances->texture);
+    glDeleteBuffers(1, &instances->buffer);
+    instances->buffer = instances->texture = 0;
+    instances->count = 0;
+    instances->inverses.clear();
+}
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Reading and writing of KTX 1.1 files
+// (https://registry.khronos.org/KTX/specs/1.0/ktxspec.v1.html), limited to
+// what the cubemap tools need: block-compressed 2D textures and cubemaps
+// with any number of mip levels, in little-endian byte order. Key/value
+// data is skipped when reading and not written.
+struct KTXImage {
+    std::uint32_t glInternalFormat; // a compressed format, such as GL_COMPRESSED_SRGB_S3TC_DXT1_EXT
+    std::uint32_t glBaseInternalFormat;
+    std::uint32_t width; // of level 0
+    std::uint32_t height;
+    std::uint32_t numFaces; // 1, or 6 for a cubemap
+    std::uint32_t numLevels;
+    std::vector<std::vector<unsigned char> > images; // level * numFaces + face
+};
+
+namespace {
+const unsigned char ktxIdentifier[12] = { 0xab, 'K', 'T', 'X', ' ', '1', '1', 0xbb, '\r', '\n', 0x1a, '\n' };
+const std::uint32_t ktxEndianness = 0x04030201;
+
+// Header fields after the identifier, in file order
+enum KTXHeaderField {
+    KTX_ENDIANNESS, KTX_GL_TYPE, KTX_GL_TYPE_SIZE, KTX_GL_FORMAT, KTX_GL_INTERNAL_FORMAT,
+    KTX_GL_BASE_INTERNAL_FORMAT, KTX_PIXEL_WIDTH, KTX_PIXEL_HEIGHT, KTX_PIXEL_DEPTH,
+    KTX_NUM_ARRAY_ELEMENTS, KTX_NUM_FACES, KTX_NUM_MIPMAP_LEVELS, KTX_BYTES_OF_KEY_VALUE_DATA,
+    KTX_NUM_HEADER_FIELDS
+};
+
+std::uint32_t ktxPadding(std::uint32_t size)
+{
+    return (4 - size % 4) % 4;
+}
+} // namespace
+
+bool ktxWrite(const KTXImage &image, const std::string &filename, std::string *error)
+{
+    std::ofstream file(filename.c_str(), std::ios::binary);
+    if (!file) {
+        *error = filename + ": could not open file for writing";
+        return false;
+    }
+    std::uint32_t header[KTX_NUM_HEADER_FIELDS] = { 0 };
+    header[KTX_ENDIANNESS] = ktxEndianness;
+    header[KTX_GL_TYPE_SIZE] = 1; // glType and glFormat are 0 for compressed formats
+    header[KTX_GL_INTERNAL_FORMAT] = image.glInternalFormat;
+    header[KTX_GL_BASE_INTERNAL_FORMAT] = image.glBaseInternalFormat;
+    header[KTX_PIXEL_WIDTH] = image.width;
+    header[KTX_PIXEL_HEIGHT] = image.height;
+    header[KTX_NUM_FACES] = image.numFaces;
+    header[KTX_NUM_MIPMAP_LEVELS] = image.numLevels;
+    file.write(reinterpret_cast<const char *>(ktxIdentifier), sizeof(ktxIdentifier));
+    file.write(reinterpret_cast<const char *>(header), sizeof(header));
+
+    const char zeros[4] = { 0, 0, 0, 0 };
+    for (std::uint32_t level = 0; level < image.numLevels; ++level) {
+        // For cubemaps, imageSize is the size of one face
+        std::uint32_t imageSize = std::uint32_t(image.images[level * image.numFaces].size());
+        file.write(reinterpret_cast<const char *>(&imageSize), sizeof(imageSize));
+        for (std::uint32_t face = 0; face < image.numFaces; ++face) {
+            const std::vector<unsigned char> &data = image.images[level * image.numFaces + face];
+            file.write(reinterpret_cast<const char *>(data.data()), data.size());
+            file.write(zeros, ktxPadding(std::uint32_t(data.size())));
+        }
+    }
+    if (!file) {
+        *error = filename + ": write failed";
+        return false;
+    }
+    return true;
+}
+
+// Returns false (with a message in error) if the file cannot be read or is
+// not a compressed texture. Sizes are checked against the file size before
+// anything is allocated, so a corrupt header cannot cause huge allocations.
+bool ktxRead(KTXImage *image, const std::string &filename, std::string *error)
+{
+    std::ifstream file(filename.c_str(), std::ios::binary | std::ios::ate);
+    if (!file) {
+        *error = filename + ": could not open file";
+        return false;
+    }
+    std::uint64_t fileSize = std::uint64_t(file.tellg());
+    file.seekg(0);
+    unsigned char identifier[sizeof(ktxIdentifier)];
+    std::uint32_t header[KTX_NUM_HEADER_FIELDS];
+    if (!file.read(reinterpret_cast<char *>(identifier), sizeof(identifier)) ||
+        !file.read(reinterpret_cast<char *>(header), sizeof(header)) ||
+        std::memcmp(identifier, ktxIdentifier, sizeof(identifier)) != 0) {
+        *error = filename + ": not a KTX file";
+        return false;
+    }
+    if (header[KTX_ENDIANNESS] != ktxEndianness) {
+        *error = filename + ": big-endian KTX files are not supported";
+        return false;
+    }
+    if (header[KTX_GL_TYPE] != 0 || header[KTX_GL_FORMAT] != 0 || header[KTX_PIXEL_DEPTH] != 0 ||
+        header[KTX_NUM_ARRAY_ELEMENTS] != 0 || (header[KTX_NUM_FACES] != 1 && header[KTX_NUM_FACES] != 6)) {
+        *error = filename + ": only compressed 2D textures and cubemaps are supported";
+        return false;
+    }
+    image->glInternalFormat = header[KTX_GL_INTERNAL_FORMAT];
+    image->glBaseInternalFormat = header[KTX_GL_BASE_INTERNAL_FORMAT];
+    image->width = header[KTX_PIXEL_WIDTH];
+    image->height = header[KTX_PIXEL_HEIGHT];
+    image->numFaces = header[KTX_NUM_FACES];
+    image->numLevels = header[KTX_NUM_MIPMAP_LEVELS] > 0 ? header[KTX_NUM_MIPMAP_LEVELS] : 1;
+    // Every level has an imageSize field, and a chain has at most 32 levels
+    std::uint64_t remaining = fileSize - sizeof(identifier) - sizeof(header);
+    if (image->numLevels > 32 || header[KTX_BYTES_OF_KEY_VALUE_DATA] > remaining ||
+        4 * std::uint64_t(image->numLevels) > remaining - header[KTX_BYTES_OF_KEY_VALUE_DATA]) {
+        *error = filename + ": invalid number of mipmap levels or key/value data size";
+        return false;
+    }
+    remaining -= header[KTX_BYTES_OF_KEY_VALUE_DATA];
+    file.seekg(header[KTX_BYTES_OF_KEY_VALUE_DATA], std::ios::cur);
+
+    image->images.assign(image->numLevels * image->numFaces, std::vector<unsigned char>());
+    for (std::uint32_t level = 0; level < image->numLevels; ++level) {
+        std::uint32_t imageSize;
+        if (remaining < sizeof(imageSize) || !file.read(reinterpret_cast<char *>(&imageSize), sizeof(imageSize))) {
+            *error = filename + ": truncated file";
+            return false;
+        }
+        remaining -= sizeof(imageSize);
+        // The last face of the last level need not be padded
+        std::uint64_t levelSize = (std::uint64_t(imageSize) + ktxPadding(imageSize)) * image->numFaces;
+        if (levelSize - ktxPadding(imageSize) > remaining) {
+            *error = filename + ": truncated file";
+            return false;
+        }
+        remaining -= std::min(levelSize, remaining);
+        for (std::uint32_t face = 0; face < image->numFaces; ++face) {
+            std::vector<unsigned char> &data = image->images[level * image->numFaces + face];
+            data.resize(imageSize);
+            if (!file.read(reinterpret_cast<char *>(data.data()), imageSize)) {
+                *error = filename + ": truncated file";
+                return false;
+            }
+            file.seekg(ktxPadding(imageSize), std::ios::cur);
+        }
+    }
+    return true;
+}
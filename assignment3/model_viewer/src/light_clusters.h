@@ -0,0 +1,323 @@
+#pragma once
+
+#include "parallel.h"
+
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <random>
+#include <vector>
+
+// Light binning for clustered forward shading. The view frustum is split
+// into LIGHT_CLUSTERS_X x LIGHT_CLUSTERS_Y screen tiles and
+// LIGHT_CLUSTERS_Z depth slices, spaced exponentially between the near and
+// far planes, and every point light is listed in the clusters ("froxels")
+// that its sphere of influence touches. mesh.frag finds the cluster of a
+// fragment from gl_FragCoord and its view depth and shades it with only
+// the lights listed there.
+//
+// lightClustersBuild runs every frame: the lights are moved to view
+// space, the tiles and slices that each light's bounding box covers are
+// found by projecting it, and the sphere is then tested against the view
+// space box of each of those clusters. The slices are binned in parallel
+// on a work-stealing pool and their lists are concatenated in slice
+// order, so the result does not depend on the number of threads and the
+// lights of every cluster are in ascending order.
+
+const int LIGHT_CLUSTERS_X = 16;
+const int LIGHT_CLUSTERS_Y = 9;
+const int LIGHT_CLUSTERS_Z = 24;
+const int LIGHT_CLUSTERS_PER_SLICE = LIGHT_CLUSTERS_X * LIGHT_CLUSTERS_Y;
+const int NUM_LIGHT_CLUSTERS = LIGHT_CLUSTERS_PER_SLICE * LIGHT_CLUSTERS_Z;
+
+// A point light that lights what is closer than radius, in model space
+struct PointLight {
+    glm::vec3 position;
+    float radius;
+    glm::vec3 color;
+};
+
+// Axis-aligned box of a cluster in view space
+struct FroxelBounds {
+    glm::vec3 min;
+    glm::vec3 max;
+};
+
+struct LightClusters {
+    // Cluster x + y * X + z * X * Y covers tile (x, y), counted from the
+    // bottom left like gl_FragCoord, and depth slice z. grid[cluster] is
+    // the (offset, count) of its lights in indices.
+    std::vector<glm::uvec2> grid;
+    std::vector<std::uint32_t> indices;
+    // Two texels per light: view space position and radius, and color
+    std::vector<glm::vec4> lightData;
+    // The slice of view depth d (> 0) is floor(log(d) * depthScale + depthBias)
+    float depthScale, depthBias;
+    std::uint32_t maxClusterLights; // the longest list
+
+    // Bounds of the clusters for the projection they were computed for
+    std::vector<FroxelBounds> bounds;
+    glm::mat4 boundsProjection;
+    float boundsNear, boundsFar;
+
+    // Per-slice scratch: the (cluster in slice, light) pairs found
+    struct Pair {
+        std::uint32_t cluster;
+        std::uint32_t light;
+    };
+    std::vector<std::vector<Pair>> slicePairs;
+    std::vector<std::vector<std::uint32_t>> sliceLights; // candidates
+    std::vector<glm::ivec4> lightTiles; // x0, y0, x1, y1 of every light
+    std::vector<glm::ivec2> lightSlices; // first and last, empty if culled
+    std::unique_ptr<StealingPool> pool;
+
+    LightClusters() : depthScale(0.0f), depthBias(0.0f), maxClusterLights(0), boundsNear(0.0f), boundsFar(0.0f) {}
+};
+
+// View depth of the boundary between slices slice - 1 and slice
+inline float lightClusterSliceDepth(int slice, float zNear, float zFar)
+{
+    return zNear * std::pow(zFar / zNear, float(slice) / LIGHT_CLUSTERS_Z);
+}
+
+// Recompute the cluster boxes: the corners of every tile are unprojected
+// at the near and far planes, and the rays through them are cut at the
+// depths of the slice boundaries. This works for both perspective and
+// orthographic projections.
+void lightClustersComputeBounds(LightClusters *clusters, const glm::mat4 &projection, float zNear, float zFar)
+{
+    glm::mat4 inverse = glm::inverse(projection);
+    auto unproject = [&](float x, float y, float z) {
+        glm::vec4 p = inverse * glm::vec4(x, y, z, 1.0f);
+        return glm::vec3(p) / p.w;
+    };
+    clusters->bounds.resize(NUM_LIGHT_CLUSTERS);
+    for (int y = 0; y < LIGHT_CLUSTERS_Y; ++y) {
+        for (int x = 0; x < LIGHT_CLUSTERS_X; ++x) {
+            glm::vec3 nearCorners[4], farCorners[4];
+            for (int i = 0; i < 4; ++i) {
+                float ndcX = 2.0f * float(x + (i & 1)) / LIGHT_CLUSTERS_X - 1.0f;
+                float ndcY = 2.0f * float(y + (i >> 1)) / LIGHT_CLUSTERS_Y - 1.0f;
+                nearCorners[i] = unproject(ndcX, ndcY, -1.0f);
+                farCorners[i] = unproject(ndcX, ndcY, 1.0f);
+            }
+            for (int z = 0; z < LIGHT_CLUSTERS_Z; ++z) {
+                float depths[2] = { lightClusterSliceDepth(z, zNear, zFar),
+                                    lightClusterSliceDepth(z + 1, zNear, zFar) };
+                FroxelBounds box = { glm::vec3(std::numeric_limits<float>::max()),
+                                     glm::vec3(-std::numeric_limits<float>::max()) };
+                for (int i = 0; i < 4; ++i) {
+                    glm::vec3 ray = farCorners[i] - nearCorners[i];
+                    for (float depth : depths) {
+                        float t = (-depth - nearCorners[i].z) / ray.z;
+                        glm::vec3 p = nearCorners[i] + t * ray;
+                        box.min = glm::min(box.min, p);
+                        box.max = glm::max(box.max, p);
+                    }
+                }
+                clusters->bounds[x + y * LIGHT_CLUSTERS_X + z * LIGHT_CLUSTERS_PER_SLICE] = box;
+            }
+        }
+    }
+    clusters->boundsProjection = projection;
+    clusters->boundsNear = zNear;
+    clusters->boundsFar = zFar;
+}
+
+// Returns true if a sphere overlaps a cluster's box
+inline bool lightClusterTestSphere(const FroxelBounds &box, const glm::vec3 &center, float radius)
+{
+    glm::vec3 d = glm::max(box.min - center, glm::vec3(0.0f)) + glm::max(center - box.max, glm::vec3(0.0f));
+    return glm::dot(d, d) <= radius * radius;
+}
+
+// The depth slice of view depth d, clamped to the grid
+inline int lightClusterSlice(const LightClusters &clusters, float depth)
+{
+    int slice = int(std::floor(std::log(depth) * clusters.depthScale + clusters.depthBias));
+    return std::min(std::max(slice, 0), LIGHT_CLUSTERS_Z - 1);
+}
+
+// Bin lights (in model space) for a camera. projection must be the one
+// the lights are drawn with and use these near and far planes. numThreads
+// 0 means all cores.
+void lightClustersBuild(LightClusters *clusters, const std::vector<PointLight> &lights, const glm::mat4 &modelView,
+                        const glm::mat4 &projection, float zNear, float zFar, int numThreads = 0)
+{
+    if (clusters->bounds.empty() || projection != clusters->boundsProjection || zNear != clusters->boundsNear ||
+        zFar != clusters->boundsFar) {
+        lightClustersComputeBounds(clusters, projection, zNear, zFar);
+    }
+    if (numThreads <= 0) {
+        numThreads = defaultThreadCount();
+    }
+    if (!clusters->pool || clusters->pool->numThreads() != numThreads) {
+        clusters->pool.reset(new StealingPool(numThreads));
+    }
+    float logRatio = std::log(zFar / zNear);
+    clusters->depthScale = LIGHT_CLUSTERS_Z / logRatio;
+    clusters->depthBias = -LIGHT_CLUSTERS_Z * std::log(zNear) / logRatio;
+
+    // Move the lights to view space and find the slices and tiles that
+    // their bounding boxes cover (in chunks, in parallel); the part in
+    // front of the near plane is projected, so the corners have positive w
+    std::size_t numLights = lights.size();
+    clusters->lightData.resize(2 * numLights);
+    clusters->lightTiles.resize(numLights);
+    clusters->lightSlices.resize(numLights);
+    float scale = std::cbrt(std::abs(glm::determinant(glm::mat3(modelView)))); // modelView may scale uniformly
+    const std::size_t chunkSize = 1024;
+    int numChunks = int((numLights + chunkSize - 1) / chunkSize);
+    clusters->pool->run(numChunks, [&](int chunk, int) {
+        std::size_t end = std::min(numLights, (chunk + 1) * chunkSize);
+        for (std::size_t i = chunk * chunkSize; i < end; ++i) {
+            glm::vec3 center = glm::vec3(modelView * glm::vec4(lights[i].position, 1.0f));
+            float radius = lights[i].radius * scale;
+            clusters->lightData[2 * i] = glm::vec4(center, radius);
+            clusters->lightData[2 * i + 1] = glm::vec4(lights[i].color, 0.0f);
+            clusters->lightSlices[i] = glm::ivec2(0, -1);
+            float nearDepth = std::max(-center.z - radius, zNear), farDepth = std::min(-center.z + radius, zFar);
+            if (nearDepth > farDepth) {
+                continue;
+            }
+            glm::vec2 ndcMin(std::numeric_limits<float>::max()), ndcMax(-std::numeric_limits<float>::max());
+            for (int corner = 0; corner < 8; ++corner) {
+                glm::vec4 p((corner & 1) ? center.x + radius : center.x - radius,
+                            (corner & 2) ? center.y + radius : center.y - radius,
+                            (corner & 4) ? -farDepth : -nearDepth, 1.0f);
+                glm::vec4 clip = projection * p;
+                glm::vec2 ndc = glm::vec2(clip) / clip.w;
+                ndcMin = glm::min(ndcMin, ndc);
+                ndcMax = glm::max(ndcMax, ndc);
+            }
+            if (ndcMin.x > 1.0f || ndcMin.y > 1.0f || ndcMax.x < -1.0f || ndcMax.y < -1.0f) {
+                continue;
+            }
+            auto tile = [](float ndc, int count) {
+                return std::min(std::max(int(std::floor((ndc * 0.5f + 0.5f) * count)), 0), count - 1);
+            };
+            clusters->lightTiles[i] = glm::ivec4(tile(ndcMin.x, LIGHT_CLUSTERS_X), tile(ndcMin.y, LIGHT_CLUSTERS_Y),
+                                                 tile(ndcMax.x, LIGHT_CLUSTERS_X), tile(ndcMax.y, LIGHT_CLUSTERS_Y));
+            clusters->lightSlices[i] = glm::ivec2(lightClusterSlice(*clusters, nearDepth),
+                                                  lightClusterSlice(*clusters, farDepth));
+        }
+    });
+    clusters->sliceLights.resize(LIGHT_CLUSTERS_Z);
+    clusters->slicePairs.resize(LIGHT_CLUSTERS_Z);
+    for (auto &slice : clusters->sliceLights) {
+        slice.clear();
+    }
+    for (std::size_t i = 0; i < numLights; ++i) {
+        for (int slice = clusters->lightSlices[i].x; slice <= clusters->lightSlices[i].y; ++slice) {
+            clusters->sliceLights[slice].push_back(std::uint32_t(i));
+        }
+    }
+
+    // Test the lights of every slice against its clusters and sort the
+    // pairs found by cluster, keeping the lights in order
+    clusters->grid.resize(NUM_LIGHT_CLUSTERS);
+    std::vector<std::uint32_t> sliceTotals(LIGHT_CLUSTERS_Z);
+    clusters->pool->run(LIGHT_CLUSTERS_Z, [&](int slice, int) {
+        std::vector<LightClusters::Pair> &pairs = clusters->slicePairs[slice];
+        pairs.clear();
+        const FroxelBounds *bounds = &clusters->bounds[slice * LIGHT_CLUSTERS_PER_SLICE];
+        glm::uvec2 *grid = &clusters->grid[slice * LIGHT_CLUSTERS_PER_SLICE];
+        for (int c = 0; c < LIGHT_CLUSTERS_PER_SLICE; ++c) {
+            grid[c] = glm::uvec2(0u);
+        }
+        for (std::uint32_t light : clusters->sliceLights[slice]) {
+            const glm::vec4 &sphere = clusters->lightData[2 * light];
+            const glm::ivec4 &tiles = clusters->lightTiles[light];
+            for (int y = tiles.y; y <= tiles.w; ++y) {
+                for (int x = tiles.x; x <= tiles.z; ++x) {
+                    std::uint32_t c = std::uint32_t(x + y * LIGHT_CLUSTERS_X);
+                    if (lightClusterTestSphere(bounds[c], glm::vec3(sphere), sphere.w)) {
+                        LightClusters::Pair pair = { c, light };
+                        pairs.push_back(pair);
+                        ++grid[c].y;
+                    }
+                }
+            }
+        }
+        std::uint32_t offset = 0;
+        for (int c = 0; c < LIGHT_CLUSTERS_PER_SLICE; ++c) {
+            grid[c].x = offset;
+            offset += grid[c].y;
+        }
+        sliceTotals[slice] = offset;
+    });
+
+    // Place the slices one after the other and scatter their pairs
+    std::vector<std::uint32_t> sliceOffsets(LIGHT_CLUSTERS_Z);
+    std::uint32_t total = 0;
+    for (int slice = 0; slice < LIGHT_CLUSTERS_Z; ++slice) {
+        sliceOffsets[slice] = total;
+        total += sliceTotals[slice];
+    }
+    clusters->indices.resize(total);
+    std::vector<std::uint32_t> sliceMax(LIGHT_CLUSTERS_Z);
+    clusters->pool->run(LIGHT_CLUSTERS_Z, [&](int slice, int) {
+        glm::uvec2 *grid = &clusters->grid[slice * LIGHT_CLUSTERS_PER_SLICE];
+        std::uint32_t next[LIGHT_CLUSTERS_PER_SLICE];
+        std::uint32_t longest = 0;
+        for (int c = 0; c < LIGHT_CLUSTERS_PER_SLICE; ++c) {
+            grid[c].x += sliceOffsets[slice];
+            next[c] = grid[c].x;
+            longest = std::max(longest, grid[c].y);
+        }
+        for (const LightClusters::Pair &pair : clusters->slicePairs[slice]) {
+            clusters->indices[next[pair.cluster]++] = pair.light;
+        }
+        sliceMax[slice] = longest;
+    });
+    clusters->maxClusterLights = *std::max_element(sliceMax.begin(), sliceMax.end());
+}
+
+// A light radius for count lights around a model fitted to the unit
+// sphere: smaller the more lights there are, so that a point is reached
+// by about as many lights at any count
+inline float pointLightRadius(int count)
+{
+    return std::max(0.02f, 0.5f * std::cbrt(10.0f / float(std::max(count, 1))));
+}
+
+// Scatter count lights of the given radius in the shell between 0.6 and
+// 1.4 around the origin (just outside a model fitted to the unit sphere),
+// with random saturated colors
+void pointLightsRandom(int count, float radius, unsigned seed, std::vector<PointLight> *lights)
+{
+    std::mt19937 random(seed);
+    std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+    lights->resize(count);
+    for (PointLight &light : *lights) {
+        glm::vec3 direction;
+        do {
+            direction = glm::vec3(uniform(random), uniform(random), uniform(random)) * 2.0f - 1.0f;
+        } while (glm::dot(direction, direction) > 1.0f || glm::dot(direction, direction) < 1e-4f);
+        light.position = glm::normalize(direction) * (0.6f + 0.8f * uniform(random));
+        light.radius = radius;
+        float hue = 6.0f * uniform(random);
+        glm::vec3 color = glm::clamp(glm::vec3(std::abs(hue - 3.0f) - 1.0f, 2.0f - std::abs(hue - 2.0f),
+                                               2.0f - std::abs(hue - 4.0f)), 0.0f, 1.0f);
+        light.color = color;
+    }
+}
+
+// Turn lights around the y axis, alternately one way and the other, by
+// angle radians
+void pointLightsOrbit(const std::vector<PointLight> &lights, float angle, std::vector<PointLight> *moved)
+{
+    moved->resize(lights.size());
+    float c = std::cos(angle), s = std::sin(angle);
+    for (std::size_t i = 0; i < lights.size(); ++i) {
+        glm::vec3 p = lights[i].position;
+        float sign = (i & 1) ? -1.0f : 1.0f;
+        (*moved)[i] = lights[i];
+        (*moved)[i].position = glm::vec3(c * p.x + sign * s * p.z, p.y, -sign * s * p.x + c * p.z);
+    }
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <string>
+#include <cstddef>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Struct for a read-only memory mapping of a whole file. The contents
+// are accessed in place, without being copied into a buffer.
+struct MappedFile {
+    const char *data;
+    std::size_t size;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#else
+    int fd;
+#endif
+
+    MappedFile() : data(nullptr),
+                   size(0),
+#ifdef _WIN32
+                   file(INVALID_HANDLE_VALUE),
+                   mapping(nullptr)
+#else
+                   fd(-1)
+#endif
+    {}
+};
+
+// Unmap a file opened with mappedFileOpen (safe to call on a closed file)
+void mappedFileClose(MappedFile &file)
+{
+#ifdef _WIN32
+    if (file.data != nullptr) {
+        UnmapViewOfFile(file.data);
+    }
+    if (file.mapping != nullptr) {
+        CloseHandle(file.mapping);
+    }
+    if (file.file != INVALID_HANDLE_VALUE) {
+        CloseHandle(file.file);
+    }
+    file.file = INVALID_HANDLE_VALUE;
+    file.mapping = nullptr;
+#else
+    if (file.data != nullptr) {
+        munmap(const_cast<char *>(file.data), file.size);
+    }
+    if (file.fd >= 0) {
+        close(file.fd);
+    }
+    file.fd = -1;
+#endif
+    file.data = nullptr;
+    file.size = 0;
+}
+
+// Map a whole file into memory for reading. An empty file is mapped
+// successfully with data set to nullptr.
+bool mappedFileOpen(MappedFile &file, const std::string &filename)
+{
+    mappedFileClose(file);
+
+#ifdef _WIN32
+    file.file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ,
+                            nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file.file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file.file, &size)) {
+        mappedFileClose(file);
+        return false;
+    }
+    file.size = std::size_t(size.QuadPart);
+    if (file.size == 0) {
+        return true;
+    }
+    file.mapping = CreateFileMappingA(file.file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (file.mapping == nullptr) {
+        mappedFileClose(file);
+        return false;
+    }
+    file.data = static_cast<const char *>(MapViewOfFile(file.mapping, FILE_MAP_READ, 0, 0, 0));
+    if (file.data == nullptr) {
+        mappedFileClose(file);
+        return false;
+    }
+#else
+    file.fd = open(filename.c_str(), O_RDONLY);
+    if (file.fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(file.fd, &st) != 0) {
+        mappedFileClose(file);
+        return false;
+    }
+    file.size = std::size_t(st.st_size);
+    if (file.size == 0) {
+        return true;
+    }
+    void *data = mmap(nullptr, file.size, PROT_READ, MAP_PRIVATE, file.fd, 0);
+    if (data == MAP_FAILED) {
+        file.size = 0;
+        mappedFileClose(file);
+        return false;
+    }
+    // The parsers read the file front to back exactly once
+    madvise(data, file.size, MADV_SEQUENTIAL);
+    file.data = static_cast<const char *>(data);
+#endif
+
+    return true;
+}
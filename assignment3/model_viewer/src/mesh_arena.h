@@ -0,0 +1,228 @@
+#pragma once
+
+#include "arena_allocator.h"
+#include "mesh_cache.h"
+#include "vertex_packing.h"
+
+#include <GL/glew.h>
+
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
+// Many meshes in one vertex buffer and one index buffer, drawn from a
+// single VAO. Vertices are PackedVertex (float position, octahedral
+// normal); indices are 32-bit and relative to the mesh's first vertex,
+// so draws pass firstVertex as the base vertex (glDrawElementsBaseVertex,
+// core since GL 3.2) and meshes can be moved in the vertex buffer without
+// rewriting their indices. Both buffers are suballocated with an
+// ArenaAllocator. When an allocation does not fit, the arena is
+// compacted, or grown to twice its size if compacting would not free
+// enough; either way the live meshes are copied into new buffers with
+// glCopyBufferSubData and never pass through the CPU again.
+
+struct ArenaMesh {
+    std::size_t firstVertex, numVertices;
+    std::size_t firstIndex, numIndices;
+    glm::vec3 boundsMin, boundsMax;
+    bool live;
+};
+
+struct MeshArena {
+    GLuint vao;
+    GLuint vertexBuffer;
+    GLuint indexBuffer;
+    ArenaAllocator vertices; // in vertices
+    ArenaAllocator indices;  // in indices
+    std::vector<ArenaMesh> meshes; // by handle; removed meshes are not live
+    GLuint positionLocation, normalLocation;
+    int numRepacks; // compactions and growths so far
+
+    MeshArena() : vao(0), vertexBuffer(0), indexBuffer(0), positionLocation(0), normalLocation(1), numRepacks(0) {}
+};
+
+// Point the VAO at the current buffers. The VAO is unbound afterwards.
+void meshArenaSetupVAO(MeshArena *arena)
+{
+    GLint previousVAO = 0;
+    glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &previousVAO);
+    glBindVertexArray(arena->vao);
+    glBindBuffer(GL_ARRAY_BUFFER, arena->vertexBuffer);
+    glEnableVertexAttribArray(arena->positionLocation);
+    glEnableVertexAttribArray(arena->normalLocation);
+    GLsizei stride = sizeof(PackedVertex);
+    glVertexAttribPointer(arena->positionLocation, 3, GL_FLOAT, GL_FALSE, stride,
+                          (void *)offsetof(PackedVertex, position));
+    glVertexAttribPointer(arena->normalLocation, 2, GL_SHORT, GL_TRUE, stride,
+                          (void *)offsetof(PackedVertex, normal));
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, arena->indexBuffer);
+    glBindVertexArray(GLuint(previousVAO));
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+// Create an empty arena with room for the given numbers of vertices and
+// indices, using the attribute locations of the mesh program
+void meshArenaCreate(MeshArena *arena, std::size_t vertexCapacity, std::size_t indexCapacity,
+                     GLuint positionLocation, GLuint normalLocation)
+{
+    arena->positionLocation = positionLocation;
+    arena->normalLocation = normalLocation;
+    arena->meshes.clear();
+    arena->numRepacks = 0;
+    arenaAllocatorReset(&arena->vertices, std::max<std::size_t>(vertexCapacity, 1));
+    arenaAllocatorReset(&arena->indices, std::max<std::size_t>(indexCapacity, 1));
+    glGenBuffers(1, &arena->vertexBuffer);
+    glBindBuffer(GL_ARRAY_BUFFER, arena->vertexBuffer);
+    glBufferData(GL_ARRAY_BUFFER, arena->vertices.capacity * sizeof(PackedVertex), nullptr, GL_STATIC_DRAW);
+    glGenBuffers(1, &arena->indexBuffer);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, arena->indexBuffer);
+    glBufferData(GL_COPY_WRITE_BUFFER, arena->indices.capacity * sizeof(std::uint32_t), nullptr, GL_STATIC_DRAW);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    glGenVertexArrays(1, &arena->vao);
+    meshArenaSetupVAO(arena);
+}
+
+namespace {
+// Copy the ranges of the live meshes, packed from offset 0 in handle
+// order, into a new buffer of capacity * elementSize bytes. Returns the
+// new buffer; the old one is deleted.
+GLuint meshArenaRepackBuffer(GLuint buffer, std::size_t capacity, std::size_t elementSize,
+                             const std::vector<std::pair<std::size_t, std::size_t> > &ranges,
+                             std::vector<std::size_t> *newOffsets)
+{
+    GLuint newBuffer;
+    glGenBuffers(1, &newBuffer);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, newBuffer);
+    glBufferData(GL_COPY_WRITE_BUFFER, capacity * elementSize, nullptr, GL_STATIC_DRAW);
+    glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+    newOffsets->clear();
+    std::size_t offset = 0;
+    for (const auto &range : ranges) {
+        newOffsets->push_back(offset);
+        if (range.second > 0) {
+            glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, range.first * elementSize,
+                                offset * elementSize, range.second * elementSize);
+        }
+        offset += range.second;
+    }
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    glDeleteBuffers(1, &buffer);
+    return newBuffer;
+}
+} // namespace
+
+// Move the live meshes to the start of new buffers with the given
+// capacities, leaving all free space in one range at the end. Also used
+// to grow the arena.
+void meshArenaRepack(MeshArena *arena, std::size_t vertexCapacity, std::size_t indexCapacity)
+{
+    std::vector<std::pair<std::size_t, std::size_t> > vertexRanges, indexRanges;
+    std::vector<ArenaMesh *> live;
+    for (ArenaMesh &mesh : arena->meshes) {
+        if (mesh.live) {
+            live.push_back(&mesh);
+            vertexRanges.push_back(std::make_pair(mesh.firstVertex, mesh.numVertices));
+            indexRanges.push_back(std::make_pair(mesh.firstIndex, mesh.numIndices));
+        }
+    }
+    std::vector<std::size_t> vertexOffsets, indexOffsets;
+    arena->vertexBuffer = meshArenaRepackBuffer(arena->vertexBuffer, vertexCapacity, sizeof(PackedVertex),
+                                                vertexRanges, &vertexOffsets);
+    arena->indexBuffer = meshArenaRepackBuffer(arena->indexBuffer, indexCapacity, sizeof(std::uint32_t),
+                                               indexRanges, &indexOffsets);
+    for (std::size_t i = 0; i < live.size(); ++i) {
+        live[i]->firstVertex = vertexOffsets[i];
+        live[i]->firstIndex = indexOffsets[i];
+    }
+    arenaAllocatorReset(&arena->vertices, vertexCapacity, arena->vertices.used);
+    arenaAllocatorReset(&arena->indices, indexCapacity, arena->indices.used);
+    meshArenaSetupVAO(arena);
+    ++arena->numRepacks;
+}
+
+// Move the live meshes together, keeping the capacity
+void meshArenaCompact(MeshArena *arena)
+{
+    meshArenaRepack(arena, arena->vertices.capacity, arena->indices.capacity);
+}
+
+// Add a mesh, returning its handle (or -1 for a mesh without triangles).
+// Handles of removed meshes are reused.
+int meshArenaAdd(MeshArena *arena, const MeshView &mesh, int numThreads = 0)
+{
+    if (mesh.numIndices == 0 || mesh.numVertices == 0) {
+        return -1;
+    }
+    ArenaMesh entry;
+    entry.numVertices = mesh.numVertices;
+    entry.numIndices = mesh.numIndices;
+    entry.live = true;
+    meshBounds(mesh, &entry.boundsMin, &entry.boundsMax);
+
+    bool fits = arenaAllocate(&arena->vertices, entry.numVertices, &entry.firstVertex);
+    if (fits && !arenaAllocate(&arena->indices, entry.numIndices, &entry.firstIndex)) {
+        arenaFree(&arena->vertices, entry.firstVertex, entry.numVertices);
+        fits = false;
+    }
+    if (!fits) {
+        // Compacting is enough if the free space adds up; otherwise grow
+        std::size_t vertexCapacity = arena->vertices.capacity;
+        std::size_t indexCapacity = arena->indices.capacity;
+        if (arena->vertices.used + entry.numVertices > vertexCapacity) {
+            vertexCapacity = std::max(2 * vertexCapacity, arena->vertices.used + entry.numVertices);
+        }
+        if (arena->indices.used + entry.numIndices > indexCapacity) {
+            indexCapacity = std::max(2 * indexCapacity, arena->indices.used + entry.numIndices);
+        }
+        meshArenaRepack(arena, vertexCapacity, indexCapacity);
+        arenaAllocate(&arena->vertices, entry.numVertices, &entry.firstVertex);
+        arenaAllocate(&arena->indices, entry.numIndices, &entry.firstIndex);
+    }
+
+    std::vector<PackedVertex> packed;
+    packVertices(mesh, &packed, numThreads);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, arena->vertexBuffer);
+    glBufferSubData(GL_COPY_WRITE_BUFFER, entry.firstVertex * sizeof(PackedVertex),
+                    packed.size() * sizeof(PackedVertex), packed.data());
+    glBindBuffer(GL_COPY_WRITE_BUFFER, arena->indexBuffer);
+    glBufferSubData(GL_COPY_WRITE_BUFFER, entry.firstIndex * sizeof(std::uint32_t),
+                    entry.numIndices * sizeof(std::uint32_t), mesh.indices);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+    for (std::size_t handle = 0; handle < arena->meshes.size(); ++handle) {
+        if (!arena->meshes[handle].live) {
+            arena->meshes[handle] = entry;
+            return int(handle);
+        }
+    }
+    arena->meshes.push_back(entry);
+    return int(arena->meshes.size() - 1);
+}
+
+// Free the ranges of a mesh. Its data stays in the buffers until it is
+// overwritten or compacted away.
+void meshArenaRemove(MeshArena *arena, int handle)
+{
+    if (handle < 0 || std::size_t(handle) >= arena->meshes.size() || !arena->meshes[handle].live) {
+        return;
+    }
+    ArenaMesh &mesh = arena->meshes[handle];
+    arenaFree(&arena->vertices, mesh.firstVertex, mesh.numVertices);
+    arenaFree(&arena->indices, mesh.firstIndex, mesh.numIndices);
+    mesh.live = false;
+}
+
+void meshArenaDestroy(MeshArena *arena)
+{
+    glDeleteVertexArrays(1, &arena->vao);
+    glDeleteBuffers(1, &arena->vertexBuffer);
+    glDeleteBuffers(1, &arena->indexBuffer);
+    arena->vao = arena->vertexBuffer = arena->indexBuffer = 0;
+    arena->meshes.clear();
+    arenaAllocatorReset(&arena->vertices, 0);
+    arenaAllocatorReset(&arena->indices, 0);
+}
@@ -0,0 +1,457 @@
+#pragma once
+
+#include "mesh_cache.h"
+#include "parallel.h"
+
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+// Bounding volume hierarchy over the triangles of a mesh, for ray picking.
+// bvhBuild splits nodes top-down with the surface area heuristic,
+// evaluated on BVH_BINS bins of the triangle centroids along each axis.
+// Nodes of more than 1/64 of the triangles are split first, with their
+// binning spread over the threads; the subtrees below them are then built
+// in parallel and appended in a fixed order, so the tree is the same for
+// any number of threads. bvhIntersect returns the nearest hit of a ray,
+// visiting the nearer child first and skipping boxes behind the nearest
+// hit so far, which takes a few microseconds even for millions of
+// triangles. Triangles are two-sided, as the viewer does not cull.
+
+const int BVH_BINS = 16;
+const int BVH_MAX_LEAF_SIZE = 8; // larger leaves are split, unless at BVH_MAX_DEPTH
+const int BVH_MAX_DEPTH = 64;
+
+// Inner nodes have count 0 and children first and first + 1; leaves hold
+// count triangles of bvh.triangles from first
+struct BVHNode {
+    glm::vec3 boundsMin;
+    std::uint32_t first;
+    glm::vec3 boundsMax;
+    std::uint32_t count;
+};
+
+struct MeshBVH {
+    std::vector<BVHNode> nodes; // nodes[0] is the root
+    std::vector<std::uint32_t> triangles; // triangle indices in leaf order
+};
+
+struct BVHHit {
+    float distance; // along the ray, in units of its direction
+    std::uint32_t triangle;
+    float u, v; // barycentric coordinates of vertices 1 and 2
+};
+
+namespace {
+struct BVHBox {
+    glm::vec3 min, max;
+
+    BVHBox() : min(std::numeric_limits<float>::max()), max(-std::numeric_limits<float>::max()) {}
+
+    void grow(const glm::vec3 &p)
+    {
+        min = glm::min(min, p);
+        max = glm::max(max, p);
+    }
+
+    void grow(const BVHBox &box)
+    {
+        min = glm::min(min, box.min);
+        max = glm::max(max, box.max);
+    }
+
+    float halfArea() const
+    {
+        glm::vec3 d = glm::max(max - min, glm::vec3(0.0f));
+        return d.x * d.y + d.y * d.z + d.z * d.x;
+    }
+};
+
+struct BVHBin {
+    BVHBox bounds;
+    std::uint32_t count;
+
+    BVHBin() : count(0) {}
+};
+
+// Bounds and centroid bounds of a range of triangles, and their bins
+// along each axis of the centroid bounds
+struct BVHNodeStats {
+    BVHBox bounds, centroids;
+    BVHBin bins[3][BVH_BINS];
+};
+
+struct BVHBuilder {
+    std::vector<BVHBox> boxes; // per triangle
+    std::uint32_t *ids;
+};
+
+inline glm::vec3 bvhCentroid(const BVHBox &box)
+{
+    return 0.5f * (box.min + box.max);
+}
+
+inline int bvhBinIndex(float c, float min, float scale)
+{
+    return std::min(BVH_BINS - 1, int((c - min) * scale));
+}
+
+// Bounds of triangles [begin, end) and of their centroids
+void bvhRangeBounds(const BVHBuilder &builder, std::size_t begin, std::size_t end, BVHBox *bounds,
+                    BVHBox *centroids)
+{
+    for (std::size_t i = begin; i < end; ++i) {
+        const BVHBox &box = builder.boxes[builder.ids[i]];
+        bounds->grow(box);
+        centroids->grow(bvhCentroid(box));
+    }
+}
+
+// Add triangles [begin, end) to the bins of stats, whose centroid bounds
+// must be set
+void bvhRangeBins(const BVHBuilder &builder, std::size_t begin, std::size_t end, BVHNodeStats *stats)
+{
+    glm::vec3 min = stats->centroids.min, extent = stats->centroids.max - min;
+    for (std::size_t i = begin; i < end; ++i) {
+        const BVHBox &box = builder.boxes[builder.ids[i]];
+        glm::vec3 c = bvhCentroid(box);
+        for (int axis = 0; axis < 3; ++axis) {
+            if (extent[axis] > 0.0f) {
+                BVHBin &bin = stats->bins[axis][bvhBinIndex(c[axis], min[axis], BVH_BINS / extent[axis])];
+                bin.bounds.grow(box);
+                ++bin.count;
+            }
+        }
+    }
+}
+
+// Compute the stats of triangles [begin, end), splitting the work into
+// ranges over the threads if numThreads > 1 and the range is large
+void bvhNodeStats(const BVHBuilder &builder, std::size_t begin, std::size_t end, int numThreads,
+                  BVHNodeStats *stats)
+{
+    std::size_t count = end - begin;
+    int numRanges = numThreads > 1 ? int(std::min<std::size_t>(4 * numThreads, count / 16384 + 1)) : 1;
+    *stats = BVHNodeStats();
+    if (numRanges == 1) {
+        bvhRangeBounds(builder, begin, end, &stats->bounds, &stats->centroids);
+        bvhRangeBins(builder, begin, end, stats);
+        return;
+    }
+
+    std::vector<BVHNodeStats> partial(numRanges);
+    parallelFor(numRanges, numThreads, [&](int r) {
+        bvhRangeBounds(builder, begin + count * r / numRanges, begin + count * (r + 1) / numRanges,
+                       &partial[r].bounds, &partial[r].centroids);
+    });
+    for (int r = 0; r < numRanges; ++r) {
+        stats->bounds.grow(partial[r].bounds);
+        stats->centroids.grow(partial[r].centroids);
+    }
+    parallelFor(numRanges, numThreads, [&](int r) {
+        partial[r].centroids = stats->centroids;
+        bvhRangeBins(builder, begin + count * r / numRanges, begin + count * (r + 1) / numRanges, &partial[r]);
+    });
+    for (int axis = 0; axis < 3; ++axis) {
+        for (int b = 0; b < BVH_BINS; ++b) {
+            BVHBin &bin = stats->bins[axis][b];
+            for (int r = 0; r < numRanges; ++r) {
+                bin.bounds.grow(partial[r].bins[axis][b].bounds);
+                bin.count += partial[r].bins[axis][b].count;
+            }
+        }
+    }
+}
+
+// Make node a leaf or split it, partitioning builder.ids. Returns the
+// number of triangles in the left child, or 0 for a leaf.
+std::size_t bvhSplitNode(BVHBuilder &builder, std::size_t begin, std::size_t end, int depth, int numThreads,
+                         BVHNode *node)
+{
+    BVHNodeStats stats;
+    bvhNodeStats(builder, begin, end, numThreads, &stats);
+    node->boundsMin = stats.bounds.min;
+    node->boundsMax = stats.bounds.max;
+    node->first = std::uint32_t(begin);
+    node->count = std::uint32_t(end - begin);
+    std::size_t count = end - begin;
+    if (count <= 2 || depth + 1 >= BVH_MAX_DEPTH) {
+        return 0;
+    }
+
+    // Cost of the best split, relative to intersecting one triangle and
+    // with traversing a node as expensive as that
+    int bestAxis = -1, bestBin = 0;
+    float bestCost = std::numeric_limits<float>::max();
+    for (int axis = 0; axis < 3; ++axis) {
+        float rightArea[BVH_BINS];
+        std::uint32_t rightCount[BVH_BINS];
+        BVHBox right;
+        std::uint32_t n = 0;
+        for (int b = BVH_BINS - 1; b > 0; --b) {
+            right.grow(stats.bins[axis][b].bounds);
+            n += stats.bins[axis][b].count;
+            rightArea[b] = right.halfArea();
+            rightCount[b] = n;
+        }
+        BVHBox left;
+        n = 0;
+        for (int b = 0; b < BVH_BINS - 1; ++b) {
+            left.grow(stats.bins[axis][b].bounds);
+            n += stats.bins[axis][b].count;
+            if (n == 0 || rightCount[b + 1] == 0) {
+                continue;
+            }
+            float cost = n * left.halfArea() + rightCount[b + 1] * rightArea[b + 1];
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestAxis = axis;
+                bestBin = b;
+            }
+        }
+    }
+
+    float area = stats.bounds.halfArea();
+    float leafCost = count * area;
+    if (count <= std::size_t(BVH_MAX_LEAF_SIZE) && (bestAxis < 0 || leafCost <= area + bestCost)) {
+        return 0;
+    }
+    std::uint32_t *middle;
+    if (bestAxis < 0) {
+        middle = builder.ids + begin + count / 2; // all centroids coincide
+    }
+    else {
+        float min = stats.centroids.min[bestAxis];
+        float scale = BVH_BINS / (stats.centroids.max[bestAxis] - min);
+        middle = std::partition(builder.ids + begin, builder.ids + end, [&](std::uint32_t id) {
+            return bvhBinIndex(bvhCentroid(builder.boxes[id])[bestAxis], min, scale) <= bestBin;
+        });
+    }
+    node->count = 0;
+    return std::size_t(middle - (builder.ids + begin));
+}
+
+// Build the subtree of triangles [begin, end) into nodes, whose first
+// element is its root; child indices are relative to nodes
+void bvhBuildSubtree(BVHBuilder &builder, std::size_t begin, std::size_t end, int depth,
+                     std::vector<BVHNode> *nodes)
+{
+    struct Task {
+        std::uint32_t node;
+        std::size_t begin, end;
+        int depth;
+    };
+    nodes->assign(1, BVHNode());
+    Task root = { 0, begin, end, depth };
+    std::vector<Task> stack(1, root);
+    while (!stack.empty()) {
+        Task task = stack.back();
+        stack.pop_back();
+        BVHNode node;
+        std::size_t numLeft = bvhSplitNode(builder, task.begin, task.end, task.depth, 1, &node);
+        if (numLeft > 0) {
+            node.first = std::uint32_t(nodes->size());
+            nodes->resize(nodes->size() + 2);
+            Task right = { node.first + 1, task.begin + numLeft, task.end, task.depth + 1 };
+            Task left = { node.first, task.begin, task.begin + numLeft, task.depth + 1 };
+            stack.push_back(right);
+            stack.push_back(left);
+        }
+        (*nodes)[task.node] = node;
+    }
+}
+
+inline bool bvhIntersectBox(const BVHNode &node, const glm::vec3 &origin, const glm::vec3 &invDirection,
+                            float maxDistance, float *entry)
+{
+    glm::vec3 t0 = (node.boundsMin - origin) * invDirection;
+    glm::vec3 t1 = (node.boundsMax - origin) * invDirection;
+    glm::vec3 tNear = glm::min(t0, t1), tFar = glm::max(t0, t1);
+    float enter = std::max(std::max(tNear.x, tNear.y), std::max(tNear.z, 0.0f));
+    float exit = std::min(std::min(tFar.x, tFar.y), std::min(tFar.z, maxDistance));
+    *entry = enter;
+    return enter <= exit;
+}
+
+// Moller-Trumbore, two-sided
+inline bool bvhIntersectTriangle(const glm::vec3 &p0, const glm::vec3 &p1, const glm::vec3 &p2,
+                                 const glm::vec3 &origin, const glm::vec3 &direction, float maxDistance,
+                                 float *distance, float *u, float *v)
+{
+    glm::vec3 e1 = p1 - p0, e2 = p2 - p0;
+    glm::vec3 p = glm::cross(direction, e2);
+    float det = glm::dot(e1, p);
+    if (det == 0.0f) {
+        return false;
+    }
+    float invDet = 1.0f / det;
+    glm::vec3 s = origin - p0;
+    float a = glm::dot(s, p) * invDet;
+    if (a < 0.0f || a > 1.0f) {
+        return false;
+    }
+    glm::vec3 q = glm::cross(s, e1);
+    float b = glm::dot(direction, q) * invDet;
+    if (b < 0.0f || a + b > 1.0f) {
+        return false;
+    }
+    float t = glm::dot(e2, q) * invDet;
+    if (t < 0.0f || t >= maxDistance) {
+        return false;
+    }
+    *distance = t;
+    *u = a;
+    *v = b;
+    return true;
+}
+} // namespace
+
+// Build the BVH of the triangles of a mesh
+void bvhBuild(MeshBVH *bvh, const MeshView &mesh, int numThreads = 0)
+{
+    if (numThreads <= 0) {
+        numThreads = defaultThreadCount();
+    }
+    std::size_t numTriangles = mesh.numIndices / 3;
+    bvh->nodes.clear();
+    bvh->triangles.resize(numTriangles);
+    if (numTriangles == 0) {
+        return;
+    }
+    BVHBuilder builder;
+    builder.boxes.resize(numTriangles);
+    builder.ids = bvh->triangles.data();
+    parallelForRange(numTriangles, numThreads, [&](std::size_t begin, std::size_t end) {
+        for (std::size_t t = begin; t < end; ++t) {
+            BVHBox box;
+            for (int k = 0; k < 3; ++k) {
+                box.grow(mesh.vertices[mesh.indices[3 * t + k]]);
+            }
+            builder.boxes[t] = box;
+            builder.ids[t] = std::uint32_t(t);
+        }
+    });
+
+    // Split the top of the tree with parallel binning, down to subtrees
+    // small enough to balance over the threads
+    struct Subtree {
+        std::uint32_t node;
+        std::size_t begin, end;
+        int depth;
+    };
+    std::size_t subtreeSize = std::max<std::size_t>(numTriangles / 64, 4096);
+    Subtree root = { 0, 0, numTriangles, 0 };
+    std::vector<Subtree> pending(1, root), subtrees;
+    bvh->nodes.resize(1);
+    while (!pending.empty()) {
+        Subtree subtree = pending.back();
+        pending.pop_back();
+        if (subtree.end - subtree.begin <= subtreeSize) {
+            subtrees.push_back(subtree);
+            continue;
+        }
+        BVHNode node;
+        std::size_t numLeft = bvhSplitNode(builder, subtree.begin, subtree.end, subtree.depth, numThreads, &node);
+        if (numLeft > 0) {
+            node.first = std::uint32_t(bvh->nodes.size());
+            bvh->nodes.resize(bvh->nodes.size() + 2);
+            Subtree right = { node.first + 1, subtree.begin + numLeft, subtree.end, subtree.depth + 1 };
+            Subtree left = { node.first, subtree.begin, subtree.begin + numLeft, subtree.depth + 1 };
+            pending.push_back(right);
+            pending.push_back(left);
+        }
+        bvh->nodes[subtree.node] = node;
+    }
+
+    // Build the subtrees and append them in order, moving child indices
+    std::vector<std::vector<BVHNode> > subtreeNodes(subtrees.size());
+    parallelFor(int(subtrees.size()), numThreads, [&](int i) {
+        bvhBuildSubtree(builder, subtrees[i].begin, subtrees[i].end, subtrees[i].depth, &subtreeNodes[i]);
+    });
+    for (std::size_t i = 0; i < subtrees.size(); ++i) {
+        const std::vector<BVHNode> &nodes = subtreeNodes[i];
+        std::uint32_t offset = std::uint32_t(bvh->nodes.size()) - 1; // nodes[0] goes to the subtree's root
+        for (std::size_t j = 0; j < nodes.size(); ++j) {
+            BVHNode node = nodes[j];
+            if (node.count == 0) {
+                node.first += offset;
+            }
+            if (j == 0) {
+                bvh->nodes[subtrees[i].node] = node;
+            }
+            else {
+                bvh->nodes.push_back(node);
+            }
+        }
+    }
+}
+
+// Find the nearest triangle hit by the ray origin + t direction with
+// 0 <= t < maxDistance. Returns false if there is none.
+bool bvhIntersect(const MeshBVH &bvh, const MeshView &mesh, const glm::vec3 &origin, const glm::vec3 &direction,
+                  BVHHit *hit, float maxDistance = std::numeric_limits<float>::max())
+{
+    if (bvh.nodes.empty()) {
+        return false;
+    }
+    glm::vec3 invDirection = 1.0f / direction;
+    bool found = false;
+    float entry;
+    if (!bvhIntersectBox(bvh.nodes[0], origin, invDirection, maxDistance, &entry)) {
+        return false;
+    }
+    // Far children still to visit, with the distance at which the ray
+    // enters them; the tree is at most BVH_MAX_DEPTH deep
+    std::uint32_t stack[BVH_MAX_DEPTH];
+    float stackEntry[BVH_MAX_DEPTH];
+    int stackSize = 0;
+    std::uint32_t current = 0;
+    for (;;) {
+        const BVHNode &node = bvh.nodes[current];
+        if (node.count > 0) {
+            for (std::uint32_t i = node.first; i < node.first + node.count; ++i) {
+                std::uint32_t t = bvh.triangles[i];
+                const std::uint32_t *index = &mesh.indices[3 * std::size_t(t)];
+                float distance, u, v;
+                if (bvhIntersectTriangle(mesh.vertices[index[0]], mesh.vertices[index[1]], mesh.vertices[index[2]],
+                                         origin, direction, maxDistance, &distance, &u, &v)) {
+                    maxDistance = distance;
+                    hit->distance = distance;
+                    hit->triangle = t;
+                    hit->u = u;
+                    hit->v = v;
+                    found = true;
+                }
+            }
+        }
+        else {
+            float entryLeft, entryRight;
+            bool left = bvhIntersectBox(bvh.nodes[node.first], origin, invDirection, maxDistance, &entryLeft);
+            bool right = bvhIntersectBox(bvh.nodes[node.first + 1], origin, invDirection, maxDistance, &entryRight);
+            if (left && right) {
+                bool leftFirst = entryLeft <= entryRight;
+                stack[stackSize] = leftFirst ? node.first + 1 : node.first;
+                stackEntry[stackSize++] = leftFirst ? entryRight : entryLeft;
+                current = leftFirst ? node.first : node.first + 1;
+                continue;
+            }
+            if (left || right) {
+                current = left ? node.first : node.first + 1;
+                continue;
+            }
+        }
+        while (stackSize > 0 && stackEntry[stackSize - 1] > maxDistance) {
+            --stackSize;
+        }
+        if (stackSize == 0) {
+            break;
+        }
+        current = stack[--stackSize];
+    }
+    return found;
+}
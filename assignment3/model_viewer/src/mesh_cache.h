@@ -0,0 +1,280 @@
+#pragma once
+
+#include "mapped_file.h"
+
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// Non-owning view of an indexed triangle mesh with per-vertex normals.
+// The arrays live either in a Mesh or in a memory-mapped mesh cache.
+// Coarser levels of detail, if any, index the same vertices; their
+// indices follow one another in lodIndices, lodCounts[i] of level i + 1.
+struct MeshView {
+    const glm::vec3 *vertices;
+    const glm::vec3 *normals;
+    const std::uint32_t *indices;
+    const std::uint32_t *lodIndices;
+    const std::uint64_t *lodCounts;
+    std::size_t numVertices;
+    std::size_t numIndices;
+    std::size_t numLodIndices;
+    std::size_t numLods;
+
+    MeshView() : vertices(nullptr),
+                 normals(nullptr),
+                 indices(nullptr),
+                 lodIndices(nullptr),
+                 lodCounts(nullptr),
+                 numVertices(0),
+                 numIndices(0),
+                 numLodIndices(0),
+                 numLods(0)
+    {}
+};
+
+// Binary mesh cache format. The file starts with a MeshCacheHeader,
+// followed by numSections MeshCacheSection entries and the section data.
+// Every section starts at a 16-byte aligned offset, so the arrays can be
+// used in place after mapping the file. All values are little-endian.
+const std::uint32_t MESH_CACHE_MAGIC = 0x48534d4d; // "MMSH"
+const std::uint32_t MESH_CACHE_VERSION = 2; // 2 added the LOD sections
+
+enum MeshCacheSectionType {
+    MESH_CACHE_POSITIONS = 1,   // numVertices glm::vec3
+    MESH_CACHE_NORMALS = 2,     // numVertices glm::vec3
+    MESH_CACHE_INDICES = 3,     // numIndices std::uint32_t
+    MESH_CACHE_LOD_INDICES = 4, // optional, std::uint32_t of all coarser levels
+    MESH_CACHE_LOD_COUNTS = 5   // optional, std::uint64_t per coarser level
+};
+
+struct MeshCacheHeader {
+    std::uint32_t magic;
+    std::uint32_t version;
+    std::uint64_t sourceSize;     // size of the OBJ file in bytes
+    std::int64_t sourceTime;      // modification time of the OBJ file
+    std::uint64_t sourceChecksum; // meshCacheChecksum of the OBJ file
+    std::uint32_t flags;          // processing options the mesh was built with
+    std::uint32_t numSections;
+    std::uint64_t numVertices;
+    std::uint64_t numIndices;
+};
+
+struct MeshCacheSection {
+    std::uint32_t type;
+    std::uint32_t reserved;
+    std::uint64_t offset;
+    std::uint64_t size;
+};
+
+// Returns the path of the cache file that belongs to an OBJ file
+std::string meshCachePath(const std::string &objFilename)
+{
+    return objFilename + ".mvmesh";
+}
+
+// Get the size and modification time of a file
+bool meshCacheFileStat(const std::string &filename, std::uint64_t *size, std::int64_t *time)
+{
+#ifdef _WIN32
+    struct _stat64 st;
+    if (_stat64(filename.c_str(), &st) != 0) {
+        return false;
+    }
+#else
+    struct stat st;
+    if (stat(filename.c_str(), &st) != 0) {
+        return false;
+    }
+#endif
+    *size = std::uint64_t(st.st_size);
+    *time = std::int64_t(st.st_mtime);
+    return true;
+}
+
+// Fast 64-bit checksum of a byte array, hashing 8 bytes per step
+std::uint64_t meshCacheChecksum(const char *data, std::size_t size)
+{
+    const std::uint64_t PRIME = 0x100000001b3ULL;
+    std::uint64_t hash = 0xcbf29ce484222325ULL ^ size;
+    std::size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        std::uint64_t word;
+        std::memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * PRIME;
+        hash ^= hash >> 29;
+    }
+    for (; i < size; ++i) {
+        hash = (hash ^ std::uint8_t(data[i])) * PRIME;
+    }
+    return hash;
+}
+
+// Checksum of a whole file
+bool meshCacheFileChecksum(const std::string &filename, std::uint64_t *checksum)
+{
+    MappedFile file;
+    if (!mappedFileOpen(file, filename)) {
+        return false;
+    }
+    *checksum = meshCacheChecksum(file.data, file.size);
+    mappedFileClose(file);
+    return true;
+}
+
+// Write a mesh cache for the OBJ file sourceFilename. The cache is written
+// to a temporary file that is renamed at the end, so readers never see a
+// partially written cache.
+bool meshCacheWrite(const std::string &cacheFilename, const std::string &sourceFilename,
+                    std::uint32_t flags, const MeshView &mesh)
+{
+    MeshCacheHeader header;
+    std::memset(&header, 0, sizeof(header));
+    header.magic = MESH_CACHE_MAGIC;
+    header.version = MESH_CACHE_VERSION;
+    header.flags = flags;
+    header.numVertices = mesh.numVertices;
+    header.numIndices = mesh.numIndices;
+    if (!meshCacheFileStat(sourceFilename, &header.sourceSize, &header.sourceTime) ||
+        !meshCacheFileChecksum(sourceFilename, &header.sourceChecksum)) {
+        return false;
+    }
+
+    const void *data[] = { mesh.vertices, mesh.normals, mesh.indices, mesh.lodIndices, mesh.lodCounts };
+    MeshCacheSection sections[] = {
+        { MESH_CACHE_POSITIONS, 0, 0, mesh.numVertices * sizeof(glm::vec3) },
+        { MESH_CACHE_NORMALS, 0, 0, mesh.numVertices * sizeof(glm::vec3) },
+        { MESH_CACHE_INDICES, 0, 0, mesh.numIndices * sizeof(std::uint32_t) },
+        { MESH_CACHE_LOD_INDICES, 0, 0, mesh.numLodIndices * sizeof(std::uint32_t) },
+        { MESH_CACHE_LOD_COUNTS, 0, 0, mesh.numLods * sizeof(std::uint64_t) }
+    };
+    // The level of detail sections are left out for meshes without them
+    header.numSections = mesh.numLods > 0 ? 5 : 3;
+    std::uint64_t offset = sizeof(header) + header.numSections * sizeof(sections[0]);
+    for (unsigned i = 0; i < header.numSections; ++i) {
+        offset = (offset + 15) & ~std::uint64_t(15);
+        sections[i].offset = offset;
+        offset += sections[i].size;
+    }
+
+    std::string tempFilename = cacheFilename + ".tmp";
+    std::FILE *f = std::fopen(tempFilename.c_str(), "wb");
+    if (f == nullptr) {
+        return false;
+    }
+    std::size_t sectionsNBytes = header.numSections * sizeof(sections[0]);
+    bool ok = std::fwrite(&header, sizeof(header), 1, f) == 1 &&
+              std::fwrite(sections, sectionsNBytes, 1, f) == 1;
+    std::uint64_t position = sizeof(header) + sectionsNBytes;
+    const char padding[16] = {};
+    for (unsigned i = 0; ok && i < header.numSections; ++i) {
+        std::size_t numPadding = std::size_t(sections[i].offset - position);
+        ok = std::fwrite(padding, 1, numPadding, f) == numPadding &&
+             std::fwrite(data[i], 1, sections[i].size, f) == sections[i].size;
+        position = sections[i].offset + sections[i].size;
+    }
+    ok = (std::fclose(f) == 0) && ok;
+    if (ok) {
+        // rename() does not replace existing files on Windows
+        std::remove(cacheFilename.c_str());
+        ok = std::rename(tempFilename.c_str(), cacheFilename.c_str()) == 0;
+    }
+    if (!ok) {
+        std::remove(tempFilename.c_str());
+    }
+    return ok;
+}
+
+// Map a mesh cache and point mesh into it. Fails if the cache does not
+// exist, is malformed, was built with other flags, or is out of date with
+// respect to the OBJ file. Up to date means the same size and either the
+// same modification time or (if the file was touched) the same checksum.
+// The file must stay mapped for as long as the view is used.
+bool meshCacheOpen(MappedFile &file, const std::string &cacheFilename,
+                   const std::string &sourceFilename, std::uint32_t flags, MeshView *mesh)
+{
+    std::uint64_t sourceSize;
+    std::int64_t sourceTime;
+    if (!meshCacheFileStat(sourceFilename, &sourceSize, &sourceTime) ||
+        !mappedFileOpen(file, cacheFilename)) {
+        return false;
+    }
+
+    MeshCacheHeader header = MeshCacheHeader(); // zero when the file is too short for one
+    bool valid = file.size >= sizeof(header);
+    if (valid) {
+        std::memcpy(&header, file.data, sizeof(header));
+        valid = header.magic == MESH_CACHE_MAGIC &&
+                header.version == MESH_CACHE_VERSION &&
+                header.flags == flags &&
+                header.sourceSize == sourceSize &&
+                file.size >= sizeof(header) + header.numSections * sizeof(MeshCacheSection);
+    }
+    if (valid && header.sourceTime != sourceTime) {
+        std::uint64_t checksum;
+        valid = meshCacheFileChecksum(sourceFilename, &checksum) &&
+                checksum == header.sourceChecksum;
+    }
+
+    MeshView view;
+    view.numVertices = std::size_t(header.numVertices);
+    view.numIndices = std::size_t(header.numIndices);
+    const MeshCacheSection *sections = reinterpret_cast<const MeshCacheSection *>(file.data + sizeof(header));
+    for (unsigned i = 0; valid && i < header.numSections; ++i) {
+        const MeshCacheSection &section = sections[i];
+        valid = section.offset % 16 == 0 && section.offset <= file.size &&
+                section.size <= file.size - section.offset;
+        const void *data = file.data + section.offset;
+        switch (section.type) {
+        case MESH_CACHE_POSITIONS:
+            valid = valid && section.size == view.numVertices * sizeof(glm::vec3);
+            view.vertices = static_cast<const glm::vec3 *>(data);
+            break;
+        case MESH_CACHE_NORMALS:
+            valid = valid && section.size == view.numVertices * sizeof(glm::vec3);
+            view.normals = static_cast<const glm::vec3 *>(data);
+            break;
+        case MESH_CACHE_INDICES:
+            valid = valid && section.size == view.numIndices * sizeof(std::uint32_t);
+            view.indices = static_cast<const std::uint32_t *>(data);
+            break;
+        case MESH_CACHE_LOD_INDICES:
+            valid = valid && section.size % sizeof(std::uint32_t) == 0;
+            view.lodIndices = static_cast<const std::uint32_t *>(data);
+            view.numLodIndices = std::size_t(section.size / sizeof(std::uint32_t));
+            break;
+        case MESH_CACHE_LOD_COUNTS:
+            valid = valid && section.size % sizeof(std::uint64_t) == 0;
+            view.lodCounts = static_cast<const std::uint64_t *>(data);
+            view.numLods = std::size_t(section.size / sizeof(std::uint64_t));
+            break;
+        default:
+            // Unknown sections are skipped
+            break;
+        }
+    }
+    valid = valid && view.vertices != nullptr && view.normals != nullptr && view.indices != nullptr;
+
+    // The levels of detail must add up to their index section
+    std::uint64_t lodIndicesTotal = 0;
+    for (std::size_t i = 0; valid && i < view.numLods; ++i) {
+        lodIndicesTotal += view.lodCounts[i];
+    }
+    valid = valid && lodIndicesTotal == view.numLodIndices;
+
+    if (!valid) {
+        mappedFileClose(file);
+        return false;
+    }
+    *mesh = view;
+    return true;
+}
@@ -0,0 +1,310 @@
+#pragma once
+
+#include "parallel.h"
+
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <numeric>
+#include <vector>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define MESH_CLUSTERS_SSE
+#endif
+
+// View frustum culling of triangle clusters. clusterTriangles reorders the
+// triangles of an index buffer so that every MESH_CLUSTER_SIZE consecutive
+// triangles form a spatially compact cluster (only the last one may be
+// smaller): the triangles are split recursively along the longest axis of
+// their centroids, with the first part holding the largest power of two
+// of clusters below the range's count. Every split then falls where the
+// binary tree over consecutive clusters (pairs 2i, 2i + 1 at every level)
+// splits, so that tree is the bounding volume hierarchy of the partition,
+// and meshClustersBuild rebuilds it from any clustered index buffer (such
+// as one from a mesh cache). meshClustersCull walks it with
+// SSE box/frustum tests and returns the visible triangles as a few ranges
+// of the index buffer, for glMultiDrawElements.
+
+const int MESH_CLUSTER_SIZE = 128; // triangles
+
+struct ClusterBounds {
+    glm::vec3 min;
+    glm::vec3 max;
+};
+
+// levels[0] holds the bounds of the clusters; node i of level l + 1
+// bounds nodes 2i and 2i + 1 (if it exists) of level l. The last level
+// has a single node.
+struct MeshClusters {
+    std::size_t numTriangles;
+    std::vector<std::vector<ClusterBounds> > levels;
+
+    MeshClusters() : numTriangles(0) {}
+};
+
+// A range of consecutive triangles in the index buffer
+struct ClusterRange {
+    std::size_t first;
+    std::size_t count;
+};
+
+struct ClusterCullStats {
+    std::size_t numClusters;
+    std::size_t numVisible; // clusters
+    std::size_t numTests;   // box/frustum tests
+};
+
+// The planes of a view frustum, a * x + b * y + c * z + d >= 0 inside,
+// stored as structure of arrays for the SSE test. The last two planes are
+// padding that everything is inside of.
+struct Frustum {
+    alignas(16) float a[8];
+    alignas(16) float b[8];
+    alignas(16) float c[8];
+    alignas(16) float d[8];
+};
+
+// Extract the frustum of a (model-view-)projection matrix, in the space
+// that the matrix transforms from (Gribb and Hartmann)
+Frustum frustumFromMatrix(const glm::mat4 &m)
+{
+    Frustum frustum;
+    for (int i = 0; i < 8; ++i) {
+        glm::vec4 plane(0.0f, 0.0f, 0.0f, 1.0f);
+        if (i < 6) {
+            int axis = i / 2;
+            float sign = (i % 2 == 0) ? 1.0f : -1.0f;
+            for (int col = 0; col < 4; ++col) {
+                plane[col] = m[col][3] + sign * m[col][axis];
+            }
+        }
+        frustum.a[i] = plane.x;
+        frustum.b[i] = plane.y;
+        frustum.c[i] = plane.z;
+        frustum.d[i] = plane.w;
+    }
+    return frustum;
+}
+
+enum FrustumTestResult {
+    FRUSTUM_OUTSIDE,
+    FRUSTUM_INTERSECTS,
+    FRUSTUM_INSIDE
+};
+
+// Classify a box against a frustum. A box is outside if its corner
+// farthest along some plane's normal is behind that plane, and inside if
+// the nearest corner is in front of every plane. Boxes that straddle two
+// planes outside the frustum near a corner may be reported as
+// intersecting, which only costs a few extra triangles.
+inline FrustumTestResult frustumTestBox(const Frustum &frustum, const ClusterBounds &box)
+{
+#ifdef MESH_CLUSTERS_SSE
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 minX = _mm_set1_ps(box.min.x), maxX = _mm_set1_ps(box.max.x);
+    const __m128 minY = _mm_set1_ps(box.min.y), maxY = _mm_set1_ps(box.max.y);
+    const __m128 minZ = _mm_set1_ps(box.min.z), maxZ = _mm_set1_ps(box.max.z);
+    __m128 outside = zero, partial = zero;
+    for (int i = 0; i < 8; i += 4) {
+        __m128 a = _mm_load_ps(frustum.a + i), b = _mm_load_ps(frustum.b + i);
+        __m128 c = _mm_load_ps(frustum.c + i), d = _mm_load_ps(frustum.d + i);
+        __m128 ax0 = _mm_mul_ps(a, minX), ax1 = _mm_mul_ps(a, maxX);
+        __m128 by0 = _mm_mul_ps(b, minY), by1 = _mm_mul_ps(b, maxY);
+        __m128 cz0 = _mm_mul_ps(c, minZ), cz1 = _mm_mul_ps(c, maxZ);
+        __m128 far = _mm_add_ps(_mm_add_ps(_mm_max_ps(ax0, ax1), _mm_max_ps(by0, by1)),
+                                _mm_add_ps(_mm_max_ps(cz0, cz1), d));
+        __m128 near = _mm_add_ps(_mm_add_ps(_mm_min_ps(ax0, ax1), _mm_min_ps(by0, by1)),
+                                 _mm_add_ps(_mm_min_ps(cz0, cz1), d));
+        outside = _mm_or_ps(outside, _mm_cmplt_ps(far, zero));
+        partial = _mm_or_ps(partial, _mm_cmplt_ps(near, zero));
+    }
+    if (_mm_movemask_ps(outside) != 0) {
+        return FRUSTUM_OUTSIDE;
+    }
+    return _mm_movemask_ps(partial) != 0 ? FRUSTUM_INTERSECTS : FRUSTUM_INSIDE;
+#else
+    bool partial = false;
+    for (int i = 0; i < 6; ++i) {
+        float x0 = frustum.a[i] * box.min.x, x1 = frustum.a[i] * box.max.x;
+        float y0 = frustum.b[i] * box.min.y, y1 = frustum.b[i] * box.max.y;
+        float z0 = frustum.c[i] * box.min.z, z1 = frustum.c[i] * box.max.z;
+        if (std::max(x0, x1) + std::max(y0, y1) + std::max(z0, z1) + frustum.d[i] < 0.0f) {
+            return FRUSTUM_OUTSIDE;
+        }
+        partial = partial || std::min(x0, x1) + std::min(y0, y1) + std::min(z0, z1) + frustum.d[i] < 0.0f;
+    }
+    return partial ? FRUSTUM_INTERSECTS : FRUSTUM_INSIDE;
+#endif
+}
+
+// Reorder the triangles of indices into clusters of clusterSize (see
+// above). Within a cluster, triangles keep their relative order, so a
+// vertex cache optimized order survives inside the clusters. The subtrees
+// below the first few splits are clustered in parallel.
+void clusterTriangles(std::vector<std::uint32_t> &indices, const std::vector<glm::vec3> &vertices,
+                      int clusterSize = MESH_CLUSTER_SIZE, int numThreads = 0)
+{
+    std::size_t numTriangles = indices.size() / 3;
+    std::size_t size = std::size_t(std::max(clusterSize, 1));
+    std::vector<glm::vec3> centroids(numTriangles);
+    parallelForRange(numTriangles, numThreads, [&](std::size_t begin, std::size_t end) {
+        for (std::size_t t = begin; t < end; ++t) {
+            centroids[t] = (vertices[indices[3 * t]] + vertices[indices[3 * t + 1]] + vertices[indices[3 * t + 2]]) /
+                           3.0f;
+        }
+    });
+    std::vector<std::uint32_t> order(numTriangles);
+    std::iota(order.begin(), order.end(), 0u);
+
+    // Split [begin, end) once and return the split point, or end for a leaf
+    auto split = [&](std::size_t begin, std::size_t end) -> std::size_t {
+        if (end - begin <= size) {
+            std::sort(order.begin() + begin, order.begin() + end);
+            return end;
+        }
+        glm::vec3 lo(centroids[order[begin]]), hi(lo);
+        for (std::size_t i = begin; i < end; ++i) {
+            lo = glm::min(lo, centroids[order[i]]);
+            hi = glm::max(hi, centroids[order[i]]);
+        }
+        glm::vec3 extent = hi - lo;
+        int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+        std::size_t numClusters = (end - begin + size - 1) / size;
+        std::size_t half = 1;
+        while (2 * half < numClusters) {
+            half *= 2;
+        }
+        std::size_t mid = begin + half * size;
+        std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end,
+                         [&](std::uint32_t t0, std::uint32_t t1) { return centroids[t0][axis] < centroids[t1][axis]; });
+        return mid;
+    };
+    auto clusterRange = [&](std::size_t begin, std::size_t end) {
+        std::vector<std::pair<std::size_t, std::size_t> > stack(1, std::make_pair(begin, end));
+        while (!stack.empty()) {
+            std::pair<std::size_t, std::size_t> range = stack.back();
+            stack.pop_back();
+            std::size_t mid = split(range.first, range.second);
+            if (mid < range.second) {
+                stack.push_back(std::make_pair(range.first, mid));
+                stack.push_back(std::make_pair(mid, range.second));
+            }
+        }
+    };
+
+    // Split serially until there are enough subtrees to balance the threads
+    if (numThreads <= 0) {
+        numThreads = defaultThreadCount();
+    }
+    std::size_t taskSize = std::max(size, numTriangles / (8 * std::size_t(numThreads)));
+    std::vector<std::pair<std::size_t, std::size_t> > tasks, pending(1, std::make_pair(std::size_t(0), numTriangles));
+    while (!pending.empty()) {
+        std::pair<std::size_t, std::size_t> range = pending.back();
+        pending.pop_back();
+        if (range.second - range.first <= taskSize) {
+            tasks.push_back(range);
+            continue;
+        }
+        std::size_t mid = split(range.first, range.second);
+        pending.push_back(std::make_pair(range.first, mid));
+        pending.push_back(std::make_pair(mid, range.second));
+    }
+    parallelFor(int(tasks.size()), numThreads, [&](int i) { clusterRange(tasks[i].first, tasks[i].second); });
+
+    std::vector<std::uint32_t> clustered(numTriangles * 3);
+    parallelForRange(numTriangles, numThreads, [&](std::size_t begin, std::size_t end) {
+        for (std::size_t t = begin; t < end; ++t) {
+            std::copy(indices.begin() + 3 * order[t], indices.begin() + 3 * order[t] + 3, clustered.begin() + 3 * t);
+        }
+    });
+    indices.swap(clustered);
+}
+
+// Build the hierarchy of a clustered index buffer
+void meshClustersBuild(const glm::vec3 *vertices, const std::uint32_t *indices, std::size_t numIndices,
+                       MeshClusters *clusters, int clusterSize = MESH_CLUSTER_SIZE, int numThreads = 0)
+{
+    std::size_t numTriangles = numIndices / 3;
+    std::size_t size = std::size_t(std::max(clusterSize, 1));
+    clusters->numTriangles = numTriangles;
+    clusters->levels.clear();
+    if (numTriangles == 0) {
+        return;
+    }
+
+    std::vector<ClusterBounds> leaves((numTriangles + size - 1) / size);
+    parallelForRange(leaves.size(), numThreads, [&](std::size_t begin, std::size_t end) {
+        for (std::size_t c = begin; c < end; ++c) {
+            std::size_t last = std::min((c + 1) * size, numTriangles) * 3;
+            ClusterBounds &box = leaves[c];
+            box.min = box.max = vertices[indices[c * size * 3]];
+            for (std::size_t i = c * size * 3; i < last; ++i) {
+                box.min = glm::min(box.min, vertices[indices[i]]);
+                box.max = glm::max(box.max, vertices[indices[i]]);
+            }
+        }
+    }, 256);
+    clusters->levels.push_back(leaves);
+
+    while (clusters->levels.back().size() > 1) {
+        const std::vector<ClusterBounds> &children = clusters->levels.back();
+        std::vector<ClusterBounds> parents((children.size() + 1) / 2);
+        for (std::size_t i = 0; i < parents.size(); ++i) {
+            parents[i] = children[2 * i];
+            if (2 * i + 1 < children.size()) {
+                parents[i].min = glm::min(parents[i].min, children[2 * i + 1].min);
+                parents[i].max = glm::max(parents[i].max, children[2 * i + 1].max);
+            }
+        }
+        clusters->levels.push_back(parents);
+    }
+}
+
+// Find the clusters that intersect frustum (in the space of the vertex
+// positions). Adjacent visible clusters are merged into one range.
+void meshClustersCull(const MeshClusters &clusters, const Frustum &frustum, std::vector<ClusterRange> *ranges,
+                      ClusterCullStats *stats, int clusterSize = MESH_CLUSTER_SIZE)
+{
+    ranges->clear();
+    ClusterCullStats result = { clusters.levels.empty() ? 0 : clusters.levels[0].size(), 0, 0 };
+    if (clusters.levels.empty()) {
+        *stats = result;
+        return;
+    }
+
+    // Depth-first, visiting the first child first so ranges come in order
+    std::vector<std::pair<int, std::size_t> > stack(1, std::make_pair(int(clusters.levels.size()) - 1, std::size_t(0)));
+    while (!stack.empty()) {
+        int level = stack.back().first;
+        std::size_t node = stack.back().second;
+        stack.pop_back();
+        ++result.numTests;
+        FrustumTestResult test = frustumTestBox(frustum, clusters.levels[level][node]);
+        if (test == FRUSTUM_OUTSIDE) {
+            continue;
+        }
+        if (test == FRUSTUM_INTERSECTS && level > 0) {
+            if (2 * node + 1 < clusters.levels[level - 1].size()) {
+                stack.push_back(std::make_pair(level - 1, 2 * node + 1));
+            }
+            stack.push_back(std::make_pair(level - 1, 2 * node));
+            continue;
+        }
+        std::size_t firstCluster = node << level;
+        std::size_t lastCluster = std::min((node + 1) << level, clusters.levels[0].size());
+        result.numVisible += lastCluster - firstCluster;
+        std::size_t first = firstCluster * clusterSize;
+        std::size_t last = std::min(lastCluster * clusterSize, clusters.numTriangles);
+        if (!ranges->empty() && ranges->back().first + ranges->back().count == first) {
+            ranges->back().count += last - first;
+        }
+        else {
+            ClusterRange range = { first, last - first };
+            ranges->push_back(range);
+        }
+    }
+    *stats = result;
+}
@@ -0,0 +1,206 @@
+#pragma once
+
+#include "utils2.h"
+#include "parallel.h"
+
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define MESH_NORMALS_SSE2
+#endif
+
+// How face normals are weighted when averaged into vertex normals
+enum NormalWeighting {
+    NORMAL_WEIGHT_AREA = 0,  // unnormalized face normals (same as computeNormals)
+    NORMAL_WEIGHT_ANGLE = 1  // unit face normals times the corner angle
+};
+
+// Normalize an array of vectors in place. Four vectors at a time are
+// transposed into a structure-of-arrays view in SSE registers, scaled and
+// transposed back. The result is bit-identical to glm::normalize.
+void normalizeVectors(glm::vec3 *vectors, std::size_t count)
+{
+    std::size_t i = 0;
+#ifdef MESH_NORMALS_SSE2
+    const __m128 one = _mm_set1_ps(1.0f);
+    for (; i + 4 <= count; i += 4) {
+        float *p = &vectors[i].x;
+        __m128 a = _mm_loadu_ps(p);     // x0 y0 z0 x1
+        __m128 b = _mm_loadu_ps(p + 4); // y1 z1 x2 y2
+        __m128 c = _mm_loadu_ps(p + 8); // z2 x3 y3 z3
+
+        __m128 t0 = _mm_shuffle_ps(b, c, _MM_SHUFFLE(2, 1, 3, 2)); // b2 b3 c1 c2
+        __m128 t1 = _mm_shuffle_ps(a, b, _MM_SHUFFLE(1, 0, 2, 1)); // a1 a2 b0 b1
+        __m128 x = _mm_shuffle_ps(a, t0, _MM_SHUFFLE(2, 0, 3, 0));
+        __m128 y = _mm_shuffle_ps(t1, t0, _MM_SHUFFLE(3, 1, 2, 0));
+        __m128 z = _mm_shuffle_ps(t1, c, _MM_SHUFFLE(3, 0, 3, 1));
+
+        // Same operation order as glm::normalize: x * (1 / sqrt((xx + yy) + zz))
+        __m128 sqr = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z));
+        __m128 scale = _mm_div_ps(one, _mm_sqrt_ps(sqr));
+        x = _mm_mul_ps(x, scale);
+        y = _mm_mul_ps(y, scale);
+        z = _mm_mul_ps(z, scale);
+
+        __m128 xyLo = _mm_unpacklo_ps(x, y); // x0 y0 x1 y1
+        __m128 xyHi = _mm_unpackhi_ps(x, y); // x2 y2 x3 y3
+        __m128 yzLo = _mm_unpacklo_ps(y, z); // y0 z0 y1 z1
+        __m128 yzHi = _mm_unpackhi_ps(y, z); // y2 z2 y3 z3
+        __m128 zxLo = _mm_unpacklo_ps(z, x); // z0 x0 z1 x1
+        __m128 zxHi = _mm_unpackhi_ps(z, x); // z2 x2 z3 x3
+        _mm_storeu_ps(p, _mm_shuffle_ps(xyLo, zxLo, _MM_SHUFFLE(3, 0, 1, 0)));
+        _mm_storeu_ps(p + 4, _mm_shuffle_ps(yzLo, xyHi, _MM_SHUFFLE(1, 0, 3, 2)));
+        _mm_storeu_ps(p + 8, _mm_shuffle_ps(zxHi, yzHi, _MM_SHUFFLE(3, 2, 3, 0)));
+    }
+#endif
+    for (; i < count; ++i) {
+        vectors[i] = glm::normalize(vectors[i]);
+    }
+}
+
+// Returns the angle of a triangle at corner c, or 0 if it is degenerate
+float cornerAngle(const glm::vec3 *vertices, const std::uint32_t *face, int c)
+{
+    glm::vec3 e1 = vertices[face[(c + 1) % 3]] - vertices[face[c]];
+    glm::vec3 e2 = vertices[face[(c + 2) % 3]] - vertices[face[c]];
+    float l1 = glm::length(e1);
+    float l2 = glm::length(e2);
+    if (l1 == 0.0f || l2 == 0.0f) {
+        return 0.0f;
+    }
+    return std::acos(glm::clamp(glm::dot(e1, e2) / (l1 * l2), -1.0f, 1.0f));
+}
+
+// Face normal of face f: unnormalized (area-weighted) or unit length
+inline glm::vec3 faceNormal(const glm::vec3 *vertices, const std::uint32_t *face, NormalWeighting weighting)
+{
+    glm::vec3 normal = glm::cross(vertices[face[1]] - vertices[face[0]], vertices[face[2]] - vertices[face[0]]);
+    if (weighting == NORMAL_WEIGHT_ANGLE) {
+        float length = glm::length(normal);
+        normal = length > 0.0f ? normal / length : glm::vec3(0.0f);
+    }
+    return normal;
+}
+
+// Compute per-vertex normals on one thread, in one pass over the faces
+// (the same summation as computeNormals)
+void computeNormalsSerial(const glm::vec3 *vertices, std::size_t numVertices,
+                          const std::uint32_t *indices, std::size_t numIndices,
+                          glm::vec3 *normals, NormalWeighting weighting)
+{
+    std::fill(normals, normals + numVertices, glm::vec3(0.0f, 0.0f, 0.0f));
+    for (std::size_t i = 0; i + 2 < numIndices; i += 3) {
+        const std::uint32_t *face = indices + i;
+        if (weighting == NORMAL_WEIGHT_ANGLE) {
+            glm::vec3 normal = faceNormal(vertices, face, weighting);
+            for (int c = 0; c < 3; ++c) {
+                normals[face[c]] += normal * cornerAngle(vertices, face, c);
+            }
+        }
+        else {
+            glm::vec3 normal = glm::cross(vertices[face[1]] - vertices[face[0]], vertices[face[2]] - vertices[face[0]]);
+            normals[face[0]] += normal;
+            normals[face[1]] += normal;
+            normals[face[2]] += normal;
+        }
+    }
+    normalizeVectors(normals, numVertices);
+}
+
+// Compute per-vertex normals in parallel. The vertices are split into one
+// contiguous range per thread and every thread only accumulates into the
+// normals it owns, so there are no write conflicts, locks or per-thread
+// copies of the normal array. The face corners are first bucketed by the
+// range of their vertex (a counting sort over chunks of faces, in
+// parallel), so each thread only reads its own corners, in face order:
+// the summation order is the same as in computeNormals, and with
+// NORMAL_WEIGHT_AREA the result is bit-identical. Small meshes and a
+// single thread use computeNormalsSerial.
+void computeNormalsParallel(const glm::vec3 *vertices, std::size_t numVertices,
+                            const std::uint32_t *indices, std::size_t numIndices,
+                            glm::vec3 *normals, NormalWeighting weighting, int numThreads)
+{
+    if (numThreads <= 0) {
+        numThreads = defaultThreadCount();
+    }
+    std::size_t numFaces = numIndices / 3;
+    int numRanges = int(std::max<std::size_t>(1, std::min<std::size_t>(numThreads, numVertices / 1024)));
+    if (numRanges == 1) {
+        computeNormalsSerial(vertices, numVertices, indices, numIndices, normals, weighting);
+        return;
+    }
+    auto rangeBegin = [&](int r) { return std::uint32_t(std::uint64_t(numVertices) * r / numRanges); };
+    auto rangeOf = [&](std::uint32_t v) {
+        return int((std::uint64_t(v + 1) * numRanges - 1) / numVertices); // rangeBegin(r) <= v < rangeBegin(r + 1)
+    };
+
+    // Face normals; count the corners of every chunk of faces per range
+    std::vector<glm::vec3> faceNormals(numFaces);
+    int numChunks = numRanges;
+    std::vector<std::size_t> counts(std::size_t(numChunks) * numRanges, 0); // [chunk][range]
+    auto chunkBegin = [&](int t) { return numFaces * t / numChunks; };
+    parallelFor(numChunks, numThreads, [&](int t) {
+        std::size_t *chunkCounts = &counts[std::size_t(t) * numRanges];
+        for (std::size_t f = chunkBegin(t); f < chunkBegin(t + 1); ++f) {
+            const std::uint32_t *face = indices + 3 * f;
+            faceNormals[f] = faceNormal(vertices, face, weighting);
+            for (int c = 0; c < 3; ++c) {
+                ++chunkCounts[rangeOf(face[c])];
+            }
+        }
+    });
+
+    // Bucket the corners (as index positions) by range, chunks in order
+    std::vector<std::size_t> offsets(counts.size());
+    std::vector<std::size_t> rangeStarts(numRanges + 1);
+    std::size_t offset = 0;
+    for (int r = 0; r < numRanges; ++r) {
+        rangeStarts[r] = offset;
+        for (int t = 0; t < numChunks; ++t) {
+            offsets[std::size_t(t) * numRanges + r] = offset;
+            offset += counts[std::size_t(t) * numRanges + r];
+        }
+    }
+    rangeStarts[numRanges] = offset;
+    std::vector<std::uint32_t> corners(offset);
+    parallelFor(numChunks, numThreads, [&](int t) {
+        std::size_t *next = &offsets[std::size_t(t) * numRanges];
+        for (std::size_t i = 3 * chunkBegin(t); i < 3 * chunkBegin(t + 1); ++i) {
+            corners[next[rangeOf(indices[i])]++] = std::uint32_t(i);
+        }
+    });
+
+    // Accumulate into owned vertex ranges
+    parallelFor(numRanges, numRanges, [&](int r) {
+        std::fill(normals + rangeBegin(r), normals + rangeBegin(r + 1), glm::vec3(0.0f, 0.0f, 0.0f));
+        for (std::size_t k = rangeStarts[r]; k < rangeStarts[r + 1]; ++k) {
+            std::size_t i = corners[k];
+            std::size_t f = i / 3;
+            if (weighting == NORMAL_WEIGHT_ANGLE) {
+                normals[indices[i]] += faceNormals[f] * cornerAngle(vertices, indices + 3 * f, int(i % 3));
+            }
+            else {
+                normals[indices[i]] += faceNormals[f];
+            }
+        }
+        normalizeVectors(normals + rangeBegin(r), rangeBegin(r + 1) - rangeBegin(r));
+    });
+}
+
+// Convenience overload in the style of computeNormals
+void computeNormalsParallel(const std::vector<glm::vec3> &vertices,
+                            const std::vector<std::uint32_t> &indices,
+                            std::vector<glm::vec3> *normals,
+                            NormalWeighting weighting, int numThreads)
+{
+    normals->resize(vertices.size());
+    computeNormalsParallel(vertices.data(), vertices.size(), indices.data(), indices.size(),
+                           normals->data(), weighting, numThreads);
+}
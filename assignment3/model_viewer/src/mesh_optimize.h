@@ -0,0 +1,227 @@
+#pragma once
+
+#include "utils2.h"
+
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// Post-transform vertex cache statistics for an index buffer
+struct VertexCacheStats {
+    float acmr; // average cache miss ratio: transformed vertices per triangle (0.5 - 3)
+    float atvr; // average transformed to vertex ratio: transformed per referenced vertex (>= 1)
+};
+
+// Simulate a FIFO post-transform vertex cache of the given size on the CPU
+VertexCacheStats simulateVertexCache(const std::uint32_t *indices, std::size_t numIndices,
+                                     std::size_t numVertices, unsigned cacheSize)
+{
+    // A vertex is in the cache if fewer than cacheSize vertices have been
+    // inserted after it; the timestamps count insertions
+    std::vector<std::uint64_t> insertedAt(numVertices, 0);
+    std::uint64_t timestamp = 0;
+    std::size_t numMisses = 0;
+    std::size_t numReferenced = 0;
+    for (std::size_t i = 0; i < numIndices; ++i) {
+        std::uint32_t v = indices[i];
+        if (insertedAt[v] == 0) {
+            ++numReferenced;
+        }
+        if (insertedAt[v] == 0 || timestamp - insertedAt[v] >= cacheSize) {
+            insertedAt[v] = ++timestamp;
+            ++numMisses;
+        }
+    }
+
+    VertexCacheStats stats;
+    stats.acmr = numIndices > 0 ? float(numMisses) / float(numIndices / 3) : 0.0f;
+    stats.atvr = numReferenced > 0 ? float(numMisses) / float(numReferenced) : 0.0f;
+    return stats;
+}
+
+namespace {
+// Vertex scoring from Tom Forsyth, "Linear-Speed Vertex Cache
+// Optimisation" (2006)
+const int FORSYTH_CACHE_SIZE = 32;
+const int FORSYTH_MAX_VALENCE = 32;
+
+struct ForsythScoreTables {
+    float cache[FORSYTH_CACHE_SIZE];
+    float valence[FORSYTH_MAX_VALENCE];
+
+    ForsythScoreTables()
+    {
+        for (int i = 0; i < FORSYTH_CACHE_SIZE; ++i) {
+            // The last triangle's vertices get a fixed score so that its
+            // strip-like neighbours are not always preferred
+            cache[i] = i < 3 ? 0.75f
+                             : std::pow(1.0f - float(i - 3) / float(FORSYTH_CACHE_SIZE - 3), 1.5f);
+        }
+        valence[0] = 0.0f;
+        for (int i = 1; i < FORSYTH_MAX_VALENCE; ++i) {
+            valence[i] = 2.0f / std::sqrt(float(i));
+        }
+    }
+};
+
+float forsythVertexScore(const ForsythScoreTables &tables, int cachePosition, std::uint32_t numLiveTriangles)
+{
+    if (numLiveTriangles == 0) {
+        return -1.0f;
+    }
+    float score = cachePosition >= 0 ? tables.cache[cachePosition] : 0.0f;
+    if (numLiveTriangles < std::uint32_t(FORSYTH_MAX_VALENCE)) {
+        return score + tables.valence[numLiveTriangles];
+    }
+    return score + 2.0f / std::sqrt(float(numLiveTriangles));
+}
+} // namespace
+
+// Reorder the triangles of an index buffer in place for post-transform
+// vertex cache locality, using Forsyth's greedy algorithm. Triangles that
+// reuse vertices recently emitted (and vertices with few remaining
+// triangles) are preferred. Runs in linear time.
+void optimizeVertexCache(std::uint32_t *indices, std::size_t numIndices, std::size_t numVertices)
+{
+    static const ForsythScoreTables tables;
+    std::size_t numTriangles = numIndices / 3;
+
+    // Vertex->triangle adjacency; the first liveTriangles[v] entries of a
+    // vertex's range are the triangles that still have to be emitted
+    std::vector<std::uint32_t> liveTriangles(numVertices, 0);
+    for (std::size_t i = 0; i < numIndices; ++i) {
+        ++liveTriangles[indices[i]];
+    }
+    std::vector<std::size_t> offsets(numVertices + 1, 0);
+    for (std::size_t v = 0; v < numVertices; ++v) {
+        offsets[v + 1] = offsets[v] + liveTriangles[v];
+    }
+    std::vector<std::uint32_t> adjacency(numIndices);
+    {
+        std::vector<std::size_t> cursor(offsets.begin(), offsets.end() - 1);
+        for (std::size_t i = 0; i < numIndices; ++i) {
+            adjacency[cursor[indices[i]]++] = std::uint32_t(i / 3);
+        }
+    }
+
+    std::vector<int> cachePosition(numVertices, -1);
+    std::vector<float> vertexScore(numVertices);
+    for (std::size_t v = 0; v < numVertices; ++v) {
+        vertexScore[v] = forsythVertexScore(tables, -1, liveTriangles[v]);
+    }
+    std::vector<float> triangleScore(numTriangles);
+    std::vector<char> emitted(numTriangles, 0);
+    for (std::size_t t = 0; t < numTriangles; ++t) {
+        const std::uint32_t *tri = indices + 3 * t;
+        triangleScore[t] = vertexScore[tri[0]] + vertexScore[tri[1]] + vertexScore[tri[2]];
+    }
+
+    std::vector<std::uint32_t> output(3 * numTriangles);
+    std::vector<std::uint32_t> cache, newCache;
+    cache.reserve(FORSYTH_CACHE_SIZE + 3);
+    newCache.reserve(FORSYTH_CACHE_SIZE + 3);
+    std::size_t nextUnemitted = 0;
+    std::int64_t best = -1;
+    for (std::size_t numEmitted = 0; numEmitted < numTriangles; ++numEmitted) {
+        if (best < 0) {
+            // No candidate around the cache: continue with the next
+            // triangle in input order
+            while (emitted[nextUnemitted]) {
+                ++nextUnemitted;
+            }
+            best = std::int64_t(nextUnemitted);
+        }
+        const std::uint32_t *tri = indices + 3 * best;
+        std::copy(tri, tri + 3, output.begin() + 3 * numEmitted);
+        emitted[best] = 1;
+
+        // Remove the triangle from its vertices' live lists and put its
+        // vertices at the front of the cache
+        newCache.clear();
+        for (int c = 0; c < 3; ++c) {
+            std::uint32_t v = tri[c];
+            std::uint32_t *list = adjacency.data() + offsets[v];
+            std::uint32_t *last = list + liveTriangles[v] - 1;
+            *std::find(list, last, std::uint32_t(best)) = *last;
+            --liveTriangles[v];
+            if (std::find(newCache.begin(), newCache.end(), v) == newCache.end()) {
+                newCache.push_back(v);
+            }
+        }
+        for (std::uint32_t v : cache) {
+            if (std::find(newCache.begin(), newCache.end(), v) == newCache.end()) {
+                newCache.push_back(v);
+            }
+        }
+
+        // Rescore the cached (and just evicted) vertices and their
+        // triangles, and pick the best of those triangles next
+        for (std::size_t i = 0; i < newCache.size(); ++i) {
+            std::uint32_t v = newCache[i];
+            cachePosition[v] = i < std::size_t(FORSYTH_CACHE_SIZE) ? int(i) : -1;
+            vertexScore[v] = forsythVertexScore(tables, cachePosition[v], liveTriangles[v]);
+        }
+        best = -1;
+        float bestScore = -1.0f;
+        for (std::uint32_t v : newCache) {
+            const std::uint32_t *list = adjacency.data() + offsets[v];
+            for (std::uint32_t k = 0; k < liveTriangles[v]; ++k) {
+                std::uint32_t t = list[k];
+                const std::uint32_t *other = indices + 3 * t;
+                triangleScore[t] = vertexScore[other[0]] + vertexScore[other[1]] + vertexScore[other[2]];
+                if (triangleScore[t] > bestScore) {
+                    bestScore = triangleScore[t];
+                    best = t;
+                }
+            }
+        }
+        if (newCache.size() > std::size_t(FORSYTH_CACHE_SIZE)) {
+            newCache.resize(FORSYTH_CACHE_SIZE);
+        }
+        cache.swap(newCache);
+    }
+
+    std::copy(output.begin(), output.end(), indices);
+}
+
+// Renumber the vertices of a mesh in the order the index buffer first
+// uses them, for vertex fetch locality. Unreferenced vertices are removed.
+void optimizeVertexFetch(OBJMesh &mesh)
+{
+    const std::uint32_t UNUSED = 0xffffffff;
+    std::vector<std::uint32_t> remap(mesh.vertices.size(), UNUSED);
+    std::uint32_t numUsed = 0;
+    for (std::uint32_t &index : mesh.indices) {
+        if (remap[index] == UNUSED) {
+            remap[index] = numUsed++;
+        }
+        index = remap[index];
+    }
+
+    std::vector<glm::vec3> vertices(numUsed);
+    std::vector<glm::vec3> normals(mesh.normals.empty() ? 0 : numUsed);
+    for (std::size_t v = 0; v < remap.size(); ++v) {
+        if (remap[v] != UNUSED) {
+            vertices[remap[v]] = mesh.vertices[v];
+            if (!normals.empty()) {
+                normals[remap[v]] = mesh.normals[v];
+            }
+        }
+    }
+    mesh.vertices.swap(vertices);
+    mesh.normals.swap(normals);
+}
+
+// Reorder a mesh for the vertex cache and then for vertex fetch. Returns
+// the FIFO cache statistics before and after.
+void optimizeMesh(OBJMesh &mesh, unsigned cacheSize, VertexCacheStats *before, VertexCacheStats *after)
+{
+    *before = simulateVertexCache(mesh.indices.data(), mesh.indices.size(), mesh.vertices.size(), cacheSize);
+    optimizeVertexCache(mesh.indices.data(), mesh.indices.size(), mesh.vertices.size());
+    optimizeVertexFetch(mesh);
+    *after = simulateVertexCache(mesh.indices.data(), mesh.indices.size(), mesh.vertices.size(), cacheSize);
+}
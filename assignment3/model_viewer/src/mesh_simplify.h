@@ -0,0 +1,344 @@
+#pragma once
+
+#include "parallel.h"
+
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <queue>
+#include <utility>
+#include <vector>
+
+// Mesh simplification with quadric error metrics (Garland and Heckbert,
+// "Surface Simplification Using Quadric Error Metrics", 1997). Edges are
+// collapsed onto one of their endpoints, never onto a new position, so
+// every level of detail indexes the vertex buffer of the original mesh
+// and a LOD chain costs nothing but extra index ranges.
+//
+// Large meshes are simplified in parallel: the triangles are partitioned
+// by a grid over their centroids, and each cell is simplified on its own
+// with the vertices it shares with other cells (and those on open
+// borders) locked. The grid is offset by half a cell on every other level
+// of the chain, so vertices locked on one level can be removed on the
+// next.
+
+// Symmetric 4x4 matrix of a quadric, sum of (n.p + d)^2 over planes
+struct Quadric {
+    double a2, ab, ac, ad, b2, bc, bd, c2, cd, d2;
+
+    Quadric() : a2(0), ab(0), ac(0), ad(0), b2(0), bc(0), bd(0), c2(0), cd(0), d2(0) {}
+
+    void addPlane(const glm::dvec3 &n, double d, double weight)
+    {
+        a2 += weight * n.x * n.x; ab += weight * n.x * n.y; ac += weight * n.x * n.z; ad += weight * n.x * d;
+        b2 += weight * n.y * n.y; bc += weight * n.y * n.z; bd += weight * n.y * d;
+        c2 += weight * n.z * n.z; cd += weight * n.z * d;
+        d2 += weight * d * d;
+    }
+
+    Quadric &operator+=(const Quadric &q)
+    {
+        a2 += q.a2; ab += q.ab; ac += q.ac; ad += q.ad; b2 += q.b2;
+        bc += q.bc; bd += q.bd; c2 += q.c2; cd += q.cd; d2 += q.d2;
+        return *this;
+    }
+
+    double error(const glm::vec3 &p) const
+    {
+        double x = p.x, y = p.y, z = p.z;
+        return a2 * x * x + 2 * ab * x * y + 2 * ac * x * z + 2 * ad * x +
+               b2 * y * y + 2 * bc * y * z + 2 * bd * y +
+               c2 * z * z + 2 * cd * z + d2;
+    }
+};
+
+namespace {
+// A candidate collapse of vertex u onto vertex v, valid while neither
+// vertex has changed since (their versions match)
+struct EdgeCollapse {
+    double cost;
+    std::uint32_t u, v;
+    std::uint32_t versionU, versionV;
+
+    bool operator<(const EdgeCollapse &other) const { return cost > other.cost; } // min-heap
+};
+
+// Simplify one partition, given as triangles with global vertex indices,
+// until at most targetTriangles remain or no collapse is possible. The
+// remaining triangles are appended to output in their original order.
+void simplifyPartition(const glm::vec3 *vertices, const std::vector<std::uint32_t> &triangles,
+                       const std::vector<char> &sharedVertex, std::size_t targetTriangles,
+                       std::vector<std::uint32_t> *output)
+{
+    // Local vertex numbering
+    std::vector<std::uint32_t> globalIds(triangles);
+    std::sort(globalIds.begin(), globalIds.end());
+    globalIds.erase(std::unique(globalIds.begin(), globalIds.end()), globalIds.end());
+    auto local = [&](std::uint32_t g) {
+        return std::uint32_t(std::lower_bound(globalIds.begin(), globalIds.end(), g) - globalIds.begin());
+    };
+    std::size_t numVertices = globalIds.size();
+    std::size_t numTriangles = triangles.size() / 3;
+    std::vector<std::uint32_t> tri(triangles.size());
+    for (std::size_t i = 0; i < tri.size(); ++i) {
+        tri[i] = local(triangles[i]);
+    }
+
+    std::vector<char> locked(numVertices);
+    for (std::size_t v = 0; v < numVertices; ++v) {
+        locked[v] = sharedVertex[globalIds[v]];
+    }
+    // Lock the ends of edges with a single triangle: open borders (and
+    // the partition boundary, which is locked already)
+    std::vector<std::pair<std::uint64_t, std::uint32_t> > edges;
+    edges.reserve(tri.size());
+    for (std::size_t t = 0; t < numTriangles; ++t) {
+        for (int k = 0; k < 3; ++k) {
+            std::uint32_t a = tri[3 * t + k], b = tri[3 * t + (k + 1) % 3];
+            edges.push_back(std::make_pair((std::uint64_t(std::min(a, b)) << 32) | std::max(a, b), a));
+        }
+    }
+    std::sort(edges.begin(), edges.end());
+    for (std::size_t i = 0; i < edges.size();) {
+        std::size_t j = i + 1;
+        while (j < edges.size() && edges[j].first == edges[i].first) {
+            ++j;
+        }
+        if (j - i == 1) {
+            locked[std::uint32_t(edges[i].first >> 32)] = 1;
+            locked[std::uint32_t(edges[i].first)] = 1;
+        }
+        i = j;
+    }
+
+    // Vertex quadrics from the area-weighted planes of their triangles
+    std::vector<glm::vec3> position(numVertices);
+    for (std::size_t v = 0; v < numVertices; ++v) {
+        position[v] = vertices[globalIds[v]];
+    }
+    std::vector<Quadric> quadrics(numVertices);
+    std::vector<std::vector<std::uint32_t> > adjacency(numVertices);
+    for (std::size_t t = 0; t < numTriangles; ++t) {
+        glm::dvec3 p0(position[tri[3 * t]]), p1(position[tri[3 * t + 1]]), p2(position[tri[3 * t + 2]]);
+        glm::dvec3 n = glm::cross(p1 - p0, p2 - p0);
+        double length = glm::length(n);
+        if (length > 0.0) {
+            n /= length;
+            for (int k = 0; k < 3; ++k) {
+                quadrics[tri[3 * t + k]].addPlane(n, -glm::dot(n, p0), 0.5 * length);
+            }
+        }
+        for (int k = 0; k < 3; ++k) {
+            adjacency[tri[3 * t + k]].push_back(std::uint32_t(t));
+        }
+    }
+
+    std::vector<char> removedTriangle(numTriangles, 0);
+    std::vector<char> removedVertex(numVertices, 0);
+    std::vector<std::uint32_t> version(numVertices, 0);
+    std::priority_queue<EdgeCollapse> heap;
+    auto pushCollapse = [&](std::uint32_t u, std::uint32_t v) {
+        if (!locked[u]) {
+            Quadric q = quadrics[u];
+            q += quadrics[v];
+            EdgeCollapse collapse = { q.error(position[v]), u, v, version[u], version[v] };
+            heap.push(collapse);
+        }
+    };
+    for (std::size_t t = 0; t < numTriangles; ++t) {
+        for (int k = 0; k < 3; ++k) {
+            std::uint32_t a = tri[3 * t + k], b = tri[3 * t + (k + 1) % 3];
+            pushCollapse(a, b);
+            pushCollapse(b, a);
+        }
+    }
+
+    std::size_t liveTriangles = numTriangles;
+    std::vector<std::uint32_t> neighbors;
+    while (liveTriangles > targetTriangles && !heap.empty()) {
+        EdgeCollapse collapse = heap.top();
+        heap.pop();
+        std::uint32_t u = collapse.u, v = collapse.v;
+        if (removedVertex[u] || removedVertex[v] || version[u] != collapse.versionU || version[v] != collapse.versionV) {
+            continue;
+        }
+
+        // Reject collapses that flip a triangle that stays
+        bool flips = false;
+        for (std::uint32_t t : adjacency[u]) {
+            const std::uint32_t *corners = &tri[3 * t];
+            if (removedTriangle[t] || corners[0] == v || corners[1] == v || corners[2] == v) {
+                continue;
+            }
+            glm::vec3 p[3], q[3];
+            for (int k = 0; k < 3; ++k) {
+                p[k] = position[corners[k]];
+                q[k] = corners[k] == u ? position[v] : p[k];
+            }
+            glm::vec3 before = glm::cross(p[1] - p[0], p[2] - p[0]);
+            glm::vec3 after = glm::cross(q[1] - q[0], q[2] - q[0]);
+            if (glm::dot(before, after) <= 0.0f) {
+                flips = true;
+                break;
+            }
+        }
+        if (flips) {
+            continue;
+        }
+
+        // Collapse: triangles on the edge disappear, the others move to v
+        for (std::uint32_t t : adjacency[u]) {
+            if (removedTriangle[t]) {
+                continue;
+            }
+            std::uint32_t *corners = &tri[3 * t];
+            if (corners[0] == v || corners[1] == v || corners[2] == v) {
+                removedTriangle[t] = 1;
+                --liveTriangles;
+                continue;
+            }
+            for (int k = 0; k < 3; ++k) {
+                if (corners[k] == u) {
+                    corners[k] = v;
+                }
+            }
+            adjacency[v].push_back(t);
+        }
+        adjacency[u].clear();
+        removedVertex[u] = 1;
+        quadrics[v] += quadrics[u];
+        ++version[v];
+
+        // Drop removed triangles from v's list and requeue its edges
+        std::vector<std::uint32_t> &around = adjacency[v];
+        around.erase(std::remove_if(around.begin(), around.end(),
+                                    [&](std::uint32_t t) { return removedTriangle[t] != 0; }),
+                     around.end());
+        neighbors.clear();
+        for (std::uint32_t t : around) {
+            for (int k = 0; k < 3; ++k) {
+                if (tri[3 * t + k] != v) {
+                    neighbors.push_back(tri[3 * t + k]);
+                }
+            }
+        }
+        std::sort(neighbors.begin(), neighbors.end());
+        neighbors.erase(std::unique(neighbors.begin(), neighbors.end()), neighbors.end());
+        for (std::uint32_t w : neighbors) {
+            pushCollapse(w, v);
+            pushCollapse(v, w);
+        }
+    }
+
+    for (std::size_t t = 0; t < numTriangles; ++t) {
+        if (!removedTriangle[t]) {
+            for (int k = 0; k < 3; ++k) {
+                output->push_back(globalIds[tri[3 * t + k]]);
+            }
+        }
+    }
+}
+} // namespace
+
+// Simplify an indexed mesh to about targetTriangles triangles (fewer are
+// not produced, but more remain where collapses would flip triangles or
+// touch locked vertices). Meshes with more than minParallelTriangles
+// triangles are split into grid cells that are simplified in parallel;
+// with gridOffset, the grid is shifted by half a cell.
+std::vector<std::uint32_t> simplifyMesh(const glm::vec3 *vertices, std::size_t numVertices,
+                                        const std::vector<std::uint32_t> &indices, std::size_t targetTriangles,
+                                        int numThreads = 0, bool gridOffset = false,
+                                        std::size_t minParallelTriangles = 100000)
+{
+    if (numThreads <= 0) {
+        numThreads = defaultThreadCount();
+    }
+    std::size_t numTriangles = indices.size() / 3;
+    int side = 1;
+    if (numThreads > 1 && numTriangles > minParallelTriangles) {
+        side = std::max(2, int(std::ceil(std::cbrt(8.0 * numThreads))));
+    }
+
+    // Assign triangles to the cells of a grid over the centroid bounds
+    std::vector<glm::vec3> centroids(numTriangles);
+    glm::vec3 lo(0.0f), hi(0.0f);
+    for (std::size_t t = 0; t < numTriangles; ++t) {
+        centroids[t] = (vertices[indices[3 * t]] + vertices[indices[3 * t + 1]] + vertices[indices[3 * t + 2]]) / 3.0f;
+        lo = t == 0 ? centroids[t] : glm::min(lo, centroids[t]);
+        hi = t == 0 ? centroids[t] : glm::max(hi, centroids[t]);
+    }
+    glm::vec3 cellSize = glm::max((hi - lo) / float(side), glm::vec3(1e-20f));
+    glm::vec3 origin = gridOffset ? lo - 0.5f * cellSize : lo;
+    int cellsPerAxis = gridOffset ? side + 1 : side;
+    int numCells = cellsPerAxis * cellsPerAxis * cellsPerAxis;
+    std::vector<std::vector<std::uint32_t> > cells(numCells);
+    std::vector<int> vertexCell(numVertices, -1);
+    std::vector<char> sharedVertex(numVertices, 0);
+    for (std::size_t t = 0; t < numTriangles; ++t) {
+        glm::ivec3 c = glm::clamp(glm::ivec3((centroids[t] - origin) / cellSize), glm::ivec3(0),
+                                  glm::ivec3(cellsPerAxis - 1));
+        int cell = (c.z * cellsPerAxis + c.y) * cellsPerAxis + c.x;
+        for (int k = 0; k < 3; ++k) {
+            std::uint32_t v = indices[3 * t + k];
+            cells[cell].push_back(v);
+            if (vertexCell[v] == -1) {
+                vertexCell[v] = cell;
+            }
+            else if (vertexCell[v] != cell) {
+                sharedVertex[v] = 1;
+            }
+        }
+    }
+
+    // Every cell gets the same share of the reduction
+    double ratio = numTriangles > 0 ? double(targetTriangles) / double(numTriangles) : 1.0;
+    std::vector<std::vector<std::uint32_t> > simplified(numCells);
+    parallelFor(numCells, numThreads, [&](int cell) {
+        if (!cells[cell].empty()) {
+            std::size_t target = std::size_t(std::ceil(ratio * double(cells[cell].size() / 3)));
+            simplifyPartition(vertices, cells[cell], sharedVertex, target, &simplified[cell]);
+        }
+    });
+
+    std::vector<std::uint32_t> result;
+    for (const std::vector<std::uint32_t> &cell : simplified) {
+        result.insert(result.end(), cell.begin(), cell.end());
+    }
+    return result;
+}
+
+// A chain of coarser levels of detail of a mesh, all indexing its vertex
+// buffer. counts[i] is the number of indices of level i + 1; the levels
+// are stored one after another in indices.
+struct MeshLODs {
+    std::vector<std::uint32_t> indices;
+    std::vector<std::uint64_t> counts;
+};
+
+// Build levels with half the triangles of the previous one, until a level
+// would have fewer than minTriangles or simplification stalls (a level
+// keeps more than 80% of the previous one's triangles).
+void buildMeshLODs(const glm::vec3 *vertices, std::size_t numVertices, const std::vector<std::uint32_t> &indices,
+                   MeshLODs *lods, int numThreads = 0, std::size_t minTriangles = 1000, int maxLevels = 8)
+{
+    lods->indices.clear();
+    lods->counts.clear();
+    std::vector<std::uint32_t> previous = indices;
+    for (int level = 1; level <= maxLevels; ++level) {
+        std::size_t previousTriangles = previous.size() / 3;
+        if (previousTriangles / 2 < minTriangles) {
+            break;
+        }
+        std::vector<std::uint32_t> next =
+            simplifyMesh(vertices, numVertices, previous, previousTriangles / 2, numThreads, level % 2 == 0);
+        if (next.size() / 3 > previousTriangles * 4 / 5) {
+            break;
+        }
+        lods->indices.insert(lods->indices.end(), next.begin(), next.end());
+        lods->counts.push_back(next.size());
+        previous.swap(next);
+    }
+}
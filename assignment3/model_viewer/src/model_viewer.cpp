@@ -5,6 +5,23 @@
 
 #include "utils.h"
 #include "utils2.h"
+#include "obj_loader.h"
+#include "mesh_cache.h"
+#include "mesh_optimize.h"
+#include "mesh_clusters.h"
+#include "mesh_simplify.h"
+#include "vertex_packing.h"
+#include "offscreen.h"
+#include "profiler.h"
+#include "program_cache.h"
+#include "shader_watcher.h"
+#include "cubemap_loader.h"
+#include "instancing.h"
+#include "mesh_arena.h"
+#include "mesh_bvh.h"
+#include "soft_raster.h"
+#include "light_clusters.h"
+#include "render_state.h"
 
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
@@ -16,19 +33,63 @@
 #define GLM_FORCE_RADIANS
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/quaternion.hpp>
 
 #include <iostream>
 #include <cstdlib>
 #include <algorithm>
-
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <sstream>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <dirent.h>
+#endif
+
+// Levels of the prefiltered cubemap mip chain, from glossy to diffuse
 #define NUM_CUBEMAP_LEVELS 8
 
+// Binding point of the Shading uniform block
+#define SHADING_BLOCK_BINDING 0
+
+// Near and far planes of the projection
+#define CAMERA_Z_NEAR 0.1f
+#define CAMERA_Z_FAR 100.0f
+
+// The passes of a frame: the mesh, then the skybox, which lies on the far
+// plane and so is only shaded where the mesh does not cover it
+const RenderPass OPAQUE_PASS = { true, true, GL_LESS, GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT };
+const RenderPass SKYBOX_PASS = { true, false, GL_LEQUAL, 0 };
+
+// Buffer textures of the clustered point lights (see light_clusters.h)
+enum LightBuffer {
+	LIGHT_BUFFER_GRID = 0,    // (offset, count) of every cluster's lights, RG32UI
+	LIGHT_BUFFER_INDICES = 1, // the lights of the clusters, R32UI
+	LIGHT_BUFFER_LIGHTS = 2,  // position and radius, color, RGBA32F
+	NUM_LIGHT_BUFFERS
+};
+
 // The attribute locations we will use in the vertex shader
 enum AttributeLocation {
     POSITION = 0,
     NORMAL = 1
 };
 
+// Vertex layouts of a MeshVAO
+enum VertexFormat {
+	VERTEX_FORMAT_FLOAT = 0,    // separate float position and normal VBOs, 24 bytes
+	VERTEX_FORMAT_PACKED = 1,   // interleaved float position and octahedral normal, 16 bytes
+	VERTEX_FORMAT_QUANTIZED = 2 // interleaved 16-bit position and octahedral normal, 12 bytes
+};
+
 enum LensType {
 	ORTOGRAPHIC = 0,
 	PERSPECTIVE = 1
@@ -38,9 +99,19 @@ enum ColorMode {
 	NORMAL_AS_RGB = 0,
 	BLINN_PHONG = 1,
 	REFLECTION = 2,
+	DIFFUSE_IBL = 3,
 	SIZE
 };
 
+// Profiled phases of a frame, in the order they are added to the profiler
+enum ProfileSection {
+	PROFILE_POLL_EVENTS = 0,
+	PROFILE_SKYBOX = 1,
+	PROFILE_MESH = 2,
+	PROFILE_TWEAKBAR = 3,
+	PROFILE_SWAP = 4
+};
+
 struct Camera {
 	glm::vec3 position;
 	glm::quat orientation;
@@ -54,6 +125,8 @@ struct Mesh {
     std::vector<glm::vec3> vertices;
     std::vector<glm::vec3> normals;
     std::vector<uint32_t> indices;
+    std::vector<uint32_t> lodIndices; // coarser levels of detail, if built
+    std::vector<uint64_t> lodCounts;
 };
 
 // Struct for representing a vertex array object (VAO) created from a
@@ -61,10 +134,16 @@ struct Mesh {
 struct MeshVAO {
     GLuint vao;
     GLuint vertexVBO;
-    GLuint normalVBO;
+    GLuint normalVBO; // 0 for interleaved formats
     GLuint indexVBO;
     int numVertices;
     int numIndices;
+    GLenum indexType; // GL_UNSIGNED_INT or GL_UNSIGNED_SHORT
+    VertexFormat vertexFormat;
+    glm::vec3 positionOffset; // dequantization of positions:
+    glm::vec3 positionScale;  // offset + scale * position
+    std::vector<glm::ivec2> lods; // first index and count of every level, LOD 0 first
+    float radius; // of the bounding sphere around the origin, for LOD selection
 };
 
 struct SkyboxVAO {
@@ -75,8 +154,106 @@ struct SkyboxVAO {
 	int numIndices;
 };
 
+// Uniform locations of the mesh program, resolved once after linking
+struct MeshUniforms {
+	GLint u_v;
+	GLint u_mv;
+	GLint u_mvp;
+	GLint u_time;
+	GLint u_position_offset;
+	GLint u_position_scale;
+	GLint u_octahedral_normals;
+	GLint u_cubemap_max_lod;
+	GLint u_irradiance_sh;
+	GLint u_instanced;
+	GLint u_clustered_lights;
+	GLint u_cluster_dims;
+	GLint u_cluster_tile_size;
+	GLint u_cluster_depth;
+};
+
+// Uniform locations of the skybox program
+struct SkyboxUniforms {
+	GLint u_view_transpose;
+	GLint u_fovy;
+	GLint u_aspect;
+};
+
+// Lighting and material state, laid out as the std140 uniform block
+// Shading in mesh.vert and mesh.frag (vec3s are aligned to 16 bytes)
+struct ShadingBlock {
+	glm::vec3 ambient_light; float pad0;
+	glm::vec3 light_position; float pad1;
+	glm::vec3 light_color; float pad2;
+	glm::vec3 diffuse_color; float pad3;
+	glm::vec3 specular_color;
+	float specular_power;
+	float ambient_weight;
+	float diffuse_weight;
+	float specular_weight;
+	GLint color_mode;
+	GLint use_gamma_correction;
+	GLint use_color_inversion;
+	float roughness;
+	GLint pad4;
+};
+static_assert(sizeof(ShadingBlock) == 112, "ShadingBlock must match the std140 layout");
+
+// Struct for command-line options
+struct Options {
+	int num_threads; // threads used for loading, 0 means all cores
+	bool use_mesh_cache; // load/write binary mesh caches next to OBJ files
+	bool use_program_cache; // load/write program binaries next to the shaders
+	NormalWeighting normal_weighting;
+	bool optimize_mesh; // reorder loaded meshes for the vertex cache
+	bool cull_clusters; // cluster loaded meshes and draw only visible clusters
+	bool build_lods; // simplify loaded meshes into levels of detail
+	VertexFormat vertex_format;
+
+	bool headless; // render models and views to PNG files and exit
+	bool software; // render them on the CPU instead, without OpenGL
+	int headless_width, headless_height;
+	std::string output_dir;
+	std::vector<std::string> models;
+	std::vector<glm::vec2> views; // yaw and pitch in degrees
+
+	std::string profile_csv; // per-frame timings are written here if set
+
+	int instances; // draw copies of the mesh on a grid of this size if > 0
+	std::string instance_file; // or at the transforms in this file
+	int instance_bench; // time frames with 1, 10, 100, ... up to this many copies
+
+	int lights; // number of animated point lights around the mesh
+	int light_bench; // time frames with 1, 10, 100, ... up to this many lights
+
+	std::string scene; // directory or list of OBJ files to draw instead of one model
+	bool scene_grid; // lay the scene's parts out on a grid instead of where they are
+
+	Options() : num_threads(0),
+	            use_mesh_cache(true),
+	            use_program_cache(true),
+	            normal_weighting(NORMAL_WEIGHT_AREA),
+	            optimize_mesh(false),
+	            cull_clusters(false),
+	            build_lods(false),
+	            vertex_format(VERTEX_FORMAT_FLOAT),
+	            headless(false),
+	            software(false),
+	            headless_width(800),
+	            headless_height(600),
+	            output_dir("."),
+	            instances(0),
+	            instance_bench(0),
+	            lights(0),
+	            light_bench(0),
+	            scene_grid(false)
+	{}
+};
+
 // Struct for resources and state
 struct Context {
+	Options options;
+
     int width;
     int height;
     float aspect;
@@ -87,20 +264,62 @@ struct Context {
     GLFWwindow *window;
     GLuint program;
 	GLuint skyboxProgram;
+	MeshUniforms meshUniforms;
+	SkyboxUniforms skyboxUniforms;
+	ShaderWatcher shaderWatcher; // rebuilds the programs when the shaders change
+	int meshProgramWatch, skyboxProgramWatch; // indices in shaderWatcher
+
+	GLuint shadingUBO;
+	ShadingBlock shadingBlock; // contents of shadingUBO
+	bool shadingBlockValid;
 
     Trackball trackball;
 	
 	GLuint defaultVAO;
+	GLStateCache glState; // bindings and draw counts of the frame
 
     Mesh mesh;
+    MappedFile meshFile; // mapped mesh cache, if the mesh was loaded from one
+    MeshView meshData; // geometry of the loaded mesh, in mesh or meshFile
     MeshVAO meshVAO;
+    MeshClusters meshClusters; // empty unless culling clusters
+    std::vector<ClusterRange> visibleRanges; // of the last drawn frame
+    std::vector<GLsizei> drawCounts; // visibleRanges for glMultiDrawElements
+    std::vector<const void *> drawOffsets;
+    int numClusters, visibleClusters; // shown in the tweakbar
+    float lodTrianglesPerPixel; // LOD selection: triangles per covered pixel
+    int lodLevel; // level drawn in the last frame, shown in the tweakbar
+    InstanceBuffer instances; // per-instance transforms, if instancing
+    MeshBVH bvh; // of the mesh's triangles, for picking (not built in headless mode)
+    std::unique_ptr<WorkerPool> bvhBuilder; // builds bvh in the background
+    std::atomic<bool> bvhReady; // bvh is built, for the loaded mesh
+    int pickedTriangle; // under the cursor, -1 if none; shown in the tweakbar
+    int pickedInstance; // of the picked triangle, 0 without instancing
+    float pickedDistance; // from the camera to the picked point
+    float pickTime; // of the last pick, in milliseconds
+
+    MeshArena scene; // parts of the scene, if --scene is given
+    std::vector<int> sceneParts; // handles in scene, in the order they were added
+    glm::vec3 sceneOffset; // fits the scene into the unit sphere:
+    float sceneScale;      // offset + scale * position
+    std::vector<GLint> drawBaseVertices; // with drawCounts and drawOffsets
+    int numSceneParts, visibleSceneParts; // shown in the tweakbar
+
+    std::vector<PointLight> lights; // clustered point lights, in model space
+    std::vector<PointLight> frameLights; // lights turned for the current frame
+    LightClusters lightClusters; // lights binned for the current frame
+    GLuint lightBuffers[NUM_LIGHT_BUFFERS];
+    GLuint lightTextures[NUM_LIGHT_BUFFERS];
+    GLint maxTextureBufferTexels; // GL_MAX_TEXTURE_BUFFER_SIZE
+    int numLights; // shown in the tweakbar
+    float lightBinningTime; // of the last frame, in milliseconds
 
 	SkyboxVAO skyboxVAO;
     
+	CubemapLoader cubemapLoader;
 	GLuint cubemap;
-	GLuint cubemap_prefiltered_levels[NUM_CUBEMAP_LEVELS];
-	GLuint cubemap_prefiltered_mipmap;
-	int cubemap_index;
+	GLuint cubemap_prefiltered_mipmap; // one prefiltered level per mip level
+	SH9 irradiance_sh; // of cubemap, zero until it has loaded
 
 	glm::vec3 background_color;
 
@@ -112,6 +331,7 @@ struct Context {
 	glm::vec3 diffuse_color;
 	glm::vec3 specular_color;
 	GLfloat specular_power;
+	float roughness; // selects the prefiltered cubemap level, 0 to 1
 
 	float ambient_weight;
 	float diffuse_weight;
@@ -122,6 +342,8 @@ struct Context {
 	int use_color_inversion;
 	
     float elapsed_time;
+
+	Profiler profiler;
 };
 
 // Returns the value of an environment variable
@@ -172,54 +394,231 @@ std::string cubemapDir(void)
     return rootDir + "/model_viewer/cubemaps/";
 }
 
-void loadMesh(const std::string &filename, Mesh *mesh)
+// Returns a view of the arrays of a mesh
+MeshView meshView(const Mesh &mesh)
+{
+	MeshView view;
+	view.vertices = mesh.vertices.data();
+	view.normals = mesh.normals.data();
+	view.indices = mesh.indices.data();
+	view.numVertices = mesh.vertices.size();
+	view.numIndices = mesh.indices.size();
+	view.lodIndices = mesh.lodIndices.data();
+	view.lodCounts = mesh.lodCounts.data();
+	view.numLodIndices = mesh.lodIndices.size();
+	view.numLods = mesh.lodCounts.size();
+	return view;
+}
+
+// Bits for the options that change the loaded geometry. They are stored
+// in mesh caches so that a cache built with other options is not reused.
+enum MeshProcessingFlag {
+	MESH_ANGLE_WEIGHTED_NORMALS = 1 << 0,
+	MESH_OPTIMIZED = 1 << 1,
+	MESH_CLUSTERED = 1 << 2,
+	MESH_LODS = 1 << 3
+};
+
+std::uint32_t meshProcessingFlags(const Options &options)
+{
+	std::uint32_t flags = 0;
+	if (options.normal_weighting == NORMAL_WEIGHT_ANGLE)
+		flags |= MESH_ANGLE_WEIGHTED_NORMALS;
+	if (options.optimize_mesh)
+		flags |= MESH_OPTIMIZED;
+	if (options.cull_clusters)
+		flags |= MESH_CLUSTERED;
+	if (options.build_lods)
+		flags |= MESH_LODS;
+	return flags;
+}
+
+// Load a mesh from its binary cache if that is up to date, and from the
+// OBJ file otherwise (writing a new cache next to it). Cached geometry is
+// not copied but stays memory-mapped in cacheFile.
+MeshView loadMesh(const std::string &filename, const Options &options, Mesh *mesh, MappedFile *cacheFile)
 {
+	std::string cacheFilename = meshCachePath(filename);
+	std::uint32_t flags = meshProcessingFlags(options);
+	MeshView view;
+	if (options.use_mesh_cache && meshCacheOpen(*cacheFile, cacheFilename, filename, flags, &view)) {
+		std::cout << "Loaded mesh cache " << cacheFilename << std::endl;
+		std::cout << "Number of triangles: " << view.numIndices / 3 << std::endl;
+		return view;
+	}
+
     OBJMesh obj_mesh;
-    objMeshLoad(obj_mesh, filename);
-    mesh->vertices = obj_mesh.vertices;
-    mesh->normals = obj_mesh.normals;
-    mesh->indices = obj_mesh.indices;
+    bool loaded = objMeshLoadMapped(obj_mesh, filename, options.num_threads, options.normal_weighting);
+	if (loaded && options.optimize_mesh) {
+		// Statistics are for a FIFO cache of typical hardware size
+		VertexCacheStats before, after;
+		optimizeMesh(obj_mesh, 16, &before, &after);
+		std::cout << "Vertex cache optimization (FIFO 16): ACMR " << before.acmr << " -> " << after.acmr
+			<< ", ATVR " << before.atvr << " -> " << after.atvr << std::endl;
+	}
+	if (loaded && options.cull_clusters) {
+		// Clusters keep the vertex cache order of their triangles, but
+		// the vertices are renumbered for the new triangle order
+		clusterTriangles(obj_mesh.indices, obj_mesh.vertices, MESH_CLUSTER_SIZE, options.num_threads);
+		if (options.optimize_mesh)
+			optimizeVertexFetch(obj_mesh);
+	}
+	mesh->lodIndices.clear();
+	mesh->lodCounts.clear();
+	if (loaded && options.build_lods) {
+		// The levels index the final vertex order, so this comes last
+		MeshLODs lods;
+		auto start = std::chrono::steady_clock::now();
+		buildMeshLODs(obj_mesh.vertices.data(), obj_mesh.vertices.size(), obj_mesh.indices, &lods, options.num_threads);
+		std::cout << "Built " << lods.counts.size() << " levels of detail in "
+			<< std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << " s" << std::endl;
+		mesh->lodIndices.swap(lods.indices);
+		mesh->lodCounts.swap(lods.counts);
+	}
+    mesh->vertices.swap(obj_mesh.vertices);
+    mesh->normals.swap(obj_mesh.normals);
+    mesh->indices.swap(obj_mesh.indices);
+	view = meshView(*mesh);
+
+	if (loaded && options.use_mesh_cache && !meshCacheWrite(cacheFilename, filename, flags, view)) {
+		std::cerr << "Could not write mesh cache " << cacheFilename << std::endl;
+	}
+	return view;
 }
 
-void createMeshVAO(Context &ctx, const Mesh &mesh, MeshVAO *meshVAO)
+// The mesh arrays may point straight into a memory-mapped mesh cache. In
+// the float vertex format they are uploaded from there without any
+// intermediate copy; the packed formats are converted first.
+void createMeshVAO(Context &ctx, const MeshView &mesh, MeshVAO *meshVAO)
 {
+	// Binding the index buffer below changes the bound VAO, which may still
+	// be the one the last frame drew with (the draws do not unbind)
+	glBindVertexArray(ctx.defaultVAO);
+	glStateInvalidate(&ctx.glState);
+
+	meshVAO->vertexFormat = ctx.options.vertex_format;
+	meshVAO->positionOffset = glm::vec3(0.0f);
+	meshVAO->positionScale = glm::vec3(1.0f);
+	meshVAO->normalVBO = 0;
+
     // Generates and populates a VBO for the vertices
     glGenBuffers(1, &(meshVAO->vertexVBO));
     glBindBuffer(GL_ARRAY_BUFFER, meshVAO->vertexVBO);
-    auto verticesNBytes = mesh.vertices.size() * sizeof(mesh.vertices[0]);
-    glBufferData(GL_ARRAY_BUFFER, verticesNBytes, mesh.vertices.data(), GL_STATIC_DRAW);
-
-    // Generates and populates a VBO for the vertex normals
-    glGenBuffers(1, &(meshVAO->normalVBO));
-    glBindBuffer(GL_ARRAY_BUFFER, meshVAO->normalVBO);
-    auto normalsNBytes = mesh.normals.size() * sizeof(mesh.normals[0]);
-    glBufferData(GL_ARRAY_BUFFER, normalsNBytes, mesh.normals.data(), GL_STATIC_DRAW);
+	std::size_t vertexNBytes = 0;
+	if (meshVAO->vertexFormat == VERTEX_FORMAT_QUANTIZED) {
+		std::vector<QuantizedVertex> quantized;
+		quantizeVertices(mesh, &quantized, &meshVAO->positionOffset, &meshVAO->positionScale, ctx.options.num_threads);
+		vertexNBytes = quantized.size() * sizeof(quantized[0]);
+		glBufferData(GL_ARRAY_BUFFER, vertexNBytes, quantized.data(), GL_STATIC_DRAW);
+	}
+	else if (meshVAO->vertexFormat == VERTEX_FORMAT_PACKED) {
+		std::vector<PackedVertex> packed;
+		packVertices(mesh, &packed, ctx.options.num_threads);
+		vertexNBytes = packed.size() * sizeof(packed[0]);
+		glBufferData(GL_ARRAY_BUFFER, vertexNBytes, packed.data(), GL_STATIC_DRAW);
+	}
+	else {
+		auto verticesNBytes = mesh.numVertices * sizeof(mesh.vertices[0]);
+		glBufferData(GL_ARRAY_BUFFER, verticesNBytes, mesh.vertices, GL_STATIC_DRAW);
+
+		// Generates and populates a VBO for the vertex normals
+		glGenBuffers(1, &(meshVAO->normalVBO));
+		glBindBuffer(GL_ARRAY_BUFFER, meshVAO->normalVBO);
+		auto normalsNBytes = mesh.numVertices * sizeof(mesh.normals[0]);
+		glBufferData(GL_ARRAY_BUFFER, normalsNBytes, mesh.normals, GL_STATIC_DRAW);
+		vertexNBytes = verticesNBytes + normalsNBytes;
+	}
 
-    // Generates and populates a VBO for the element indices
+    // Generates and populates a VBO for the element indices, with 16-bit
+    // indices when the vertex count allows it (and a packed format is used).
+    // The coarser levels of detail follow the full mesh in the same VBO.
     glGenBuffers(1, &(meshVAO->indexVBO));
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, meshVAO->indexVBO);
-    auto indicesNBytes = mesh.indices.size() * sizeof(mesh.indices[0]);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indicesNBytes, mesh.indices.data(), GL_STATIC_DRAW);
+	std::size_t indicesNBytes = 0;
+	std::size_t totalIndices = mesh.numIndices + mesh.numLodIndices;
+	if (meshVAO->vertexFormat != VERTEX_FORMAT_FLOAT && mesh.numVertices <= 65536) {
+		std::vector<std::uint16_t> indices16, lodIndices16;
+		packIndices16(mesh, &indices16);
+		MeshView lodView;
+		lodView.indices = mesh.lodIndices;
+		lodView.numIndices = mesh.numLodIndices;
+		packIndices16(lodView, &lodIndices16);
+		indices16.insert(indices16.end(), lodIndices16.begin(), lodIndices16.end());
+		indicesNBytes = indices16.size() * sizeof(indices16[0]);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, indicesNBytes, indices16.data(), GL_STATIC_DRAW);
+		meshVAO->indexType = GL_UNSIGNED_SHORT;
+	}
+	else {
+		indicesNBytes = totalIndices * sizeof(mesh.indices[0]);
+		std::size_t lod0NBytes = mesh.numIndices * sizeof(mesh.indices[0]);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, indicesNBytes, nullptr, GL_STATIC_DRAW);
+		glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, 0, lod0NBytes, mesh.indices);
+		if (mesh.numLodIndices > 0)
+			glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, lod0NBytes, indicesNBytes - lod0NBytes, mesh.lodIndices);
+		meshVAO->indexType = GL_UNSIGNED_INT;
+	}
+	meshVAO->lods.assign(1, glm::ivec2(0, int(mesh.numIndices)));
+	std::size_t first = mesh.numIndices;
+	for (std::size_t i = 0; i < mesh.numLods; ++i) {
+		meshVAO->lods.push_back(glm::ivec2(int(first), int(mesh.lodCounts[i])));
+		first += std::size_t(mesh.lodCounts[i]);
+	}
+	meshVAO->radius = 0.0f;
+	for (std::size_t i = 0; i < mesh.numVertices; ++i) {
+		meshVAO->radius = std::max(meshVAO->radius, glm::length(mesh.vertices[i]));
+	}
 
     // Creates a vertex array object (VAO) for drawing the mesh
     glGenVertexArrays(1, &(meshVAO->vao));
     glBindVertexArray(meshVAO->vao);
     glBindBuffer(GL_ARRAY_BUFFER, meshVAO->vertexVBO);
     glEnableVertexAttribArray(POSITION);
-    glVertexAttribPointer(POSITION, 3, GL_FLOAT, GL_FALSE, 0, nullptr);
-    glBindBuffer(GL_ARRAY_BUFFER, meshVAO->normalVBO);
     glEnableVertexAttribArray(NORMAL);
-    glVertexAttribPointer(NORMAL, 3, GL_FLOAT, GL_FALSE, 0, nullptr);
+	if (meshVAO->vertexFormat == VERTEX_FORMAT_QUANTIZED) {
+		GLsizei stride = sizeof(QuantizedVertex);
+		glVertexAttribPointer(POSITION, 3, GL_UNSIGNED_SHORT, GL_TRUE, stride, (void *)offsetof(QuantizedVertex, position));
+		glVertexAttribPointer(NORMAL, 2, GL_SHORT, GL_TRUE, stride, (void *)offsetof(QuantizedVertex, normal));
+	}
+	else if (meshVAO->vertexFormat == VERTEX_FORMAT_PACKED) {
+		GLsizei stride = sizeof(PackedVertex);
+		glVertexAttribPointer(POSITION, 3, GL_FLOAT, GL_FALSE, stride, (void *)offsetof(PackedVertex, position));
+		glVertexAttribPointer(NORMAL, 2, GL_SHORT, GL_TRUE, stride, (void *)offsetof(PackedVertex, normal));
+	}
+	else {
+		glVertexAttribPointer(POSITION, 3, GL_FLOAT, GL_FALSE, 0, nullptr);
+		glBindBuffer(GL_ARRAY_BUFFER, meshVAO->normalVBO);
+		glVertexAttribPointer(NORMAL, 3, GL_FLOAT, GL_FALSE, 0, nullptr);
+	}
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, meshVAO->indexVBO);
     glBindVertexArray(ctx.defaultVAO); // unbinds the VAO
 
     // Additional information required by draw calls
-    meshVAO->numVertices = mesh.vertices.size();
-    meshVAO->numIndices = mesh.indices.size();
+    meshVAO->numVertices = mesh.numVertices;
+    meshVAO->numIndices = mesh.numIndices;
+
+	std::cout << "Mesh buffers: " << vertexNBytes / 1024 << " KiB vertices, "
+		<< indicesNBytes / 1024 << " KiB indices";
+	if (meshVAO->lods.size() > 1)
+		std::cout << " (" << meshVAO->lods.size() << " levels of detail)";
+	std::cout << std::endl;
+}
+
+void destroyMeshVAO(MeshVAO *meshVAO)
+{
+	glDeleteVertexArrays(1, &meshVAO->vao);
+	glDeleteBuffers(1, &meshVAO->vertexVBO);
+	if (meshVAO->normalVBO != 0)
+		glDeleteBuffers(1, &meshVAO->normalVBO);
+	glDeleteBuffers(1, &meshVAO->indexVBO);
+	meshVAO->vao = meshVAO->vertexVBO = meshVAO->normalVBO = meshVAO->indexVBO = 0;
 }
 
 void createSkyboxVAO(Context &ctx, SkyboxVAO *skyboxVAO)
 {
+	// As in createMeshVAO, keep the index buffer out of other VAOs
+	glBindVertexArray(ctx.defaultVAO);
+	glStateInvalidate(&ctx.glState);
+
 	// Generates and populates a VBO for the vertices
     glGenBuffers(1, &(skyboxVAO->vertexVBO));
     glBindBuffer(GL_ARRAY_BUFFER, skyboxVAO->vertexVBO);
@@ -264,30 +663,192 @@ void initializeTrackball(Context &ctx)
     ctx.trackball.center = center;
 }
 
-void init(Context &ctx)
+// Set the sampler units and uniform block bindings of a program, which
+// never change
+void setupProgram(GLuint program, const UniformTable &uniforms)
+{
+	if (program == 0)
+		return;
+	glUseProgram(program);
+	glUniform1i(uniformLocation(uniforms, "u_cubemap"), /*GL_TEXTURE0*/ 0);
+	glUniform1i(uniformLocation(uniforms, "u_instances"), /*GL_TEXTURE1*/ 1);
+	glUniform1i(uniformLocation(uniforms, "u_light_grid"), /*GL_TEXTURE2*/ 2);
+	glUniform1i(uniformLocation(uniforms, "u_light_indices"), /*GL_TEXTURE3*/ 3);
+	glUniform1i(uniformLocation(uniforms, "u_lights"), /*GL_TEXTURE4*/ 4);
+	GLuint shadingIndex = glGetUniformBlockIndex(program, "Shading");
+	if (shadingIndex != GL_INVALID_INDEX)
+		glUniformBlockBinding(program, shadingIndex, SHADING_BLOCK_BINDING);
+	glUseProgram(0);
+}
+
+// Returns the program cache file for a program, or "" if caching is off
+std::string programCachePath(const Context &ctx, const std::string &name)
 {
-    ctx.program = loadShaderProgram(shaderDir() + "mesh.vert", shaderDir() + "mesh.frag");
+	return ctx.options.use_program_cache ? shaderDir() + name + ".mvprog" : std::string();
+}
 
-	ctx.skyboxProgram = loadShaderProgram(shaderDir() + "skybox.vert", shaderDir() + "skybox.frag");
+// Make program the mesh program, replacing (and deleting) the current one
+void setMeshProgram(Context &ctx, GLuint program)
+{
+	UniformTable uniforms = reflectUniforms(program);
+	setupProgram(program, uniforms);
+	MeshUniforms &u = ctx.meshUniforms;
+	u.u_v = uniformLocation(uniforms, "u_v");
+	u.u_mv = uniformLocation(uniforms, "u_mv");
+	u.u_mvp = uniformLocation(uniforms, "u_mvp");
+	u.u_time = uniformLocation(uniforms, "u_time");
+	u.u_position_offset = uniformLocation(uniforms, "u_position_offset");
+	u.u_position_scale = uniformLocation(uniforms, "u_position_scale");
+	u.u_octahedral_normals = uniformLocation(uniforms, "u_octahedral_normals");
+	u.u_cubemap_max_lod = uniformLocation(uniforms, "u_cubemap_max_lod");
+	u.u_irradiance_sh = uniformLocation(uniforms, "u_irradiance_sh");
+	u.u_instanced = uniformLocation(uniforms, "u_instanced");
+	u.u_clustered_lights = uniformLocation(uniforms, "u_clustered_lights");
+	u.u_cluster_dims = uniformLocation(uniforms, "u_cluster_dims");
+	u.u_cluster_tile_size = uniformLocation(uniforms, "u_cluster_tile_size");
+	u.u_cluster_depth = uniformLocation(uniforms, "u_cluster_depth");
+	glDeleteProgram(ctx.program);
+	ctx.program = program;
+}
 
-    loadMesh((modelDir() + "gargo.obj"), &ctx.mesh);
-    createMeshVAO(ctx, ctx.mesh, &ctx.meshVAO);
+// Make program the skybox program, replacing (and deleting) the current one
+void setSkyboxProgram(Context &ctx, GLuint program)
+{
+	UniformTable uniforms = reflectUniforms(program);
+	setupProgram(program, uniforms);
+	SkyboxUniforms &u = ctx.skyboxUniforms;
+	u.u_view_transpose = uniformLocation(uniforms, "u_view_transpose");
+	u.u_fovy = uniformLocation(uniforms, "u_fovy");
+	u.u_aspect = uniformLocation(uniforms, "u_aspect");
+	glDeleteProgram(ctx.skyboxProgram);
+	ctx.skyboxProgram = program;
+}
 
-	createSkyboxVAO(ctx, &ctx.skyboxVAO);
+// Build the mesh program; if that fails, the current one is kept
+void loadMeshProgram(Context &ctx)
+{
+	GLuint program = loadShaderProgramCached(shaderDir() + "mesh.vert", shaderDir() + "mesh.frag",
+	                                         programCachePath(ctx, "mesh"));
+	if (program != 0)
+		setMeshProgram(ctx, program);
+}
 
-    // Load cubemap texture(s)
-    // ...
-	const std::string cubemap_path = cubemapDir() + "/Forrest/";
-	ctx.cubemap = loadCubemap(cubemap_path);
-	const std::string levels[] = { "2048", "512", "128", "32", "8", "2", "0.5", "0.125" };
-	for (int i=0; i < NUM_CUBEMAP_LEVELS; i++) {
-		ctx.cubemap_prefiltered_levels[i] = loadCubemap(cubemap_path + "prefiltered/" + levels[i]);
+// Build the skybox program; if that fails, the current one is kept
+void loadSkyboxProgram(Context &ctx)
+{
+	GLuint program = loadShaderProgramCached(shaderDir() + "skybox.vert", shaderDir() + "skybox.frag",
+	                                         programCachePath(ctx, "skybox"));
+	if (program != 0)
+		setSkyboxProgram(ctx, program);
+}
+
+// Start rebuilding the programs in the background when their shaders
+// change on disk (interactive mode only; R still rebuilds them at once)
+void startShaderWatcher(Context &ctx)
+{
+	ctx.meshProgramWatch = shaderWatcherAdd(ctx.shaderWatcher, "mesh.vert", "mesh.frag", programCachePath(ctx, "mesh"));
+	ctx.skyboxProgramWatch = shaderWatcherAdd(ctx.shaderWatcher, "skybox.vert", "skybox.frag",
+	                                          programCachePath(ctx, "skybox"));
+	if (shaderWatcherStart(ctx.shaderWatcher, shaderDir(), ctx.window))
+		std::cout << "Watching " << shaderDir() << " for shader changes" << std::endl;
+}
+
+// Swap in the programs that the shader watcher has rebuilt
+void updateShaders(Context &ctx)
+{
+	for (const RebuiltProgram &rebuilt : shaderWatcherPoll(ctx.shaderWatcher)) {
+		if (rebuilt.index == ctx.meshProgramWatch)
+			setMeshProgram(ctx, rebuilt.program);
+		else if (rebuilt.index == ctx.skyboxProgramWatch)
+			setSkyboxProgram(ctx, rebuilt.program);
+		glStateInvalidate(&ctx.glState); // setupProgram changed the program
 	}
-	//ctx.cubemap_prefiltered_mipmap = loadCubemapMipmap(cubemap_path + "prefiltered/");
-	ctx.cubemap_index = 0;
+}
 
+// Upload the lighting and material state to the Shading uniform block if
+// any of it has changed since the last upload (from the tweakbar or keys)
+void updateShadingBlock(Context &ctx)
+{
+	ShadingBlock block;
+	std::memset(static_cast<void *>(&block), 0, sizeof(block)); // padding must compare equal
+	block.ambient_light = ctx.ambient_light;
+	block.light_position = ctx.light_position;
+	block.light_color = ctx.light_color;
+	block.diffuse_color = ctx.diffuse_color;
+	block.specular_color = ctx.specular_color;
+	block.specular_power = ctx.specular_power;
+	block.ambient_weight = ctx.ambient_weight;
+	block.diffuse_weight = ctx.diffuse_weight;
+	block.specular_weight = ctx.specular_weight;
+	block.color_mode = ctx.color_mode;
+	block.use_gamma_correction = ctx.use_gamma_correction;
+	block.use_color_inversion = ctx.use_color_inversion;
+	block.roughness = ctx.roughness;
+
+	if (ctx.shadingBlockValid && std::memcmp(&block, &ctx.shadingBlock, sizeof(block)) == 0)
+		return;
+	glBindBuffer(GL_UNIFORM_BUFFER, ctx.shadingUBO);
+	glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(block), &block);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	ctx.shadingBlock = block;
+	ctx.shadingBlockValid = true;
+}
+
+// Upload the instance transforms from the options, if any
+void initInstances(Context &ctx)
+{
+	std::vector<glm::mat4> transforms;
+	if (!ctx.options.instance_file.empty()) {
+		if (!instanceLoadFile(ctx.options.instance_file, &transforms))
+			return;
+	}
+	else if (ctx.options.instances > 0) {
+		instanceGrid(ctx.options.instances, &transforms);
+	}
+	if (!transforms.empty() && instanceBufferUpload(&ctx.instances, transforms))
+		std::cout << "Drawing " << transforms.size() << " instances" << std::endl;
+}
+
+// Replace the clustered point lights with count random ones around the
+// mesh (none if count is 0)
+void initLights(Context &ctx, int count)
+{
+	pointLightsRandom(count, pointLightRadius(count), 1, &ctx.lights);
+	ctx.numLights = count;
+	ctx.lightBinningTime = 0.0f;
+}
+
+// Create the buffer textures of the clustered point lights; their buffers
+// are refilled every frame by updateLightClusters
+void createLightBuffers(Context &ctx)
+{
+	const GLenum formats[NUM_LIGHT_BUFFERS] = { GL_RG32UI, GL_R32UI, GL_RGBA32F };
+	ctx.maxTextureBufferTexels = 0;
+	glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &ctx.maxTextureBufferTexels);
+	glGenBuffers(NUM_LIGHT_BUFFERS, ctx.lightBuffers);
+	glGenTextures(NUM_LIGHT_BUFFERS, ctx.lightTextures);
+	for (int i = 0; i < NUM_LIGHT_BUFFERS; i++) {
+		glBindBuffer(GL_TEXTURE_BUFFER, ctx.lightBuffers[i]);
+		glBufferData(GL_TEXTURE_BUFFER, 16, nullptr, GL_STREAM_DRAW);
+		glBindTexture(GL_TEXTURE_BUFFER, ctx.lightTextures[i]);
+		glTexBuffer(GL_TEXTURE_BUFFER, formats[i], ctx.lightBuffers[i]);
+	}
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+	glBindTexture(GL_TEXTURE_BUFFER, 0);
+}
+
+// Set the camera, lighting and material to their defaults
+void initSettings(Context &ctx)
+{
 	ctx.zoom = 1.0f;
 	ctx.lensType = LensType::PERSPECTIVE;
+	ctx.lodTrianglesPerPixel = 0.5f;
+	ctx.lodLevel = 0;
+	ctx.pickedTriangle = -1;
+	ctx.pickedInstance = 0;
+	ctx.pickedDistance = 0.0f;
+	ctx.pickTime = 0.0f;
+	ctx.bvhReady = false;
 
     initializeTrackball(ctx);
 
@@ -301,6 +862,7 @@ void init(Context &ctx)
 	ctx.diffuse_color = glm::vec3(0.1, 1.0, 0.1);
 	ctx.specular_color = glm::vec3(0.04);
 	ctx.specular_power = 60.0f;
+	ctx.roughness = 0.0f;
 
 	ctx.ambient_weight = 1.0f;
 	ctx.diffuse_weight = 1.0f;
@@ -311,6 +873,262 @@ void init(Context &ctx)
 	ctx.use_color_inversion = 0;
 }
 
+// The directories of the prefiltered levels of a cubemap, sharpest first
+std::vector<std::string> prefilteredDirs(const std::string &cubemap_path)
+{
+	const std::string levels[] = { "2048", "512", "128", "32", "8", "2", "0.5", "0.125" };
+	std::vector<std::string> levelDirs;
+	for (int i=0; i < NUM_CUBEMAP_LEVELS; i++) {
+		levelDirs.push_back(cubemap_path + "prefiltered/" + levels[i]);
+	}
+	return levelDirs;
+}
+
+void init(Context &ctx)
+{
+	glStateInvalidate(&ctx.glState); // nothing is cached or counted yet
+	glStateBeginFrame(&ctx.glState);
+	ctx.program = 0;
+	ctx.skyboxProgram = 0;
+	loadMeshProgram(ctx);
+	loadSkyboxProgram(ctx);
+
+	glGenBuffers(1, &ctx.shadingUBO);
+	glBindBuffer(GL_UNIFORM_BUFFER, ctx.shadingUBO);
+	glBufferData(GL_UNIFORM_BUFFER, sizeof(ShadingBlock), nullptr, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	glBindBufferBase(GL_UNIFORM_BUFFER, SHADING_BLOCK_BINDING, ctx.shadingUBO);
+	ctx.shadingBlockValid = false;
+
+	createSkyboxVAO(ctx, &ctx.skyboxVAO);
+	initInstances(ctx);
+	createLightBuffers(ctx);
+	initLights(ctx, ctx.options.lights);
+
+    // Load cubemap texture(s) in the background; the skybox is added
+    // first so that it appears first
+	const std::string cubemap_path = cubemapDir() + "/Forrest/";
+	cubemapLoaderInit(ctx.cubemapLoader, ctx.options.num_threads);
+	// BC1-compressed KTX files (written by cubemap_compress) are uploaded
+	// directly; the PNG images are used where they have not been generated
+	ctx.irradiance_sh = SH9();
+	ctx.cubemap = loadCubemapKTX(cubemap_path + "cubemap.ktx", &ctx.irradiance_sh);
+	if (ctx.cubemap == 0)
+		ctx.cubemap = cubemapLoaderAdd(ctx.cubemapLoader, cubemap_path, true, true);
+	ctx.cubemap_prefiltered_mipmap = loadCubemapKTX(cubemap_path + "prefiltered.ktx");
+	if (ctx.cubemap_prefiltered_mipmap == 0) {
+		ctx.cubemap_prefiltered_mipmap = cubemapLoaderAddMipmapped(ctx.cubemapLoader, prefilteredDirs(cubemap_path));
+	}
+
+	initSettings(ctx);
+	glStateInvalidate(&ctx.glState); // program setup and texture uploads bypassed the cache
+}
+
+// Build the picking BVH of the loaded mesh on a background thread, so
+// that loading does not wait for it (see waitForBVH)
+void startBVHBuild(Context &ctx)
+{
+	if (!ctx.bvhBuilder)
+		ctx.bvhBuilder.reset(new WorkerPool(1));
+	ctx.bvhReady = false;
+	ctx.bvhBuilder->submit([&ctx]() {
+		auto start = std::chrono::steady_clock::now();
+		bvhBuild(&ctx.bvh, ctx.meshData, ctx.options.num_threads);
+		std::ostringstream message;
+		message << "Built picking BVH (" << ctx.bvh.nodes.size() << " nodes) in "
+		        << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << " s"
+		        << std::endl;
+		std::cout << message.str();
+		ctx.bvhReady = true;
+	});
+}
+
+// Returns true if the picking BVH is built, waiting for a build in the
+// background if wait is set (and returning false at once if not)
+bool waitForBVH(Context &ctx, bool wait)
+{
+	if (!ctx.bvhReady && wait && ctx.bvhBuilder)
+		ctx.bvhBuilder->wait();
+	return ctx.bvhReady;
+}
+
+// Load a model and create the VAO that drawMesh uses
+void loadModel(Context &ctx, const std::string &filename)
+{
+    ctx.meshData = loadMesh(filename, ctx.options, &ctx.mesh, &ctx.meshFile);
+    createMeshVAO(ctx, ctx.meshData, &ctx.meshVAO);
+    if (ctx.options.cull_clusters) {
+        meshClustersBuild(ctx.meshData.vertices, ctx.meshData.indices, ctx.meshData.numIndices, &ctx.meshClusters,
+                          MESH_CLUSTER_SIZE, ctx.options.num_threads);
+        ctx.numClusters = ctx.visibleClusters = int(ctx.meshClusters.levels.empty() ? 0 : ctx.meshClusters.levels[0].size());
+    }
+    if (!ctx.options.headless && ctx.options.instance_bench == 0 && ctx.options.light_bench == 0)
+        startBVHBuild(ctx);
+    ctx.trackball.translation = glm::vec3(0.0f);
+}
+
+void unloadModel(Context &ctx)
+{
+	glBindVertexArray(ctx.defaultVAO); // rather than the deleted VAO's binding falling back to 0
+	glStateInvalidate(&ctx.glState);
+	destroyMeshVAO(&ctx.meshVAO);
+	ctx.meshClusters = MeshClusters();
+	waitForBVH(ctx, true); // the build reads the mesh
+	ctx.bvhReady = false;
+	ctx.bvh = MeshBVH();
+	ctx.pickedTriangle = -1;
+	mappedFileClose(ctx.meshFile);
+	ctx.mesh = Mesh();
+	ctx.meshData = meshView(ctx.mesh);
+}
+
+// Get the OBJ files of a scene: the .obj files in a directory (sorted by
+// name), or the lines of a list file, relative to the list's directory.
+// Empty lines and lines starting with # are skipped.
+bool listSceneFiles(const std::string &path, std::vector<std::string> *files)
+{
+	files->clear();
+	auto isOBJ = [](const std::string &name) {
+		return name.size() > 4 && name.compare(name.size() - 4, 4, ".obj") == 0;
+	};
+	bool isDirectory = false;
+#ifdef _WIN32
+	_finddata_t entry;
+	intptr_t handle = _findfirst((path + "/*").c_str(), &entry);
+	if (handle != -1) {
+		isDirectory = true;
+		do {
+			if (!(entry.attrib & _A_SUBDIR) && isOBJ(entry.name))
+				files->push_back(path + "/" + entry.name);
+		} while (_findnext(handle, &entry) == 0);
+		_findclose(handle);
+	}
+#else
+	if (DIR *dir = opendir(path.c_str())) {
+		isDirectory = true;
+		while (dirent *entry = readdir(dir)) {
+			if (isOBJ(entry->d_name))
+				files->push_back(path + "/" + entry->d_name);
+		}
+		closedir(dir);
+	}
+#endif
+	if (isDirectory) {
+		std::sort(files->begin(), files->end());
+		return true;
+	}
+
+	std::ifstream list(path);
+	if (!list) {
+		std::cerr << "Error: could not read scene " << path << std::endl;
+		return false;
+	}
+	std::string::size_type slash = path.find_last_of("/\\");
+	std::string listDir = slash == std::string::npos ? std::string() : path.substr(0, slash + 1);
+	std::string line;
+	while (std::getline(list, line)) {
+		line.erase(line.find_last_not_of(" \t\r") + 1);
+		if (line.empty() || line[0] == '#')
+			continue;
+		bool absolute = line[0] == '/' || line[0] == '\\' || (line.size() > 1 && line[1] == ':');
+		files->push_back(absolute ? line : listDir + line);
+	}
+	return true;
+}
+
+// Fit the live parts of the scene into the unit sphere
+void updateSceneBounds(Context &ctx)
+{
+	glm::vec3 lo(0.0f), hi(0.0f);
+	bool first = true;
+	for (const ArenaMesh &part : ctx.scene.meshes) {
+		if (!part.live)
+			continue;
+		lo = first ? part.boundsMin : glm::min(lo, part.boundsMin);
+		hi = first ? part.boundsMax : glm::max(hi, part.boundsMax);
+		first = false;
+	}
+	float radius = 0.5f * glm::length(hi - lo);
+	ctx.sceneScale = radius > 0.0f ? 1.0f / radius : 1.0f;
+	ctx.sceneOffset = -0.5f * (lo + hi) * ctx.sceneScale;
+	ctx.numSceneParts = ctx.visibleSceneParts = int(ctx.sceneParts.size());
+}
+
+void printSceneArena(const Context &ctx)
+{
+	const MeshArena &arena = ctx.scene;
+	std::cout << "Scene: " << ctx.sceneParts.size() << " parts, vertices "
+		<< arena.vertices.used * sizeof(PackedVertex) / 1024 << " of "
+		<< arena.vertices.capacity * sizeof(PackedVertex) / 1024 << " KiB, indices "
+		<< arena.indices.used * sizeof(std::uint32_t) / 1024 << " of "
+		<< arena.indices.capacity * sizeof(std::uint32_t) / 1024 << " KiB, "
+		<< arena.numRepacks << " compactions" << std::endl;
+}
+
+// Load an OBJ file into the scene arena. If cell is given, the part is
+// scaled and moved from its bounds into that cell of the grid.
+bool addScenePart(Context &ctx, const std::string &filename, const glm::mat4 *cell = nullptr)
+{
+	// Clusters and levels of detail are not used for scene parts
+	Options options = ctx.options;
+	options.cull_clusters = false;
+	options.build_lods = false;
+	Mesh mesh;
+	MappedFile cacheFile;
+	MeshView view = loadMesh(filename, options, &mesh, &cacheFile);
+	std::vector<glm::vec3> moved;
+	if (cell != nullptr && view.numVertices > 0) {
+		glm::vec3 lo, hi;
+		meshBounds(view, &lo, &hi);
+		float radius = 0.5f * glm::length(hi - lo);
+		glm::mat4 fit = glm::scale(*cell, glm::vec3(radius > 0.0f ? 1.0f / radius : 1.0f));
+		fit = glm::translate(fit, -0.5f * (lo + hi));
+		moved.resize(view.numVertices);
+		for (std::size_t i = 0; i < view.numVertices; i++)
+			moved[i] = glm::vec3(fit * glm::vec4(view.vertices[i], 1.0f));
+		view.vertices = moved.data();
+	}
+	int handle = meshArenaAdd(&ctx.scene, view, ctx.options.num_threads);
+	mappedFileClose(cacheFile);
+	if (handle < 0) {
+		std::cerr << "Skipped " << filename << ": no triangles" << std::endl;
+		return false;
+	}
+	ctx.sceneParts.push_back(handle);
+	return true;
+}
+
+// Load every part of --scene into one vertex and one index arena
+void loadScene(Context &ctx)
+{
+	std::vector<std::string> files;
+	if (!listSceneFiles(ctx.options.scene, &files))
+		std::exit(EXIT_FAILURE);
+	std::vector<glm::mat4> cells;
+	if (ctx.options.scene_grid)
+		instanceGrid(int(files.size()), &cells);
+	// Start small; the arena grows as parts are added
+	meshArenaCreate(&ctx.scene, 1 << 16, 1 << 18, POSITION, NORMAL);
+	auto start = std::chrono::steady_clock::now();
+	for (std::size_t i = 0; i < files.size(); i++)
+		addScenePart(ctx, files[i], cells.empty() ? nullptr : &cells[i]);
+	std::cout << "Loaded " << ctx.sceneParts.size() << " scene parts in "
+		<< std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << " s" << std::endl;
+	updateSceneBounds(ctx);
+	printSceneArena(ctx);
+}
+
+// Remove the most recently added part of the scene
+void removeLastScenePart(Context &ctx)
+{
+	if (ctx.sceneParts.empty())
+		return;
+	meshArenaRemove(&ctx.scene, ctx.sceneParts.back());
+	ctx.sceneParts.pop_back();
+	updateSceneBounds(ctx);
+	printSceneArena(ctx);
+}
+
 void getViewMatrix(glm::mat4 *dst)
 {
 	*dst = glm::lookAt(glm::vec3(0, 0, 2), glm::vec3(), glm::vec3(0, 1, 0));
@@ -324,6 +1142,20 @@ float getFovy(Context &ctx)
 	return 0;
 }
 
+void getProjectionMatrix(Context &ctx, glm::mat4 *dst)
+{
+	float zNear = CAMERA_Z_NEAR;
+	float zFar = CAMERA_Z_FAR;
+	if (ctx.lensType == LensType::PERSPECTIVE) {
+		float fovy = getFovy(ctx);
+		*dst = glm::perspective(fovy, ctx.aspect, zNear, zFar);
+	}
+	else {
+		float hh = 2.0f / pow(2.0f, ctx.zoom);
+		*dst = glm::ortho(-hh * ctx.aspect, hh * ctx.aspect, -hh, hh, zNear, zFar);
+	}
+}
+
 void drawSkybox(Context &ctx)
 {
 	glm::mat4 view;
@@ -334,113 +1166,577 @@ void drawSkybox(Context &ctx)
 	float aspect = ctx.aspect;
 
     // Activate program
-	glUseProgram(ctx.skyboxProgram);
+	glStateUseProgram(&ctx.glState, ctx.skyboxProgram);
 
     // Bind textures
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_CUBE_MAP, ctx.cubemap);
-	glUniform1i(glGetUniformLocation(ctx.skyboxProgram, "u_cubemap"), /*GL_TEXTURE0*/ 0);
+	glStateBindTexture(&ctx.glState, 0, GL_TEXTURE_CUBE_MAP, ctx.cubemap);
 
-	glUniformMatrix4fv(glGetUniformLocation(ctx.skyboxProgram, "u_view_transpose"), 1, GL_FALSE, &view_transpose[0][0]);
-	glUniform1f(glGetUniformLocation(ctx.skyboxProgram, "u_fovy"), fovy);
-	glUniform1f(glGetUniformLocation(ctx.skyboxProgram, "u_aspect"), aspect);
+	const SkyboxUniforms &u = ctx.skyboxUniforms;
+	glUniformMatrix4fv(u.u_view_transpose, 1, GL_FALSE, &view_transpose[0][0]);
+	glUniform1f(u.u_fovy, fovy);
+	glUniform1f(u.u_aspect, aspect);
 
 	// Draw!
-	glBindVertexArray(ctx.skyboxVAO.vao);
+	glStateBindVertexArray(&ctx.glState, ctx.skyboxVAO.vao);
 	glDrawElements(GL_TRIANGLES, ctx.skyboxVAO.numIndices, GL_UNSIGNED_BYTE, 0);
-    glBindVertexArray(ctx.defaultVAO);
+	glStateCountDraws(&ctx.glState);
+}
+
+// Returns the radius in pixels of the bounding sphere of a mesh on screen
+float getMeshScreenRadius(Context &ctx, const MeshVAO &meshVAO)
+{
+	const float distance = 2.0f; // of the camera from the origin, see getViewMatrix
+	float halfHeight = 0.5f * float(ctx.height);
+	if (ctx.lensType == LensType::PERSPECTIVE) {
+		if (meshVAO.radius >= distance)
+			return halfHeight * 1e6f; // the camera is inside the bounding sphere
+		return meshVAO.radius / (distance * std::tan(0.5f * getFovy(ctx))) * halfHeight;
+	}
+	float hh = 2.0f / pow(2.0f, ctx.zoom);
+	return meshVAO.radius / hh * halfHeight;
+}
+
+// Select the level of detail of a mesh from its size on screen: the
+// finest level with at most ctx.lodTrianglesPerPixel triangles per pixel
+// covered by its bounding sphere, or the coarsest level if none has
+int selectMeshLOD(Context &ctx, const MeshVAO &meshVAO)
+{
+	float radius = getMeshScreenRadius(ctx, meshVAO);
+	double pixels = std::min(3.14159265 * double(radius) * double(radius), double(ctx.width) * double(ctx.height));
+	double maxTriangles = double(ctx.lodTrianglesPerPixel) * pixels;
+	int numLevels = int(meshVAO.lods.size());
+	for (int level = 0; level < numLevels; ++level) {
+		if (meshVAO.lods[level].y / 3 <= maxTriangles)
+			return level;
+	}
+	return numLevels - 1;
+}
+
+// Draw the parts of the scene that are in the view frustum with one
+// glMultiDrawElementsBaseVertex from the arena's VAO (or, for instances,
+// one instanced draw per part). The mesh program and its uniforms must
+// be set up already.
+void drawScene(Context &ctx, const glm::mat4 &mvp, bool instanced)
+{
+	Frustum frustum = frustumFromMatrix(mvp);
+	ctx.drawCounts.clear();
+	ctx.drawOffsets.clear();
+	ctx.drawBaseVertices.clear();
+	for (int handle : ctx.sceneParts) {
+		const ArenaMesh &part = ctx.scene.meshes[handle];
+		ClusterBounds bounds = {
+			ctx.sceneOffset + ctx.sceneScale * part.boundsMin,
+			ctx.sceneOffset + ctx.sceneScale * part.boundsMax
+		};
+		if (!instanced && frustumTestBox(frustum, bounds) == FRUSTUM_OUTSIDE)
+			continue;
+		ctx.drawCounts.push_back(GLsizei(part.numIndices));
+		ctx.drawOffsets.push_back(reinterpret_cast<const void *>(part.firstIndex * sizeof(std::uint32_t)));
+		ctx.drawBaseVertices.push_back(GLint(part.firstVertex));
+	}
+	ctx.visibleSceneParts = int(ctx.drawCounts.size());
+
+	glStateBindVertexArray(&ctx.glState, ctx.scene.vao);
+	if (instanced) {
+		for (std::size_t i = 0; i < ctx.drawCounts.size(); i++)
+			glDrawElementsInstancedBaseVertex(GL_TRIANGLES, ctx.drawCounts[i], GL_UNSIGNED_INT, ctx.drawOffsets[i],
+			                                  ctx.instances.count, ctx.drawBaseVertices[i]);
+		glStateCountDraws(&ctx.glState, int(ctx.drawCounts.size()));
+	}
+	else if (!ctx.drawCounts.empty()) {
+		glMultiDrawElementsBaseVertex(GL_TRIANGLES, ctx.drawCounts.data(), GL_UNSIGNED_INT,
+		                              const_cast<GLvoid **>(ctx.drawOffsets.data()), GLsizei(ctx.drawCounts.size()),
+		                              ctx.drawBaseVertices.data());
+		glStateCountDraws(&ctx.glState);
+	}
+}
+
+// Turn the point lights for the current time, bin them into the clusters
+// of the view frustum on the CPU, upload the lists and set the uniforms
+// of the mesh program for the clustered lights (or turn them off)
+void updateLightClusters(Context &ctx, const glm::mat4 &mv, const glm::mat4 &projection)
+{
+	const MeshUniforms &u = ctx.meshUniforms;
+	glUniform1i(u.u_clustered_lights, !ctx.lights.empty());
+	if (ctx.lights.empty())
+		return;
+
+	auto start = std::chrono::steady_clock::now();
+	pointLightsOrbit(ctx.lights, 0.3f * ctx.elapsed_time, &ctx.frameLights);
+	LightClusters &clusters = ctx.lightClusters;
+	lightClustersBuild(&clusters, ctx.frameLights, mv, projection, CAMERA_Z_NEAR, CAMERA_Z_FAR,
+	                   ctx.options.num_threads);
+	ctx.lightBinningTime = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+	std::size_t maxTexels = std::size_t(ctx.maxTextureBufferTexels);
+	if (clusters.indices.size() > maxTexels || clusters.lightData.size() > maxTexels) {
+		glUniform1i(u.u_clustered_lights, 0);
+		return;
+	}
+	const std::size_t sizes[NUM_LIGHT_BUFFERS] = {
+		clusters.grid.size() * sizeof(glm::uvec2),
+		clusters.indices.size() * sizeof(std::uint32_t),
+		clusters.lightData.size() * sizeof(glm::vec4)
+	};
+	const void *data[NUM_LIGHT_BUFFERS] = { clusters.grid.data(), clusters.indices.data(), clusters.lightData.data() };
+	for (int i = 0; i < NUM_LIGHT_BUFFERS; i++) {
+		glBindBuffer(GL_TEXTURE_BUFFER, ctx.lightBuffers[i]);
+		glBufferData(GL_TEXTURE_BUFFER, std::max<std::size_t>(sizes[i], 16), nullptr, GL_STREAM_DRAW); // orphan
+		glBufferSubData(GL_TEXTURE_BUFFER, 0, sizes[i], data[i]);
+		glStateBindTexture(&ctx.glState, 2 + i, GL_TEXTURE_BUFFER, ctx.lightTextures[i]);
+	}
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+	glm::vec2 tileSize(float(ctx.width) / LIGHT_CLUSTERS_X, float(ctx.height) / LIGHT_CLUSTERS_Y);
+	glUniform3i(u.u_cluster_dims, LIGHT_CLUSTERS_X, LIGHT_CLUSTERS_Y, LIGHT_CLUSTERS_Z);
+	glUniform2fv(u.u_cluster_tile_size, 1, &tileSize[0]);
+	glUniform2f(u.u_cluster_depth, clusters.depthScale, clusters.depthBias);
 }
 
 // MODIFY THIS FUNCTION
 void drawMesh(Context &ctx, GLuint program, const MeshVAO &meshVAO)
 {
     // Define uniforms
-    glm::mat4 model = trackballGetRotationMatrix(ctx.trackball);
+    glm::mat4 model = trackballGetMatrix(ctx.trackball);
 
 	glm::mat4 view;
 	getViewMatrix(&view);
-	
-	float zNear = 0.1f;
-	float zFar = 100.f;
 	glm::mat4 projection;
-	if (ctx.lensType == LensType::PERSPECTIVE) {
-		float fovy = getFovy(ctx);
-		projection = glm::perspective(fovy, ctx.aspect, zNear, zFar);
-	}
-	else {
-		float hh = 2.0f / pow(2.0f, ctx.zoom);
-		projection = glm::ortho(-hh * ctx.aspect, hh * ctx.aspect, -hh, hh, zNear, zFar);
-	}
+	getProjectionMatrix(ctx, &projection);
 
     glm::mat4 mv = view * model;
     glm::mat4 mvp = projection * mv;
 
     // Activate program
-    glUseProgram(program);
+    glStateUseProgram(&ctx.glState, program);
 
     // Bind textures
     // ...
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_CUBE_MAP, ctx.cubemap_prefiltered_levels[ctx.cubemap_index]);
-	//glBindTexture(GL_TEXTURE_CUBE_MAP, ctx.cubemap_prefiltered_mipmap);
-	glUniform1i(glGetUniformLocation(program, "u_cubemap"), /*GL_TEXTURE0*/ 0);
-	//glUniform1f(glGetUniformLocation(program, "u_cubemap_lod"), (float)ctx.cubemap_index);
-	//glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
-
-
-    // Pass uniforms
-	glUniformMatrix4fv(glGetUniformLocation(program, "u_v"), 1, GL_FALSE, &view[0][0]);
-    glUniformMatrix4fv(glGetUniformLocation(program, "u_mv"), 1, GL_FALSE, &mv[0][0]);
-    glUniformMatrix4fv(glGetUniformLocation(program, "u_mvp"), 1, GL_FALSE, &mvp[0][0]);
-    glUniform1f(glGetUniformLocation(program, "u_time"), ctx.elapsed_time);
-    // ...
-	glUniform3fv(glGetUniformLocation(program, "u_ambient_light"), 1, &ctx.ambient_light[0]);
-
-	glUniform3fv(glGetUniformLocation(program, "u_light_position"), 1, &ctx.light_position[0]);
-	glUniform3fv(glGetUniformLocation(program, "u_light_color"), 1, &ctx.light_color[0]);
-	
-	glUniform3fv(glGetUniformLocation(program, "u_diffuse_color"), 1, &ctx.diffuse_color[0]);
-	glUniform3fv(glGetUniformLocation(program, "u_specular_color"), 1, &ctx.specular_color[0]);
-	glUniform1f(glGetUniformLocation(program, "u_specular_power"), ctx.specular_power);
-
-	glUniform1f(glGetUniformLocation(program, "u_ambient_weight"), ctx.ambient_weight);
-	glUniform1f(glGetUniformLocation(program, "u_diffuse_weight"), ctx.diffuse_weight);
-	glUniform1f(glGetUniformLocation(program, "u_specular_weight"), ctx.specular_weight);
-
-	glUniform1i(glGetUniformLocation(program, "u_color_mode"), ctx.color_mode);
-	glUniform1i(glGetUniformLocation(program, "u_use_gamma_correction"), ctx.use_gamma_correction);
-	glUniform1i(glGetUniformLocation(program, "u_use_color_inversion"), ctx.use_color_inversion);
+	glStateBindTexture(&ctx.glState, 0, GL_TEXTURE_CUBE_MAP, ctx.cubemap_prefiltered_mipmap);
+
+    // Pass uniforms; lighting and material are in the Shading block
+	updateShadingBlock(ctx);
+	const MeshUniforms &u = ctx.meshUniforms;
+	glUniformMatrix4fv(u.u_v, 1, GL_FALSE, &view[0][0]);
+    glUniformMatrix4fv(u.u_mv, 1, GL_FALSE, &mv[0][0]);
+    glUniformMatrix4fv(u.u_mvp, 1, GL_FALSE, &mvp[0][0]);
+    glUniform1f(u.u_time, ctx.elapsed_time);
+
+	bool sceneMode = ctx.scene.vao != 0;
+	if (sceneMode) {
+		glm::vec3 scale(ctx.sceneScale);
+		glUniform3fv(u.u_position_offset, 1, &ctx.sceneOffset[0]);
+		glUniform3fv(u.u_position_scale, 1, &scale[0]);
+		glUniform1i(u.u_octahedral_normals, 1);
+	}
+	else {
+		glUniform3fv(u.u_position_offset, 1, &meshVAO.positionOffset[0]);
+		glUniform3fv(u.u_position_scale, 1, &meshVAO.positionScale[0]);
+		glUniform1i(u.u_octahedral_normals, meshVAO.vertexFormat != VERTEX_FORMAT_FLOAT);
+	}
+	glUniform1f(u.u_cubemap_max_lod, float(NUM_CUBEMAP_LEVELS - 1));
+	cubemapLoaderIrradiance(ctx.cubemapLoader, ctx.cubemap, &ctx.irradiance_sh);
+	glUniform3fv(u.u_irradiance_sh, 9, &ctx.irradiance_sh.c[0][0]);
+	bool instanced = ctx.instances.count > 0;
+	glUniform1i(u.u_instanced, instanced);
+	if (instanced)
+		glStateBindTexture(&ctx.glState, 1, GL_TEXTURE_BUFFER, ctx.instances.texture);
+	updateLightClusters(ctx, mv, projection);
+
+	if (sceneMode) {
+		drawScene(ctx, mvp, instanced);
+		return;
+	}
 
-    // Draw!
-    glBindVertexArray(meshVAO.vao);
-    glDrawElements(GL_TRIANGLES, meshVAO.numIndices, GL_UNSIGNED_INT, 0);
-    glBindVertexArray(ctx.defaultVAO);
+    // Draw! With clusters, only the ranges of the index buffer that are
+    // in the view frustum (instances are not culled). Clusters belong to
+    // the full mesh; coarser levels of detail are drawn whole.
+	ctx.lodLevel = meshVAO.lods.size() > 1 ? selectMeshLOD(ctx, meshVAO) : 0;
+	std::size_t indexSize = meshVAO.indexType == GL_UNSIGNED_SHORT ? 2 : 4;
+	GLsizei lodCount = meshVAO.lods.empty() ? meshVAO.numIndices : meshVAO.lods[ctx.lodLevel].y;
+	const void *lodOffset = reinterpret_cast<const void *>(
+		meshVAO.lods.empty() ? 0 : meshVAO.lods[ctx.lodLevel].x * indexSize);
+	glStateBindVertexArray(&ctx.glState, meshVAO.vao);
+	if (instanced) {
+		glDrawElementsInstanced(GL_TRIANGLES, lodCount, meshVAO.indexType, lodOffset, ctx.instances.count);
+		glStateCountDraws(&ctx.glState);
+	}
+	else if (!ctx.meshClusters.levels.empty() && ctx.lodLevel == 0) {
+		ClusterCullStats stats;
+		meshClustersCull(ctx.meshClusters, frustumFromMatrix(mvp), &ctx.visibleRanges, &stats);
+		ctx.visibleClusters = int(stats.numVisible);
+		ctx.drawCounts.clear();
+		ctx.drawOffsets.clear();
+		for (const ClusterRange &range : ctx.visibleRanges) {
+			ctx.drawCounts.push_back(GLsizei(3 * range.count));
+			ctx.drawOffsets.push_back(reinterpret_cast<const void *>(3 * range.first * indexSize));
+		}
+		if (!ctx.drawCounts.empty()) {
+			glMultiDrawElements(GL_TRIANGLES, ctx.drawCounts.data(), meshVAO.indexType, ctx.drawOffsets.data(),
+			                    GLsizei(ctx.drawCounts.size()));
+			glStateCountDraws(&ctx.glState);
+		}
+	}
+	else {
+		glDrawElements(GL_TRIANGLES, lodCount, meshVAO.indexType, lodOffset);
+		glStateCountDraws(&ctx.glState);
+	}
 }
 
 void display(Context &ctx)
 {
+	glStateBeginFrame(&ctx.glState);
     glClearColor(ctx.background_color[0], ctx.background_color[1], ctx.background_color[2], 1.0);
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-	glDisable(GL_DEPTH_TEST);
-	glDepthMask(GL_FALSE);
+	renderPassBegin(&ctx.glState, OPAQUE_PASS); // the depth test ensures that polygons overlap correctly
+	profilerBegin(ctx.profiler, PROFILE_MESH);
+    drawMesh(ctx, ctx.program, ctx.meshVAO);
+	profilerEnd(ctx.profiler, PROFILE_MESH);
+
+	// Last, so that early depth testing rejects what the mesh covers
+	renderPassBegin(&ctx.glState, SKYBOX_PASS);
+	profilerBegin(ctx.profiler, PROFILE_SKYBOX);
 	drawSkybox(ctx);
-	glDepthMask(GL_TRUE);
+	profilerEnd(ctx.profiler, PROFILE_SKYBOX);
+}
 
-    glEnable(GL_DEPTH_TEST); // ensures that polygons overlap correctly
-    drawMesh(ctx, ctx.program, ctx.meshVAO);
+// Returns the file name of a path without directories and extension
+std::string fileStem(const std::string &path)
+{
+	std::string::size_type slash = path.find_last_of("/\\");
+	std::string name = slash == std::string::npos ? path : path.substr(slash + 1);
+	return name.substr(0, name.find_last_of('.'));
+}
+
+// Returns the path of a model given on the command line; names without a
+// directory are looked up in the model directory
+std::string modelPath(const std::string &model)
+{
+	bool hasDir = model.find_first_of("/\\") != std::string::npos;
+	return hasDir ? model : modelDir() + model;
+}
+
+// Render every view of every model from the options into an offscreen
+// framebuffer and write them as <output_dir>/<model>_<view>.png. PNG
+// encoding runs on worker threads and overlaps with rendering.
+int renderHeadless(Context &ctx)
+{
+	const Options &options = ctx.options;
+	std::vector<std::string> models = options.models;
+	if (models.empty())
+		models.push_back("gargo.obj");
+	std::vector<glm::vec2> views = options.views;
+	if (views.empty())
+		views.push_back(glm::vec2(0.0f));
+
+	cubemapLoaderFinish(ctx.cubemapLoader);
+	glStateInvalidate(&ctx.glState); // the uploads bound textures
+
+	Framebuffer framebuffer;
+	if (!framebufferCreate(&framebuffer, ctx.width, ctx.height))
+		return EXIT_FAILURE;
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer.fbo);
+	glViewport(0, 0, ctx.width, ctx.height);
+
+	// A few queued frames keep the encoders busy without holding every
+	// frame in memory
+	int numEncoders = options.num_threads > 0 ? options.num_threads : defaultThreadCount();
+	WorkerPool encoder(numEncoders, 2 * numEncoders);
+	FrameCapture capture;
+	frameCaptureCreate(&capture, ctx.width, ctx.height, &encoder);
+
+	for (const std::string &model : models) {
+		loadModel(ctx, modelPath(model));
+		for (std::size_t i = 0; i < views.size(); i++) {
+			glm::quat pitch = glm::angleAxis(glm::radians(views[i].y), glm::vec3(1.0f, 0.0f, 0.0f));
+			glm::quat yaw = glm::angleAxis(glm::radians(views[i].x), glm::vec3(0.0f, 1.0f, 0.0f));
+			ctx.trackball.qCurrent = pitch * yaw;
+			display(ctx);
+
+			std::string filename = options.output_dir + "/" + fileStem(model) + "_" + std::to_string(i) + ".png";
+			frameCaptureRead(capture, filename);
+			std::cout << "Rendered " << filename << std::endl;
+		}
+		unloadModel(ctx);
+	}
+	frameCaptureFinish(capture);
+
+	frameCaptureDestroy(&capture);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	framebufferDestroy(&framebuffer);
+	return EXIT_SUCCESS;
+}
+
+// The state that display() passes to the shaders, for softRender
+SoftScene softScene(Context &ctx, const CubemapImage &skybox, const std::vector<CubemapImage> &prefiltered,
+                    const SH9 &irradiance_sh)
+{
+	SoftScene scene;
+	scene.model = trackballGetMatrix(ctx.trackball);
+	getViewMatrix(&scene.view);
+	getProjectionMatrix(ctx, &scene.projection);
+	scene.fovy = getFovy(ctx);
+	scene.aspect = ctx.aspect;
+	scene.ambient_light = ctx.ambient_light;
+	scene.light_position = ctx.light_position;
+	scene.light_color = ctx.light_color;
+	scene.diffuse_color = ctx.diffuse_color;
+	scene.specular_color = ctx.specular_color;
+	scene.specular_power = ctx.specular_power;
+	scene.ambient_weight = ctx.ambient_weight;
+	scene.diffuse_weight = ctx.diffuse_weight;
+	scene.specular_weight = ctx.specular_weight;
+	scene.color_mode = ctx.color_mode;
+	scene.gamma_correction = ctx.use_gamma_correction != 0;
+	scene.color_inversion = ctx.use_color_inversion != 0;
+	scene.roughness = ctx.roughness;
+	scene.skybox = &skybox;
+	scene.prefiltered = &prefiltered;
+	scene.irradiance_sh = irradiance_sh;
+	scene.background_color = ctx.background_color;
+	return scene;
+}
+
+// Render the same images as renderHeadless with the software rasterizer,
+// for machines without a GPU. Runs without an OpenGL context: only the
+// settings of the context are initialized, and the cubemaps are loaded
+// as CPU images. Meshes are drawn in the float format as one draw, so
+// instancing, clusters and levels of detail do not apply.
+int renderSoftware(Context &ctx)
+{
+	const Options &options = ctx.options;
+	std::vector<std::string> models = options.models;
+	if (models.empty())
+		models.push_back("gargo.obj");
+	std::vector<glm::vec2> views = options.views;
+	if (views.empty())
+		views.push_back(glm::vec2(0.0f));
+
+	ctx.width = options.headless_width;
+	ctx.height = options.headless_height;
+	ctx.aspect = float(ctx.width) / float(ctx.height);
+	initSettings(ctx);
+
+	const std::string cubemap_path = cubemapDir() + "/Forrest/";
+	CubemapImage skybox;
+	std::vector<CubemapImage> prefiltered;
+	std::string error;
+	if (!cubemapImageLoad(&skybox, cubemap_path, &error, options.num_threads) ||
+	    !softLoadCubemapLevels(prefilteredDirs(cubemap_path), &prefiltered, &error, options.num_threads)) {
+		std::cerr << "Error: " << error << std::endl;
+		return EXIT_FAILURE;
+	}
+	SH9 irradiance_sh = shIrradiance(shProjectCubemap(skybox, options.num_threads));
+
+	SoftRasterizer raster(options.num_threads);
+	SoftFramebuffer framebuffer;
+	bool ok = true;
+	for (const std::string &model : models) {
+		Mesh mesh;
+		MappedFile meshFile;
+		MeshView view = loadMesh(modelPath(model), options, &mesh, &meshFile);
+		for (std::size_t i = 0; i < views.size(); i++) {
+			glm::quat pitch = glm::angleAxis(glm::radians(views[i].y), glm::vec3(1.0f, 0.0f, 0.0f));
+			glm::quat yaw = glm::angleAxis(glm::radians(views[i].x), glm::vec3(0.0f, 1.0f, 0.0f));
+			ctx.trackball.qCurrent = pitch * yaw;
+			auto start = std::chrono::steady_clock::now();
+			softRender(raster, view, softScene(ctx, skybox, prefiltered, irradiance_sh), ctx.width, ctx.height,
+			           &framebuffer);
+			double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+			std::string filename = options.output_dir + "/" + fileStem(model) + "_" + std::to_string(i) + ".png";
+			ok = softFramebufferSave(framebuffer, filename) && ok;
+			std::cout << "Rendered " << filename << " in " << ms << " ms" << std::endl;
+		}
+		mappedFileClose(meshFile);
+	}
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Render the first model (of --model, default gargo.obj) offscreen as a
+// grid of 1, 10, 100, ... copies up to options.instance_bench, and report
+// the average frame time of each count. Frames are queued back to back
+// and the GPU is waited for once per count, so the time is that of the
+// GPU (or of the driver, if it is slower).
+int runInstanceBenchmark(Context &ctx)
+{
+	const Options &options = ctx.options;
+	const int numFrames = 32;
+	cubemapLoaderFinish(ctx.cubemapLoader);
+	glStateInvalidate(&ctx.glState); // the uploads bound textures
+
+	Framebuffer framebuffer;
+	if (!framebufferCreate(&framebuffer, ctx.width, ctx.height))
+		return EXIT_FAILURE;
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer.fbo);
+	glViewport(0, 0, ctx.width, ctx.height);
+	loadModel(ctx, modelPath(options.models.empty() ? "gargo.obj" : options.models[0]));
+	ctx.elapsed_time = 0.0f;
+
+	std::vector<int> counts;
+	for (int count = 1; count < options.instance_bench; count *= 10)
+		counts.push_back(count);
+	counts.push_back(options.instance_bench);
+	bool ok = true;
+	for (int count : counts) {
+		std::vector<glm::mat4> transforms;
+		instanceGrid(count, &transforms);
+		if (!instanceBufferUpload(&ctx.instances, transforms)) {
+			ok = false;
+			break;
+		}
+		glStateInvalidate(&ctx.glState); // the upload bound a texture
+		display(ctx); // warm up
+		glFinish();
+		auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < numFrames; i++)
+			display(ctx);
+		glFinish();
+		double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / numFrames;
+		double triangles = double(count) * ctx.meshVAO.lods[ctx.lodLevel].y / 3;
+		const RenderStats &stats = ctx.glState.frame;
+		std::cout << "instances " << count << ": " << ms << " ms/frame, "
+			<< triangles / (ms * 1e3) << " Mtriangles/s, " << stats.drawCalls << " draw calls and "
+			<< stats.stateChanges << " state changes (" << stats.skippedChanges << " skipped) per frame" << std::endl;
+	}
+
+	unloadModel(ctx);
+	instanceBufferDestroy(&ctx.instances);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	framebufferDestroy(&framebuffer);
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Render the first model (of --model, default gargo.obj) offscreen in the
+// Blinn-Phong mode, lit by 1, 10, 100, ... up to options.light_bench
+// clustered point lights, and report the average frame time of each count
+// and how much of it went to binning the lights on the CPU. The lights
+// turn from frame to frame, so they are binned anew every frame.
+int runLightBenchmark(Context &ctx)
+{
+	const Options &options = ctx.options;
+	const int numFrames = 32;
+	cubemapLoaderFinish(ctx.cubemapLoader);
+	glStateInvalidate(&ctx.glState); // the uploads bound textures
+
+	Framebuffer framebuffer;
+	if (!framebufferCreate(&framebuffer, ctx.width, ctx.height))
+		return EXIT_FAILURE;
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer.fbo);
+	glViewport(0, 0, ctx.width, ctx.height);
+	loadModel(ctx, modelPath(options.models.empty() ? "gargo.obj" : options.models[0]));
+	ctx.color_mode = ColorMode::BLINN_PHONG;
+
+	std::vector<int> counts;
+	for (int count = 1; count < options.light_bench; count *= 10)
+		counts.push_back(count);
+	counts.push_back(options.light_bench);
+	for (int count : counts) {
+		initLights(ctx, count);
+		ctx.elapsed_time = 0.0f;
+		display(ctx); // warm up
+		glFinish();
+		double binningTime = 0.0;
+		auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < numFrames; i++) {
+			ctx.elapsed_time = float(i + 1) / 60.0f;
+			display(ctx);
+			binningTime += ctx.lightBinningTime;
+		}
+		glFinish();
+		double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / numFrames;
+		std::cout << "lights " << count << ": " << ms << " ms/frame, " << binningTime / numFrames
+			<< " ms of it binning on the CPU (" << ctx.lightClusters.indices.size() << " light references, at most "
+			<< ctx.lightClusters.maxClusterLights << " per cluster)" << std::endl;
+	}
+
+	unloadModel(ctx);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	framebufferDestroy(&framebuffer);
+	return EXIT_SUCCESS;
 }
 
 void reloadShaders(Context *ctx)
 {
-    glDeleteProgram(ctx->program);
-    ctx->program = loadShaderProgram(shaderDir() + "mesh.vert", shaderDir() + "mesh.frag");
-	ctx->skyboxProgram = loadShaderProgram(shaderDir() + "skybox.vert", shaderDir() + "skybox.frag");
+	loadMeshProgram(*ctx);
+	loadSkyboxProgram(*ctx);
+	glStateInvalidate(&ctx->glState); // setupProgram changed the program
+}
+
+// Cast a ray from the camera through window position (x, y) and find the
+// nearest triangle of the mesh, or of any of its instances (scene parts
+// are not picked). The ray is moved into the space of every instance
+// transform in turn; as these are affine, distances along it stay
+// comparable. On a hit, the point is returned in world space and
+// ctx->pickedTriangle, ctx->pickedInstance and ctx->pickedDistance are
+// set; on a miss pickedTriangle is -1. If the BVH is still being built,
+// the pick waits for it, or misses if wait is false.
+bool pickMesh(Context *ctx, double x, double y, glm::vec3 *point, bool wait = true)
+{
+    if (!waitForBVH(*ctx, wait)) {
+        ctx->pickedTriangle = -1;
+        return false;
+    }
+    glm::mat4 model = trackballGetMatrix(ctx->trackball);
+    glm::mat4 view, projection;
+    getViewMatrix(&view);
+    getProjectionMatrix(*ctx, &projection);
+    glm::mat4 inverse = glm::inverse(projection * view * model);
+
+    // Cursor positions are in screen coordinates, which differ from
+    // pixels on high-DPI displays
+    int windowWidth, windowHeight;
+    glfwGetWindowSize(ctx->window, &windowWidth, &windowHeight);
+    glm::vec2 ndc(2.0f * float(x) / std::max(windowWidth, 1) - 1.0f, 1.0f - 2.0f * float(y) / std::max(windowHeight, 1));
+    glm::vec4 nearPoint = inverse * glm::vec4(ndc, -1.0f, 1.0f);
+    glm::vec4 farPoint = inverse * glm::vec4(ndc, 1.0f, 1.0f);
+    glm::vec3 origin = glm::vec3(nearPoint) / nearPoint.w;
+    glm::vec3 direction = glm::normalize(glm::vec3(farPoint) / farPoint.w - origin);
+
+    auto start = std::chrono::steady_clock::now();
+    const std::vector<glm::mat4> &toInstances = ctx->instances.inverses;
+    int numInstances = toInstances.empty() ? 1 : int(toInstances.size());
+    BVHHit hit;
+    hit.distance = std::numeric_limits<float>::max();
+    bool found = false;
+    for (int i = 0; i < numInstances; i++) {
+        glm::vec3 instanceOrigin = origin, instanceDirection = direction;
+        if (!toInstances.empty()) {
+            instanceOrigin = glm::vec3(toInstances[i] * glm::vec4(origin, 1.0f));
+            instanceDirection = glm::mat3(toInstances[i]) * direction;
+        }
+        if (bvhIntersect(ctx->bvh, ctx->meshData, instanceOrigin, instanceDirection, &hit, hit.distance)) {
+            found = true;
+            ctx->pickedInstance = i;
+        }
+    }
+    ctx->pickTime = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+    ctx->pickedTriangle = found ? int(hit.triangle) : -1;
+    if (!found)
+        return false;
+    *point = glm::vec3(model * glm::vec4(origin + hit.distance * direction, 1.0f));
+    glm::vec3 eye = glm::vec3(glm::inverse(view)[3]);
+    ctx->pickedDistance = glm::length(*point - eye);
+    return true;
 }
 
 void mouseButtonPressed(Context *ctx, int button, int x, int y)
 {
     if (button == GLFW_MOUSE_BUTTON_LEFT) {
+        // Orbit around the point under the cursor, or around the model's
+        // origin if there is none
+        glm::vec3 point;
+        if (pickMesh(ctx, x, y, &point)) {
+            ctx->trackball.pivot = point;
+            std::cout << "Picked triangle " << ctx->pickedTriangle;
+            if (ctx->instances.count > 0)
+                std::cout << " of instance " << ctx->pickedInstance;
+            std::cout << " at distance " << ctx->pickedDistance
+                      << " (" << ctx->pickTime << " ms)" << std::endl;
+        }
+        else {
+            ctx->trackball.pivot = ctx->trackball.translation;
+        }
         ctx->trackball.center = glm::vec2(x, y);
         trackballStartTracking(ctx->trackball, glm::vec2(x, y));
     }
@@ -502,6 +1798,12 @@ void toggleColoringInversion(Context *ctx)
 	ctx->use_color_inversion ^= 1;
 }
 
+// Step the roughness by one prefiltered level (T/Y keys)
+void changeRoughness(Context *ctx, float delta)
+{
+	ctx->roughness = glm::clamp(ctx->roughness + delta, 0.0f, 1.0f);
+}
+
 void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods)
 {
 #ifdef WITH_TWEAKBAR
@@ -537,12 +1839,14 @@ void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods
 			toggleColoringInversion(ctx);
 			break;
 		case GLFW_KEY_T:
-			if (ctx->cubemap_index > 0)
-				ctx->cubemap_index--;
+			changeRoughness(ctx, -1.0f / (NUM_CUBEMAP_LEVELS - 1));
 			break;
 		case GLFW_KEY_Y:
-			if (ctx->cubemap_index < NUM_CUBEMAP_LEVELS - 1)
-				ctx->cubemap_index++;
+			changeRoughness(ctx, 1.0f / (NUM_CUBEMAP_LEVELS - 1));
+			break;
+		case GLFW_KEY_DELETE:
+			if (!ctx->options.scene.empty())
+				removeLastScenePart(*ctx);
 			break;
 		default:
 			break;
@@ -553,6 +1857,19 @@ void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods
     }*/
 }
 
+// Files dropped on the window are added to the scene, as they are (not
+// on the grid of --scene-grid)
+void dropCallback(GLFWwindow* window, int count, const char** paths)
+{
+    Context *ctx = static_cast<Context *>(glfwGetWindowUserPointer(window));
+    if (ctx->options.scene.empty())
+        return;
+    for (int i = 0; i < count; i++)
+        addScenePart(*ctx, paths[i]);
+    updateSceneBounds(*ctx);
+    printSceneArena(*ctx);
+}
+
 void mouseButtonCallback(GLFWwindow* window, int button, int action, int mods)
 {
 #ifdef WITH_TWEAKBAR
@@ -579,6 +1896,10 @@ void cursorPosCallback(GLFWwindow* window, double x, double y)
 
     Context *ctx = static_cast<Context *>(glfwGetWindowUserPointer(window));
     moveTrackball(ctx, x, y);
+    if (!ctx->trackball.tracking) {
+        glm::vec3 point;
+        pickMesh(ctx, x, y, &point, false); // for the tweakbar
+    }
 }
 
 void scrollCallback(GLFWwindow* window, double xoffset, double yoffset) 
@@ -606,21 +1927,217 @@ void resizeCallback(GLFWwindow* window, int width, int height)
     glViewport(0, 0, width, height);
 }
 
-int main(void)
+void initProfiler(Context &ctx)
+{
+	Profiler &profiler = ctx.profiler;
+	profilerInit(profiler, ctx.options.profile_csv);
+	profilerAddSection(profiler, "poll_events", false);
+	profilerAddSection(profiler, "draw_skybox", true);
+	profilerAddSection(profiler, "draw_mesh", true);
+	profilerAddSection(profiler, "tweakbar", true);
+	profilerAddSection(profiler, "swap_buffers", false);
+}
+
+#ifdef WITH_TWEAKBAR
+// Add a panel with the min/avg/p99 milliseconds of the frame and of every
+// profiled phase over the last PROFILER_HISTORY_SIZE frames
+void addProfilerBar(Context &ctx)
+{
+	TwBar *bar = TwNewBar("Profiler");
+	TwDefine("Profiler size='260 400' position='520 16' refresh=0.5 valueswidth=80 iconified=true");
+	struct Row {
+		std::string group;
+		std::string kind;
+		ProfilerStats *stats;
+	};
+	std::vector<Row> rows;
+	Row frameRow = { "frame", "cpu", &ctx.profiler.frameHistory.stats };
+	rows.push_back(frameRow);
+	for (ProfilerSection &section : ctx.profiler.sections) {
+		Row cpuRow = { section.name, "cpu", &section.cpu.stats };
+		rows.push_back(cpuRow);
+		if (section.gpu) {
+			Row gpuRow = { section.name, "gpu", &section.gpuHistory.stats };
+			rows.push_back(gpuRow);
+		}
+	}
+	for (const Row &row : rows) {
+		const char *statNames[] = { "min", "avg", "p99" };
+		float *values[] = { &row.stats->min, &row.stats->avg, &row.stats->p99 };
+		for (int i = 0; i < 3; i++) {
+			std::string name = row.group + " " + row.kind + " " + statNames[i];
+			std::string def = "group='" + row.group + "' label='" + row.kind + " " + statNames[i] + " (ms)' precision=3";
+			TwAddVarRO(bar, name.c_str(), TW_TYPE_FLOAT, values[i], def.c_str());
+		}
+	}
+	TwAddVarRO(bar, "Draw calls", TW_TYPE_INT32, &ctx.glState.frame.drawCalls, "group='state'");
+	TwAddVarRO(bar, "State changes", TW_TYPE_INT32, &ctx.glState.frame.stateChanges, "group='state'");
+	TwAddVarRO(bar, "Redundant changes skipped", TW_TYPE_INT32, &ctx.glState.frame.skippedChanges, "group='state'");
+}
+#endif // WITH_TWEAKBAR
+
+void printUsage(const char *program)
+{
+	std::cout << "Usage: " << program << " [options]" << std::endl
+		<< "  --threads N      number of threads used for loading (default: all cores)" << std::endl
+		<< "  --no-mesh-cache  always parse OBJ files, do not read or write mesh caches" << std::endl
+		<< "  --no-program-cache" << std::endl
+		<< "                   always compile shaders, do not read or write program binaries" << std::endl
+		<< "  --angle-weighted-normals" << std::endl
+		<< "                   weight face normals by corner angle instead of area" << std::endl
+		<< "  --optimize-mesh  reorder triangles and vertices for the vertex caches" << std::endl
+		<< "  --cull-clusters  draw only the triangle clusters in the view frustum" << std::endl
+		<< "  --lod            build levels of detail and draw one matching the size on screen" << std::endl
+		<< "  --vertex-format float|packed|quantized" << std::endl
+		<< "                   layout of the mesh vertex buffer (default: float)" << std::endl
+		<< "  --headless       render to PNG files without a visible window and exit" << std::endl
+		<< "  --software       render to PNG files on the CPU (no OpenGL needed) and exit" << std::endl
+		<< "  --model FILE     model to render in headless mode (repeatable, default: gargo.obj)" << std::endl
+		<< "  --view YAW,PITCH model rotation in degrees for headless mode (repeatable)" << std::endl
+		<< "  --size WxH       headless image size (default: 800x600)" << std::endl
+		<< "  --output-dir DIR directory for headless images (default: .)" << std::endl
+		<< "  --instances N    draw N copies of the mesh on a grid with one instanced draw" << std::endl
+		<< "  --instance-file FILE" << std::endl
+		<< "                   draw copies at the transforms in FILE (see README.md)" << std::endl
+		<< "  --instance-bench N" << std::endl
+		<< "                   report the frame time of 1, 10, 100, ... up to N copies and exit" << std::endl
+		<< "  --lights N       light the mesh with N moving point lights (clustered shading)" << std::endl
+		<< "  --light-bench N  report the frame and light binning time of 1, 10, 100, ... up to" << std::endl
+		<< "                   N point lights and exit" << std::endl
+		<< "  --scene DIR|FILE draw the OBJ files of a directory or list file as one scene" << std::endl
+		<< "  --scene-grid     lay the scene's parts out on a grid" << std::endl
+		<< "  --profile-csv FILE" << std::endl
+		<< "                   write the CPU and GPU time of every frame to a CSV file" << std::endl;
+}
+
+void parseOptions(int argc, char *argv[], Options *options)
+{
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg == "--threads" && i + 1 < argc) {
+			options->num_threads = std::max(0, std::atoi(argv[++i]));
+		}
+		else if (arg == "--no-mesh-cache") {
+			options->use_mesh_cache = false;
+		}
+		else if (arg == "--no-program-cache") {
+			options->use_program_cache = false;
+		}
+		else if (arg == "--angle-weighted-normals") {
+			options->normal_weighting = NORMAL_WEIGHT_ANGLE;
+		}
+		else if (arg == "--optimize-mesh") {
+			options->optimize_mesh = true;
+		}
+		else if (arg == "--cull-clusters") {
+			options->cull_clusters = true;
+		}
+		else if (arg == "--lod") {
+			options->build_lods = true;
+		}
+		else if (arg == "--vertex-format" && i + 1 < argc) {
+			std::string format = argv[++i];
+			if (format == "float")
+				options->vertex_format = VERTEX_FORMAT_FLOAT;
+			else if (format == "packed")
+				options->vertex_format = VERTEX_FORMAT_PACKED;
+			else if (format == "quantized")
+				options->vertex_format = VERTEX_FORMAT_QUANTIZED;
+			else {
+				printUsage(argv[0]);
+				std::exit(EXIT_FAILURE);
+			}
+		}
+		else if (arg == "--headless") {
+			options->headless = true;
+		}
+		else if (arg == "--software") {
+			options->software = true;
+		}
+		else if (arg == "--model" && i + 1 < argc) {
+			options->models.push_back(argv[++i]);
+		}
+		else if (arg == "--view" && i + 1 < argc) {
+			glm::vec2 view;
+			if (std::sscanf(argv[++i], "%f,%f", &view.x, &view.y) != 2) {
+				printUsage(argv[0]);
+				std::exit(EXIT_FAILURE);
+			}
+			options->views.push_back(view);
+		}
+		else if (arg == "--size" && i + 1 < argc) {
+			int width, height;
+			if (std::sscanf(argv[++i], "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0) {
+				printUsage(argv[0]);
+				std::exit(EXIT_FAILURE);
+			}
+			options->headless_width = width;
+			options->headless_height = height;
+		}
+		else if (arg == "--output-dir" && i + 1 < argc) {
+			options->output_dir = argv[++i];
+		}
+		else if (arg == "--instances" && i + 1 < argc) {
+			options->instances = std::max(0, std::atoi(argv[++i]));
+		}
+		else if (arg == "--instance-file" && i + 1 < argc) {
+			options->instance_file = argv[++i];
+		}
+		else if (arg == "--instance-bench" && i + 1 < argc) {
+			options->instance_bench = std::max(0, std::atoi(argv[++i]));
+		}
+		else if (arg == "--lights" && i + 1 < argc) {
+			options->lights = std::max(0, std::atoi(argv[++i]));
+		}
+		else if (arg == "--light-bench" && i + 1 < argc) {
+			options->light_bench = std::max(0, std::atoi(argv[++i]));
+		}
+		else if (arg == "--scene" && i + 1 < argc) {
+			options->scene = argv[++i];
+		}
+		else if (arg == "--scene-grid") {
+			options->scene_grid = true;
+		}
+		else if (arg == "--profile-csv" && i + 1 < argc) {
+			options->profile_csv = argv[++i];
+		}
+		else {
+			printUsage(argv[0]);
+			std::exit(arg == "--help" ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+	}
+}
+
+int main(int argc, char *argv[])
 {
     Context ctx;
+    parseOptions(argc, argv, &ctx.options);
+    if (ctx.options.software) {
+        std::exit(renderSoftware(ctx));
+    }
 
-    // Create a GLFW window
+    // Create a GLFW window. In headless mode (and for the instancing and
+    // light benchmarks) it stays hidden and is only used for its context;
+    // everything is rendered into an FBO.
+    bool headless = ctx.options.headless || ctx.options.instance_bench > 0 || ctx.options.light_bench > 0;
     glfwSetErrorCallback(errorCallback);
-    glfwInit();
+    if (!glfwInit()) {
+        std::exit(EXIT_FAILURE);
+    }
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
     glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 2);
     glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
     glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
-    ctx.width = 800;
-    ctx.height = 600;
+    glfwWindowHint(GLFW_VISIBLE, headless ? GL_FALSE : GL_TRUE);
+    ctx.width = headless ? ctx.options.headless_width : 800;
+    ctx.height = headless ? ctx.options.headless_height : 600;
     ctx.aspect = float(ctx.width) / float(ctx.height);
-    ctx.window = glfwCreateWindow(ctx.width, ctx.height, "Model viewer", nullptr, nullptr);
+    ctx.window = glfwCreateWindow(headless ? 1 : ctx.width, headless ? 1 : ctx.height, "Model viewer", nullptr, nullptr);
+    if (ctx.window == nullptr) {
+        std::cerr << "Error: could not create an OpenGL 3.2 context" << std::endl;
+        glfwTerminate();
+        std::exit(EXIT_FAILURE);
+    }
     glfwMakeContextCurrent(ctx.window);
     glfwSetWindowUserPointer(ctx.window, &ctx);
     glfwSetKeyCallback(ctx.window, keyCallback);
@@ -628,6 +2145,7 @@ int main(void)
     glfwSetCursorPosCallback(ctx.window, cursorPosCallback);
 	glfwSetScrollCallback(ctx.window, scrollCallback);
     glfwSetFramebufferSizeCallback(ctx.window, resizeCallback);
+    glfwSetDropCallback(ctx.window, dropCallback);
 
     // Load OpenGL functions
     glewExperimental = true;
@@ -637,6 +2155,27 @@ int main(void)
         std::exit(EXIT_FAILURE);
     }
     std::cout << "OpenGL version: " << glGetString(GL_VERSION) << std::endl;
+    std::cout << "OpenGL renderer: " << glGetString(GL_RENDERER) << std::endl;
+
+    // Initialize rendering
+    glGenVertexArrays(1, &ctx.defaultVAO);
+    glBindVertexArray(ctx.defaultVAO);
+    glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
+    init(ctx);
+
+    if (headless) {
+        int status = ctx.options.light_bench > 0 ? runLightBenchmark(ctx)
+                   : ctx.options.instance_bench > 0 ? runInstanceBenchmark(ctx) : renderHeadless(ctx);
+        cubemapLoaderShutdown(ctx.cubemapLoader);
+        glfwDestroyWindow(ctx.window);
+        glfwTerminate();
+        std::exit(status);
+    }
+    if (!ctx.options.scene.empty())
+        loadScene(ctx);
+    else
+        loadModel(ctx, modelDir() + "gargo.obj");
+    startShaderWatcher(ctx);
 
     // Initialize AntTweakBar (if enabled)
 #ifdef WITH_TWEAKBAR
@@ -665,11 +2204,13 @@ int main(void)
 	TwAddVarRW(tweakbar, "Material diffuse color", TW_TYPE_COLOR3F, &ctx.diffuse_color[0], "colormode=hls");
 	TwAddVarRW(tweakbar, "Material specular color", TW_TYPE_COLOR3F, &ctx.specular_color[0], "colormode=hls");
 	TwAddVarRW(tweakbar, "Material specular power", TW_TYPE_FLOAT, &ctx.specular_power, NULL);
+	TwAddVarRW(tweakbar, "Material roughness", TW_TYPE_FLOAT, &ctx.roughness, "min=0 max=1 step=0.01");
 	TwAddSeparator(tweakbar, NULL, NULL);
 	TwEnumVal colorModeEV[] = {
 		{NORMAL_AS_RGB, "Normal as RGB"}, 
 		{BLINN_PHONG, "Blinn-Phong"}, 
-		{REFLECTION, "Reflection"}
+		{REFLECTION, "Reflection"},
+		{DIFFUSE_IBL, "Diffuse environment"}
 	};
 	TwType colorModeType = TwDefineEnum("ColorMode", colorModeEV, ColorMode::SIZE);
 	TwAddVarRW(tweakbar, "Color mode", colorModeType, &ctx.color_mode, NULL);
@@ -679,26 +2220,75 @@ int main(void)
 	TwAddVarRW(tweakbar, "Ambient weight", TW_TYPE_FLOAT, &ctx.ambient_weight, NULL);
 	TwAddVarRW(tweakbar, "Diffuse weight", TW_TYPE_FLOAT, &ctx.diffuse_weight, NULL);
 	TwAddVarRW(tweakbar, "Specular weight", TW_TYPE_FLOAT, &ctx.specular_weight, NULL);
+	if (ctx.options.cull_clusters) {
+		TwAddSeparator(tweakbar, NULL, NULL);
+		TwAddVarRO(tweakbar, "Clusters", TW_TYPE_INT32, &ctx.numClusters, NULL);
+		TwAddVarRO(tweakbar, "Visible clusters", TW_TYPE_INT32, &ctx.visibleClusters, NULL);
+	}
+	if (ctx.options.build_lods) {
+		TwAddSeparator(tweakbar, NULL, NULL);
+		TwAddVarRW(tweakbar, "LOD triangles per pixel", TW_TYPE_FLOAT, &ctx.lodTrianglesPerPixel,
+		           "min=0.01 max=16 step=0.05");
+		TwAddVarRO(tweakbar, "LOD level", TW_TYPE_INT32, &ctx.lodLevel, NULL);
+	}
+	if (!ctx.options.scene.empty()) {
+		TwAddSeparator(tweakbar, NULL, NULL);
+		TwAddVarRO(tweakbar, "Scene parts", TW_TYPE_INT32, &ctx.numSceneParts, NULL);
+		TwAddVarRO(tweakbar, "Visible parts", TW_TYPE_INT32, &ctx.visibleSceneParts, NULL);
+	}
+	else {
+		TwAddSeparator(tweakbar, NULL, NULL);
+		TwAddVarRO(tweakbar, "Triangle under cursor", TW_TYPE_INT32, &ctx.pickedTriangle, NULL);
+		if (ctx.instances.count > 0)
+			TwAddVarRO(tweakbar, "Instance", TW_TYPE_INT32, &ctx.pickedInstance, NULL);
+		TwAddVarRO(tweakbar, "Distance", TW_TYPE_FLOAT, &ctx.pickedDistance, NULL);
+		TwAddVarRO(tweakbar, "Pick time (ms)", TW_TYPE_FLOAT, &ctx.pickTime, "precision=4");
+	}
+	if (!ctx.lights.empty()) {
+		TwAddSeparator(tweakbar, NULL, NULL);
+		TwAddVarRO(tweakbar, "Point lights", TW_TYPE_INT32, &ctx.numLights, NULL);
+		TwAddVarRO(tweakbar, "Most lights in a cluster", TW_TYPE_UINT32, &ctx.lightClusters.maxClusterLights, NULL);
+		TwAddVarRO(tweakbar, "Light binning (ms)", TW_TYPE_FLOAT, &ctx.lightBinningTime, "precision=3");
+	}
 #endif // WITH_TWEAKBAR
 
-    // Initialize rendering
-    glGenVertexArrays(1, &ctx.defaultVAO);
-    glBindVertexArray(ctx.defaultVAO);
-    glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
-    init(ctx);
+    initProfiler(ctx);
+#ifdef WITH_TWEAKBAR
+    addProfilerBar(ctx);
+#endif // WITH_TWEAKBAR
 
     // Start rendering loop
     while (!glfwWindowShouldClose(ctx.window)) {
+        profilerBeginFrame(ctx.profiler);
+        profilerBegin(ctx.profiler, PROFILE_POLL_EVENTS);
         glfwPollEvents();
+        profilerEnd(ctx.profiler, PROFILE_POLL_EVENTS);
+        int pendingFaces = ctx.cubemapLoader.numPending;
+        cubemapLoaderUpdate(ctx.cubemapLoader, 6);
+        if (ctx.cubemapLoader.numPending != pendingFaces)
+            glStateInvalidate(&ctx.glState); // the uploads bound textures
+        updateShaders(ctx);
         ctx.elapsed_time = glfwGetTime();
         display(ctx);
 #ifdef WITH_TWEAKBAR
+        profilerBegin(ctx.profiler, PROFILE_TWEAKBAR);
         TwDraw();
+        // AntTweakBar restores the program, VAO and depth test it changes,
+        // but leaves texture unit 0 active
+        ctx.glState.activeUnit = 0;
+        profilerEnd(ctx.profiler, PROFILE_TWEAKBAR);
 #endif // WITH_TWEAKBAR
+        profilerBegin(ctx.profiler, PROFILE_SWAP);
         glfwSwapBuffers(ctx.window);
+        profilerEnd(ctx.profiler, PROFILE_SWAP);
+        profilerEndFrame(ctx.profiler);
     }
 
     // Shutdown
+    profilerShutdown(ctx.profiler);
+    shaderWatcherShutdown(ctx.shaderWatcher);
+    ctx.bvhBuilder.reset(); // waits for a build
+    cubemapLoaderShutdown(ctx.cubemapLoader);
 #ifdef WITH_TWEAKBAR
     TwTerminate();
 #endif // WITH_TWEAKBAR
@@ -0,0 +1,386 @@
+#pragma once
+
+#include "utils2.h"
+#include "mapped_file.h"
+#include "parallel.h"
+#include "mesh_normals.h"
+
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+
+// Parsing helpers for the memory-mapped OBJ loader. They work directly on
+// the bytes of the file and never allocate.
+namespace {
+inline bool objIsSpace(char c)
+{
+    return c == ' ' || c == '\t';
+}
+
+inline bool objIsDelimiter(const char *p, const char *end)
+{
+    return p == end || *p == ' ' || *p == '\t' || *p == '\r' || *p == '\n';
+}
+
+inline bool objIsDigit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+inline const char *objSkipSpace(const char *p, const char *end)
+{
+    while (p != end && objIsSpace(*p)) {
+        ++p;
+    }
+    return p;
+}
+
+// Returns a pointer to the first character of the next line
+inline const char *objNextLine(const char *p, const char *end)
+{
+    const char *newline = static_cast<const char *>(std::memchr(p, '\n', end - p));
+    return newline != nullptr ? newline + 1 : end;
+}
+
+// Returns the line type ('v', 'f' or 0 for lines that are ignored) and
+// advances p past the keyword
+inline char objLineType(const char *&p, const char *end)
+{
+    p = objSkipSpace(p, end);
+    if (end - p >= 2 && (p[0] == 'v' || p[0] == 'f') && objIsSpace(p[1])) {
+        char type = p[0];
+        p += 2;
+        return type;
+    }
+    return 0;
+}
+
+// Slow path for floats the fast path cannot convert exactly (very long
+// mantissas, large exponents, inf/nan). Copies the token to the stack.
+bool objParseFloatFallback(const char *&p, const char *end, float &value)
+{
+    char buffer[64];
+    std::size_t length = 0;
+    while (p + length != end && !objIsDelimiter(p + length, end) && length < sizeof(buffer) - 1) {
+        buffer[length] = p[length];
+        ++length;
+    }
+    buffer[length] = '\0';
+    char *parsedEnd = nullptr;
+    value = std::strtof(buffer, &parsedEnd);
+    if (parsedEnd == buffer || !objIsDelimiter(p + (parsedEnd - buffer), end)) {
+        return false;
+    }
+    p += parsedEnd - buffer;
+    return true;
+}
+
+// Parse a decimal floating-point number in place
+bool objParseFloat(const char *&p, const char *end, float &value)
+{
+    static const double powersOf10[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+
+    const char *start = p;
+    const char *q = p;
+    bool negative = false;
+    if (q != end && (*q == '-' || *q == '+')) {
+        negative = (*q == '-');
+        ++q;
+    }
+
+    // Accumulate up to 19 significant digits; the rest only shift the exponent
+    std::uint64_t mantissa = 0;
+    int numSignificant = 0;
+    int exponent = 0;
+    bool sawDigit = false;
+    while (q != end && objIsDigit(*q)) {
+        sawDigit = true;
+        if (numSignificant < 19) {
+            mantissa = mantissa * 10 + (*q - '0');
+            numSignificant += (mantissa != 0);
+        }
+        else {
+            ++exponent;
+        }
+        ++q;
+    }
+    if (q != end && *q == '.') {
+        ++q;
+        while (q != end && objIsDigit(*q)) {
+            sawDigit = true;
+            if (numSignificant < 19) {
+                mantissa = mantissa * 10 + (*q - '0');
+                numSignificant += (mantissa != 0);
+                --exponent;
+            }
+            ++q;
+        }
+    }
+    if (!sawDigit) {
+        return objParseFloatFallback(p, end, value);
+    }
+    if (q != end && (*q == 'e' || *q == 'E')) {
+        ++q;
+        bool negativeExponent = false;
+        if (q != end && (*q == '-' || *q == '+')) {
+            negativeExponent = (*q == '-');
+            ++q;
+        }
+        if (q == end || !objIsDigit(*q)) {
+            return false;
+        }
+        int e = 0;
+        while (q != end && objIsDigit(*q)) {
+            if (e < 100000) {
+                e = e * 10 + (*q - '0');
+            }
+            ++q;
+        }
+        exponent += negativeExponent ? -e : e;
+    }
+    if (!objIsDelimiter(q, end)) {
+        return false;
+    }
+
+    // Both the mantissa and the power of ten are exact doubles here, so
+    // the product/quotient is correctly rounded
+    if (mantissa == 0) {
+        value = negative ? -0.0f : 0.0f;
+    }
+    else if (mantissa < (std::uint64_t(1) << 53) && exponent >= -22 && exponent <= 22) {
+        double d = double(mantissa);
+        d = exponent < 0 ? d / powersOf10[-exponent] : d * powersOf10[exponent];
+        value = float(negative ? -d : d);
+    }
+    else {
+        p = start;
+        return objParseFloatFallback(p, end, value);
+    }
+    p = q;
+    return true;
+}
+
+// Parse the position index of a face vertex ("i", "i/t", "i//n" or
+// "i/t/n") and skip the texture and normal indices
+bool objParseFaceIndex(const char *&p, const char *end, std::int64_t &value)
+{
+    bool negative = false;
+    if (p != end && *p == '-') {
+        negative = true;
+        ++p;
+    }
+    if (p == end || !objIsDigit(*p)) {
+        return false;
+    }
+    std::int64_t index = 0;
+    while (p != end && objIsDigit(*p)) {
+        if (index < (std::int64_t(1) << 40)) {
+            index = index * 10 + (*p - '0');
+        }
+        ++p;
+    }
+    while (!objIsDelimiter(p, end)) {
+        if (*p != '/' && !objIsDigit(*p) && *p != '-') {
+            return false;
+        }
+        ++p;
+    }
+    value = negative ? -index : index;
+    return true;
+}
+} // namespace
+
+// Count the vertices and triangle indices (after fan triangulation of
+// polygons) in a range of an OBJ file that starts at a line boundary
+void objCountRange(const char *begin, const char *end,
+                   std::size_t *numVertices, std::size_t *numIndices)
+{
+    std::size_t vertexCount = 0;
+    std::size_t indexCount = 0;
+    const char *p = begin;
+    while (p != end) {
+        char type = objLineType(p, end);
+        if (type == 'v') {
+            ++vertexCount;
+        }
+        else if (type == 'f') {
+            std::size_t numCorners = 0;
+            p = objSkipSpace(p, end);
+            while (p != end && *p != '\r' && *p != '\n') {
+                ++numCorners;
+                while (!objIsDelimiter(p, end)) {
+                    ++p;
+                }
+                p = objSkipSpace(p, end);
+            }
+            if (numCorners >= 3) {
+                indexCount += 3 * (numCorners - 2);
+            }
+        }
+        p = objNextLine(p, end);
+    }
+    *numVertices = vertexCount;
+    *numIndices = indexCount;
+}
+
+// Parse the vertices and faces in a range of an OBJ file that starts at a
+// line boundary into preallocated arrays sized by objCountRange.
+// vertexBase is the number of vertices in the file before the range and
+// is needed to resolve negative (relative) indices. Returns false if the
+// range contains malformed vertex or face lines.
+bool objParseRange(const char *begin, const char *end, std::size_t vertexBase,
+                   glm::vec3 *vertices, std::uint32_t *indices)
+{
+    std::int64_t numVertices = std::int64_t(vertexBase);
+    const char *p = begin;
+    while (p != end) {
+        char type = objLineType(p, end);
+        if (type == 'v') {
+            glm::vec3 &vertex = *vertices++;
+            p = objSkipSpace(p, end);
+            if (!objParseFloat(p, end, vertex.x)) return false;
+            p = objSkipSpace(p, end);
+            if (!objParseFloat(p, end, vertex.y)) return false;
+            p = objSkipSpace(p, end);
+            if (!objParseFloat(p, end, vertex.z)) return false;
+            ++numVertices;
+        }
+        else if (type == 'f') {
+            // Triangulate polygons as a fan around the first corner
+            std::uint32_t first = 0, previous = 0;
+            int numCorners = 0;
+            p = objSkipSpace(p, end);
+            while (p != end && *p != '\r' && *p != '\n') {
+                std::int64_t index;
+                if (!objParseFaceIndex(p, end, index) || index == 0) {
+                    return false;
+                }
+                index = index > 0 ? index - 1 : numVertices + index;
+                if (index < 0 || index > std::int64_t(UINT32_MAX)) {
+                    return false;
+                }
+                std::uint32_t current = std::uint32_t(index);
+                if (numCorners == 0) {
+                    first = current;
+                }
+                else if (numCorners >= 2) {
+                    *indices++ = first;
+                    *indices++ = previous;
+                    *indices++ = current;
+                }
+                previous = current;
+                ++numCorners;
+                p = objSkipSpace(p, end);
+            }
+        }
+        p = objNextLine(p, end);
+    }
+    return true;
+}
+
+// Split a file into numChunks ranges that start and end at line
+// boundaries. Returns the numChunks + 1 range boundaries; ranges may be
+// empty for tiny files.
+std::vector<const char *> objSplitLines(const char *begin, const char *end, int numChunks)
+{
+    std::vector<const char *> bounds(1, begin);
+    std::size_t size = end - begin;
+    for (int i = 1; i < numChunks; ++i) {
+        const char *p = std::max(begin + size * i / numChunks, bounds.back());
+        if (p != begin && p != end && p[-1] != '\n') {
+            p = objNextLine(p, end);
+        }
+        bounds.push_back(p);
+    }
+    bounds.push_back(end);
+    return bounds;
+}
+
+// Read an OBJMesh from an .obj file by parsing the memory-mapped file in
+// place. Unlike objMeshLoad, this also handles v/vt/vn face indices,
+// negative indices and polygonal faces.
+//
+// With numThreads != 1 (0 means all cores), the file is split into
+// chunks at line boundaries that are counted and then parsed in parallel,
+// each chunk directly into its final position in the output vectors. The
+// result is bit-identical to the single-threaded path. Normals are
+// computed in parallel as well, weighted as given.
+bool objMeshLoadMapped(OBJMesh &mesh, const std::string &filename, int numThreads = 1,
+                       NormalWeighting weighting = NORMAL_WEIGHT_AREA)
+{
+    // Chunks smaller than this are not worth a thread
+    const std::size_t MIN_CHUNK_SIZE = 1 << 20;
+
+    mesh.vertices.clear();
+    mesh.normals.clear();
+    mesh.indices.clear();
+
+    MappedFile file;
+    if (!mappedFileOpen(file, filename)) {
+        std::cerr << "Could not open " << filename << std::endl;
+        return false;
+    }
+    const char *begin = file.data;
+    const char *end = file.data + file.size;
+
+    if (numThreads <= 0) {
+        numThreads = defaultThreadCount();
+    }
+    int numChunks = int(std::min<std::size_t>(4 * numThreads, file.size / MIN_CHUNK_SIZE));
+    numChunks = std::max(numChunks, 1);
+    std::vector<const char *> bounds = objSplitLines(begin, end, numChunks);
+
+    // A cheap counting pass gives the output offset of every chunk, so the
+    // output is allocated exactly once and never copied
+    std::vector<std::size_t> vertexOffsets(numChunks + 1, 0);
+    std::vector<std::size_t> indexOffsets(numChunks + 1, 0);
+    parallelFor(numChunks, numThreads, [&](int i) {
+        objCountRange(bounds[i], bounds[i + 1], &vertexOffsets[i + 1], &indexOffsets[i + 1]);
+    });
+    for (int i = 0; i < numChunks; ++i) {
+        vertexOffsets[i + 1] += vertexOffsets[i];
+        indexOffsets[i + 1] += indexOffsets[i];
+    }
+    std::size_t numVertices = vertexOffsets[numChunks];
+    std::size_t numIndices = indexOffsets[numChunks];
+    mesh.vertices.resize(numVertices);
+    mesh.indices.resize(numIndices);
+
+    std::vector<char> parsed(numChunks, 0);
+    parallelFor(numChunks, numThreads, [&](int i) {
+        parsed[i] = objParseRange(bounds[i], bounds[i + 1], vertexOffsets[i],
+                                  mesh.vertices.data() + vertexOffsets[i],
+                                  mesh.indices.data() + indexOffsets[i]);
+    });
+    mappedFileClose(file);
+    if (std::find(parsed.begin(), parsed.end(), 0) != parsed.end()) {
+        std::cerr << "Malformed vertex or face in " << filename << std::endl;
+        return false;
+    }
+    for (std::size_t i = 0; i < numIndices; ++i) {
+        if (mesh.indices[i] >= numVertices) {
+            std::cerr << "Face index out of range in " << filename << std::endl;
+            return false;
+        }
+    }
+
+    // Compute normals
+    computeNormalsParallel(mesh.vertices, mesh.indices, &mesh.normals, weighting, numThreads);
+
+    // Display log message
+    std::cout << "Loaded OBJ file " << filename << std::endl;
+    std::cout << "Number of triangles: " << numIndices / 3 << std::endl;
+
+    return true;
+}
@@ -0,0 +1,164 @@
+#pragma once
+
+#include "parallel.h"
+
+#include <GL/glew.h>
+#include <lodepng.h>
+
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Framebuffer object with a color and a depth renderbuffer, for rendering
+// without a visible window
+struct Framebuffer {
+    GLuint fbo;
+    GLuint colorRBO;
+    GLuint depthRBO;
+    int width;
+    int height;
+};
+
+bool framebufferCreate(Framebuffer *framebuffer, int width, int height)
+{
+    framebuffer->width = width;
+    framebuffer->height = height;
+
+    glGenRenderbuffers(1, &framebuffer->colorRBO);
+    glBindRenderbuffer(GL_RENDERBUFFER, framebuffer->colorRBO);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glGenRenderbuffers(1, &framebuffer->depthRBO);
+    glBindRenderbuffer(GL_RENDERBUFFER, framebuffer->depthRBO);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+    glGenFramebuffers(1, &framebuffer->fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer->fbo);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, framebuffer->colorRBO);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, framebuffer->depthRBO);
+    GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    if (status != GL_FRAMEBUFFER_COMPLETE) {
+        std::cerr << "Error: framebuffer incomplete (0x" << std::hex << status << std::dec << ")" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void framebufferDestroy(Framebuffer *framebuffer)
+{
+    glDeleteFramebuffers(1, &framebuffer->fbo);
+    glDeleteRenderbuffers(1, &framebuffer->colorRBO);
+    glDeleteRenderbuffers(1, &framebuffer->depthRBO);
+    framebuffer->fbo = framebuffer->colorRBO = framebuffer->depthRBO = 0;
+}
+
+// Writes rendered frames to PNG files without stalling the render loop.
+// Each frame is read back into one of two pixel buffer objects, and the
+// other one (holding the previous frame, which the GPU has finished by
+// then) is mapped and handed to a worker pool that encodes it. So the
+// readback of a frame and the encoding of the one before overlap with
+// rendering the next.
+struct FrameCapture {
+    GLuint pbos[2];
+    std::string filenames[2]; // empty if the buffer holds no pending frame
+    int next; // buffer that the next frame is read into
+    int width;
+    int height;
+    WorkerPool *encoder;
+};
+
+namespace {
+// Flip the RGBA rows (OpenGL reads bottom-up), drop alpha and write a PNG
+void frameCaptureEncode(const std::string &filename, const std::vector<unsigned char> &rgba,
+                        int width, int height)
+{
+    std::vector<unsigned char> rgb(std::size_t(width) * height * 3);
+    for (int y = 0; y < height; ++y) {
+        const unsigned char *src = &rgba[std::size_t(height - 1 - y) * width * 4];
+        unsigned char *dst = &rgb[std::size_t(y) * width * 3];
+        for (int x = 0; x < width; ++x) {
+            dst[3 * x + 0] = src[4 * x + 0];
+            dst[3 * x + 1] = src[4 * x + 1];
+            dst[3 * x + 2] = src[4 * x + 2];
+        }
+    }
+    unsigned error = lodepng::encode(filename, rgb, width, height, LCT_RGB);
+    if (error) {
+        std::cerr << "Error: could not write " << filename << ": " << lodepng_error_text(error) << std::endl;
+    }
+}
+
+// Map a pending buffer and queue its frame for encoding
+void frameCaptureResolve(FrameCapture &capture, int buffer)
+{
+    if (capture.filenames[buffer].empty()) {
+        return;
+    }
+    std::size_t size = std::size_t(capture.width) * capture.height * 4;
+    std::shared_ptr<std::vector<unsigned char> > pixels(new std::vector<unsigned char>(size));
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, capture.pbos[buffer]);
+    const void *mapped = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, GL_MAP_READ_BIT);
+    if (mapped != nullptr) {
+        std::memcpy(pixels->data(), mapped, size);
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    std::string filename = capture.filenames[buffer];
+    capture.filenames[buffer].clear();
+    if (mapped == nullptr) {
+        std::cerr << "Error: could not map the pixels of " << filename << std::endl;
+        return;
+    }
+    int width = capture.width, height = capture.height;
+    capture.encoder->submit([=]() { frameCaptureEncode(filename, *pixels, width, height); });
+}
+} // namespace
+
+void frameCaptureCreate(FrameCapture *capture, int width, int height, WorkerPool *encoder)
+{
+    capture->width = width;
+    capture->height = height;
+    capture->next = 0;
+    capture->encoder = encoder;
+    glGenBuffers(2, capture->pbos);
+    for (int i = 0; i < 2; ++i) {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, capture->pbos[i]);
+        glBufferData(GL_PIXEL_PACK_BUFFER, std::size_t(width) * height * 4, nullptr, GL_STREAM_READ);
+        capture->filenames[i].clear();
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+// Start reading back the current read framebuffer; it is written to
+// filename later
+void frameCaptureRead(FrameCapture &capture, const std::string &filename)
+{
+    int buffer = capture.next;
+    frameCaptureResolve(capture, buffer); // normally done by the previous call already
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, capture.pbos[buffer]);
+    glReadPixels(0, 0, capture.width, capture.height, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    capture.filenames[buffer] = filename;
+
+    capture.next = 1 - buffer;
+    frameCaptureResolve(capture, capture.next);
+}
+
+// Encode all pending frames and wait until they are written
+void frameCaptureFinish(FrameCapture &capture)
+{
+    frameCaptureResolve(capture, capture.next);
+    frameCaptureResolve(capture, 1 - capture.next);
+    capture.encoder->wait();
+}
+
+void frameCaptureDestroy(FrameCapture *capture)
+{
+    glDeleteBuffers(2, capture->pbos);
+    capture->pbos[0] = capture->pbos[1] = 0;
+}
@@ -0,0 +1,330 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Returns the number of hardware threads, used when no thread count is
+// given explicitly
+int defaultThreadCount()
+{
+    unsigned numThreads = std::thread::hardware_concurrency();
+    return numThreads > 0 ? int(numThreads) : 1;
+}
+
+// Call fn(i) for every i in [0, count) using up to numThreads threads,
+// the calling thread included. Tasks are handed out one at a time, so
+// count should be a few times larger than numThreads for good balance.
+// Returns when all tasks have finished.
+template <typename Function>
+void parallelFor(int count, int numThreads, Function fn)
+{
+    if (numThreads <= 0) {
+        numThreads = defaultThreadCount();
+    }
+    numThreads = std::min(numThreads, count);
+    if (numThreads <= 1) {
+        for (int i = 0; i < count; ++i) {
+            fn(i);
+        }
+        return;
+    }
+
+    std::atomic<int> next(0);
+    auto worker = [&]() {
+        for (int i = next++; i < count; i = next++) {
+            fn(i);
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int i = 1; i < numThreads; ++i) {
+        threads.push_back(std::thread(worker));
+    }
+    worker();
+    for (auto &thread : threads) {
+        thread.join();
+    }
+}
+
+// Call fn(begin, end) for consecutive ranges that together cover
+// [0, count), using up to numThreads threads. Ranges hold at least
+// minRangeSize elements so tiny inputs are not split up.
+template <typename Function>
+void parallelForRange(std::size_t count, int numThreads, Function fn, std::size_t minRangeSize = 4096)
+{
+    if (numThreads <= 0) {
+        numThreads = defaultThreadCount();
+    }
+    std::size_t numRanges = std::min<std::size_t>(4 * numThreads, count / std::max<std::size_t>(minRangeSize, 1));
+    numRanges = std::max<std::size_t>(numRanges, 1);
+    parallelFor(int(numRanges), numThreads, [&](int i) {
+        fn(count * i / numRanges, count * (i + 1) / numRanges);
+    });
+}
+
+// A fixed set of threads that run submitted tasks in FIFO order, for work
+// that should overlap with the calling thread (unlike parallelFor, which
+// returns when everything is done). If maxQueued is nonzero, submit blocks
+// while that many tasks are waiting, which bounds the memory held by them.
+// The destructor waits for all tasks.
+class WorkerPool {
+public:
+    explicit WorkerPool(int numThreads = 0, std::size_t maxQueued = 0)
+        : maxQueued_(maxQueued), numRunning_(0), stopping_(false)
+    {
+        if (numThreads <= 0) {
+            numThreads = defaultThreadCount();
+        }
+        for (int i = 0; i < numThreads; ++i) {
+            threads_.push_back(std::thread([this]() { run(); }));
+        }
+    }
+
+    ~WorkerPool()
+    {
+        wait();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        taskAdded_.notify_all();
+        for (auto &thread : threads_) {
+            thread.join();
+        }
+    }
+
+    void submit(std::function<void()> task)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (maxQueued_ > 0 && tasks_.size() >= maxQueued_) {
+            stateChanged_.wait(lock);
+        }
+        tasks_.push_back(std::move(task));
+        taskAdded_.notify_one();
+    }
+
+    // Wait until all submitted tasks have finished
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (!tasks_.empty() || numRunning_ > 0) {
+            stateChanged_.wait(lock);
+        }
+    }
+
+private:
+    WorkerPool(const WorkerPool &);
+    WorkerPool &operator=(const WorkerPool &);
+
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (;;) {
+            while (tasks_.empty() && !stopping_) {
+                taskAdded_.wait(lock);
+            }
+            if (tasks_.empty()) {
+                return;
+            }
+            std::function<void()> task = std::move(tasks_.front());
+            tasks_.pop_front();
+            ++numRunning_;
+            stateChanged_.notify_all();
+            lock.unlock();
+            task();
+            lock.lock();
+            --numRunning_;
+            stateChanged_.notify_all();
+        }
+    }
+
+    std::vector<std::thread> threads_;
+    std::deque<std::function<void()> > tasks_;
+    std::size_t maxQueued_;
+    int numRunning_;
+    bool stopping_;
+    std::mutex mutex_;
+    std::condition_variable taskAdded_;
+    std::condition_variable stateChanged_;
+};
+
+// Persistent threads for parallel loops that run many times, such as the
+// tiles of every frame, without the thread start-up of parallelFor. Each
+// thread starts on its own contiguous share of the indices; a thread that
+// runs out steals the upper half of the largest share left, so uneven
+// tasks balance out while most indices stay with the thread that owns the
+// neighbouring ones. run() returns when all tasks have finished and is
+// not reentrant.
+class StealingPool {
+public:
+    explicit StealingPool(int numThreads = 0)
+        : generation_(0), numFinished_(0), stopping_(false)
+    {
+        if (numThreads <= 0) {
+            numThreads = defaultThreadCount();
+        }
+        shares_ = std::vector<Share>(numThreads);
+        for (int i = 1; i < numThreads; ++i) {
+            threads_.push_back(std::thread([this, i]() { workerLoop(i); }));
+        }
+    }
+
+    ~StealingPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        jobAdded_.notify_all();
+        for (auto &thread : threads_) {
+            thread.join();
+        }
+    }
+
+    int numThreads() const { return int(shares_.size()); }
+
+    // Call fn(i, thread) for every i in [0, count), where thread is the
+    // index of the calling thread in [0, numThreads()); the calling thread
+    // is thread 0
+    template <typename Function>
+    void run(int count, Function fn)
+    {
+        int numThreads = int(shares_.size());
+        for (int i = 0; i < numThreads; ++i) {
+            shares_[i].begin = int(std::int64_t(count) * i / numThreads);
+            shares_[i].end = int(std::int64_t(count) * (i + 1) / numThreads);
+        }
+        if (numThreads == 1) {
+            work(0, fn);
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            job_ = [&](int thread) { work(thread, fn); };
+            numFinished_ = 0;
+            ++generation_;
+        }
+        jobAdded_.notify_all();
+        work(0, fn);
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (numFinished_ < numThreads - 1) {
+            jobFinished_.wait(lock);
+        }
+        job_ = nullptr;
+    }
+
+private:
+    StealingPool(const StealingPool &);
+    StealingPool &operator=(const StealingPool &);
+
+    // The indices [begin, end) that a thread has left. They only change
+    // under the mutex; thieves read them without it to pick a victim.
+    struct Share {
+        std::mutex mutex;
+        std::atomic<int> begin, end;
+        char padding[64]; // keeps the shares of threads on separate cache lines
+
+        Share() : begin(0), end(0) {}
+        Share(const Share &) : begin(0), end(0) {}
+    };
+
+    // Take the next index of a thread's own share
+    bool pop(int thread, int *index)
+    {
+        Share &share = shares_[thread];
+        std::lock_guard<std::mutex> lock(share.mutex);
+        if (share.begin >= share.end) {
+            return false;
+        }
+        *index = share.begin;
+        share.begin = *index + 1;
+        return true;
+    }
+
+    // Move the upper half of the largest other share to a thread's own
+    bool steal(int thread)
+    {
+        for (;;) {
+            int victim = -1, largest = 0;
+            for (int i = 0; i < int(shares_.size()); ++i) {
+                int remaining = shares_[i].end.load(std::memory_order_relaxed) -
+                                shares_[i].begin.load(std::memory_order_relaxed);
+                if (i != thread && remaining > largest) {
+                    victim = i;
+                    largest = remaining;
+                }
+            }
+            if (victim < 0) {
+                return false;
+            }
+            int begin, end;
+            {
+                std::lock_guard<std::mutex> lock(shares_[victim].mutex);
+                Share &share = shares_[victim];
+                if (share.end - share.begin <= 0) {
+                    continue; // taken in the meantime
+                }
+                end = share.end;
+                begin = end - (end - share.begin + 1) / 2;
+                share.end = begin;
+            }
+            std::lock_guard<std::mutex> lock(shares_[thread].mutex);
+            shares_[thread].begin = begin;
+            shares_[thread].end = end;
+            return true;
+        }
+    }
+
+    template <typename Function>
+    void work(int thread, Function &fn)
+    {
+        int index;
+        do {
+            while (pop(thread, &index)) {
+                fn(index, thread);
+            }
+        } while (steal(thread));
+    }
+
+    void workerLoop(int thread)
+    {
+        std::uint64_t seen = 0;
+        for (;;) {
+            std::function<void(int)> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                while (generation_ == seen && !stopping_) {
+                    jobAdded_.wait(lock);
+                }
+                if (stopping_) {
+                    return;
+                }
+                seen = generation_;
+                job = job_;
+            }
+            job(thread);
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                ++numFinished_;
+            }
+            jobFinished_.notify_one();
+        }
+    }
+
+    std::vector<Share> shares_;
+    std::vector<std::thread> threads_;
+    std::function<void(int)> job_;
+    std::uint64_t generation_;
+    int numFinished_;
+    bool stopping_;
+    std::mutex mutex_;
+    std::condition_variable jobAdded_;
+    std::condition_variable jobFinished_;
+};
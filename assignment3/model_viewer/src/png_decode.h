@@ -0,0 +1,513 @@
+#pragma once
+
+#include <lodepng.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define PNG_DECODE_SSE2
+#endif
+
+// Faster PNG decoding: a zlib decoder plugged into lodepng through its
+// custom_zlib hook (lodepng's own inflate reads one bit at a time). Huffman
+// codes are decoded with a lookup table of the next 10 bits and a 64-bit
+// bit buffer, and the Adler-32 checksum is vectorized with SSE2. The CRC
+// and unfiltering speedups live in lodepng.cpp itself. Use pngDecode in
+// place of lodepng::decode.
+
+namespace {
+const int inflateFastBits = 10;
+
+// A canonical Huffman code. fast[] decodes codes of up to inflateFastBits
+// bits in one lookup: symbol << 4 | length, or 0 for longer codes, which
+// are decoded length by length from the canonical code ranges.
+struct InflateHuffman {
+    std::uint16_t fast[1 << inflateFastBits];
+    int firstCode[17];   // first code of each length
+    int firstSymbol[17]; // index in symbols of that code
+    int maxCode[18];     // one past the last code of each length, << (16 - length)
+    std::uint16_t symbols[288];
+    std::uint8_t lengths[288];
+};
+
+// Bit reader. Bits are consumed from the low end of a 64-bit buffer;
+// reading past the end of the input yields zeros and sets overrun.
+struct InflateBits {
+    const unsigned char *in;
+    const unsigned char *end;
+    std::uint64_t buffer;
+    int count;
+    int padding; // bytes of zeros added past the end
+};
+
+inline void inflateRefill(InflateBits &bits)
+{
+    if (bits.end - bits.in >= 8) {
+        std::uint64_t word = 0;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ || defined(_M_X64) || defined(_M_IX86)
+        std::memcpy(&word, bits.in, 8);
+#else
+        for (int i = 7; i >= 0; --i) {
+            word = (word << 8) | bits.in[i];
+        }
+#endif
+        bits.buffer |= word << bits.count;
+        bits.in += (63 - bits.count) >> 3;
+        bits.count |= 56;
+        return;
+    }
+    while (bits.count <= 56) {
+        if (bits.in < bits.end) {
+            bits.buffer |= std::uint64_t(*bits.in++) << bits.count;
+        }
+        else {
+            ++bits.padding;
+        }
+        bits.count += 8;
+    }
+}
+
+// Read n <= 32 bits; the caller refills first
+inline unsigned inflateGetBits(InflateBits &bits, int n)
+{
+    unsigned value = unsigned(bits.buffer & ((std::uint64_t(1) << n) - 1));
+    bits.buffer >>= n;
+    bits.count -= n;
+    return value;
+}
+
+inline unsigned inflateReverse16(unsigned v)
+{
+    v = ((v & 0xaaaa) >> 1) | ((v & 0x5555) << 1);
+    v = ((v & 0xcccc) >> 2) | ((v & 0x3333) << 2);
+    v = ((v & 0xf0f0) >> 4) | ((v & 0x0f0f) << 4);
+    v = ((v & 0xff00) >> 8) | ((v & 0x00ff) << 8);
+    return v;
+}
+
+// Build a code from the code lengths of num symbols. Returns a lodepng
+// error code (0 if the lengths form a valid code).
+unsigned inflateBuildHuffman(InflateHuffman &h, const std::uint8_t *lengths, int num)
+{
+    int counts[16] = { 0 };
+    for (int i = 0; i < num; ++i) {
+        ++counts[lengths[i]];
+    }
+    counts[0] = 0;
+    int code = 0, k = 0;
+    int nextCode[16];
+    for (int len = 1; len < 16; ++len) {
+        nextCode[len] = code;
+        h.firstCode[len] = code;
+        h.firstSymbol[len] = k;
+        code += counts[len];
+        if (counts[len] != 0 && code - 1 >= (1 << len)) {
+            return 55; // over-subscribed
+        }
+        h.maxCode[len] = code << (16 - len);
+        code <<= 1;
+        k += counts[len];
+    }
+    h.maxCode[16] = 0x10000;
+    h.maxCode[17] = 0x7fffffff; // sentinel for invalid codes
+    std::memset(h.fast, 0, sizeof(h.fast));
+    for (int i = 0; i < num; ++i) {
+        int len = lengths[i];
+        if (len == 0) {
+            continue;
+        }
+        int index = h.firstSymbol[len] + nextCode[len] - h.firstCode[len];
+        h.symbols[index] = std::uint16_t(i);
+        h.lengths[index] = std::uint8_t(len);
+        if (len <= inflateFastBits) {
+            // Codes are read least significant bit first
+            unsigned reversed = inflateReverse16(unsigned(nextCode[len])) >> (16 - len);
+            for (unsigned j = reversed; j < (1u << inflateFastBits); j += 1u << len) {
+                h.fast[j] = std::uint16_t((i << 4) | len);
+            }
+        }
+        ++nextCode[len];
+    }
+    return 0;
+}
+
+// Decode one symbol, or return -1 for an invalid code. The buffer must
+// hold at least 15 bits.
+inline int inflateDecode(InflateBits &bits, const InflateHuffman &h)
+{
+    unsigned entry = h.fast[bits.buffer & ((1u << inflateFastBits) - 1)];
+    if (entry != 0) {
+        int len = int(entry & 15);
+        bits.buffer >>= len;
+        bits.count -= len;
+        return int(entry >> 4);
+    }
+    unsigned code = inflateReverse16(unsigned(bits.buffer & 0xffff));
+    int len = inflateFastBits + 1;
+    while (int(code) >= h.maxCode[len]) {
+        ++len;
+    }
+    if (len > 15) {
+        return -1;
+    }
+    int index = h.firstSymbol[len] + int(code >> (16 - len)) - h.firstCode[len];
+    bits.buffer >>= len;
+    bits.count -= len;
+    return h.symbols[index];
+}
+
+const std::uint16_t inflateLengthBase[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+const std::uint8_t inflateLengthExtra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+const std::uint16_t inflateDistanceBase[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073,
+    4097, 6145, 8193, 12289, 16385, 24577
+};
+const std::uint8_t inflateDistanceExtra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+// Output buffer allocated with malloc, as lodepng frees it with free
+struct InflateOutput {
+    unsigned char *data;
+    std::size_t size;
+    std::size_t capacity;
+};
+
+// Make room for n more bytes, plus slack for the 8-byte match copies
+inline bool inflateReserve(InflateOutput &out, std::size_t n)
+{
+    if (out.size + n + 8 <= out.capacity) {
+        return true;
+    }
+    std::size_t capacity = std::max(out.capacity * 2, out.size + n + 8);
+    unsigned char *data = static_cast<unsigned char *>(std::realloc(out.data, capacity));
+    if (data == nullptr) {
+        return false;
+    }
+    out.data = data;
+    out.capacity = capacity;
+    return true;
+}
+
+unsigned inflateStored(InflateBits &bits, InflateOutput &out)
+{
+    // Skip to a byte boundary, then read LEN and NLEN from the buffer
+    inflateGetBits(bits, bits.count & 7);
+    inflateRefill(bits);
+    unsigned len = inflateGetBits(bits, 16);
+    unsigned nlen = inflateGetBits(bits, 16);
+    if (len + nlen != 65535) {
+        return 21;
+    }
+    if (!inflateReserve(out, len)) {
+        return 83;
+    }
+    // Whole bytes still in the buffer come first, then the input
+    while (len > 0 && bits.count >= 8) {
+        out.data[out.size++] = (unsigned char)inflateGetBits(bits, 8);
+        --len;
+    }
+    if (len == 0) {
+        return 0;
+    }
+    if (bits.padding > 0 || std::size_t(bits.end - bits.in) < len) {
+        return 23;
+    }
+    bits.buffer = 0; // may hold bits of the bytes that are copied below
+    std::memcpy(out.data + out.size, bits.in, len);
+    out.size += len;
+    bits.in += len;
+    return 0;
+}
+
+unsigned inflateCodes(InflateBits &bits, InflateOutput &out, const InflateHuffman &litlen,
+                      const InflateHuffman &distance)
+{
+    for (;;) {
+        inflateRefill(bits);
+        if (bits.padding > 8) {
+            return 10; // more padding than the buffer holds has been read
+        }
+        int symbol = inflateDecode(bits, litlen);
+        if (symbol < 256) {
+            if (symbol < 0) {
+                return 16;
+            }
+            if (!inflateReserve(out, 1)) {
+                return 83;
+            }
+            out.data[out.size++] = (unsigned char)symbol;
+            continue;
+        }
+        if (symbol == 256) {
+            return bits.padding * 8 > bits.count ? 10 : 0;
+        }
+        symbol -= 257;
+        if (symbol >= 29) {
+            return 16;
+        }
+        // Length code, length extra, distance code and distance extra take
+        // at most 15 + 5 + 15 + 13 bits; the buffer has 56 after a refill
+        unsigned length = inflateLengthBase[symbol] + inflateGetBits(bits, inflateLengthExtra[symbol]);
+        int distanceSymbol = inflateDecode(bits, distance);
+        if (distanceSymbol < 0 || distanceSymbol >= 30) {
+            return 18;
+        }
+        inflateRefill(bits);
+        std::size_t dist = inflateDistanceBase[distanceSymbol] +
+                           inflateGetBits(bits, inflateDistanceExtra[distanceSymbol]);
+        if (dist > out.size) {
+            return 52;
+        }
+        if (bits.padding * 8 > bits.count) {
+            return 10;
+        }
+        if (!inflateReserve(out, length)) {
+            return 83;
+        }
+        unsigned char *dst = out.data + out.size;
+        const unsigned char *src = dst - dist;
+        out.size += length;
+        if (dist >= 8) {
+            // Copy 8 bytes at a time; may write up to 7 bytes past the end
+            for (unsigned i = 0; i < length; i += 8) {
+                std::memcpy(dst + i, src + i, 8);
+            }
+        }
+        else {
+            for (unsigned i = 0; i < length; ++i) {
+                dst[i] = src[i];
+            }
+        }
+    }
+}
+
+unsigned inflateDynamicTables(InflateBits &bits, InflateHuffman &litlen, InflateHuffman &distance)
+{
+    static const std::uint8_t order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+    inflateRefill(bits);
+    int hlit = int(inflateGetBits(bits, 5)) + 257;
+    int hdist = int(inflateGetBits(bits, 5)) + 1;
+    int hclen = int(inflateGetBits(bits, 4)) + 4;
+    if (hlit > 286 || hdist > 30) {
+        return 13;
+    }
+    std::uint8_t codeLengths[19] = { 0 };
+    for (int i = 0; i < hclen; ++i) {
+        inflateRefill(bits);
+        codeLengths[order[i]] = std::uint8_t(inflateGetBits(bits, 3));
+    }
+    InflateHuffman lengthCode;
+    unsigned error = inflateBuildHuffman(lengthCode, codeLengths, 19);
+    if (error != 0) {
+        return error;
+    }
+    std::uint8_t lengths[286 + 30];
+    int n = 0;
+    while (n < hlit + hdist) {
+        inflateRefill(bits);
+        int symbol = inflateDecode(bits, lengthCode);
+        if (symbol < 0) {
+            return 16;
+        }
+        if (symbol < 16) {
+            lengths[n++] = std::uint8_t(symbol);
+            continue;
+        }
+        std::uint8_t value = 0;
+        int repeat;
+        if (symbol == 16) {
+            if (n == 0) {
+                return 54;
+            }
+            value = lengths[n - 1];
+            repeat = 3 + int(inflateGetBits(bits, 2));
+        }
+        else if (symbol == 17) {
+            repeat = 3 + int(inflateGetBits(bits, 3));
+        }
+        else {
+            repeat = 11 + int(inflateGetBits(bits, 7));
+        }
+        if (n + repeat > hlit + hdist) {
+            return 14;
+        }
+        std::memset(lengths + n, value, repeat);
+        n += repeat;
+    }
+    if (bits.padding * 8 > bits.count) {
+        return 10;
+    }
+    if (lengths[256] == 0) {
+        return 64; // no end code
+    }
+    error = inflateBuildHuffman(litlen, lengths, hlit);
+    if (error == 0) {
+        error = inflateBuildHuffman(distance, lengths + hlit, hdist);
+    }
+    return error;
+}
+
+void inflateFixedTables(InflateHuffman &litlen, InflateHuffman &distance)
+{
+    std::uint8_t lengths[288];
+    std::fill(lengths, lengths + 144, 8);
+    std::fill(lengths + 144, lengths + 256, 9);
+    std::fill(lengths + 256, lengths + 280, 7);
+    std::fill(lengths + 280, lengths + 288, 8);
+    inflateBuildHuffman(litlen, lengths, 288);
+    std::fill(lengths, lengths + 30, 5);
+    inflateBuildHuffman(distance, lengths, 30);
+}
+} // namespace
+
+// Adler-32 of data, continuing from adler (1 for a new checksum)
+unsigned pngAdler32(unsigned adler, const unsigned char *data, std::size_t len)
+{
+    // At most this many bytes can be summed before s2 can overflow
+    const unsigned base = 65521, nmax = 5552;
+    unsigned s1 = adler & 0xffff, s2 = adler >> 16;
+#ifdef PNG_DECODE_SSE2
+    // 16 bytes per step: s1 gains their sum and s2 gains 16 * s1 plus
+    // their sum weighted 16, 15, ..., 1
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i weightsLow = _mm_set_epi16(9, 10, 11, 12, 13, 14, 15, 16);
+    const __m128i weightsHigh = _mm_set_epi16(1, 2, 3, 4, 5, 6, 7, 8);
+    while (len >= 16) {
+        std::size_t blocks = std::min<std::size_t>(len / 16, nmax / 16);
+        len -= blocks * 16;
+        __m128i vs1 = _mm_cvtsi32_si128(int(s1));
+        __m128i vs2 = _mm_cvtsi32_si128(int(s2));
+        __m128i vs1Sum = zero; // s1 before each step
+        for (std::size_t i = 0; i < blocks; ++i, data += 16) {
+            __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data));
+            vs1Sum = _mm_add_epi32(vs1Sum, vs1);
+            vs1 = _mm_add_epi32(vs1, _mm_sad_epu8(bytes, zero));
+            vs2 = _mm_add_epi32(vs2, _mm_madd_epi16(_mm_unpacklo_epi8(bytes, zero), weightsLow));
+            vs2 = _mm_add_epi32(vs2, _mm_madd_epi16(_mm_unpackhi_epi8(bytes, zero), weightsHigh));
+        }
+        vs2 = _mm_add_epi32(vs2, _mm_slli_epi32(vs1Sum, 4));
+        unsigned lanes1[4], lanes2[4];
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(lanes1), vs1);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(lanes2), vs2);
+        s1 = (lanes1[0] + lanes1[1] + lanes1[2] + lanes1[3]) % base;
+        s2 = (lanes2[0] + lanes2[1] + lanes2[2] + lanes2[3]) % base;
+    }
+#endif
+    while (len > 0) {
+        std::size_t n = std::min<std::size_t>(len, nmax);
+        len -= n;
+        for (; n > 0; --n) {
+            s1 += *data++;
+            s2 += s1;
+        }
+        s1 %= base;
+        s2 %= base;
+    }
+    return (s2 << 16) | s1;
+}
+
+// Decode a zlib stream (a LodePNGDecompressSettings::custom_zlib
+// function). *out is allocated with malloc.
+unsigned pngZlibDecompress(unsigned char **out, std::size_t *outsize, const unsigned char *in, std::size_t insize,
+                           const LodePNGDecompressSettings *settings)
+{
+    if (insize < 2) {
+        return 53;
+    }
+    if ((in[0] * 256 + in[1]) % 31 != 0) {
+        return 24;
+    }
+    if ((in[0] & 15) != 8 || (in[0] >> 4) > 7) {
+        return 25;
+    }
+    if ((in[1] >> 5) & 1) {
+        return 26;
+    }
+
+    InflateBits bits;
+    bits.in = in + 2;
+    bits.end = in + insize;
+    bits.buffer = 0;
+    bits.count = 0;
+    bits.padding = 0;
+    InflateOutput output;
+    output.data = nullptr;
+    output.size = output.capacity = 0;
+    if (!inflateReserve(output, insize * 4)) {
+        return 83;
+    }
+
+    // The tables are large, so they live on the heap
+    std::unique_ptr<InflateHuffman[]> tables(new InflateHuffman[2]);
+    unsigned error = 0;
+    bool last = false;
+    while (!last && error == 0) {
+        inflateRefill(bits);
+        last = inflateGetBits(bits, 1) != 0;
+        unsigned type = inflateGetBits(bits, 2);
+        if (type == 0) {
+            error = inflateStored(bits, output);
+        }
+        else if (type == 1) {
+            inflateFixedTables(tables[0], tables[1]);
+            error = inflateCodes(bits, output, tables[0], tables[1]);
+        }
+        else if (type == 2) {
+            error = inflateDynamicTables(bits, tables[0], tables[1]);
+            if (error == 0) {
+                error = inflateCodes(bits, output, tables[0], tables[1]);
+            }
+        }
+        else {
+            error = 20;
+        }
+    }
+
+    if (error == 0 && !settings->ignore_adler32) {
+        // The checksum follows the last block at a byte boundary
+        inflateGetBits(bits, bits.count & 7);
+        inflateRefill(bits);
+        unsigned adler = 0;
+        for (int i = 0; i < 4; ++i) {
+            adler = (adler << 8) | inflateGetBits(bits, 8);
+        }
+        if (bits.padding * 8 > bits.count) {
+            error = 53;
+        }
+        else if (pngAdler32(1, output.data, output.size) != adler) {
+            error = 58;
+        }
+    }
+    if (error != 0) {
+        std::free(output.data);
+        return error;
+    }
+    *out = output.data;
+    *outsize = output.size;
+    return 0;
+}
+
+// Decode a PNG file to 8-bit RGBA, like lodepng::decode
+unsigned pngDecode(std::vector<unsigned char> &out, unsigned &width, unsigned &height, const std::string &filename)
+{
+    std::vector<unsigned char> buffer;
+    lodepng::load_file(buffer, filename);
+    if (buffer.empty()) {
+        return 78; // could not open the file
+    }
+    lodepng::State state;
+    state.decoder.zlibsettings.custom_zlib = pngZlibDecompress;
+    return lodepng::decode(out, width, height, state, buffer);
+}
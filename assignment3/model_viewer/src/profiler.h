@@ -0,0 +1,295 @@
+#pragma once
+
+#include <GL/glew.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Number of frames a GL timer query may take before its result is
+// needed. Results are only read once available, so the CPU never waits.
+#define PROFILER_FRAME_LAG 4
+
+// Number of frames the statistics are computed over
+#define PROFILER_HISTORY_SIZE 256
+
+struct ProfilerStats {
+    float min; // milliseconds
+    float avg;
+    float p99;
+};
+
+// Ring of the last PROFILER_HISTORY_SIZE samples of a timer
+struct ProfilerHistory {
+    std::vector<float> samples;
+    std::size_t next;
+    ProfilerStats stats;
+};
+
+// A timed phase of a frame. Phases with gpu set are also measured with GL
+// timer queries; they must not overlap each other.
+struct ProfilerSection {
+    std::string name;
+    bool gpu;
+    std::chrono::steady_clock::time_point cpuStart;
+    ProfilerHistory cpu;
+    ProfilerHistory gpuHistory;
+    GLuint queries[PROFILER_FRAME_LAG];
+    std::int64_t queryFrames[PROFILER_FRAME_LAG]; // frame a query was issued in, -1 if free
+};
+
+// Timings of one frame, kept until the GPU results are in (or too old) so
+// that they can be written as one CSV row. Missing values are negative.
+struct ProfilerFrame {
+    std::int64_t frame;
+    float total;
+    std::vector<float> cpu;
+    std::vector<float> gpu;
+};
+
+struct Profiler {
+    std::vector<ProfilerSection> sections;
+    ProfilerHistory frameHistory;
+    ProfilerFrame frames[PROFILER_FRAME_LAG];
+    std::int64_t frame;
+    bool inFrame;
+    bool gpuTimers; // GL_TIME_ELAPSED queries are supported
+    std::chrono::steady_clock::time_point frameStart;
+    std::ofstream csv;
+    std::vector<float> scratch;
+
+    Profiler() : frame(0), inFrame(false), gpuTimers(false) {}
+};
+
+namespace {
+void profilerHistoryInit(ProfilerHistory &history)
+{
+    history.samples.clear();
+    history.samples.reserve(PROFILER_HISTORY_SIZE);
+    history.next = 0;
+    history.stats.min = history.stats.avg = history.stats.p99 = 0.0f;
+}
+
+void profilerHistoryAdd(ProfilerHistory &history, float sample)
+{
+    if (history.samples.size() < PROFILER_HISTORY_SIZE) {
+        history.samples.push_back(sample);
+    }
+    else {
+        history.samples[history.next] = sample;
+    }
+    history.next = (history.next + 1) % PROFILER_HISTORY_SIZE;
+}
+
+void profilerHistoryUpdateStats(ProfilerHistory &history, std::vector<float> &scratch)
+{
+    if (history.samples.empty()) {
+        return;
+    }
+    scratch.assign(history.samples.begin(), history.samples.end());
+    std::size_t p99Index = (scratch.size() * 99) / 100;
+    std::nth_element(scratch.begin(), scratch.begin() + p99Index, scratch.end());
+    history.stats.p99 = scratch[p99Index];
+    history.stats.min = *std::min_element(scratch.begin(), scratch.end());
+    double sum = 0.0;
+    for (float sample : scratch) {
+        sum += sample;
+    }
+    history.stats.avg = float(sum / scratch.size());
+}
+
+float profilerMilliseconds(std::chrono::steady_clock::time_point start,
+                           std::chrono::steady_clock::time_point end)
+{
+    return std::chrono::duration<float, std::milli>(end - start).count();
+}
+
+void profilerWriteRow(Profiler &profiler, const ProfilerFrame &record)
+{
+    if (!profiler.csv.is_open() || record.frame < 0) {
+        return;
+    }
+    profiler.csv << record.frame << "," << record.total;
+    for (std::size_t s = 0; s < profiler.sections.size(); ++s) {
+        profiler.csv << "," << record.cpu[s];
+        if (profiler.sections[s].gpu) {
+            profiler.csv << "," << record.gpu[s];
+        }
+    }
+    profiler.csv << "\n";
+}
+
+// Read the results of all finished timer queries
+void profilerPollQueries(Profiler &profiler)
+{
+    for (std::size_t s = 0; s < profiler.sections.size(); ++s) {
+        ProfilerSection &section = profiler.sections[s];
+        for (int q = 0; q < PROFILER_FRAME_LAG; ++q) {
+            if (section.queryFrames[q] < 0) {
+                continue;
+            }
+            GLint available = 0;
+            glGetQueryObjectiv(section.queries[q], GL_QUERY_RESULT_AVAILABLE, &available);
+            if (!available) {
+                continue;
+            }
+            GLuint64 nanoseconds = 0;
+            glGetQueryObjectui64v(section.queries[q], GL_QUERY_RESULT, &nanoseconds);
+            float ms = float(double(nanoseconds) * 1e-6);
+            profilerHistoryAdd(section.gpuHistory, ms);
+            ProfilerFrame &record = profiler.frames[section.queryFrames[q] % PROFILER_FRAME_LAG];
+            if (record.frame == section.queryFrames[q]) {
+                record.gpu[s] = ms;
+            }
+            section.queryFrames[q] = -1;
+        }
+    }
+}
+} // namespace
+
+// Set up a profiler. If csvFilename is not empty, the timings of every
+// frame are written to it.
+void profilerInit(Profiler &profiler, const std::string &csvFilename)
+{
+    profiler.sections.clear();
+    profilerHistoryInit(profiler.frameHistory);
+    profiler.frame = 0;
+    profiler.inFrame = false;
+    for (int f = 0; f < PROFILER_FRAME_LAG; ++f) {
+        profiler.frames[f].frame = -1;
+    }
+    profiler.gpuTimers = GLEW_VERSION_3_3 || GLEW_ARB_timer_query;
+    if (!profiler.gpuTimers) {
+        std::cout << "GL timer queries are not supported, only CPU times are profiled" << std::endl;
+    }
+    if (!csvFilename.empty()) {
+        profiler.csv.open(csvFilename.c_str());
+        if (!profiler.csv) {
+            std::cerr << "Error: could not open " << csvFilename << std::endl;
+        }
+    }
+}
+
+// Add a phase to profile, before the first frame. Returns its id.
+int profilerAddSection(Profiler &profiler, const std::string &name, bool gpu)
+{
+    ProfilerSection section;
+    section.name = name;
+    section.gpu = gpu && profiler.gpuTimers;
+    profilerHistoryInit(section.cpu);
+    profilerHistoryInit(section.gpuHistory);
+    for (int q = 0; q < PROFILER_FRAME_LAG; ++q) {
+        section.queries[q] = 0;
+        section.queryFrames[q] = -1;
+    }
+    if (section.gpu) {
+        glGenQueries(PROFILER_FRAME_LAG, section.queries);
+    }
+    profiler.sections.push_back(section);
+    return int(profiler.sections.size()) - 1;
+}
+
+void profilerBeginFrame(Profiler &profiler)
+{
+    if (profiler.frame == 0 && profiler.csv.is_open()) {
+        profiler.csv << "frame,total_ms";
+        for (const ProfilerSection &section : profiler.sections) {
+            profiler.csv << "," << section.name << "_cpu_ms";
+            if (section.gpu) {
+                profiler.csv << "," << section.name << "_gpu_ms";
+            }
+        }
+        profiler.csv << "\n";
+    }
+
+    // The record slot of this frame last held frame - PROFILER_FRAME_LAG;
+    // write it out with whatever GPU results have arrived by now
+    ProfilerFrame &record = profiler.frames[profiler.frame % PROFILER_FRAME_LAG];
+    profilerWriteRow(profiler, record);
+    record.frame = profiler.frame;
+    record.total = -1.0f;
+    record.cpu.assign(profiler.sections.size(), -1.0f);
+    record.gpu.assign(profiler.sections.size(), -1.0f);
+
+    profiler.frameStart = std::chrono::steady_clock::now();
+    profiler.inFrame = true;
+}
+
+// Start timing a section. Does nothing outside of a frame.
+void profilerBegin(Profiler &profiler, int id)
+{
+    if (!profiler.inFrame) {
+        return;
+    }
+    ProfilerSection &section = profiler.sections[id];
+    if (section.gpu) {
+        // A query whose result is still pending is not reused, the GPU
+        // time of this frame is skipped instead
+        int q = int(profiler.frame % PROFILER_FRAME_LAG);
+        if (section.queryFrames[q] < 0) {
+            glBeginQuery(GL_TIME_ELAPSED, section.queries[q]);
+            section.queryFrames[q] = profiler.frame;
+        }
+    }
+    section.cpuStart = std::chrono::steady_clock::now();
+}
+
+void profilerEnd(Profiler &profiler, int id)
+{
+    if (!profiler.inFrame) {
+        return;
+    }
+    ProfilerSection &section = profiler.sections[id];
+    float ms = profilerMilliseconds(section.cpuStart, std::chrono::steady_clock::now());
+    profilerHistoryAdd(section.cpu, ms);
+    profiler.frames[profiler.frame % PROFILER_FRAME_LAG].cpu[id] = ms;
+    if (section.gpu && section.queryFrames[profiler.frame % PROFILER_FRAME_LAG] == profiler.frame) {
+        glEndQuery(GL_TIME_ELAPSED);
+    }
+}
+
+void profilerEndFrame(Profiler &profiler)
+{
+    float ms = profilerMilliseconds(profiler.frameStart, std::chrono::steady_clock::now());
+    profilerHistoryAdd(profiler.frameHistory, ms);
+    profiler.frames[profiler.frame % PROFILER_FRAME_LAG].total = ms;
+    profiler.inFrame = false;
+
+    if (profiler.gpuTimers) {
+        profilerPollQueries(profiler);
+    }
+
+    // Statistics over the history
+    profilerHistoryUpdateStats(profiler.frameHistory, profiler.scratch);
+    for (ProfilerSection &section : profiler.sections) {
+        profilerHistoryUpdateStats(section.cpu, profiler.scratch);
+        if (section.gpu) {
+            profilerHistoryUpdateStats(section.gpuHistory, profiler.scratch);
+        }
+    }
+    ++profiler.frame;
+}
+
+// Write the remaining frames (with the GPU results that are in by now)
+// and release the queries
+void profilerShutdown(Profiler &profiler)
+{
+    if (profiler.gpuTimers) {
+        profilerPollQueries(profiler);
+    }
+    for (std::int64_t f = profiler.frame - PROFILER_FRAME_LAG; f < profiler.frame; ++f) {
+        if (f >= 0) {
+            profilerWriteRow(profiler, profiler.frames[f % PROFILER_FRAME_LAG]);
+        }
+    }
+    for (ProfilerSection &section : profiler.sections) {
+        if (section.gpu) {
+            glDeleteQueries(PROFILER_FRAME_LAG, section.queries);
+        }
+    }
+    profiler.csv.close();
+}
@@ -0,0 +1,179 @@
+#pragma once
+
+#include "utils.h"
+#include "mesh_cache.h"
+
+#include <GL/glew.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// On-disk cache of linked program binaries (glGetProgramBinary). A cache
+// file holds one ProgramCacheHeader followed by the binary. It is keyed by
+// a checksum of the shader sources and of the GL vendor, renderer and
+// version strings, so editing a shader or updating the driver turns the
+// cache into a miss, and the program is compiled and the cache rewritten.
+const std::uint32_t PROGRAM_CACHE_MAGIC = 0x47504d4d; // "MMPG"
+const std::uint32_t PROGRAM_CACHE_VERSION = 1;
+
+struct ProgramCacheHeader {
+    std::uint32_t magic;
+    std::uint32_t version;
+    std::uint64_t key;
+    std::uint32_t binaryFormat;
+    std::uint32_t binarySize;
+};
+
+// Returns true if the driver can save and load program binaries
+bool programCacheSupported(void)
+{
+    if (!GLEW_VERSION_4_1 && !GLEW_ARB_get_program_binary) {
+        return false;
+    }
+    GLint numFormats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &numFormats);
+    return numFormats > 0;
+}
+
+// Key of a program: its sources and the driver that compiles them
+std::uint64_t programCacheKey(const std::string &vertexShaderSource, const std::string &fragmentShaderSource)
+{
+    std::string key = vertexShaderSource;
+    key += '\0';
+    key += fragmentShaderSource;
+    const GLenum strings[] = { GL_VENDOR, GL_RENDERER, GL_VERSION };
+    for (GLenum name : strings) {
+        const GLubyte *value = glGetString(name);
+        key += '\0';
+        if (value != nullptr) {
+            key += reinterpret_cast<const char *>(value);
+        }
+    }
+    return meshCacheChecksum(key.data(), key.size());
+}
+
+// Create a program from the cache file, if it exists and has the given
+// key. Returns 0 on a miss, including when the driver rejects the binary.
+GLuint programCacheLoad(const std::string &cacheFilename, std::uint64_t key)
+{
+    std::FILE *f = std::fopen(cacheFilename.c_str(), "rb");
+    if (f == nullptr) {
+        return 0;
+    }
+    ProgramCacheHeader header;
+    std::vector<char> binary;
+    bool ok = std::fread(&header, sizeof(header), 1, f) == 1 &&
+              header.magic == PROGRAM_CACHE_MAGIC &&
+              header.version == PROGRAM_CACHE_VERSION &&
+              header.key == key;
+    if (ok) {
+        binary.resize(header.binarySize);
+        ok = std::fread(binary.data(), 1, binary.size(), f) == binary.size();
+    }
+    std::fclose(f);
+    if (!ok) {
+        return 0;
+    }
+
+    GLuint program = glCreateProgram();
+    glProgramBinary(program, header.binaryFormat, binary.data(), GLsizei(binary.size()));
+    GLint linked = 0;
+    glGetProgramiv(program, GL_LINK_STATUS, &linked);
+    if (!linked) {
+        glDeleteProgram(program);
+        return 0;
+    }
+    return program;
+}
+
+// Write the binary of a linked program (created with the retrievable
+// hint) to the cache file. Like meshCacheWrite, the file is written under
+// a temporary name and renamed at the end. Writes are serialized, as the
+// shader watcher's thread and the render thread (a rebuild on R) may
+// write the same cache file, and so the same temporary file, at once.
+bool programCacheWrite(const std::string &cacheFilename, std::uint64_t key, GLuint program)
+{
+    GLint binarySize = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &binarySize);
+    if (binarySize <= 0) {
+        return false;
+    }
+    std::vector<char> binary(binarySize);
+    GLenum binaryFormat = 0;
+    glGetProgramBinary(program, binarySize, &binarySize, &binaryFormat, binary.data());
+
+    ProgramCacheHeader header;
+    std::memset(&header, 0, sizeof(header));
+    header.magic = PROGRAM_CACHE_MAGIC;
+    header.version = PROGRAM_CACHE_VERSION;
+    header.key = key;
+    header.binaryFormat = binaryFormat;
+    header.binarySize = std::uint32_t(binarySize);
+
+    static std::mutex writeMutex;
+    std::lock_guard<std::mutex> lock(writeMutex);
+    std::string tempFilename = cacheFilename + ".tmp";
+    std::FILE *f = std::fopen(tempFilename.c_str(), "wb");
+    if (f == nullptr) {
+        return false;
+    }
+    bool ok = std::fwrite(&header, sizeof(header), 1, f) == 1 &&
+              std::fwrite(binary.data(), 1, header.binarySize, f) == header.binarySize;
+    ok = (std::fclose(f) == 0) && ok;
+    if (ok) {
+        // rename() does not replace existing files on Windows
+        std::remove(cacheFilename.c_str());
+        ok = std::rename(tempFilename.c_str(), cacheFilename.c_str()) == 0;
+    }
+    if (!ok) {
+        std::remove(tempFilename.c_str());
+    }
+    return ok;
+}
+
+// Like loadShaderProgram, but takes the program from cacheFilename if it
+// holds a binary of the same sources for the same driver, and otherwise
+// compiles it and (re)writes the cache. An empty cacheFilename, or a
+// driver without program binary formats, always compiles.
+GLuint loadShaderProgramCached(const std::string &vertexShaderFilename,
+                               const std::string &fragmentShaderFilename,
+                               const std::string &cacheFilename,
+                               UniformTable *uniforms = nullptr)
+{
+    if (uniforms != nullptr) {
+        uniforms->clear();
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::string vertexShaderSource = readShaderSource(vertexShaderFilename);
+    std::string fragmentShaderSource = readShaderSource(fragmentShaderFilename);
+    bool useCache = !cacheFilename.empty() && programCacheSupported();
+    std::uint64_t key = useCache ? programCacheKey(vertexShaderSource, fragmentShaderSource) : 0;
+    GLuint program = useCache ? programCacheLoad(cacheFilename, key) : 0;
+    bool hit = program != 0;
+    if (!hit) {
+        program = linkShaderProgram(vertexShaderSource, fragmentShaderSource, useCache);
+        if (program != 0 && useCache && !programCacheWrite(cacheFilename, key, program)) {
+            std::cerr << "Could not write program cache " << cacheFilename << std::endl;
+        }
+    }
+    if (program == 0) {
+        return 0;
+    }
+
+    if (useCache) {
+        double milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "Loaded program " << cacheFilename << (hit ? " from cache" : " from source") << " ("
+                  << milliseconds << " ms)" << std::endl;
+    }
+    if (uniforms != nullptr) {
+        *uniforms = reflectUniforms(program);
+    }
+    return program;
+}
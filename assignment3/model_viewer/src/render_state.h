@@ -0,0 +1,148 @@
+#pragma once
+
+#include <GL/glew.h>
+
+// A cache of the OpenGL state that the viewer's draws change: the
+// program, the vertex array, the texture of every unit and the depth
+// state. The glState* functions only call OpenGL when the state actually
+// changes, and count the calls made and skipped and the draws of the
+// frame. Nothing is unbound after a draw; the next draw binds what it
+// needs.
+//
+// Since nothing is unbound, the VAO (and program and textures) of the
+// last draw stay bound after a frame, and the cache is kept from frame to
+// frame, so a frame that draws what the last one did changes nothing.
+// Code that binds an index buffer must bind its own or the default VAO
+// first, or it replaces the index buffer of that VAO; code that changes
+// any of this state without the cache (VAO creation, texture uploads,
+// program setup and reloads) must then call glStateInvalidate.
+//
+// A RenderPass groups draws that share depth state, and may clear the
+// framebuffer first (with depth writes on, as glClear respects the depth
+// mask).
+
+#define GL_STATE_TEXTURE_UNITS 8
+
+// Cached values that are not known
+#define GL_STATE_UNKNOWN 0xFFFFFFFFu
+
+struct RenderStats {
+    int drawCalls;
+    int stateChanges; // calls that reached OpenGL
+    int skippedChanges; // redundant calls that did not
+};
+
+struct GLStateCache {
+    GLuint program;
+    GLuint vao;
+    GLuint activeUnit;
+    GLenum textureTargets[GL_STATE_TEXTURE_UNITS];
+    GLuint textures[GL_STATE_TEXTURE_UNITS];
+    GLuint depthTest, depthMask; // GL_TRUE, GL_FALSE or unknown
+    GLenum depthFunc;
+    RenderStats frame; // of the current (or, between frames, the last) frame
+};
+
+struct RenderPass {
+    bool depthTest;
+    bool depthWrite;
+    GLenum depthFunc;
+    GLbitfield clear; // buffers cleared when the pass begins, or 0
+};
+
+// Forget the cached state, after OpenGL calls that bypassed the cache
+void glStateInvalidate(GLStateCache *state)
+{
+    state->program = state->vao = state->activeUnit = GL_STATE_UNKNOWN;
+    for (int unit = 0; unit < GL_STATE_TEXTURE_UNITS; ++unit) {
+        state->textureTargets[unit] = GL_STATE_UNKNOWN;
+        state->textures[unit] = GL_STATE_UNKNOWN;
+    }
+    state->depthTest = state->depthMask = state->depthFunc = GL_STATE_UNKNOWN;
+}
+
+// Start counting a new frame; the cached state is kept
+void glStateBeginFrame(GLStateCache *state)
+{
+    state->frame.drawCalls = 0;
+    state->frame.stateChanges = 0;
+    state->frame.skippedChanges = 0;
+}
+
+// Returns true (and counts a change) if a cached value must be set
+inline bool glStateChange(GLStateCache *state, GLuint *cached, GLuint value)
+{
+    if (*cached == value) {
+        ++state->frame.skippedChanges;
+        return false;
+    }
+    *cached = value;
+    ++state->frame.stateChanges;
+    return true;
+}
+
+void glStateUseProgram(GLStateCache *state, GLuint program)
+{
+    if (glStateChange(state, &state->program, program)) {
+        glUseProgram(program);
+    }
+}
+
+void glStateBindVertexArray(GLStateCache *state, GLuint vao)
+{
+    if (glStateChange(state, &state->vao, vao)) {
+        glBindVertexArray(vao);
+    }
+}
+
+// Bind texture to target of a unit (0 for GL_TEXTURE0 and so on). A unit
+// is assumed to be used with one target at a time.
+void glStateBindTexture(GLStateCache *state, int unit, GLenum target, GLuint texture)
+{
+    if (state->textureTargets[unit] == target && state->textures[unit] == texture) {
+        ++state->frame.skippedChanges;
+        return;
+    }
+    if (glStateChange(state, &state->activeUnit, GLuint(unit))) {
+        glActiveTexture(GL_TEXTURE0 + unit);
+    }
+    state->textureTargets[unit] = target;
+    state->textures[unit] = texture;
+    ++state->frame.stateChanges;
+    glBindTexture(target, texture);
+}
+
+void glStateSetDepth(GLStateCache *state, bool test, bool write, GLenum func)
+{
+    if (glStateChange(state, &state->depthTest, test ? GL_TRUE : GL_FALSE)) {
+        if (test) {
+            glEnable(GL_DEPTH_TEST);
+        }
+        else {
+            glDisable(GL_DEPTH_TEST);
+        }
+    }
+    if (glStateChange(state, &state->depthMask, write ? GL_TRUE : GL_FALSE)) {
+        glDepthMask(write ? GL_TRUE : GL_FALSE);
+    }
+    if (glStateChange(state, &state->depthFunc, func)) {
+        glDepthFunc(func);
+    }
+}
+
+// Count draw calls, which are made directly
+inline void glStateCountDraws(GLStateCache *state, int count = 1)
+{
+    state->frame.drawCalls += count;
+}
+
+void renderPassBegin(GLStateCache *state, const RenderPass &pass)
+{
+    if (pass.clear != 0) {
+        if (pass.clear & GL_DEPTH_BUFFER_BIT) {
+            glStateSetDepth(state, pass.depthTest, true, pass.depthFunc);
+        }
+        glClear(pass.clear);
+    }
+    glStateSetDepth(state, pass.depthTest, pass.depthWrite, pass.depthFunc);
+}
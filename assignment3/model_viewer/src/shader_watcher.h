@@ -0,0 +1,195 @@
+#pragma once
+
+#include "program_cache.h"
+
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+// Recompiles shader programs in the background when their sources change.
+// A worker thread watches the shader directory with inotify and, after a
+// shader file has been written, compiles and links every program that uses
+// it in a hidden context shared with the render window. Only programs that
+// link are handed to the render thread (shaderWatcherPoll, once per frame),
+// which swaps them in; when a compile fails, the log is printed and the
+// current program stays in use. File watching is only available on Linux.
+
+// A program to rebuild: its shader files (relative to the watched
+// directory) and its program cache file ("" for none)
+struct WatchedProgram {
+    std::string vertexShader;
+    std::string fragmentShader;
+    std::string cacheFilename;
+};
+
+// A rebuilt program, waiting to be swapped in
+struct RebuiltProgram {
+    int index; // in ShaderWatcher::programs
+    GLuint program;
+};
+
+struct ShaderWatcher {
+    std::string dir;
+    std::vector<WatchedProgram> programs;
+    GLFWwindow *window; // hidden, shares objects with the render window
+    int inotifyFd;
+    std::thread thread;
+    std::atomic<bool> stop;
+
+    std::mutex mutex; // guards rebuilt
+    std::vector<RebuiltProgram> rebuilt;
+
+    ShaderWatcher() : window(nullptr), inotifyFd(-1), stop(false) {}
+};
+
+// Add a program to rebuild; returns its index for shaderWatcherPoll
+int shaderWatcherAdd(ShaderWatcher &watcher, const std::string &vertexShader, const std::string &fragmentShader,
+                     const std::string &cacheFilename)
+{
+    WatchedProgram program;
+    program.vertexShader = vertexShader;
+    program.fragmentShader = fragmentShader;
+    program.cacheFilename = cacheFilename;
+    watcher.programs.push_back(program);
+    return int(watcher.programs.size()) - 1;
+}
+
+#ifdef __linux__
+// Wait up to timeoutMs for changes and add the names of the files that
+// were written (or moved into place, as many editors save) to changed
+void shaderWatcherRead(ShaderWatcher &watcher, int timeoutMs, std::vector<std::string> *changed)
+{
+    pollfd fd = { watcher.inotifyFd, POLLIN, 0 };
+    if (poll(&fd, 1, timeoutMs) <= 0) {
+        return;
+    }
+    alignas(inotify_event) char buffer[4096];
+    ssize_t size = read(watcher.inotifyFd, buffer, sizeof(buffer));
+    for (ssize_t offset = 0; offset < size;) {
+        const inotify_event *event = reinterpret_cast<const inotify_event *>(buffer + offset);
+        if (event->len > 0) {
+            changed->push_back(event->name);
+        }
+        offset += sizeof(inotify_event) + event->len;
+    }
+}
+
+void shaderWatcherRun(ShaderWatcher &watcher)
+{
+    glfwMakeContextCurrent(watcher.window);
+    while (!watcher.stop) {
+        std::vector<std::string> changed;
+        shaderWatcherRead(watcher, 100, &changed);
+        if (changed.empty()) {
+            continue;
+        }
+        // Editors often write a file in several steps; let them finish
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        shaderWatcherRead(watcher, 0, &changed);
+
+        for (std::size_t i = 0; i < watcher.programs.size(); ++i) {
+            const WatchedProgram &source = watcher.programs[i];
+            bool touched = false;
+            for (const std::string &name : changed) {
+                touched = touched || name == source.vertexShader || name == source.fragmentShader;
+            }
+            if (!touched) {
+                continue;
+            }
+            std::cout << "Rebuilding " << source.vertexShader << " + " << source.fragmentShader << std::endl;
+            GLuint program = loadShaderProgramCached(watcher.dir + source.vertexShader,
+                                                     watcher.dir + source.fragmentShader, source.cacheFilename);
+            if (program == 0) {
+                continue;
+            }
+            // The program must be complete before another context uses it
+            glFinish();
+            std::lock_guard<std::mutex> lock(watcher.mutex);
+            RebuiltProgram rebuilt = { int(i), program };
+            watcher.rebuilt.push_back(rebuilt);
+        }
+    }
+    glfwMakeContextCurrent(nullptr);
+}
+#endif // __linux__
+
+// Start watching dir (ending with a separator) for changes to the added
+// programs. Must be called on the thread that owns sharedWindow, after
+// all programs are added. Returns false if watching is not available.
+bool shaderWatcherStart(ShaderWatcher &watcher, const std::string &dir, GLFWwindow *sharedWindow)
+{
+#ifdef __linux__
+    watcher.dir = dir;
+    watcher.inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watcher.inotifyFd < 0) {
+        return false;
+    }
+    if (inotify_add_watch(watcher.inotifyFd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        close(watcher.inotifyFd);
+        watcher.inotifyFd = -1;
+        return false;
+    }
+    // The other window hints stay as they were set for sharedWindow
+    glfwWindowHint(GLFW_VISIBLE, GL_FALSE);
+    watcher.window = glfwCreateWindow(1, 1, "Shader compiler", nullptr, sharedWindow);
+    if (watcher.window == nullptr) {
+        close(watcher.inotifyFd);
+        watcher.inotifyFd = -1;
+        return false;
+    }
+    watcher.stop = false;
+    watcher.thread = std::thread(shaderWatcherRun, std::ref(watcher));
+    return true;
+#else
+    (void)watcher;
+    (void)dir;
+    (void)sharedWindow;
+    return false;
+#endif // __linux__
+}
+
+// Take the programs that were rebuilt since the last call. The caller
+// owns them and should delete the programs they replace.
+std::vector<RebuiltProgram> shaderWatcherPoll(ShaderWatcher &watcher)
+{
+    std::vector<RebuiltProgram> rebuilt;
+    std::lock_guard<std::mutex> lock(watcher.mutex);
+    rebuilt.swap(watcher.rebuilt);
+    return rebuilt;
+}
+
+// Stop the worker (waiting for a running compile) and delete programs
+// that were never taken. Must be called on the thread that started it.
+void shaderWatcherShutdown(ShaderWatcher &watcher)
+{
+    if (watcher.thread.joinable()) {
+        watcher.stop = true;
+        watcher.thread.join();
+    }
+    for (const RebuiltProgram &rebuilt : shaderWatcherPoll(watcher)) {
+        glDeleteProgram(rebuilt.program);
+    }
+#ifdef __linux__
+    if (watcher.inotifyFd >= 0) {
+        close(watcher.inotifyFd);
+        watcher.inotifyFd = -1;
+    }
+#endif // __linux__
+    if (watcher.window != nullptr) {
+        glfwDestroyWindow(watcher.window);
+        watcher.window = nullptr;
+    }
+}
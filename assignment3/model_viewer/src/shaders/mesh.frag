@@ -4,49 +4,120 @@
 in vec3 v_normal;
 in vec3 v_light;
 in vec3 v_viewer;
+in vec3 v_view_position;
 
 out vec4 frag_color;
 
-uniform vec3 u_ambient_light;
-uniform vec3 u_light_color;
-
-uniform vec3 u_diffuse_color, u_specular_color;
-uniform float u_specular_power;
-
-uniform float u_ambient_weight;
-uniform float u_diffuse_weight;
-uniform float u_specular_weight;
+// Lighting and material state, shared with mesh.vert.
+// Must match ShadingBlock in model_viewer.cpp.
+layout(std140) uniform Shading {
+	vec3 u_ambient_light;
+	vec3 u_light_position;
+	vec3 u_light_color;
+	vec3 u_diffuse_color;
+	vec3 u_specular_color;
+	float u_specular_power;
+	float u_ambient_weight;
+	float u_diffuse_weight;
+	float u_specular_weight;
+	int u_color_mode;
+	int u_use_gamma_correction;
+	int u_use_color_inversion;
+	float u_roughness;
+};
 
 #define CM_NORMAL_AS_RGB	0
 #define CM_BLINN_PHONG		1
 #define CM_REFLECTION		2
-uniform int u_color_mode;
-uniform int u_use_gamma_correction;
-uniform int u_use_color_inversion;
+#define CM_DIFFUSE_IBL		3
 
+// Prefiltered environment, from glossy (level 0) to diffuse (last level)
 uniform samplerCube u_cubemap;
-//uniform float u_cubemap_lod;
-
-vec3 blinn_phong(vec3 N, vec3 L, vec3 H) 
+uniform float u_cubemap_max_lod;
+
+// Irradiance of the environment divided by pi, as 9 spherical harmonics
+// coefficients in the order Y00, Y1-1, Y10, Y11, Y2-2, Y2-1, Y20, Y21, Y22
+uniform vec3 u_irradiance_sh[9];
+
+// Point lights binned into clusters of the view frustum (see
+// light_clusters.h), used when u_clustered_lights is set. u_light_grid
+// holds the (offset, count) of every cluster's lights in u_light_indices;
+// u_lights holds two texels per light: view space position and radius,
+// and color.
+uniform int u_clustered_lights;
+uniform usamplerBuffer u_light_grid;
+uniform usamplerBuffer u_light_indices;
+uniform samplerBuffer u_lights;
+uniform ivec3 u_cluster_dims;
+uniform vec2 u_cluster_tile_size; // in pixels
+uniform vec2 u_cluster_depth; // slice = log(depth) * x + y
+
+// Weighted diffuse and specular terms of a light of intensity C from
+// direction L
+vec3 light_terms(vec3 N, vec3 L, vec3 H, vec3 C)
 {
-	vec3 ambient_intensity = u_ambient_light;
-	vec3 ambient_term = u_diffuse_color * ambient_intensity;
-
-	vec3 diffuse_intensity = u_light_color * max(0.0, dot(N, L));
-	vec3 diffuse_term = u_diffuse_color * diffuse_intensity;
+	vec3 diffuse_term = u_diffuse_color * C * max(0.0, dot(N, L));
 
 	// Normalization factor from "Real-Time Rendering" book, 2nd ed.
 	float specular_norm = (8.0 + u_specular_power) / 8.0;
-	vec3 specular_intensity = u_light_color * max(0.0, pow(dot(N, H), u_specular_power)) * specular_norm;
+	vec3 specular_intensity = C * max(0.0, pow(dot(N, H), u_specular_power)) * specular_norm;
 	vec3 specular_term = u_specular_color * specular_intensity;
 
-	mat3 color_matrix = mat3(ambient_term, diffuse_term, specular_term);
-	vec3 weights = vec3(u_ambient_weight, u_diffuse_weight, u_specular_weight);
-	vec3 combined = color_matrix * weights;
-	//vec3 combined = ambient_term + diffuse_term + specular_term;
+	return diffuse_term * u_diffuse_weight + specular_term * u_specular_weight;
+}
+
+// The point lights of the fragment's cluster, with an inverse square
+// falloff that reaches zero at the light's radius
+vec3 clustered_lights(vec3 N)
+{
+	vec3 V = normalize(-v_view_position);
+	float depth = max(-v_view_position.z, 1e-4);
+	ivec3 cell = ivec3(ivec2(gl_FragCoord.xy / u_cluster_tile_size), int(log(depth) * u_cluster_depth.x + u_cluster_depth.y));
+	cell = clamp(cell, ivec3(0), u_cluster_dims - 1);
+	int cluster = cell.x + u_cluster_dims.x * (cell.y + u_cluster_dims.y * cell.z);
+	uvec2 range = texelFetch(u_light_grid, cluster).xy;
+
+	vec3 color = vec3(0.0);
+	for (uint i = 0u; i < range.y; i++) {
+		int light = int(texelFetch(u_light_indices, int(range.x + i)).r);
+		vec4 position_radius = texelFetch(u_lights, 2 * light);
+		vec3 to_light = position_radius.xyz - v_view_position;
+		float d = length(to_light);
+		if (d >= position_radius.w)
+			continue;
+		float window = 1.0 - pow(d / position_radius.w, 4.0);
+		float falloff = window * window / (d * d + 1.0);
+		vec3 L = to_light / d;
+		color += light_terms(N, L, normalize(L + V), texelFetch(u_lights, 2 * light + 1).rgb * falloff);
+	}
+	return color;
+}
+
+vec3 blinn_phong(vec3 N, vec3 L, vec3 H) 
+{
+	vec3 ambient_intensity = u_ambient_light;
+	vec3 ambient_term = u_diffuse_color * ambient_intensity;
+
+	vec3 combined = ambient_term * u_ambient_weight + light_terms(N, L, H, u_light_color);
+	if (u_clustered_lights != 0)
+		combined += clustered_lights(N);
 	return combined;
 }
 
+vec3 sh_irradiance(vec3 N)
+{
+	vec3 color = u_irradiance_sh[0] * 0.282095;
+	color += u_irradiance_sh[1] * (0.488603 * N.y);
+	color += u_irradiance_sh[2] * (0.488603 * N.z);
+	color += u_irradiance_sh[3] * (0.488603 * N.x);
+	color += u_irradiance_sh[4] * (1.092548 * N.x * N.y);
+	color += u_irradiance_sh[5] * (1.092548 * N.y * N.z);
+	color += u_irradiance_sh[6] * (0.315392 * (3.0 * N.z * N.z - 1.0));
+	color += u_irradiance_sh[7] * (1.092548 * N.x * N.z);
+	color += u_irradiance_sh[8] * (0.546274 * (N.x * N.x - N.y * N.y));
+	return max(color, vec3(0.0));
+}
+
 vec3 gamma_correction(vec3 linear_color)
 {
 	return pow(linear_color, vec3(1.0/2.2));
@@ -69,7 +140,10 @@ void main()
 			color = blinn_phong(N, L, H);
 			break;
 		case CM_REFLECTION:
-			color = texture(u_cubemap, R).rgb;
+			color = textureLod(u_cubemap, R, u_roughness * u_cubemap_max_lod).rgb;
+			break;
+		case CM_DIFFUSE_IBL:
+			color = u_diffuse_color * sh_irradiance(N);
 			break;
 		default:
 			break;
@@ -3,25 +3,73 @@
 #extension GL_ARB_explicit_attrib_location : require
 
 layout(location = 0) in vec4 a_position;
-layout(location = 1) in vec3 a_normal;
+layout(location = 1) in vec3 a_normal; // xy is an octahedral normal in packed formats
 
 out vec3 v_normal;
 out vec3 v_light;
 out vec3 v_viewer;
+out vec3 v_view_position; // for the clustered point lights
 
 uniform mat4 u_v; // View matrix
 uniform mat4 u_mv; // Model-View matrix
 uniform mat4 u_mvp; // Model-View-Projection matrix
 
-uniform vec3 u_light_position;
+// Lighting and material state, shared with mesh.frag.
+// Must match ShadingBlock in model_viewer.cpp.
+layout(std140) uniform Shading {
+	vec3 u_ambient_light;
+	vec3 u_light_position;
+	vec3 u_light_color;
+	vec3 u_diffuse_color;
+	vec3 u_specular_color;
+	float u_specular_power;
+	float u_ambient_weight;
+	float u_diffuse_weight;
+	float u_specular_weight;
+	int u_color_mode;
+	int u_use_gamma_correction;
+	int u_use_color_inversion;
+	float u_roughness;
+};
+
+// Vertex format decoding (see VertexFormat)
+uniform vec3 u_position_offset;
+uniform vec3 u_position_scale;
+uniform int u_octahedral_normals;
+
+// Per-instance model transforms (see instancing.h), four texels per
+// matrix, applied before u_mv when u_instanced is set
+uniform int u_instanced;
+uniform samplerBuffer u_instances;
+
+vec3 oct_decode(vec2 e)
+{
+	vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+	if (n.z < 0.0) {
+		vec2 sign_not_zero = vec2(e.x >= 0.0 ? 1.0 : -1.0, e.y >= 0.0 ? 1.0 : -1.0);
+		n.xy = (1.0 - abs(e.yx)) * sign_not_zero;
+	}
+	return normalize(n);
+}
 
 void main()
 {
-	vec3 vs_vertex_position = mat3(u_mv) * a_position.xyz;
+	vec3 position = u_position_offset + u_position_scale * a_position.xyz;
+	vec3 normal = u_octahedral_normals != 0 ? oct_decode(a_normal.xy) : a_normal;
+	if (u_instanced != 0) {
+		int base = 4 * gl_InstanceID;
+		mat4 instance = mat4(texelFetch(u_instances, base), texelFetch(u_instances, base + 1),
+		                     texelFetch(u_instances, base + 2), texelFetch(u_instances, base + 3));
+		position = (instance * vec4(position, 1.0)).xyz;
+		normal = mat3(instance) * normal;
+	}
+
+	vec3 vs_vertex_position = mat3(u_mv) * position;
 	vec3 vs_light_position = mat3(u_v) * u_light_position;
-	v_normal = mat3(u_mv) * a_normal;
+	v_normal = mat3(u_mv) * normal;
 	v_light = vs_light_position - vs_vertex_position;
 	v_viewer = -vs_vertex_position;
+	v_view_position = (u_mv * vec4(position, 1.0)).xyz;
 
-	gl_Position = u_mvp * vec4(a_position.xyz, 1.0);
+	gl_Position = u_mvp * vec4(position, 1.0);
 }
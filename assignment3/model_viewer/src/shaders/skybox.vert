@@ -12,7 +12,9 @@ uniform float u_aspect;
 
 void main() 
 {
-	gl_Position = a_position;
+	// On the far plane, so that it is drawn only where the depth buffer is
+	// still clear (display() draws it after the mesh with GL_LEQUAL)
+	gl_Position = vec4(a_position.xy, 1.0, 1.0);
 
 	vec3 vs_ray_dir = vec3(
 		tan(u_fovy/2.0)*u_aspect*a_position.x, 
@@ -0,0 +1,593 @@
+#pragma once
+
+#include "cubemap_image.h"
+#include "mesh_cache.h"
+#include "parallel.h"
+#include "spherical_harmonics.h"
+
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SOFT_RASTER_SSE2
+#endif
+
+// CPU renderer for machines without a GPU, reproducing what display()
+// draws with mesh.vert/mesh.frag and skybox.vert/skybox.frag.
+//
+// A frame runs in three parallel passes on a StealingPool:
+//  1. vertices are transformed into clip space with the varyings of
+//     mesh.vert;
+//  2. the triangles, in contiguous chunks, are clipped against the near
+//     plane, set up in snapped screen coordinates and binned into the
+//     64x64 pixel tiles their bounds overlap;
+//  3. every tile is rasterized on its own: edge functions are evaluated
+//     for four pixels at a time (SSE2) against a tile depth buffer that
+//     keeps the nearest triangle per pixel, and each covered pixel is then
+//     shaded once; uncovered pixels get the skybox.
+// Tiles walk the bins chunk by chunk, so triangles are always tested in
+// submission order and the image does not depend on the thread count.
+// There is no backface culling, as in the viewer.
+
+const int SOFT_TILE_SIZE = 64;
+
+// RGBA8 color, top row first (unlike glReadPixels)
+struct SoftFramebuffer {
+    int width, height;
+    std::vector<std::uint8_t> color;
+
+    SoftFramebuffer() : width(0), height(0) {}
+};
+
+// The state that display() hands to the shaders
+struct SoftScene {
+    glm::mat4 model, view, projection;
+    float fovy, aspect; // of the skybox rays, 0 fovy in orthographic mode (see getFovy)
+
+    // The Shading block (see ShadingBlock); light_position is in world space
+    glm::vec3 ambient_light;
+    glm::vec3 light_position;
+    glm::vec3 light_color;
+    glm::vec3 diffuse_color;
+    glm::vec3 specular_color;
+    float specular_power;
+    float ambient_weight, diffuse_weight, specular_weight;
+    int color_mode; // a ColorMode
+    bool gamma_correction;
+    bool color_inversion;
+    float roughness;
+
+    const CubemapImage *skybox; // linear; the background color is used if null
+    const std::vector<CubemapImage> *prefiltered; // mip levels of u_cubemap, for reflections
+    SH9 irradiance_sh;
+    glm::vec3 background_color;
+
+    SoftScene() : skybox(nullptr), prefiltered(nullptr) {}
+};
+
+enum SoftColorMode {
+    SOFT_NORMAL_AS_RGB = 0,
+    SOFT_BLINN_PHONG = 1,
+    SOFT_REFLECTION = 2,
+    SOFT_DIFFUSE_IBL = 3
+};
+
+// Output of the vertex stage: clip position and the varyings of mesh.vert
+struct SoftVertex {
+    glm::vec4 clip;
+    glm::vec3 normal, light, viewer;
+};
+
+// A triangle set up for rasterization: snapped screen positions (y down),
+// window depth and 1 / w of its vertices. Vertex indices with
+// SOFT_CLIPPED_VERTEX set refer to the clipped vertices of the chunk.
+struct SoftTriangle {
+    float x[3], y[3], z[3], invW[3];
+    std::uint32_t v[3];
+};
+
+const std::uint32_t SOFT_CLIPPED_VERTEX = 0x80000000u;
+
+// Per-thread buffers of a tile: depth and the nearest triangle (with its
+// chunk) of every pixel
+struct SoftTileBuffers {
+    float depth[SOFT_TILE_SIZE * SOFT_TILE_SIZE];
+    const SoftTriangle *triangle[SOFT_TILE_SIZE * SOFT_TILE_SIZE];
+    int chunk[SOFT_TILE_SIZE * SOFT_TILE_SIZE];
+};
+
+struct SoftRasterStats {
+    std::size_t numTriangles; // set up after clipping and culling
+    std::size_t numBinned;    // triangle/tile pairs
+};
+
+struct SoftRasterizer {
+    StealingPool pool;
+    std::vector<SoftVertex> vertices;
+    int numChunks;
+    std::vector<std::vector<SoftTriangle> > triangles; // per chunk
+    std::vector<std::vector<SoftVertex> > clipped;     // per chunk
+    std::vector<std::vector<std::uint32_t> > bins;     // chunk * numTiles + tile
+    std::vector<SoftTileBuffers> tileBuffers;         // per thread
+    int tilesX, tilesY;
+    SoftRasterStats stats;
+
+    explicit SoftRasterizer(int numThreads = 0) : pool(numThreads), numChunks(0), tilesX(0), tilesY(0) {}
+};
+
+namespace {
+SoftVertex softLerp(const SoftVertex &a, const SoftVertex &b, float t)
+{
+    SoftVertex v;
+    v.clip = a.clip + t * (b.clip - a.clip);
+    v.normal = a.normal + t * (b.normal - a.normal);
+    v.light = a.light + t * (b.light - a.light);
+    v.viewer = a.viewer + t * (b.viewer - a.viewer);
+    return v;
+}
+
+// Screen position snapped to 1/16 pixel, as GPUs do, so that shared
+// edges are evaluated identically by both triangles
+float softSnap(float x)
+{
+    return std::floor(x * 16.0f + 0.5f) * (1.0f / 16.0f);
+}
+
+// Set up a triangle in screen space and add it to the bins of its chunk.
+// Vertices must be in front of the near plane.
+void softSetupTriangle(SoftRasterizer &raster, int chunk, int width, int height,
+                       const SoftVertex *const vertex[3], const std::uint32_t index[3])
+{
+    SoftTriangle triangle;
+    for (int k = 0; k < 3; ++k) {
+        const glm::vec4 &clip = vertex[k]->clip;
+        float invW = 1.0f / clip.w;
+        triangle.x[k] = softSnap((clip.x * invW * 0.5f + 0.5f) * width);
+        triangle.y[k] = softSnap((0.5f - clip.y * invW * 0.5f) * height);
+        triangle.z[k] = clip.z * invW * 0.5f + 0.5f;
+        triangle.invW[k] = invW;
+        triangle.v[k] = index[k];
+    }
+    float area = (triangle.x[1] - triangle.x[0]) * (triangle.y[2] - triangle.y[0]) -
+                 (triangle.x[2] - triangle.x[0]) * (triangle.y[1] - triangle.y[0]);
+    if (area == 0.0f) {
+        return;
+    }
+
+    // Pixels whose centers are within the bounds
+    float minX = std::min(triangle.x[0], std::min(triangle.x[1], triangle.x[2]));
+    float maxX = std::max(triangle.x[0], std::max(triangle.x[1], triangle.x[2]));
+    float minY = std::min(triangle.y[0], std::min(triangle.y[1], triangle.y[2]));
+    float maxY = std::max(triangle.y[0], std::max(triangle.y[1], triangle.y[2]));
+    int x0 = std::max(0, int(std::ceil(minX - 0.5f)));
+    int x1 = std::min(width - 1, int(std::floor(maxX - 0.5f)));
+    int y0 = std::max(0, int(std::ceil(minY - 0.5f)));
+    int y1 = std::min(height - 1, int(std::floor(maxY - 0.5f)));
+    if (x0 > x1 || y0 > y1) {
+        return;
+    }
+
+    std::vector<SoftTriangle> &triangles = raster.triangles[chunk];
+    std::uint32_t id = std::uint32_t(triangles.size());
+    triangles.push_back(triangle);
+    int numTiles = raster.tilesX * raster.tilesY;
+    for (int ty = y0 / SOFT_TILE_SIZE; ty <= y1 / SOFT_TILE_SIZE; ++ty) {
+        for (int tx = x0 / SOFT_TILE_SIZE; tx <= x1 / SOFT_TILE_SIZE; ++tx) {
+            raster.bins[std::size_t(chunk) * numTiles + ty * raster.tilesX + tx].push_back(id);
+        }
+    }
+}
+
+// Clip a triangle against the near plane (z >= -w) and set up the 0, 1
+// or 2 resulting triangles
+void softClipTriangle(SoftRasterizer &raster, int chunk, int width, int height, const std::uint32_t index[3])
+{
+    const SoftVertex *vertex[3];
+    int outcodes[3], numBehind = 0;
+    for (int k = 0; k < 3; ++k) {
+        vertex[k] = &raster.vertices[index[k]];
+        const glm::vec4 &c = vertex[k]->clip;
+        outcodes[k] = (c.x > c.w) | (c.x < -c.w) << 1 | (c.y > c.w) << 2 | (c.y < -c.w) << 3 |
+                      (c.z > c.w) << 4 | (c.z < -c.w) << 5;
+        numBehind += (c.z < -c.w);
+    }
+    if ((outcodes[0] & outcodes[1] & outcodes[2]) != 0) {
+        return; // all outside one plane
+    }
+    if (numBehind == 0) {
+        softSetupTriangle(raster, chunk, width, height, vertex, index);
+        return;
+    }
+
+    // Sutherland-Hodgman against z + w >= 0, appending new vertices to
+    // the chunk's clipped vertices
+    std::vector<SoftVertex> &clipped = raster.clipped[chunk];
+    std::uint32_t polygon[4];
+    int numPolygon = 0;
+    for (int k = 0; k < 3; ++k) {
+        const SoftVertex &a = *vertex[k], &b = *vertex[(k + 1) % 3];
+        float da = a.clip.z + a.clip.w, db = b.clip.z + b.clip.w;
+        if (da >= 0.0f) {
+            polygon[numPolygon++] = index[k];
+        }
+        if ((da >= 0.0f) != (db >= 0.0f)) {
+            polygon[numPolygon++] = std::uint32_t(clipped.size()) | SOFT_CLIPPED_VERTEX;
+            clipped.push_back(softLerp(a, b, da / (da - db)));
+        }
+    }
+    for (int k = 1; k + 1 < numPolygon; ++k) {
+        std::uint32_t fan[3] = { polygon[0], polygon[k], polygon[k + 1] };
+        const SoftVertex *fanVertex[3];
+        for (int j = 0; j < 3; ++j) {
+            fanVertex[j] = (fan[j] & SOFT_CLIPPED_VERTEX) ? &clipped[fan[j] & ~SOFT_CLIPPED_VERTEX]
+                                                          : &raster.vertices[fan[j]];
+        }
+        softSetupTriangle(raster, chunk, width, height, fanVertex, fan);
+    }
+}
+
+glm::vec3 softSampleLod(const std::vector<CubemapImage> &levels, const glm::vec3 &direction, float lod)
+{
+    lod = glm::clamp(lod, 0.0f, float(levels.size() - 1));
+    int level = int(lod);
+    glm::vec3 color = cubemapSample(levels[level], direction);
+    if (lod > float(level)) {
+        color = glm::mix(color, cubemapSample(levels[level + 1], direction), lod - float(level));
+    }
+    return color;
+}
+
+// mesh.frag
+glm::vec3 softShade(const SoftScene &scene, const glm::vec3 &normal, const glm::vec3 &light,
+                    const glm::vec3 &viewer)
+{
+    glm::vec3 N = glm::normalize(normal);
+    glm::vec3 L = glm::normalize(light);
+    glm::vec3 V = glm::normalize(viewer);
+    glm::vec3 H = glm::normalize(L + V);
+
+    glm::vec3 color(0.0f);
+    switch (scene.color_mode) {
+    case SOFT_NORMAL_AS_RGB:
+        color = 0.5f * N + 0.5f;
+        break;
+    case SOFT_BLINN_PHONG: {
+        glm::vec3 ambient = scene.diffuse_color * scene.ambient_light;
+        glm::vec3 diffuse = scene.diffuse_color * scene.light_color * std::max(0.0f, glm::dot(N, L));
+        float specularNorm = (8.0f + scene.specular_power) / 8.0f;
+        float NdotH = glm::dot(N, H);
+        float specular = NdotH > 0.0f ? std::pow(NdotH, scene.specular_power) * specularNorm : 0.0f;
+        color = scene.ambient_weight * ambient + scene.diffuse_weight * diffuse +
+                scene.specular_weight * specular * scene.specular_color * scene.light_color;
+        break;
+    }
+    case SOFT_REFLECTION:
+        if (scene.prefiltered != nullptr && !scene.prefiltered->empty()) {
+            glm::vec3 R = glm::reflect(-V, N);
+            float maxLod = float(scene.prefiltered->size() - 1);
+            color = softSampleLod(*scene.prefiltered, R, scene.roughness * maxLod);
+        }
+        break;
+    case SOFT_DIFFUSE_IBL:
+        color = scene.diffuse_color * glm::max(shEvaluate(scene.irradiance_sh, N), glm::vec3(0.0f));
+        break;
+    default:
+        break;
+    }
+    if (scene.gamma_correction) {
+        color = glm::pow(glm::max(color, glm::vec3(0.0f)), glm::vec3(1.0f / 2.2f));
+    }
+    if (scene.color_inversion) {
+        color = glm::vec3(1.0f) - color;
+    }
+    return color;
+}
+
+inline void softStore(std::uint8_t *pixel, const glm::vec3 &color)
+{
+    for (int c = 0; c < 3; ++c) {
+        pixel[c] = std::uint8_t(glm::clamp(color[c], 0.0f, 1.0f) * 255.0f + 0.5f);
+    }
+    pixel[3] = 255;
+}
+
+// Edge function setup of a triangle: E_k(x, y) = a[k] x + b[k] y + c[k],
+// relative to the tile origin, positive inside. The edge opposite vertex
+// k gives its barycentric weight E_k / area.
+struct SoftEdges {
+    float a[3], b[3], c[3];
+    bool inclusive[3]; // top-left edges own the pixels they pass through
+    float invArea;
+};
+
+void softSetupEdges(const SoftTriangle &triangle, float originX, float originY, SoftEdges *edges)
+{
+    double area = (double(triangle.x[1]) - triangle.x[0]) * (double(triangle.y[2]) - triangle.y[0]) -
+                  (double(triangle.x[2]) - triangle.x[0]) * (double(triangle.y[1]) - triangle.y[0]);
+    double sign = area > 0.0 ? 1.0 : -1.0;
+    for (int k = 0; k < 3; ++k) {
+        int i = (k + 1) % 3, j = (k + 2) % 3;
+        double ax = double(triangle.x[i]) - originX, ay = double(triangle.y[i]) - originY;
+        double dx = double(triangle.x[j]) - triangle.x[i], dy = double(triangle.y[j]) - triangle.y[i];
+        // (dx, dy) x (p - a), made positive inside for both windings
+        edges->a[k] = float(-dy * sign);
+        edges->b[k] = float(dx * sign);
+        edges->c[k] = float((dy * ax - dx * ay) * sign);
+        double sdx = dx * sign, sdy = dy * sign;
+        edges->inclusive[k] = sdy < 0.0 || (sdy == 0.0 && sdx > 0.0);
+    }
+    edges->invArea = float(1.0 / (area * sign));
+}
+
+// Depth test the pixels of a tile that a triangle covers
+void softRasterizeTriangle(const SoftTriangle &triangle, int chunk, int tileX, int tileY, int tileW, int tileH,
+                           SoftTileBuffers &tile)
+{
+    float originX = float(tileX * SOFT_TILE_SIZE), originY = float(tileY * SOFT_TILE_SIZE);
+    SoftEdges e;
+    softSetupEdges(triangle, originX, originY, &e);
+
+    // Pixels of the tile within the triangle's bounds
+    float minX = std::min(triangle.x[0], std::min(triangle.x[1], triangle.x[2])) - originX;
+    float maxX = std::max(triangle.x[0], std::max(triangle.x[1], triangle.x[2])) - originX;
+    float minY = std::min(triangle.y[0], std::min(triangle.y[1], triangle.y[2])) - originY;
+    float maxY = std::max(triangle.y[0], std::max(triangle.y[1], triangle.y[2])) - originY;
+    int x0 = std::max(0, int(std::ceil(minX - 0.5f))) & ~3;
+    int x1 = std::min(tileW - 1, int(std::floor(maxX - 0.5f)));
+    int y0 = std::max(0, int(std::ceil(minY - 0.5f)));
+    int y1 = std::min(tileH - 1, int(std::floor(maxY - 0.5f)));
+
+    float z0 = triangle.z[0], dz1 = triangle.z[1] - z0, dz2 = triangle.z[2] - z0;
+#ifdef SOFT_RASTER_SSE2
+    const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+    const __m128 offsets = _mm_set_ps(3.5f, 2.5f, 1.5f, 0.5f);
+    __m128 a[3], inclusive[3];
+    for (int k = 0; k < 3; ++k) {
+        a[k] = _mm_set1_ps(e.a[k]);
+        inclusive[k] = _mm_castsi128_ps(_mm_set1_epi32(e.inclusive[k] ? -1 : 0));
+    }
+    const __m128 invArea = _mm_set1_ps(e.invArea);
+    const __m128 vz0 = _mm_set1_ps(z0), vdz1 = _mm_set1_ps(dz1), vdz2 = _mm_set1_ps(dz2);
+    for (int y = y0; y <= y1; ++y) {
+        float py = float(y) + 0.5f;
+        __m128 rowC[3];
+        for (int k = 0; k < 3; ++k) {
+            rowC[k] = _mm_set1_ps(e.b[k] * py + e.c[k]);
+        }
+        for (int x = x0; x <= x1; x += 4) {
+            __m128 px = _mm_add_ps(_mm_set1_ps(float(x)), offsets);
+            __m128 edge[3], inside = _mm_cmplt_ps(px, _mm_set1_ps(float(x1 + 1)));
+            for (int k = 0; k < 3; ++k) {
+                edge[k] = _mm_add_ps(_mm_mul_ps(a[k], px), rowC[k]);
+                __m128 covers = _mm_or_ps(_mm_cmpgt_ps(edge[k], zero),
+                                          _mm_and_ps(_mm_cmpeq_ps(edge[k], zero), inclusive[k]));
+                inside = _mm_and_ps(inside, covers);
+            }
+            if (_mm_movemask_ps(inside) == 0) {
+                continue;
+            }
+            __m128 z = _mm_add_ps(vz0, _mm_add_ps(_mm_mul_ps(_mm_mul_ps(edge[1], invArea), vdz1),
+                                                  _mm_mul_ps(_mm_mul_ps(edge[2], invArea), vdz2)));
+            float *depth = &tile.depth[y * SOFT_TILE_SIZE + x];
+            __m128 old = _mm_loadu_ps(depth);
+            __m128 pass = _mm_and_ps(inside, _mm_cmplt_ps(z, old));
+            pass = _mm_and_ps(pass, _mm_and_ps(_mm_cmpge_ps(z, zero), _mm_cmple_ps(z, one)));
+            int mask = _mm_movemask_ps(pass);
+            if (mask == 0) {
+                continue;
+            }
+            _mm_storeu_ps(depth, _mm_or_ps(_mm_and_ps(pass, z), _mm_andnot_ps(pass, old)));
+            for (int i = 0; i < 4; ++i) {
+                if (mask & (1 << i)) {
+                    tile.triangle[y * SOFT_TILE_SIZE + x + i] = &triangle;
+                    tile.chunk[y * SOFT_TILE_SIZE + x + i] = chunk;
+                }
+            }
+        }
+    }
+#else
+    for (int y = y0; y <= y1; ++y) {
+        float py = float(y) + 0.5f;
+        for (int x = x0; x <= x1; ++x) {
+            float px = float(x) + 0.5f;
+            float edge[3];
+            bool inside = true;
+            for (int k = 0; k < 3; ++k) {
+                edge[k] = e.a[k] * px + (e.b[k] * py + e.c[k]);
+                inside = inside && (edge[k] > 0.0f || (edge[k] == 0.0f && e.inclusive[k]));
+            }
+            if (!inside) {
+                continue;
+            }
+            float z = z0 + ((edge[1] * e.invArea) * dz1 + (edge[2] * e.invArea) * dz2);
+            float &depth = tile.depth[y * SOFT_TILE_SIZE + x];
+            if (z < depth && z >= 0.0f && z <= 1.0f) {
+                depth = z;
+                tile.triangle[y * SOFT_TILE_SIZE + x] = &triangle;
+                tile.chunk[y * SOFT_TILE_SIZE + x] = chunk;
+            }
+        }
+    }
+#endif
+}
+
+// Rasterize and shade one tile into the framebuffer
+void softRenderTile(SoftRasterizer &raster, const SoftScene &scene, int tileIndex, SoftTileBuffers &tile,
+                    SoftFramebuffer *framebuffer)
+{
+    int tileX = tileIndex % raster.tilesX, tileY = tileIndex / raster.tilesX;
+    int tileW = std::min(SOFT_TILE_SIZE, framebuffer->width - tileX * SOFT_TILE_SIZE);
+    int tileH = std::min(SOFT_TILE_SIZE, framebuffer->height - tileY * SOFT_TILE_SIZE);
+    std::fill(tile.depth, tile.depth + SOFT_TILE_SIZE * SOFT_TILE_SIZE, 1.0f);
+    std::fill(tile.triangle, tile.triangle + SOFT_TILE_SIZE * SOFT_TILE_SIZE, nullptr);
+
+    int numTiles = raster.tilesX * raster.tilesY;
+    for (int chunk = 0; chunk < raster.numChunks; ++chunk) {
+        const std::vector<SoftTriangle> &triangles = raster.triangles[chunk];
+        for (std::uint32_t id : raster.bins[std::size_t(chunk) * numTiles + tileIndex]) {
+            softRasterizeTriangle(triangles[id], chunk, tileX, tileY, tileW, tileH, tile);
+        }
+    }
+
+    // Skybox rays as in skybox.vert, for uncovered pixels
+    glm::mat3 viewTranspose = glm::mat3(glm::transpose(scene.view));
+    float tanHalfFovy = std::tan(scene.fovy / 2.0f);
+    float originX = float(tileX * SOFT_TILE_SIZE), originY = float(tileY * SOFT_TILE_SIZE);
+    for (int y = 0; y < tileH; ++y) {
+        float py = originY + float(y) + 0.5f;
+        std::uint8_t *row = &framebuffer->color[(std::size_t(originY) + y) * framebuffer->width * 4];
+        for (int x = 0; x < tileW; ++x) {
+            float px = originX + float(x) + 0.5f;
+            std::uint8_t *pixel = row + (std::size_t(originX) + x) * 4;
+            const SoftTriangle *triangle = tile.triangle[y * SOFT_TILE_SIZE + x];
+            if (triangle == nullptr) {
+                glm::vec3 color = scene.background_color;
+                if (scene.skybox != nullptr) {
+                    float ndcX = 2.0f * px / framebuffer->width - 1.0f;
+                    float ndcY = 1.0f - 2.0f * py / framebuffer->height;
+                    glm::vec3 ray(tanHalfFovy * scene.aspect * ndcX, tanHalfFovy * ndcY, -1.0f);
+                    color = cubemapSample(*scene.skybox, viewTranspose * ray);
+                }
+                softStore(pixel, color);
+                continue;
+            }
+
+            // Perspective-correct varyings from the screen-space weights
+            float w[3], sum = 0.0f;
+            for (int k = 0; k < 3; ++k) {
+                int i = (k + 1) % 3, j = (k + 2) % 3;
+                float edge = (triangle->x[j] - triangle->x[i]) * (py - triangle->y[i]) -
+                             (triangle->y[j] - triangle->y[i]) * (px - triangle->x[i]);
+                w[k] = edge * triangle->invW[k];
+                sum += w[k];
+            }
+            glm::vec3 normal(0.0f), light(0.0f), viewer(0.0f);
+            int chunk = tile.chunk[y * SOFT_TILE_SIZE + x];
+            for (int k = 0; k < 3; ++k) {
+                std::uint32_t v = triangle->v[k];
+                const SoftVertex &vertex = (v & SOFT_CLIPPED_VERTEX) ? raster.clipped[chunk][v & ~SOFT_CLIPPED_VERTEX]
+                                                                     : raster.vertices[v];
+                float weight = sum != 0.0f ? w[k] / sum : 1.0f / 3.0f;
+                normal += weight * vertex.normal;
+                light += weight * vertex.light;
+                viewer += weight * vertex.viewer;
+            }
+            softStore(pixel, softShade(scene, normal, light, viewer));
+        }
+    }
+}
+} // namespace
+
+// Render a mesh (with float positions and normals) and the skybox into a
+// framebuffer of the given size
+void softRender(SoftRasterizer &raster, const MeshView &mesh, const SoftScene &scene, int width, int height,
+                SoftFramebuffer *framebuffer)
+{
+    framebuffer->width = width;
+    framebuffer->height = height;
+    framebuffer->color.resize(std::size_t(width) * height * 4);
+    int numThreads = raster.pool.numThreads();
+
+    // Vertex stage, as mesh.vert
+    glm::mat4 mv = scene.view * scene.model;
+    glm::mat4 mvp = scene.projection * mv;
+    glm::mat3 mv3(mv);
+    glm::vec3 lightPosition = glm::mat3(scene.view) * scene.light_position;
+    raster.vertices.resize(mesh.numVertices);
+    int numVertexRanges = int(std::min<std::size_t>(8 * numThreads, mesh.numVertices / 1024 + 1));
+    raster.pool.run(numVertexRanges, [&](int range, int) {
+        std::size_t begin = mesh.numVertices * range / numVertexRanges;
+        std::size_t end = mesh.numVertices * (range + 1) / numVertexRanges;
+        for (std::size_t i = begin; i < end; ++i) {
+            SoftVertex &vertex = raster.vertices[i];
+            glm::vec3 position = mesh.vertices[i];
+            glm::vec3 viewPosition = mv3 * position;
+            vertex.clip = mvp * glm::vec4(position, 1.0f);
+            vertex.normal = mv3 * mesh.normals[i];
+            vertex.light = lightPosition - viewPosition;
+            vertex.viewer = -viewPosition;
+        }
+    });
+
+    // Setup and binning, one chunk of triangles per task
+    raster.tilesX = (width + SOFT_TILE_SIZE - 1) / SOFT_TILE_SIZE;
+    raster.tilesY = (height + SOFT_TILE_SIZE - 1) / SOFT_TILE_SIZE;
+    int numTiles = raster.tilesX * raster.tilesY;
+    std::size_t numTriangles = mesh.numIndices / 3;
+    raster.numChunks = int(std::min<std::size_t>(8 * numThreads, numTriangles / 256 + 1));
+    raster.triangles.resize(raster.numChunks);
+    raster.clipped.resize(raster.numChunks);
+    raster.bins.resize(std::size_t(raster.numChunks) * numTiles);
+    raster.pool.run(raster.numChunks, [&](int chunk, int) {
+        raster.triangles[chunk].clear();
+        raster.clipped[chunk].clear();
+        for (int tile = 0; tile < numTiles; ++tile) {
+            raster.bins[std::size_t(chunk) * numTiles + tile].clear();
+        }
+        std::size_t begin = numTriangles * chunk / raster.numChunks;
+        std::size_t end = numTriangles * (chunk + 1) / raster.numChunks;
+        for (std::size_t t = begin; t < end; ++t) {
+            softClipTriangle(raster, chunk, width, height, &mesh.indices[3 * t]);
+        }
+    });
+    raster.stats.numTriangles = raster.stats.numBinned = 0;
+    for (int chunk = 0; chunk < raster.numChunks; ++chunk) {
+        raster.stats.numTriangles += raster.triangles[chunk].size();
+        for (int tile = 0; tile < numTiles; ++tile) {
+            raster.stats.numBinned += raster.bins[std::size_t(chunk) * numTiles + tile].size();
+        }
+    }
+
+    // Tiles
+    raster.tileBuffers.resize(numThreads);
+    raster.pool.run(numTiles, [&](int tile, int thread) {
+        softRenderTile(raster, scene, tile, raster.tileBuffers[thread], framebuffer);
+    });
+}
+
+// Load the prefiltered levels of a cubemap as mip levels, as
+// cubemapLoaderAddMipmapped does: level i is box-filtered down to the size
+// of the first level divided by 2^i
+bool softLoadCubemapLevels(const std::vector<std::string> &dirnames, std::vector<CubemapImage> *levels,
+                           std::string *error, int numThreads = 0)
+{
+    levels->assign(dirnames.size(), CubemapImage());
+    for (std::size_t i = 0; i < dirnames.size(); ++i) {
+        CubemapImage &level = (*levels)[i];
+        if (!cubemapImageLoad(&level, dirnames[i], error, numThreads)) {
+            return false;
+        }
+        int size = std::max((*levels)[0].size >> i, 1);
+        while (level.size > size) {
+            CubemapImage half;
+            cubemapImageDownsample(level, &half);
+            level = half;
+        }
+    }
+    return true;
+}
+
+// Write the framebuffer as an RGB PNG file
+bool softFramebufferSave(const SoftFramebuffer &framebuffer, const std::string &filename)
+{
+    std::vector<unsigned char> rgb(std::size_t(framebuffer.width) * framebuffer.height * 3);
+    for (std::size_t i = 0; i < rgb.size() / 3; ++i) {
+        for (int c = 0; c < 3; ++c) {
+            rgb[3 * i + c] = framebuffer.color[4 * i + c];
+        }
+    }
+    unsigned error = lodepng::encode(filename, rgb, unsigned(framebuffer.width), unsigned(framebuffer.height), LCT_RGB);
+    if (error != 0) {
+        std::cerr << "Error: could not write " << filename << ": " << lodepng_error_text(error) << std::endl;
+        return false;
+    }
+    return true;
+}
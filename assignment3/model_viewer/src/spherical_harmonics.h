@@ -0,0 +1,119 @@
+#pragma once
+
+#include "cubemap_image.h"
+#include "parallel.h"
+
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+
+#include <cstddef>
+#include <vector>
+
+// Third order (9 coefficient) real spherical harmonics, in the order
+// Y00, Y1-1, Y10, Y11, Y2-2, Y2-1, Y20, Y21, Y22. Used for irradiance
+// environment maps (Ramamoorthi and Hanrahan, "An Efficient Representation
+// for Irradiance Environment Maps", 2001).
+struct SH9 {
+    glm::vec3 c[9];
+};
+
+// Evaluate the 9 basis functions in a unit direction
+void shBasis9(const glm::vec3 &d, float basis[9])
+{
+    basis[0] = 0.282095f;
+    basis[1] = 0.488603f * d.y;
+    basis[2] = 0.488603f * d.z;
+    basis[3] = 0.488603f * d.x;
+    basis[4] = 1.092548f * d.x * d.y;
+    basis[5] = 1.092548f * d.y * d.z;
+    basis[6] = 0.315392f * (3.0f * d.z * d.z - 1.0f);
+    basis[7] = 1.092548f * d.x * d.z;
+    basis[8] = 0.546274f * (d.x * d.x - d.y * d.y);
+}
+
+// Project one face of sRGB RGBA8 texels (top row first, as decoded from a
+// PNG file) onto the basis, weighting every texel by its solid angle. The
+// six faces can be projected independently and their coefficients added.
+SH9 shProjectFaceSrgba8(int face, int size, const unsigned char *pixels)
+{
+    static const SrgbTable table;
+    SH9 sum;
+    for (int k = 0; k < 9; ++k) {
+        sum.c[k] = glm::vec3(0.0f);
+    }
+    float basis[9];
+    for (int y = 0; y < size; ++y) {
+        for (int x = 0; x < size; ++x) {
+            const unsigned char *p = &pixels[(std::size_t(y) * size + x) * 4];
+            glm::vec3 d = glm::normalize(cubemapTexelDirection(face, size, x, y));
+            glm::vec3 radiance = glm::vec3(table.toLinear[p[0]], table.toLinear[p[1]], table.toLinear[p[2]]) *
+                                 cubemapTexelSolidAngle(size, x, y);
+            shBasis9(d, basis);
+            for (int k = 0; k < 9; ++k) {
+                sum.c[k] += radiance * basis[k];
+            }
+        }
+    }
+    return sum;
+}
+
+// Project the radiance of a cubemap onto the basis, weighting every texel
+// by its solid angle. Rows are projected in parallel; the partial sums are
+// added in a fixed order, so the result does not depend on the number of
+// threads.
+SH9 shProjectCubemap(const CubemapImage &image, int numThreads)
+{
+    int n = image.size;
+    std::vector<SH9> rows(6 * n);
+    parallelFor(6 * n, numThreads, [&](int row) {
+        int face = row / n, y = row % n;
+        SH9 &sum = rows[row];
+        for (int k = 0; k < 9; ++k) {
+            sum.c[k] = glm::vec3(0.0f);
+        }
+        float basis[9];
+        for (int x = 0; x < n; ++x) {
+            glm::vec3 d = glm::normalize(cubemapTexelDirection(face, n, x, y));
+            glm::vec3 radiance = image.faces[face][y * n + x] * cubemapTexelSolidAngle(n, x, y);
+            shBasis9(d, basis);
+            for (int k = 0; k < 9; ++k) {
+                sum.c[k] += radiance * basis[k];
+            }
+        }
+    });
+
+    SH9 sh;
+    for (int k = 0; k < 9; ++k) {
+        sh.c[k] = glm::vec3(0.0f);
+    }
+    for (const SH9 &row : rows) {
+        for (int k = 0; k < 9; ++k) {
+            sh.c[k] += row.c[k];
+        }
+    }
+    return sh;
+}
+
+// Convolve radiance coefficients with the clamped cosine lobe and divide
+// by pi, so that shEvaluate gives the light reflected by a white
+// Lambertian surface (irradiance / pi) with the given normal
+SH9 shIrradiance(const SH9 &radiance)
+{
+    const float band[3] = { 1.0f, 2.0f / 3.0f, 0.25f };
+    SH9 sh;
+    for (int k = 0; k < 9; ++k) {
+        sh.c[k] = radiance.c[k] * band[k == 0 ? 0 : (k < 4 ? 1 : 2)];
+    }
+    return sh;
+}
+
+glm::vec3 shEvaluate(const SH9 &sh, const glm::vec3 &d)
+{
+    float basis[9];
+    shBasis9(d, basis);
+    glm::vec3 value(0.0f);
+    for (int k = 0; k < 9; ++k) {
+        value += sh.c[k] * basis[k];
+    }
+    return value;
+}
@@ -1,14 +1,25 @@
 #pragma once
 
+#include "bc1.h"
+#include "cubemap_image.h"
+#include "ktx.h"
+#include "spherical_harmonics.h"
+
 #include <GL/glew.h>
 #include <lodepng.h>
 
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <map>
 #include <string>
 #include <vector>
 
+// Locations of the active uniforms of a program, by name. Array uniforms
+// are stored under their base name (without "[0]").
+typedef std::map<std::string, GLint> UniformTable;
+
 std::string readShaderSource(const std::string &filename)
 {
     std::ifstream file(filename);
@@ -38,44 +49,82 @@ void showProgramInfoLog(GLuint program)
     std::cerr << infoLogStr << std::endl;
 }
 
-GLuint loadShaderProgram(const std::string &vertexShaderFilename,
-                         const std::string &fragmentShaderFilename)
+// Query the locations of all active uniforms of a linked program, so that
+// they do not have to be looked up by name while rendering. Uniforms in
+// uniform blocks have no location and are skipped.
+UniformTable reflectUniforms(GLuint program)
+{
+    UniformTable uniforms;
+    GLint numUniforms = 0, maxNameLength = 0;
+    glGetProgramiv(program, GL_ACTIVE_UNIFORMS, &numUniforms);
+    glGetProgramiv(program, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxNameLength);
+    std::vector<char> name(std::max(maxNameLength, 1));
+    for (GLint i = 0; i < numUniforms; ++i) {
+        GLint size = 0;
+        GLenum type = 0;
+        glGetActiveUniform(program, i, name.size(), nullptr, &size, &type, &name[0]);
+        GLint location = glGetUniformLocation(program, &name[0]);
+        if (location < 0) {
+            continue;
+        }
+        std::string nameStr(&name[0]);
+        std::string::size_type bracket = nameStr.find('[');
+        uniforms[nameStr.substr(0, bracket)] = location;
+    }
+    return uniforms;
+}
+
+// Returns the location of a uniform from a table, or -1 (which glUniform*
+// ignores) if the program does not use it
+GLint uniformLocation(const UniformTable &uniforms, const std::string &name)
+{
+    UniformTable::const_iterator it = uniforms.find(name);
+    return it != uniforms.end() ? it->second : -1;
+}
+
+// Compile a shader of the given type from source. Returns 0 (after
+// printing the info log) if compilation fails.
+GLuint compileShader(GLenum type, const std::string &source)
 {
-    // Load and compile vertex shader
-    GLuint vertexShader = glCreateShader(GL_VERTEX_SHADER);
-    std::string vertexShaderSource = readShaderSource(vertexShaderFilename);
-    const char *vertexShaderSourcePtr = vertexShaderSource.c_str();
-    glShaderSource(vertexShader, 1, &vertexShaderSourcePtr, nullptr);
+    GLuint shader = glCreateShader(type);
+    const char *sourcePtr = source.c_str();
+    glShaderSource(shader, 1, &sourcePtr, nullptr);
 
-    glCompileShader(vertexShader);
+    glCompileShader(shader);
     GLint compiled = 0;
-    glGetShaderiv(vertexShader, GL_COMPILE_STATUS, &compiled);
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
     if (!compiled) {
-        std::cerr << "Vertex shader compilation failed:" << std::endl;
-        showShaderInfoLog(vertexShader);
-        glDeleteShader(vertexShader);
+        std::cerr << (type == GL_VERTEX_SHADER ? "Vertex" : "Fragment") << " shader compilation failed:" << std::endl;
+        showShaderInfoLog(shader);
+        glDeleteShader(shader);
         return 0;
     }
+    return shader;
+}
 
-    // Load and compile fragment shader
-    GLuint fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-    std::string fragmentShaderSource = readShaderSource(fragmentShaderFilename);
-    const char *fragmentShaderSourcePtr = fragmentShaderSource.c_str();
-    glShaderSource(fragmentShader, 1, &fragmentShaderSourcePtr, nullptr);
-
-    glCompileShader(fragmentShader);
-    compiled = 0;
-    glGetShaderiv(fragmentShader, GL_COMPILE_STATUS, &compiled);
-    if (!compiled) {
-        std::cerr << "Fragment shader compilation failed:" << std::endl;
-        showShaderInfoLog(fragmentShader);
+// Compile and link a program from vertex and fragment shader sources.
+// With retrievable, the driver is asked to keep the program binary, so
+// that it can be read back with glGetProgramBinary. Returns 0 if either
+// step fails; the shader objects are deleted in any case.
+GLuint linkShaderProgram(const std::string &vertexShaderSource,
+                         const std::string &fragmentShaderSource,
+                         bool retrievable = false)
+{
+    GLuint vertexShader = compileShader(GL_VERTEX_SHADER, vertexShaderSource);
+    if (vertexShader == 0) {
+        return 0;
+    }
+    GLuint fragmentShader = compileShader(GL_FRAGMENT_SHADER, fragmentShaderSource);
+    if (fragmentShader == 0) {
         glDeleteShader(vertexShader);
-        glDeleteShader(fragmentShader);
         return 0;
     }
 
     // Create program object
     GLuint program = glCreateProgram();
+    if (retrievable) {
+        glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    }
 
     // Attach shaders to the program
     glAttachShader(program, vertexShader);
@@ -84,6 +133,12 @@ GLuint loadShaderProgram(const std::string &vertexShaderFilename,
     // Link program
     glLinkProgram(program);
 
+    // Clean up: the shaders are only needed for linking
+    glDetachShader(program, vertexShader);
+    glDetachShader(program, fragmentShader);
+    glDeleteShader(vertexShader);
+    glDeleteShader(fragmentShader);
+
     // Check linking status
     GLint linked = 0;
     glGetProgramiv(program, GL_LINK_STATUS, &linked);
@@ -91,14 +146,27 @@ GLuint loadShaderProgram(const std::string &vertexShaderFilename,
         std::cerr << "Linking failed:" << std::endl;
         showProgramInfoLog(program);
         glDeleteProgram(program);
-        glDeleteShader(vertexShader);
-        glDeleteShader(fragmentShader);
         return 0;
     }
 
-    // Clean up
-    glDetachShader(program, vertexShader);
-    glDetachShader(program, fragmentShader);
+    return program;
+}
+
+// Load, compile and link a program. If uniforms is given, it is filled
+// with the locations of the program's active uniforms.
+GLuint loadShaderProgram(const std::string &vertexShaderFilename,
+                         const std::string &fragmentShaderFilename,
+                         UniformTable *uniforms = nullptr)
+{
+    if (uniforms != nullptr) {
+        uniforms->clear();
+    }
+
+    GLuint program = linkShaderProgram(readShaderSource(vertexShaderFilename),
+                                       readShaderSource(fragmentShaderFilename));
+    if (program != 0 && uniforms != nullptr) {
+        *uniforms = reflectUniforms(program);
+    }
 
     return program;
 }
@@ -167,7 +235,8 @@ GLuint loadCubemap(const std::string &dirname)
     return texture;
 }
 
-// Load cubemap with pre-computed mipmap chain
+// Load cubemap with pre-computed mipmap chain. The images of every level
+// may have the size of level 0; they are downsampled to their mip size.
 GLuint loadCubemapMipmap(const std::string &dirname)
 {
     const char *levels[] = { "2048", "512", "128", "32", "8", "2", "0.5", "0.125" };
@@ -192,6 +261,11 @@ GLuint loadCubemapMipmap(const std::string &dirname)
                 std::cout << "Error: " << lodepng_error_text(error) << std::endl;
                 std::exit(EXIT_FAILURE);
             }
+            if (i > 0 && !downsampleSrgba8To(data[i][j], &width[i], &height[i],
+                                             std::max(width[0] >> i, 1u), std::max(height[0] >> i, 1u))) {
+                std::cout << "Error: " << filename << " is too small for mipmap level " << i << std::endl;
+                std::exit(EXIT_FAILURE);
+            }
         }
     }
 
@@ -202,6 +276,7 @@ GLuint loadCubemapMipmap(const std::string &dirname)
     glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
     glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
     glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, num_levels - 1);
     for (unsigned i = 0; i < num_levels; ++i) {
         for (unsigned j = 0; j < num_sides; ++j) {
             glTexImage2D(targets[j], i, GL_SRGB8_ALPHA8, width[i], height[i],
@@ -212,3 +287,80 @@ GLuint loadCubemapMipmap(const std::string &dirname)
 
     return texture;
 }
+
+// Load a BC1-compressed cubemap written by cubemap_compress: every face and
+// mip level is uploaded as is, with no decoding. Returns 0 if the file
+// cannot be read (for example if it has not been generated) or the driver
+// does not support the format, so that the caller can fall back to the PNG
+// images. If irradiance is given, it is set to the spherical harmonics
+// irradiance of level 0 (see shIrradiance).
+GLuint loadCubemapKTX(const std::string &filename, SH9 *irradiance = nullptr)
+{
+    const GLenum targets[] = {
+        GL_TEXTURE_CUBE_MAP_POSITIVE_X, GL_TEXTURE_CUBE_MAP_NEGATIVE_X,
+        GL_TEXTURE_CUBE_MAP_POSITIVE_Y, GL_TEXTURE_CUBE_MAP_NEGATIVE_Y,
+        GL_TEXTURE_CUBE_MAP_POSITIVE_Z, GL_TEXTURE_CUBE_MAP_NEGATIVE_Z
+    };
+
+    KTXImage image;
+    std::string error;
+    if (!ktxRead(&image, filename, &error)) {
+        if (std::ifstream(filename.c_str())) {
+            std::cout << "Error: " << error << std::endl; // exists, but is invalid
+        }
+        return 0;
+    }
+    if (image.numFaces != 6 || image.glInternalFormat != GL_COMPRESSED_SRGB_S3TC_DXT1_EXT ||
+        image.width != image.height) {
+        std::cout << "Error: " << filename << " is not a BC1 cubemap" << std::endl;
+        return 0;
+    }
+    for (GLuint i = 0; i < image.numLevels; ++i) {
+        GLuint size = std::max(image.width >> i, 1u);
+        for (GLuint j = 0; j < 6; ++j) {
+            if (image.images[i * 6 + j].size() != bc1ImageSize(size, size)) {
+                std::cout << "Error: " << filename << " has the wrong size for mipmap level " << i << std::endl;
+                return 0;
+            }
+        }
+    }
+
+    while (glGetError() != GL_NO_ERROR) {}
+    GLuint texture;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_CUBE_MAP, texture);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER,
+                    image.numLevels > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, image.numLevels - 1);
+    for (GLuint i = 0; i < image.numLevels; ++i) {
+        GLuint size = std::max(image.width >> i, 1u);
+        for (GLuint j = 0; j < 6; ++j) {
+            const std::vector<unsigned char> &data = image.images[i * 6 + j];
+            glCompressedTexImage2D(targets[j], i, image.glInternalFormat, size, size, 0,
+                                   GLsizei(data.size()), data.data());
+        }
+    }
+    glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+    if (glGetError() != GL_NO_ERROR) {
+        std::cout << "Error: could not upload " << filename << " (BC1 sRGB textures unsupported?)" << std::endl;
+        glDeleteTextures(1, &texture);
+        return 0;
+    }
+
+    if (irradiance != nullptr) {
+        SH9 radiance = SH9();
+        std::vector<unsigned char> pixels;
+        for (GLuint j = 0; j < 6; ++j) {
+            bc1DecompressImage(image.images[j].data(), image.width, image.height, &pixels);
+            SH9 face = shProjectFaceSrgba8(int(j), int(image.width), pixels.data());
+            for (int k = 0; k < 9; ++k) {
+                radiance.c[k] += face.c[k];
+            }
+        }
+        *irradiance = shIrradiance(radiance);
+    }
+    return texture;
+}
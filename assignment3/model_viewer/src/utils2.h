@@ -23,13 +23,19 @@ struct Trackball {
     glm::vec3 vStart;
     glm::quat qStart;
     glm::quat qCurrent;
+    glm::vec3 pivot; // point kept in place by the rotation, set before tracking starts
+    glm::vec3 translationStart;
+    glm::vec3 translation; // applied after the rotation, to orbit around pivots
 
     Trackball() : radius(1.0),
                   center(glm::vec2(0.0f, 0.0f)),
                   tracking(false),
                   vStart(glm::vec3(0.0f, 0.0f, 1.0f)),
                   qStart(glm::quat(1.0f, 0.0f, 0.0f, 0.0f)),
-                  qCurrent(glm::quat(1.0f, 0.0f, 0.0f, 0.0f))
+                  qCurrent(glm::quat(1.0f, 0.0f, 0.0f, 0.0f)),
+                  pivot(glm::vec3(0.0f)),
+                  translationStart(glm::vec3(0.0f)),
+                  translation(glm::vec3(0.0f))
     {}
 };
 
@@ -90,6 +96,7 @@ void trackballStartTracking(Trackball &trackball, glm::vec2 point)
 {
     trackball.vStart = mapMousePointToUnitSphere(point, trackball.radius, trackball.center);
     trackball.qStart = glm::quat(trackball.qCurrent);
+    trackball.translationStart = trackball.translation;
     trackball.tracking = true;
 }
 
@@ -117,6 +124,11 @@ void trackballMove(Trackball &trackball, glm::vec2 point)
         q = glm::normalize(q);
         trackball.qCurrent = glm::normalize(glm::cross(q, trackball.qStart));
     }
+
+    // Rotate the start translation around the pivot by the same amount,
+    // so that the pivot stays where it is
+    glm::quat rotation = trackball.qCurrent * glm::inverse(trackball.qStart);
+    trackball.translation = trackball.pivot + rotation * (trackball.translationStart - trackball.pivot);
 }
 
 // Get trackball orientation in matrix form
@@ -125,6 +137,15 @@ glm::mat4 trackballGetRotationMatrix(Trackball &trackball)
     return glm::mat4_cast(trackball.qCurrent);
 }
 
+// Get trackball orientation and translation (from orbiting around a
+// pivot) in matrix form
+glm::mat4 trackballGetMatrix(Trackball &trackball)
+{
+    glm::mat4 matrix = glm::mat4_cast(trackball.qCurrent);
+    matrix[3] = glm::vec4(trackball.translation, 1.0f);
+    return matrix;
+}
+
 // Read an OBJMesh from an .obj file
 bool objMeshLoad(OBJMesh &mesh, const std::string &filename)
 {
@@ -0,0 +1,122 @@
+#pragma once
+
+#include "mesh_cache.h"
+#include "parallel.h"
+
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// Interleaved vertex with a full-precision position and an octahedral
+// normal in two signed normalized shorts (16 bytes)
+struct PackedVertex {
+    float position[3];
+    std::int16_t normal[2];
+};
+
+// Interleaved vertex with a position quantized to 16 bits per component
+// relative to the mesh bounds (the fourth component is padding) and an
+// octahedral normal (12 bytes)
+struct QuantizedVertex {
+    std::uint16_t position[4];
+    std::int16_t normal[2];
+};
+
+namespace {
+inline float signNotZero(float x)
+{
+    return x >= 0.0f ? 1.0f : -1.0f;
+}
+
+inline std::int16_t packSnorm16(float x)
+{
+    return std::int16_t(std::floor(glm::clamp(x, -1.0f, 1.0f) * 32767.0f + 0.5f));
+}
+} // namespace
+
+// Encode a unit vector with the octahedral mapping (Cigolle et al., "A
+// Survey of Efficient Representations for Independent Unit Vectors").
+// The shader decodes it with oct_decode in mesh.vert.
+void octEncode(const glm::vec3 &n, std::int16_t encoded[2])
+{
+    float l1 = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+    glm::vec2 p = l1 > 0.0f ? glm::vec2(n.x, n.y) / l1 : glm::vec2(0.0f);
+    if (n.z < 0.0f) {
+        p = glm::vec2((1.0f - std::abs(p.y)) * signNotZero(p.x),
+                      (1.0f - std::abs(p.x)) * signNotZero(p.y));
+    }
+    encoded[0] = packSnorm16(p.x);
+    encoded[1] = packSnorm16(p.y);
+}
+
+// Get the axis-aligned bounding box of a mesh's vertices
+void meshBounds(const MeshView &mesh, glm::vec3 *boundsMin, glm::vec3 *boundsMax)
+{
+    glm::vec3 lo(0.0f), hi(0.0f);
+    if (mesh.numVertices > 0) {
+        lo = hi = mesh.vertices[0];
+    }
+    for (std::size_t i = 1; i < mesh.numVertices; ++i) {
+        lo = glm::min(lo, mesh.vertices[i]);
+        hi = glm::max(hi, mesh.vertices[i]);
+    }
+    *boundsMin = lo;
+    *boundsMax = hi;
+}
+
+// Interleave positions and octahedral normals
+void packVertices(const MeshView &mesh, std::vector<PackedVertex> *packed, int numThreads)
+{
+    packed->resize(mesh.numVertices);
+    parallelForRange(mesh.numVertices, numThreads, [&](std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin; i < end; ++i) {
+            PackedVertex &vertex = (*packed)[i];
+            vertex.position[0] = mesh.vertices[i].x;
+            vertex.position[1] = mesh.vertices[i].y;
+            vertex.position[2] = mesh.vertices[i].z;
+            octEncode(mesh.normals[i], vertex.normal);
+        }
+    });
+}
+
+// Interleave 16-bit quantized positions and octahedral normals. A
+// position is reconstructed as offset + scale * (quantized / 65535).
+void quantizeVertices(const MeshView &mesh, std::vector<QuantizedVertex> *quantized,
+                      glm::vec3 *offset, glm::vec3 *scale, int numThreads)
+{
+    glm::vec3 boundsMin, boundsMax;
+    meshBounds(mesh, &boundsMin, &boundsMax);
+    glm::vec3 extent = boundsMax - boundsMin;
+    glm::vec3 invExtent(extent.x > 0.0f ? 1.0f / extent.x : 0.0f,
+                        extent.y > 0.0f ? 1.0f / extent.y : 0.0f,
+                        extent.z > 0.0f ? 1.0f / extent.z : 0.0f);
+
+    quantized->resize(mesh.numVertices);
+    parallelForRange(mesh.numVertices, numThreads, [&](std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin; i < end; ++i) {
+            QuantizedVertex &vertex = (*quantized)[i];
+            glm::vec3 t = glm::clamp((mesh.vertices[i] - boundsMin) * invExtent, 0.0f, 1.0f);
+            for (int c = 0; c < 3; ++c) {
+                vertex.position[c] = std::uint16_t(t[c] * 65535.0f + 0.5f);
+            }
+            vertex.position[3] = 0;
+            octEncode(mesh.normals[i], vertex.normal);
+        }
+    });
+    *offset = boundsMin;
+    *scale = extent;
+}
+
+// Narrow an index buffer to 16 bits. Only valid if all indices are below
+// 65536.
+void packIndices16(const MeshView &mesh, std::vector<std::uint16_t> *indices)
+{
+    indices->resize(mesh.numIndices);
+    for (std::size_t i = 0; i < mesh.numIndices; ++i) {
+        (*indices)[i] = std::uint16_t(mesh.indices[i]);
+    }
+}
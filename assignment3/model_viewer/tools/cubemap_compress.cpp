@@ -0,0 +1,212 @@
+// Cubemap compression tool
+//
+// Compresses a cubemap (posx.png ... negz.png) and its mip chain to BC1
+// and writes them to <cubemap_dir>/cubemap.ktx, which the viewer uploads
+// as is instead of decoding the PNG files. If the directory has
+// prefiltered images (prefiltered/<power>/), they are compressed to
+// <cubemap_dir>/prefiltered.ktx as one level per mip level, like
+// loadCubemapMipmap. Runs on the CPU only.
+//
+// Usage: cubemap_compress <cubemap_dir> [options]
+//
+
+#include "bc1.h"
+#include "cubemap_image.h"
+#include "ktx.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// GL_COMPRESSED_SRGB_S3TC_DXT1_EXT and GL_RGB, without including GL
+const std::uint32_t formatSrgbBC1 = 0x8C4C;
+const std::uint32_t baseFormatRGB = 0x1907;
+
+// Same levels as loadCubemapMipmap
+const char *const levelNames[] = { "2048", "512", "128", "32", "8", "2", "0.5", "0.125" };
+const int numLevels = sizeof(levelNames) / sizeof(levelNames[0]);
+
+void printUsage(const char *program)
+{
+    std::cout << "Usage: " << program << " <cubemap_dir> [options]" << std::endl
+              << "  --output DIR   output directory (default: cubemap_dir)" << std::endl
+              << "  --threads N    number of threads (default: all cores)" << std::endl;
+}
+
+double secondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Statistics over all compressed faces of a file
+struct CompressStats {
+    std::size_t uncompressedBytes; // as GL_SRGB8_ALPHA8
+    std::size_t compressedBytes;
+    double squaredError;
+    std::size_t numSamples;
+};
+
+// Compress one face level into the image and accumulate its error
+void compressFace(const std::vector<unsigned char> &pixels, unsigned width, unsigned height,
+                  std::vector<unsigned char> *blocks, CompressStats *stats, int numThreads)
+{
+    bc1CompressImage(pixels.data(), width, height, blocks, numThreads);
+    std::vector<unsigned char> decoded;
+    bc1DecompressImage(blocks->data(), width, height, &decoded);
+    for (std::size_t i = 0; i < decoded.size(); ++i) {
+        if (i % 4 != 3) {
+            double d = double(decoded[i]) - pixels[i];
+            stats->squaredError += d * d;
+            ++stats->numSamples;
+        }
+    }
+    stats->uncompressedBytes += pixels.size();
+    stats->compressedBytes += blocks->size();
+}
+
+bool writeKTX(const KTXImage &image, const std::string &filename, const CompressStats &stats,
+              std::chrono::steady_clock::time_point start)
+{
+    std::string error;
+    if (!ktxWrite(image, filename, &error)) {
+        std::cerr << "Error: " << error << std::endl;
+        return false;
+    }
+    double mse = stats.squaredError / std::max<std::size_t>(stats.numSamples, 1);
+    double psnr = mse > 0.0 ? 10.0 * std::log10(255.0 * 255.0 / mse) : 99.0;
+    std::cout << "Wrote " << filename << ": " << image.width << "x" << image.height << ", "
+              << image.numLevels << " levels, " << stats.compressedBytes / 1024 << " KiB ("
+              << stats.uncompressedBytes / 1024 << " KiB uncompressed), PSNR " << psnr << " dB, "
+              << secondsSince(start) << " s" << std::endl;
+    return true;
+}
+
+KTXImage makeCubemapKTX(unsigned width, unsigned height, int numLevels)
+{
+    KTXImage image;
+    image.glInternalFormat = formatSrgbBC1;
+    image.glBaseInternalFormat = baseFormatRGB;
+    image.width = width;
+    image.height = height;
+    image.numFaces = 6;
+    image.numLevels = numLevels;
+    image.images.resize(6 * numLevels);
+    return image;
+}
+
+// The cubemap with a mip chain down to 1x1, downsampled in linear space
+bool compressCubemap(const std::string &inputDir, const std::string &filename, int numThreads)
+{
+    auto start = std::chrono::steady_clock::now();
+    std::vector<unsigned char> pixels[6];
+    unsigned width[6], height[6], errors[6];
+    parallelFor(6, numThreads, [&](int f) {
+        std::string name = inputDir + "/" + cubemapImageFaceNames[f] + ".png";
+        errors[f] = lodepng::decode(pixels[f], width[f], height[f], name);
+    });
+    for (int f = 0; f < 6; ++f) {
+        if (errors[f] != 0 || width[f] != width[0] || height[f] != height[0]) {
+            std::cerr << "Error: " << inputDir << "/" << cubemapImageFaceNames[f] << ".png: "
+                      << (errors[f] != 0 ? lodepng_error_text(errors[f]) : "faces must have the same size")
+                      << std::endl;
+            return false;
+        }
+    }
+    int levels = 1;
+    while ((std::max(width[0], height[0]) >> levels) > 0) {
+        ++levels;
+    }
+    KTXImage image = makeCubemapKTX(width[0], height[0], levels);
+    CompressStats stats = CompressStats();
+    for (int level = 0; level < levels; ++level) {
+        for (int f = 0; f < 6; ++f) {
+            if (level > 0) {
+                downsampleSrgba8To(pixels[f], &width[f], &height[f],
+                                   std::max(width[f] / 2, 1u), std::max(height[f] / 2, 1u));
+            }
+            compressFace(pixels[f], width[f], height[f], &image.images[level * 6 + f], &stats, numThreads);
+        }
+    }
+    return writeKTX(image, filename, stats, start);
+}
+
+// The prefiltered levels, from the glossiest at level 0. Each level has
+// half the size of the one before (as in the cubemap loader), but the
+// chain need not end at 1x1, as the loaders set GL_TEXTURE_MAX_LEVEL.
+// Levels stored larger than their mip size are downsampled.
+bool compressPrefiltered(const std::string &prefilteredDir, const std::string &filename, int numThreads)
+{
+    auto start = std::chrono::steady_clock::now();
+    KTXImage image;
+    CompressStats stats = CompressStats();
+    for (int level = 0; level < numLevels; ++level) {
+        std::string levelDir = prefilteredDir + "/" + levelNames[level];
+        std::vector<unsigned char> pixels[6];
+        unsigned width[6], height[6], errors[6];
+        parallelFor(6, numThreads, [&](int f) {
+            std::string name = levelDir + "/" + cubemapImageFaceNames[f] + ".png";
+            errors[f] = lodepng::decode(pixels[f], width[f], height[f], name);
+        });
+        if (level == 0) {
+            image = makeCubemapKTX(width[0], height[0], numLevels);
+        }
+        for (int f = 0; f < 6; ++f) {
+            std::string name = levelDir + "/" + cubemapImageFaceNames[f] + ".png";
+            if (errors[f] != 0) {
+                std::cerr << "Error: " << name << ": " << lodepng_error_text(errors[f]) << std::endl;
+                return false;
+            }
+            if (!downsampleSrgba8To(pixels[f], &width[f], &height[f], std::max(image.width >> level, 1u),
+                                    std::max(image.height >> level, 1u))) {
+                std::cerr << "Error: " << name << " is too small for mipmap level " << level << std::endl;
+                return false;
+            }
+            compressFace(pixels[f], width[f], height[f], &image.images[level * 6 + f], &stats, numThreads);
+        }
+    }
+    return writeKTX(image, filename, stats, start);
+}
+
+int main(int argc, char *argv[])
+{
+    std::string inputDir, outputDir;
+    int numThreads = 0;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--output" && i + 1 < argc) {
+            outputDir = argv[++i];
+        }
+        else if (arg == "--threads" && i + 1 < argc) {
+            numThreads = std::max(0, std::atoi(argv[++i]));
+        }
+        else if (inputDir.empty() && arg[0] != '-') {
+            inputDir = arg;
+        }
+        else {
+            printUsage(argv[0]);
+            return arg == "--help" ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (inputDir.empty()) {
+        printUsage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (outputDir.empty()) {
+        outputDir = inputDir;
+    }
+
+    if (!compressCubemap(inputDir, outputDir + "/cubemap.ktx", numThreads)) {
+        return EXIT_FAILURE;
+    }
+    unsigned width, height;
+    std::string prefilteredDir = inputDir + "/prefiltered";
+    if (pngImageSize(prefilteredDir + "/" + levelNames[0] + "/posx.png", &width, &height) &&
+        !compressPrefiltered(prefilteredDir, outputDir + "/prefiltered.ktx", numThreads)) {
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
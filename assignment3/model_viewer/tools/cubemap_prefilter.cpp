@@ -0,0 +1,181 @@
+// Environment map prefiltering tool
+//
+// Reads a cubemap (posx.png ... negz.png) and writes the Phong-lobe
+// prefiltered levels that the viewer loads as one mip chain, to
+// <output>/prefiltered/<power>/, and a diffuse irradiance cubemap computed
+// from 9 spherical harmonics coefficients, to <output>/irradiance/.
+// Runs on the CPU only.
+//
+// Usage: cubemap_prefilter <cubemap_dir> [options]
+//
+
+#include "cubemap_image.h"
+#include "cubemap_prefilter.h"
+#include "spherical_harmonics.h"
+
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Same levels as loadCubemapMipmap and the viewer's prefiltered mip chain
+const char *const levelNames[] = { "2048", "512", "128", "32", "8", "2", "0.5", "0.125" };
+const int numLevels = sizeof(levelNames) / sizeof(levelNames[0]);
+
+// Powers from this one up are importance sampled; lower ones are summed
+// over a downsampled source
+const float minImportancePower = 32.0f;
+const int maxBruteForceSourceSize = 32;
+
+bool makeDirectory(const std::string &path)
+{
+#ifdef _WIN32
+    int result = _mkdir(path.c_str());
+#else
+    int result = mkdir(path.c_str(), 0755);
+#endif
+    struct stat info;
+    return result == 0 || (stat(path.c_str(), &info) == 0 && (info.st_mode & S_IFDIR));
+}
+
+void printUsage(const char *program)
+{
+    std::cout << "Usage: " << program << " <cubemap_dir> [options]" << std::endl
+              << "  --output DIR         output directory (default: cubemap_dir)" << std::endl
+              << "  --size N             face size of level 0 (default: input size)" << std::endl
+              << "  --full-size          write every level at the size of level 0 instead of" << std::endl
+              << "                       its mip size" << std::endl
+              << "  --samples N          samples per texel for importance sampling (default: 256)" << std::endl
+              << "  --irradiance-size N  face size of the irradiance cubemap (default: 32)" << std::endl
+              << "  --threads N          number of threads (default: all cores)" << std::endl;
+}
+
+double secondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char *argv[])
+{
+    std::string inputDir, outputDir;
+    int size = 0, numSamples = 256, irradianceSize = 32, numThreads = 0;
+    bool fullSize = false;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--output" && i + 1 < argc) {
+            outputDir = argv[++i];
+        }
+        else if (arg == "--size" && i + 1 < argc) {
+            size = std::atoi(argv[++i]);
+        }
+        else if (arg == "--full-size") {
+            fullSize = true;
+        }
+        else if (arg == "--samples" && i + 1 < argc) {
+            numSamples = std::max(1, std::atoi(argv[++i]));
+        }
+        else if (arg == "--irradiance-size" && i + 1 < argc) {
+            irradianceSize = std::max(1, std::atoi(argv[++i]));
+        }
+        else if (arg == "--threads" && i + 1 < argc) {
+            numThreads = std::max(0, std::atoi(argv[++i]));
+        }
+        else if (inputDir.empty() && arg[0] != '-') {
+            inputDir = arg;
+        }
+        else {
+            printUsage(argv[0]);
+            return arg == "--help" ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (inputDir.empty()) {
+        printUsage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (outputDir.empty()) {
+        outputDir = inputDir;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    CubemapImage input;
+    std::string error;
+    if (!cubemapImageLoad(&input, inputDir, &error, numThreads)) {
+        std::cerr << "Error: " << error << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (size <= 0) {
+        size = input.size;
+    }
+    std::vector<CubemapImage> mips;
+    cubemapImageMipChain(input, &mips);
+    std::cout << "Loaded " << inputDir << " (" << input.size << "x" << input.size << ") in "
+              << secondsSince(start) << " s" << std::endl;
+
+    // The brute-force levels sum over the first mip that is small enough
+    const CubemapImage *smallSource = &mips.back();
+    for (const CubemapImage &mip : mips) {
+        if (mip.size <= maxBruteForceSourceSize) {
+            smallSource = &mip;
+            break;
+        }
+    }
+
+    std::string prefilteredDir = outputDir + "/prefiltered";
+    if (!makeDirectory(outputDir) || !makeDirectory(prefilteredDir)) {
+        std::cerr << "Error: could not create " << prefilteredDir << std::endl;
+        return EXIT_FAILURE;
+    }
+    for (int level = 0; level < numLevels; ++level) {
+        auto levelStart = std::chrono::steady_clock::now();
+        float power = float(std::atof(levelNames[level]));
+        int levelSize = fullSize ? size : std::max(size >> level, 1);
+        CubemapImage output;
+        bool importance = power >= minImportancePower;
+        if (importance) {
+            prefilterPhongImportance(mips, power, levelSize, numSamples, &output, numThreads);
+        }
+        else {
+            prefilterPhongBruteForce(*smallSource, power, levelSize, &output, numThreads);
+        }
+        std::string levelDir = prefilteredDir + "/" + levelNames[level];
+        if (!makeDirectory(levelDir) || !cubemapImageSave(output, levelDir, &error)) {
+            std::cerr << "Error: could not write " << levelDir << " " << error << std::endl;
+            return EXIT_FAILURE;
+        }
+        std::cout << "Power " << levelNames[level] << ": " << levelSize << "x" << levelSize
+                  << (importance ? ", importance sampled" : ", summed") << ", "
+                  << secondsSince(levelStart) << " s" << std::endl;
+    }
+
+    auto irradianceStart = std::chrono::steady_clock::now();
+    SH9 sh = shIrradiance(shProjectCubemap(input, numThreads));
+    CubemapImage irradiance;
+    cubemapImageAllocate(&irradiance, irradianceSize);
+    for (int face = 0; face < 6; ++face) {
+        for (int y = 0; y < irradianceSize; ++y) {
+            for (int x = 0; x < irradianceSize; ++x) {
+                glm::vec3 d = glm::normalize(cubemapTexelDirection(face, irradianceSize, x, y));
+                irradiance.faces[face][y * irradianceSize + x] = glm::max(shEvaluate(sh, d), glm::vec3(0.0f));
+            }
+        }
+    }
+    std::string irradianceDir = outputDir + "/irradiance";
+    if (!makeDirectory(irradianceDir) || !cubemapImageSave(irradiance, irradianceDir, &error)) {
+        std::cerr << "Error: could not write " << irradianceDir << " " << error << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::cout << "Irradiance: " << irradianceSize << "x" << irradianceSize << ", "
+              << secondsSince(irradianceStart) << " s" << std::endl << "SH9 irradiance coefficients:" << std::endl;
+    for (int k = 0; k < 9; ++k) {
+        std::cout << "  " << sh.c[k].x << " " << sh.c[k].y << " " << sh.c[k].z << std::endl;
+    }
+    std::cout << "Total: " << secondsSince(start) << " s" << std::endl;
+    return EXIT_SUCCESS;
+}
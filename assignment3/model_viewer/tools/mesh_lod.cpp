@@ -0,0 +1,150 @@
+// Level of detail tool
+//
+// Builds the LOD chain of a mesh (OBJ file or synthetic grid) with
+// buildMeshLODs, as the viewer does with --lod, and reports the triangles
+// of every level and the build time with one thread and with all of them.
+// With --output, every level is written as <stem>_lod<i>.obj, with the
+// normals of the original vertices, for inspection in other tools.
+//
+// Usage: mesh_lod <obj_file | num_triangles> [options]
+//
+
+#include "utils2.h"
+#include "obj_loader.h"
+#include "mesh_simplify.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+void printUsage(const char *program)
+{
+    std::cout << "Usage: " << program << " <obj_file | num_triangles> [options]" << std::endl
+              << "  --output DIR     write every level as an OBJ file to DIR" << std::endl
+              << "  --threads N      number of threads (default: all cores)" << std::endl
+              << "  --min-triangles N" << std::endl
+              << "                   stop before levels with fewer triangles (default: 1000)" << std::endl;
+}
+
+double secondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Build a wavy n x n quad grid in [-1, 1]^2
+void makeGrid(OBJMesh &mesh, int n)
+{
+    for (int j = 0; j <= n; ++j) {
+        for (int i = 0; i <= n; ++i) {
+            float x = float(i) / n * 2.0f - 1.0f;
+            float y = float(j) / n * 2.0f - 1.0f;
+            mesh.vertices.push_back(glm::vec3(x, y, 0.1f * std::sin(10.0f * x) * std::cos(7.0f * y)));
+        }
+    }
+    for (int j = 0; j < n; ++j) {
+        for (int i = 0; i < n; ++i) {
+            std::uint32_t v0 = j * (n + 1) + i;
+            std::uint32_t v2 = v0 + n + 1;
+            std::uint32_t triangles[] = { v0, v0 + 1, v2 + 1, v0, v2 + 1, v2 };
+            mesh.indices.insert(mesh.indices.end(), triangles, triangles + 6);
+        }
+    }
+    computeNormals(mesh.vertices, mesh.indices, &mesh.normals);
+}
+
+// Write the vertices of a mesh (all of them, so that the indices stay
+// valid) and the given triangles as an OBJ file
+bool writeOBJ(const std::string &filename, const OBJMesh &mesh, const std::uint32_t *indices, std::size_t numIndices)
+{
+    std::FILE *f = std::fopen(filename.c_str(), "w");
+    if (f == nullptr) {
+        std::cerr << "Error: could not create " << filename << std::endl;
+        return false;
+    }
+    for (const glm::vec3 &v : mesh.vertices) {
+        std::fprintf(f, "v %g %g %g\n", v.x, v.y, v.z);
+    }
+    for (const glm::vec3 &n : mesh.normals) {
+        std::fprintf(f, "vn %g %g %g\n", n.x, n.y, n.z);
+    }
+    for (std::size_t i = 0; i + 2 < numIndices; i += 3) {
+        std::fprintf(f, "f %u//%u %u//%u %u//%u\n", indices[i] + 1, indices[i] + 1, indices[i + 1] + 1,
+                     indices[i + 1] + 1, indices[i + 2] + 1, indices[i + 2] + 1);
+    }
+    return std::fclose(f) == 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        printUsage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    std::string input = argv[1];
+    std::string outputDir;
+    int numThreads = 0;
+    std::size_t minTriangles = 1000;
+    for (int i = 2; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--output" && i + 1 < argc) {
+            outputDir = argv[++i];
+        }
+        else if (arg == "--threads" && i + 1 < argc) {
+            numThreads = std::max(0, std::atoi(argv[++i]));
+        }
+        else if (arg == "--min-triangles" && i + 1 < argc) {
+            minTriangles = std::size_t(std::max(1, std::atoi(argv[++i])));
+        }
+        else {
+            printUsage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    OBJMesh mesh;
+    std::string stem = "grid";
+    if (input.find_first_not_of("0123456789") == std::string::npos) {
+        makeGrid(mesh, std::max(1, int(std::sqrt(std::atof(input.c_str()) / 2.0))));
+    }
+    else if (!objMeshLoadMapped(mesh, input, numThreads)) {
+        return EXIT_FAILURE;
+    }
+    else {
+        std::string::size_type slash = input.find_last_of("/\\");
+        stem = slash == std::string::npos ? input : input.substr(slash + 1);
+        stem = stem.substr(0, stem.find_last_of('.'));
+    }
+    std::cout << mesh.indices.size() / 3 << " triangles, " << mesh.vertices.size() << " vertices" << std::endl;
+
+    MeshLODs serial, lods;
+    auto start = std::chrono::steady_clock::now();
+    buildMeshLODs(mesh.vertices.data(), mesh.vertices.size(), mesh.indices, &serial, 1, minTriangles);
+    double serialTime = secondsSince(start);
+    start = std::chrono::steady_clock::now();
+    buildMeshLODs(mesh.vertices.data(), mesh.vertices.size(), mesh.indices, &lods, numThreads, minTriangles);
+    double parallelTime = secondsSince(start);
+    int threads = numThreads > 0 ? numThreads : defaultThreadCount();
+    std::cout << "buildMeshLODs: " << serialTime << " s with 1 thread, " << parallelTime << " s with " << threads
+              << " threads" << std::endl;
+
+    bool ok = true;
+    std::size_t offset = 0;
+    for (std::size_t level = 0; level <= lods.counts.size(); ++level) {
+        const std::uint32_t *indices = level == 0 ? mesh.indices.data() : lods.indices.data() + offset;
+        std::size_t numIndices = level == 0 ? mesh.indices.size() : std::size_t(lods.counts[level - 1]);
+        std::cout << "LOD " << level << ": " << numIndices / 3 << " triangles" << std::endl;
+        if (!outputDir.empty()) {
+            ok = writeOBJ(outputDir + "/" + stem + "_lod" + std::to_string(level) + ".obj", mesh, indices, numIndices) &&
+                 ok;
+        }
+        if (level > 0) {
+            offset += numIndices;
+        }
+    }
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}